@@ -80,6 +80,20 @@ ${CLI} verify -f $MPT/test1      && fail "verify with no seed should fail"
 ${CLI} verify -S 1 -f badfile    && fail "verify with bad filename should fail"
 ${CLI} verify -S 1 -f $MPT/test1 || fail "verify 1 after creat"
 ${CLI} verify -S 99 -f $MPT/test1 && fail "verify with wrong seed shoud fail"
+${CLI} verify -S 1 -t 1 -f $MPT/test1 || fail "single-threaded verify"
+${CLI} verify -S 1 -t 0 -f $MPT/test1 && fail "verify with 0 threads should fail"
+
+# A file big enough to split across threads (and for the vector path)
+${CLI} creat -r -s 100m -S 4 -t 8 $MPT/test4  || fail "creat test4 with 8 threads"
+${CLI} verify -S 4 -t 8 -f $MPT/test4         || fail "verify test4 with 8 threads"
+${CLI} verify -S 4 -t 1 -f $MPT/test4         || fail "verify test4 with 1 thread"
+${CLI} verify -S 5 -f $MPT/test4              && fail "verify test4 with wrong seed should fail"
+${CLI} chkread -t 8 $MPT/test4                || fail "chkread test4 with 8 threads"
+${CLI} verify -S 4 -M align=2m,populate -f $MPT/test4 || fail "verify test4 with a 2m aligned mapping"
+${CLI} verify -S 4 -M align=none,advice=sequential -f $MPT/test4 || fail "verify test4 unaligned"
+${CLI} chkread -M advice=hugepage $MPT/test4   || fail "chkread test4 with madvise"
+${CLI} creat -r -s 100m -S 4 -M populate $MPT/test4 || fail "re-randomize test4 with populate"
+${CLI} verify -S 4 -M align=3m -f $MPT/test4   && fail "verify with a bad mapping option should fail"
 
 
 # Create 2 more files
@@ -156,6 +170,7 @@ ${CLI} chkread                           && fail "chkread with no args should fa
 
 ${CLI} logplay -rc $MPT            || fail "logplay -rc should succeed"
 ${CLI} logplay -rm $MPT            && fail "logplay with -m and -r should fail"
+${CLI} logplay -rF $MPT            && fail "logplay --follow with -r should fail"
 ${CLI} logplay                     && fail "logplay without MPT arg should fail"
 
 # Unmount and remount
@@ -231,10 +246,15 @@ ${CLI_NOSUDO} check $MPT      && fail "famfs check without sudo should fail"
 ${CLI} check $MPT             || fail "famfs check should succeed"
 ${CLI} check "relpath"        && fail "famfs check on relpath should fail"
 ${CLI} check "/badpath"       && fail "famfs check on bad path should fail"
+${CLI} check -t 1 $MPT        || fail "single-threaded famfs check should succeed"
+${CLI} check -t 0 $MPT        && fail "famfs check with 0 threads should fail"
+${CLI} check -l $MPT          || fail "famfs check against the log should succeed"
 sudo touch $MPT/unmapped_file
 ${CLI} check -vvv $MPT        && fail "famfs check should fail due to unmapped file"
+${CLI} check -l -t 8 $MPT     && fail "famfs check -l should fail due to unmapped file"
 sudo rm $MPT/unmapped_file
 ${CLI} check -v $MPT          || fail "famfs check should succeed after removing unmapped file"
+${CLI} check -v -l $MPT       || fail "famfs check -l should succeed after removing unmapped file"
 
 
 ${CLI_NOSUDO} fsck -hv $MPT && fail "fsck without sudo should fail"
@@ -244,11 +264,29 @@ ${CLI} flush             && fail "flush with no args should fail"
 ${CLI} flush /bogus/file && "flush of a bogus file should fail"
 ${CLI} flush $(sudo find $MPT -type f -print) || fail "flush all files should work"
 ${CLI} flush -vv $(sudo find $MPT -print)     && fail "this flush should report errors"
+${CLI} flush -v -r $MPT                        || fail "recursive flush should work"
+${CLI} flush -v -r -t 1 $MPT                   || fail "inline recursive flush should work"
+${CLI} flush -v -o 4k -l 1m $MPT/test4        || fail "flush of a range should work"
+${CLI} flush -v -o 1g $MPT/test1              || fail "flush of a range past EOF is a no-op"
+${CLI} flush -t 0 $MPT/test1                  && fail "flush with 0 threads should fail"
+${CLI} flush -l 4x $MPT/test1                 && fail "flush with a bad length unit should fail"
+${CLI} flush -o 4kb $MPT/test1                && fail "flush with a bad offset unit should fail"
 
 ${CLI} fsck      && fail "fsck with no args should fail"
 ${CLI} fsck -?   || fail "fsck -h should succeed"x
 ${CLI} fsck $MPT || fail "fsck should succeed"
 ${CLI} fsck --human $MPT || fail "fsck --human should succeed"
+${CLI} fsck -t 1 $MPT    || fail "fsck with 1 thread should succeed"
+${CLI} fsck -t 16 $MPT   || fail "fsck with 16 threads should succeed"
+${CLI} fsck -t 0 $MPT    && fail "fsck with 0 threads should fail"
+${CLI} stats -?                 || fail "stats -? should succeed"
+${CLI} stats                    && fail "stats with no command should fail"
+${CLI} stats -f xml fsck $MPT   && fail "stats with a bad format should fail"
+${CLI} stats badcmd             && fail "stats with a bad command should fail"
+${CLI} stats fsck $MPT          || fail "stats fsck should succeed"
+${CLI} stats -f json -o /tmp/famfs_stats.json logplay $MPT || fail "stats logplay should succeed"
+grep -q '"logplay":{"count":1,' /tmp/famfs_stats.json || fail "stats logplay should count a log play"
+${CLI} stats -f prom fsck $MPT | grep -q '^famfs_bitmap_build_count ' || fail "stats prom output"
 
 set +x
 echo "*************************************************************************************"
@@ -105,6 +105,8 @@ ${CLI} verify -S 42 -f $MPT/${F}_cp || fail "verify ${F}_cp"
 
 ${CLI} cp --gid=-1 && fail "cp should fail with negative gid"
 ${CLI} cp --uid=-1 && fail "cp should fail with negative uid"
+${CLI} cp -c 4x $MPT/$F $MPT/${F}_cpc && fail "cp should fail with an unknown chunk size unit"
+${CLI} cp -c 0 $MPT/$F $MPT/${F}_cpc  && fail "cp should fail with a zero chunk size"
 
 #
 # mkdir with absolute path
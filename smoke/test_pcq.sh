@@ -75,13 +75,16 @@ ${PCQ} --time 10 --nmessages 100 && fail "pcq should fail with --time and --nmes
 ${PCQ} --create                  && fail "pcq --creaete should fail with no bzsize"
 ${PCQ} --create -D -v --bsize 1024 --nbuckets 1024 && fail "should fail with missing filename"
 ${PCQ} --create -D -v --bsize 1024 --nbuckets 1024 && fail "Create should fail with no file"
+${PCQ} --create --crc md5 --bsize 1024 --nbuckets 1024 $MPT/qbad && fail "Create should fail with bad crc"
 
 # Create some queues
 ${PCQ} --create -D -v --bsize 1024 --nbuckets 1024 $MPT/q0 || fail "basic pcq create 0"
-${PCQ} --create -v --bsize 64   --nbuckets 1K   $MPT/q1 || fail "basic pcq create 1"
+${PCQ} --create -v --bsize 64   --nbuckets 1K --crc crc32 $MPT/q1 || fail "basic pcq create 1"
 ${PCQ} --create -v --bsize 64K  --nbuckets 512  $MPT/q2 || fail "basic pcq create 2"
 ${PCQ} --create -v --bsize 512K --nbuckets 1k   $MPT/q3 || fail "basic pcq create 3"
 ${PCQ} --create -v --bsize 256K --nbuckets 256  $MPT/q4 || fail "basic pcq create 4"
+${PCQ} --create -v --bsize 1024 --nbuckets 256 --lanes 0 $MPT/qbad && fail "create 0 lanes should fail"
+${PCQ} --create -v --bsize 1024 --nbuckets 256 --lanes 4 $MPT/q5 || fail "pcq create 5 (4 lanes)"
 
 # Set ownership to the non-privileged caller of this script, so tests run a non-root
 # This is important because root can write even without write permissions and we
@@ -98,6 +101,8 @@ sudo chown $id:$grp $MPT/q1.consumer
 sudo chown $id:$grp $MPT/q2.consumer
 sudo chown $id:$grp $MPT/q3.consumer
 sudo chown $id:$grp $MPT/q4.consumer
+sudo chown $id:$grp $MPT/q5
+sudo chown $id:$grp $MPT/q5.consumer
 
 # From here on we run the non-sudo ${pcq} rather than the sudo ${PCQ}
 
@@ -195,6 +200,66 @@ assert_equal $(cat $STATUSFILE) 2000 "produce/consume 1m with q3"
 ${pcq} -pc --seed 43 -N 1000 --statusfile $STATUSFILE $MPT/q4 || fail "p/c 1m in q4"
 assert_equal $(cat $STATUSFILE) 2000 "produce/consume 1m with q4"
 
+# Batched puts and gets, including batches larger than the queue (q1 has 1K buckets)
+${pcq} -pc --seed 44 -N 5000 --batch 16 --statusfile $STATUSFILE $MPT/q0 || fail "batch p/c q0"
+assert_equal $(cat $STATUSFILE) 10000 "batched produce/consume with q0"
+${pcq} -pc --seed 44 -N 5000 --batch 2K --statusfile $STATUSFILE $MPT/q1 || fail "batch p/c q1"
+assert_equal $(cat $STATUSFILE) 10000 "batched produce/consume with q1"
+${pcq} --producer -N 100 --batch 7 --statusfile $STATUSFILE $MPT/q2 || fail "batch put q2"
+assert_equal $(cat $STATUSFILE) 100 "batched put 100 in q2"
+${pcq} --drain --batch 64 --statusfile $STATUSFILE $MPT/q2 || fail "batch drain q2"
+assert_equal $(cat $STATUSFILE) 100 "batched drain 100 from q2"
+${pcq} --producer --batch 0 $MPT/q2 && fail "batch 0 should fail"
+
+# Zero-copy: fill and validate messages in the buckets
+${pcq} -pc --zerocopy --seed 45 -N 5000 --statusfile $STATUSFILE $MPT/q0 || fail "zc p/c q0"
+assert_equal $(cat $STATUSFILE) 10000 "zero-copy produce/consume with q0"
+${pcq} -pc -Z --seed 45 -N 5000 --batch 2K --statusfile $STATUSFILE $MPT/q1 || fail "zc batch p/c q1"
+assert_equal $(cat $STATUSFILE) 10000 "zero-copy batched produce/consume with q1"
+${pcq} --producer -Z --seed 46 -N 100 --batch 7 --statusfile $STATUSFILE $MPT/q2 || fail "zc put q2"
+assert_equal $(cat $STATUSFILE) 100 "zero-copy put 100 in q2"
+${pcq} --drain --batch 64 --statusfile $STATUSFILE $MPT/q2 || fail "drain zc q2"
+assert_equal $(cat $STATUSFILE) 100 "drain 100 zero-copy messages from q2"
+
+# Lanes: all lanes through the MPMC front-end, then one lane at a time
+${pcq} -pc --seed 47 -N 10000 --threads 4 --statusfile $STATUSFILE $MPT/q5 || fail "mpmc p/c q5"
+assert_equal $(cat $STATUSFILE) 20000 "4 threads produce/consume on 4 lanes"
+${pcq} -pc --seed 47 -N 10000 -T 3 -H -B 16 --statusfile $STATUSFILE $MPT/q5 || fail "mpmc hash q5"
+assert_equal $(cat $STATUSFILE) 20000 "3 hashed threads produce/consume on 4 lanes"
+${pcq} -pc --seed 47 -N 5000 --statusfile $STATUSFILE $MPT/q5 || fail "1 thread p/c q5"
+assert_equal $(cat $STATUSFILE) 10000 "1 thread produce/consume on 4 lanes"
+${pcq} -pc --seed 47 -N 1000 --lane 3 -Z --statusfile $STATUSFILE $MPT/q5 || fail "lane 3 p/c q5"
+assert_equal $(cat $STATUSFILE) 2000 "zero-copy produce/consume on lane 3"
+${pcq} --producer --seed 48 -N 100 --lane 1 --statusfile $STATUSFILE $MPT/q5 || fail "put lane 1"
+${pcq} --producer --seed 48 -N 100 --lane 2 --statusfile $STATUSFILE $MPT/q5 || fail "put lane 2"
+${pcq} --info --statusfile $STATUSFILE $MPT/q5 || fail "info q5"
+assert_equal $(cat $STATUSFILE) 200 "200 messages in the lanes of q5"
+${pcq} --drain --lane 1 --statusfile $STATUSFILE $MPT/q5 || fail "drain lane 1"
+assert_equal $(cat $STATUSFILE) 100 "drain 100 from lane 1"
+${pcq} --drain --statusfile $STATUSFILE $MPT/q5 || fail "drain q5"
+assert_equal $(cat $STATUSFILE) 100 "drain 100 from all lanes"
+${pcq} --producer -N 100 --lane 4 $MPT/q5 && fail "lane 4 of 4 should fail"
+${pcq} -pc -N 100 --lane 1 --threads 2 $MPT/q5 && fail "--lane with --threads should fail"
+${pcq} -pc -N 100 -Z --threads 2 $MPT/q5 && fail "--zerocopy with --threads should fail"
+
+# Wait policies
+${pcq} -pc --seed 49 -N 5000 --wait adaptive --statusfile $STATUSFILE $MPT/q0 || fail "adaptive wait q0"
+assert_equal $(cat $STATUSFILE) 10000 "produce/consume with adaptive wait"
+${pcq} -pc --seed 49 -N 5000 -W adaptive:10:50 -T 2 --statusfile $STATUSFILE $MPT/q5 || fail "adaptive wait q5"
+assert_equal $(cat $STATUSFILE) 10000 "mpmc produce/consume with adaptive wait"
+${pcq} --consumer --time 2 --wait adaptive $MPT/q1 || fail "idle adaptive consumer"
+${pcq} --producer -N 1 --wait spin $MPT/q1 && fail "bad --wait policy should fail"
+${pcq} --producer -N 1 --wait adaptive:1:0 $MPT/q1 && fail "0 max sleep should fail"
+
+# Benchmark sweeps (these reformat q5, which is not used after this)
+${pcq} --bench -N 2000 -B 1,16 --statusfile $STATUSFILE $MPT/q5 || fail "bench q5"
+assert_equal $(cat $STATUSFILE) 8000 "bench q5 with 2 batch sizes"
+${pcq} --bench -N 1000 -b 256,1K -n 64,256 -T 2 -o csv $MPT/q5 || fail "bench sweep q5 csv"
+${pcq} --bench -N 1000 -b 512 -n 128 -o json $MPT/q5 || fail "bench q5 json"
+${pcq} --bench -N 1000 -b 64M $MPT/q5 && fail "bench geometry that doesn't fit should fail"
+${pcq} --bench --seed 1 $MPT/q5 && fail "bench with seed should fail"
+${pcq} -pc -N 100 -B 1,16 $MPT/q5 && fail "batch list without --bench should fail"
+
 # Run simultaneous producer/consumer for 10K messages on each queue
 ${pcq} -pc -s 1 -N 10000 --statusfile $STATUSFILE $MPT/q0 || fail "p/c 1m in q0"
 assert_equal $(cat $STATUSFILE) 20000 "produce/consume 1m with q0"
@@ -5,7 +5,12 @@
 #ifndef _H_MSE_PLATFORM_BITMAP
 #define _H_MSE_PLATFORM_BITMAP
 
+#include <string.h>
+#include <endian.h>
+
 #define BYTE_SHIFT 3
+#define WORD_SHIFT 6
+#define WORD_BITS  64
 
 static inline int
 mu_bitmap_size(int num_blocks)
@@ -98,6 +103,198 @@ mu_bitmap_test_and_clear(u8 *bitmap, s64 index)
 	return 1;
 }
 
+/*
+ * Word-at-a-time scanning
+ *
+ * The bitmap is an array of bytes, and bit n lives in byte n/8 at position n%8. Loading
+ * eight bytes as a little-endian u64 therefore puts bit (64 * w + k) at position k of
+ * word w, so we can skip whole runs of set or clear bits with ctz rather than testing
+ * one bit at a time. Words are loaded with memcpy(), so the bitmap need not be aligned,
+ * and the last (partial) word never reads past mu_bitmap_size(nbits) bytes.
+ */
+
+/**
+ * mu_bitmap_word()
+ *
+ * Load 64-bit word @word of a bitmap of @nbits bits. Bits at or beyond @nbits are
+ * returned as zero.
+ */
+static inline u64
+mu_bitmap_word(const u8 *bitmap, u64 nbits, u64 word)
+{
+	u64 nbytes = (nbits + 8 - 1) >> BYTE_SHIFT;
+	u64 byte_num = word << (WORD_SHIFT - BYTE_SHIFT);
+	u64 tail = nbits - (word << WORD_SHIFT);
+	u64 val = 0;
+
+	if (byte_num + sizeof(val) <= nbytes)
+		memcpy(&val, &bitmap[byte_num], sizeof(val));
+	else
+		memcpy(&val, &bitmap[byte_num], nbytes - byte_num);
+
+	val = le64toh(val);
+	if (tail < WORD_BITS)
+		val &= (1ULL << tail) - 1;
+
+	return val;
+}
+
+/**
+ * mu_bitmap_find_next_set()
+ *
+ * Find the first set bit at or after @start
+ *
+ * Return value: index of the bit, or @nbits if there are no set bits in [@start, @nbits)
+ */
+static inline u64
+mu_bitmap_find_next_set(const u8 *bitmap, u64 nbits, u64 start)
+{
+	u64 word = start >> WORD_SHIFT;
+	u64 nwords = (nbits + WORD_BITS - 1) >> WORD_SHIFT;
+	u64 val;
+
+	if (start >= nbits)
+		return nbits;
+
+	/* Mask off the bits below start in the first word */
+	val = mu_bitmap_word(bitmap, nbits, word) & (~0ULL << (start & (WORD_BITS - 1)));
+	while (!val) {
+		if (++word >= nwords)
+			return nbits;
+		val = mu_bitmap_word(bitmap, nbits, word);
+	}
+	return (word << WORD_SHIFT) + __builtin_ctzll(val);
+}
+
+/**
+ * mu_bitmap_find_next_zero()
+ *
+ * Find the first clear bit at or after @start
+ *
+ * Return value: index of the bit, or @nbits if there are no clear bits in [@start, @nbits)
+ */
+static inline u64
+mu_bitmap_find_next_zero(const u8 *bitmap, u64 nbits, u64 start)
+{
+	u64 word = start >> WORD_SHIFT;
+	u64 nwords = (nbits + WORD_BITS - 1) >> WORD_SHIFT;
+	u64 val;
+	u64 bit;
+
+	if (start >= nbits)
+		return nbits;
+
+	val = ~mu_bitmap_word(bitmap, nbits, word) & (~0ULL << (start & (WORD_BITS - 1)));
+	while (!val) {
+		if (++word >= nwords)
+			return nbits;
+		val = ~mu_bitmap_word(bitmap, nbits, word);
+	}
+
+	/* Bits past nbits load as zero, so clamp rather than report them as free */
+	bit = (word << WORD_SHIFT) + __builtin_ctzll(val);
+	return (bit < nbits) ? bit : nbits;
+}
+
+/**
+ * mu_bitmap_find_first_zero()
+ */
+static inline u64
+mu_bitmap_find_first_zero(const u8 *bitmap, u64 nbits)
+{
+	return mu_bitmap_find_next_zero(bitmap, nbits, 0);
+}
+
+/**
+ * mu_bitmap_zero_run()
+ *
+ * Return the number of consecutive clear bits starting at @start, looking no further
+ * than @max bits (the result is <= @max)
+ */
+static inline u64
+mu_bitmap_zero_run(const u8 *bitmap, u64 nbits, u64 start, u64 max)
+{
+	u64 end = (max < nbits - start) ? start + max : nbits;
+
+	if (start >= nbits)
+		return 0;
+
+	return mu_bitmap_find_next_set(bitmap, end, start) - start;
+}
+
+/**
+ * mu_bitmap_count_set()
+ *
+ * Count the set bits in [0, @nbits)
+ */
+static inline u64
+mu_bitmap_count_set(const u8 *bitmap, u64 nbits)
+{
+	u64 nwords = (nbits + WORD_BITS - 1) >> WORD_SHIFT;
+	u64 count = 0;
+	u64 word;
+
+	for (word = 0; word < nwords; word++)
+		count += __builtin_popcountll(mu_bitmap_word(bitmap, nbits, word));
+
+	return count;
+}
+
+/**
+ * mu_bitmap_set_range()
+ *
+ * Set bits [@start, @start + @nbits). Partial bytes at either end are handled one bit at
+ * a time; whole bytes in the middle are set with memset().
+ */
+static inline void
+mu_bitmap_set_range(u8 *bitmap, u64 start, u64 nbits)
+{
+	u64 end = start + nbits;
+	u64 first_byte, last_byte;
+
+	while (start < end && (start & 7)) {
+		mu_bitmap_set(bitmap, start);
+		start++;
+	}
+	first_byte = start >> BYTE_SHIFT;
+	last_byte = end >> BYTE_SHIFT;
+	if (last_byte > first_byte) {
+		memset(&bitmap[first_byte], 0xff, last_byte - first_byte);
+		start = last_byte << BYTE_SHIFT;
+	}
+	while (start < end) {
+		mu_bitmap_set(bitmap, start);
+		start++;
+	}
+}
+
+/**
+ * mu_bitmap_clear_range()
+ *
+ * Clear bits [@start, @start + @nbits)
+ */
+static inline void
+mu_bitmap_clear_range(u8 *bitmap, u64 start, u64 nbits)
+{
+	u64 end = start + nbits;
+	u64 first_byte, last_byte;
+
+	while (start < end && (start & 7)) {
+		mu_bitmap_test_and_clear(bitmap, start);
+		start++;
+	}
+	first_byte = start >> BYTE_SHIFT;
+	last_byte = end >> BYTE_SHIFT;
+	if (last_byte > first_byte) {
+		memset(&bitmap[first_byte], 0, last_byte - first_byte);
+		start = last_byte << BYTE_SHIFT;
+	}
+	while (start < end) {
+		mu_bitmap_test_and_clear(bitmap, start);
+		start++;
+	}
+}
+
 /*
  * Inline routines for 32-bit offsets
  */
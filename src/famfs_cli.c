@@ -22,6 +22,8 @@
 #include <sys/param.h> /* MIN()/MAX() */
 #include <libgen.h>
 #include <sys/mount.h>
+#include <signal.h>
+#include <time.h>
 
 #include <linux/types.h>
 #include <linux/ioctl.h>
@@ -30,6 +32,8 @@
 #include "famfs_lib.h"
 #include "random_buffer.h"
 #include "mu_mem.h"
+#include "thpool.h"
+#include "famfs_stats.h"
 
 /* Global option related stuff */
 
@@ -39,6 +43,7 @@ struct option global_options[] = {
 	 * We distinguish them by their indices.
 	 */
 	{"dryrun",       no_argument,       0, 'n'},
+	{"no-alloc-cache", no_argument,     0, 'A'},
 	{0, 0, 0, 0}
 };
 
@@ -51,6 +56,21 @@ void print_global_opts(void)
 		printf("\t--%s\n", global_options[i++].name);
 }
 
+/* The -M|--map argument of the commands that mmap files */
+static void
+famfs_mmap_opts_usage(void)
+{
+	printf("Mapping options (-M|--map, comma-separated):\n"
+	       "    align=auto|none|2m|1g - Align the mapping so it can use 2MiB/1GiB pages\n"
+	       "                            (auto, the default, aligns as the extents allow)\n"
+	       "    populate              - Prefault the page tables (MAP_POPULATE)\n"
+	       "    advice=<advice>       - madvise() hint: normal, random, sequential,\n"
+	       "                            willneed, hugepage or nohugepage\n"
+	       "    node=<n>              - Prefer numa node <n> (page cache backed files)\n"
+	       "The alignment and page size that the mapping got are reported.\n"
+	       "\n");
+}
+
 /********************************************************************/
 
 void
@@ -72,9 +92,27 @@ famfs_logplay_usage(int   argc,
 	       "    -m|--mmap   - Get the log via mmap\n"
 	       "    -c|--client - force \"client mode\" (all files read-only)\n"
 	       "    -n|--dryrun - Process the log but don't instantiate the files & directories\n"
+	       "    -f|--full   - Play the whole log, ignoring the local logplay checkpoint\n"
+	       "                  (by default only entries added since the last successful\n"
+	       "                  logplay on this host are played)\n"
+	       "    -t|--threads <n> - Number of threads creating files (default %d;\n"
+	       "                  1 creates them serially)\n"
+	       "    -F|--follow - After playing the log, keep running and play new entries as\n"
+	       "                  they are committed. SIGUSR1 prints a histogram of the\n"
+	       "                  commit-to-visible latency; SIGINT/SIGTERM stop. Follows the\n"
+	       "                  log via mmap (the default), so it can't be used with -r or -n\n"
 	       "\n"
 	       "\n",
-	       progname);
+	       progname, FAMFS_LOGPLAY_DEFAULT_THREADS);
+}
+
+static void
+famfs_follow_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		famfs_follow_report = 1;
+	else
+		famfs_follow_stop = 1;
 }
 
 int
@@ -87,6 +125,9 @@ do_famfs_cli_logplay(int argc, char *argv[])
 	int use_mmap = 0;
 	int use_read = 0;
 	int client_mode = 0;
+	int full = 0;
+	int nthreads = FAMFS_LOGPLAY_DEFAULT_THREADS;
+	int follow = 0;
 	int verbose = 0;
 
 	/* XXX can't use any of the same strings as the global args! */
@@ -96,6 +137,9 @@ do_famfs_cli_logplay(int argc, char *argv[])
 		{"mmap",      no_argument,             0,  'm'},
 		{"read",      no_argument,             0,  'r'},
 		{"client",    no_argument,             0,  'c'},
+		{"full",      no_argument,             0,  'f'},
+		{"threads",   required_argument,       0,  't'},
+		{"follow",    no_argument,             0,  'F'},
 		{"verbose",    no_argument,            0,  'v'},
 		{0, 0, 0, 0}
 	};
@@ -104,7 +148,7 @@ do_famfs_cli_logplay(int argc, char *argv[])
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+vrcmnh?",
+	while ((c = getopt_long(argc, argv, "+vrcmfnt:Fh?",
 				logplay_options, &optind)) != EOF) {
 
 		arg_ct++;
@@ -129,6 +173,20 @@ do_famfs_cli_logplay(int argc, char *argv[])
 		case 'c':
 			client_mode++;
 			break;
+		case 'f':
+			full = 1;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				fprintf(stderr, "famfs logplay: invalid thread count (%s)\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'F':
+			follow = 1;
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -152,7 +210,87 @@ do_famfs_cli_logplay(int argc, char *argv[])
 	}
 	fspath = argv[optind++];
 
-	return famfs_logplay(fspath, use_mmap, dry_run, client_mode, verbose);
+	if (follow && (use_read || dry_run)) {
+		fprintf(stderr,
+			"Error: --follow needs the log via mmap, and can't be a dry run\n\n");
+		famfs_logplay_usage(argc, argv);
+		return -1;
+	}
+	if (follow) {
+		struct sigaction sa = { 0 };
+
+		sa.sa_handler = famfs_follow_signal;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	return famfs_logplay(fspath, use_mmap, dry_run, client_mode, full, nthreads, follow,
+			     verbose);
+}
+
+/********************************************************************/
+void
+famfs_compact_usage(int   argc,
+		    char *argv[])
+{
+	char *progname = argv[0];
+
+	printf("\n"
+	       "famfs compact: Compact the log of a famfs file system\n"
+	       "\n"
+	       "The log is replaced with a checkpoint: a marker followed by a re-encoded\n"
+	       "record for each file and directory, after which the log continues. This\n"
+	       "reclaims log space, and makes logplay cheaper. Must be run on the master, and\n"
+	       "the file system must be quiet: no client may play the log while it is being\n"
+	       "compacted.\n"
+	       "\n"
+	       "    %s compact [args] <mount_point>\n"
+	       "\n"
+	       "Arguments:\n"
+	       "    -?               - Print this message\n"
+	       "    -v|--verbose     - Print verbose output\n"
+	       "\n", progname);
+}
+
+int
+do_famfs_cli_compact(int argc, char *argv[])
+{
+	int c;
+	int verbose = 0;
+
+	/* XXX can't use any of the same strings as the global args! */
+	struct option compact_options[] = {
+		/* These options set a */
+		{"verbose",   no_argument,             0,  'v'},
+		{0, 0, 0, 0}
+	};
+
+	/* Note: the "+" at the beginning of the arg string tells getopt_long
+	 * to return -1 when it sees something that is not recognized option
+	 * (e.g. the command that will mux us off to the command handlers
+	 */
+	while ((c = getopt_long(argc, argv, "+vh?",
+				compact_options, &optind)) != EOF) {
+		switch (c) {
+		case 'v':
+			verbose++;
+			break;
+		case 'h':
+		case '?':
+			famfs_compact_usage(argc, argv);
+			return 0;
+		}
+	}
+
+	if (optind > (argc - 1)) {
+		fprintf(stderr, "Must specify mount_point\n");
+		famfs_compact_usage(argc, argv);
+		return -1;
+	}
+
+	return famfs_compact(argv[optind++], verbose);
 }
 
 /********************************************************************/
@@ -289,7 +427,7 @@ do_famfs_cli_mount(int argc, char *argv[])
 		goto err_out;
 	}
 
-	rc = famfs_logplay(realmpt, use_mmap, 0, 0, verbose);
+	rc = famfs_logplay(realmpt, use_mmap, 0, 0, 1, FAMFS_LOGPLAY_DEFAULT_THREADS, 0, verbose);
 
 err_out:
 	free(realdaxdev);
@@ -396,12 +534,18 @@ famfs_fsck_usage(int   argc,
 	       "    -?           - Print this message\n"
 	       "    -m|--mmap    - Access the superblock and log via mmap\n"
 	       "    -h|--human   - Print sizes in a human-friendly form\n"
+	       "    -t|--threads <n> - Threads to validate the log with (default %d; large\n"
+	       "                   logs are split among them)\n"
 	       "    -v|--verbose - Print debugging output while executing the command\n"
 	       "\n"
+	       "Every log entry's crc and sequence number are checked, and allocation\n"
+	       "collisions are reported, along with histograms of the extent and free\n"
+	       "space sizes.\n"
+	       "\n"
 	       "Exit codes:\n"
 	       "  0  - No errors were found\n"
 	       " !=0 - Errors were found\n"
-	       "\n", progname, progname);
+	       "\n", progname, progname, FAMFS_FSCK_DEFAULT_THREADS);
 }
 
 int
@@ -414,6 +558,7 @@ do_famfs_cli_fsck(int argc, char *argv[])
 	int use_mmap = 0;
 	int use_read = 0;
 	int human = 0; /* -h is no longer --help... */
+	int nthreads = FAMFS_FSCK_DEFAULT_THREADS;
 	int verbose = 0;
 
 	/* XXX can't use any of the same strings as the global args! */
@@ -421,6 +566,7 @@ do_famfs_cli_fsck(int argc, char *argv[])
 		/* These options set a */
 		{"mmap",        no_argument,             0,  'm'},
 		{"human",       no_argument,             0,  'h'},
+		{"threads",     required_argument,       0,  't'},
 		{"verbose",     no_argument,             0,  'v'},
 		{0, 0, 0, 0}
 	};
@@ -429,7 +575,7 @@ do_famfs_cli_fsck(int argc, char *argv[])
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+vh?mr",
+	while ((c = getopt_long(argc, argv, "+t:vh?mr",
 				fsck_options, &optind)) != EOF) {
 
 		arg_ct++;
@@ -446,6 +592,13 @@ do_famfs_cli_fsck(int argc, char *argv[])
 		case 'h':
 			human = 1;
 			break;
+		case 't':
+			nthreads = strtol(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n", __func__, optarg);
+				return -1;
+			}
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -471,12 +624,43 @@ do_famfs_cli_fsck(int argc, char *argv[])
 	}
 
 	daxdev = argv[optind++];
-	return famfs_fsck(daxdev, use_mmap, human, verbose);
+	return famfs_fsck(daxdev, use_mmap, human, nthreads, verbose);
 }
 
 
 /********************************************************************/
 
+static s64 get_multiplier(const char *endptr)
+{
+	size_t multiplier = 1;
+
+	if (!endptr)
+		return 1;
+
+	switch (*endptr) {
+	case 'k':
+	case 'K':
+		multiplier = 1024;
+		break;
+	case 'm':
+	case 'M':
+		multiplier = 1024 * 1024;
+		break;
+	case 'g':
+	case 'G':
+		multiplier = 1024 * 1024 * 1024;
+		break;
+	case 0:
+		return 1;
+	default:
+		return -1; /* Unknown unit */
+	}
+	++endptr;
+	if (*endptr) /* If the unit was not the last char in string, it's an error */
+		return -1;
+	return multiplier;
+}
+
 void
 famfs_cp_usage(int   argc,
 	    char *argv[])
@@ -500,7 +684,17 @@ famfs_cp_usage(int   argc,
 	       "    -m|--mode=<mode> - Set mode (as in chmod) to octal value\n"
 	       "    -u|--uid=<uid>   - Specify uid (default is current user's uid)\n"
 	       "    -g|--gid=<gid>   - Specify uid (default is current user's gid)\n"
+	       "    -P|--policy=<policy> - Allocation policy: first (default), best, next\n"
+	       "                           or stripe\n"
+	       "    -t|--threads=<n> - Data copy threads (default %d; 1 copies inline)\n"
+	       "    -c|--chunksize=<size> - Files are copied by the threads in chunks of this\n"
+	       "                           size (default %dMiB)\n"
+	       "    -D|--direct      - Read sources with O_DIRECT (where supported) and write\n"
+	       "                       with non-temporal stores, bypassing the cache\n"
+	       "    -M|--map=<opts>  - How the destination files are mapped (see below;\n"
+	       "                       reported with -vv)\n"
 	       "    -v|verbose       - print debugging output while executing the command\n"
+	       "                       (and report copy throughput)\n"
 	       "\n"
 	       "NOTE 1: 'famfs cp' will never overwrite an existing file, which is a side-effect\n"
 	       "        of the facts that famfs never does delete, truncate or allocate-on-write\n"
@@ -510,7 +704,9 @@ famfs_cp_usage(int   argc,
 	       "        other non-famfs tools), the files created will be invalid. Any such files\n"
 	       "        can be found using 'famfs check'.\n"
 	       "\n",
-	       progname, progname, progname);
+	       progname, progname, progname, FAMFS_CP_DEFAULT_THREADS,
+	       FAMFS_CP_DEFAULT_CHUNKSIZE / (1024 * 1024));
+	famfs_mmap_opts_usage();
 }
 
 int
@@ -525,6 +721,13 @@ do_famfs_cli_cp(int argc, char *argv[])
 	gid_t gid = getgid();
 	mode_t current_umask;
 	int recursive = 0;
+	int policy = FAMFS_ALLOC_FIRST_FIT;
+	int nthreads = FAMFS_CP_DEFAULT_THREADS;
+	size_t chunksize = FAMFS_CP_DEFAULT_CHUNKSIZE;
+	struct famfs_mmap_opts mopts;
+	int direct = 0;
+	char *endptr;
+	s64 mult;
 	int rc;
 
 	/* XXX can't use any of the same strings as the global args! */
@@ -533,15 +736,22 @@ do_famfs_cli_cp(int argc, char *argv[])
 		{"mode",        required_argument,    0,  'm'},
 		{"uid",         required_argument,             0,  'u'},
 		{"gid",         required_argument,             0,  'g'},
+		{"policy",      required_argument,    0,  'P'},
+		{"threads",     required_argument,    0,  't'},
+		{"chunksize",   required_argument,    0,  'c'},
+		{"direct",      no_argument,          0,  'D'},
+		{"map",         required_argument,    0,  'M'},
 		{"verbose",     no_argument,          0,  'v'},
 		{0, 0, 0, 0}
 	};
 
+	famfs_mmap_opts_init(&mopts);
+
 	/* Note: the "+" at the beginning of the arg string tells getopt_long
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+rm:u:g:vh?",
+	while ((c = getopt_long(argc, argv, "+rm:u:g:P:t:c:DM:vh?",
 				cp_options, &optind)) != EOF) {
 
 		arg_ct++;
@@ -567,8 +777,47 @@ do_famfs_cli_cp(int argc, char *argv[])
 		case 'g':
 			gid = strtol(optarg, 0, 0);
 			break;
+
+		case 'P':
+			policy = famfs_alloc_policy_from_name(optarg);
+			if (policy < 0) {
+				fprintf(stderr, "%s: invalid allocation policy (%s)\n",
+					__func__, optarg);
+				famfs_cp_usage(argc, argv);
+				return -1;
+			}
+			break;
+
+		case 't':
+			nthreads = strtol(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n", __func__, optarg);
+				return -1;
+			}
+			break;
+
+		case 'c':
+			chunksize = strtoull(optarg, &endptr, 0);
+			mult = get_multiplier(endptr);
+			if (mult < 0 || chunksize == 0) {
+				fprintf(stderr, "%s: invalid chunk size (%s)\n", __func__, optarg);
+				famfs_cp_usage(argc, argv);
+				return -1;
+			}
+			chunksize *= mult;
+			break;
+
+		case 'D':
+			direct = 1;
+			break;
+
+		case 'M':
+			if (famfs_mmap_opts_parse(&mopts, optarg))
+				return -1;
+			break;
 		}
 	}
+	mopts.verbose = (verbose > 1);
 
 	remaining_args = argc - optind;
 
@@ -583,7 +832,8 @@ do_famfs_cli_cp(int argc, char *argv[])
 	umask(current_umask);
 	mode &= ~(current_umask);
 
-	rc = famfs_cp_multi(argc - optind, &argv[optind], mode, uid, gid, recursive, verbose);
+	rc = famfs_cp_multi(argc - optind, &argv[optind], mode, uid, gid, recursive, policy,
+			    nthreads, chunksize, direct, &mopts, verbose);
 	return rc;
 }
 
@@ -614,30 +864,33 @@ famfs_check_usage(int   argc,
 	       "    %s check [args] <mount point>\n"
 	       "\n"
 	       "Arguments:\n"
-	       "    -?           - Print this message\n"
-	       "    -v|--verbose - Print debugging output while executing the command\n"
-	       "                   (the verbose arg can be repeated for more verbose output)\n"
+	       "    -?                 - Print this message\n"
+	       "    -t|--threads <n>   - Number of threads walking the tree (default=%d)\n"
+	       "    -l|--log           - Also check the files against the log: every file and\n"
+	       "                         directory must be logged (files with the same size and\n"
+	       "                         number of extents), and everything logged must exist\n"
+	       "    -v|--verbose       - Print debugging output while executing the command\n"
+	       "                         (the verbose arg can be repeated for more verbose output)\n"
 	       "\n"
 	       "Exit codes:\n"
 	       "   0    - All files properly mapped\n"
 	       "When non-zero, the exit code is the bitwise or of the following values:\n"
-	       "   1    - At least one unmapped file found\n"
+	       "   1    - At least one unmapped file found (or, with --log, a file or\n"
+	       "          directory that doesn't match the log)\n"
 	       "   2    - Superblock file missing or corrupt\n"
 	       "   4    - Log file missing or corrupt\n"
 	       "\n"
-	       "In the future we may support checking whether each file is in the log, and that\n"
-	       "the file properties and map match the log, but the files found in the mounted\n"
-	       "file system are not currently compared to the log\n"
-	       "\n"
 	       "TODO: add an option to remove bad files\n"
-	       "TODO: add an option to check that all files match the log (and fix problems)\n"
-	       "\n", progname);
+	       "TODO: add an option to fix files that don't match the log\n"
+	       "\n", progname, FAMFS_CHECK_DEFAULT_THREADS);
 }
 
 int
 do_famfs_cli_check(int argc, char *argv[])
 {
+	int nthreads = FAMFS_CHECK_DEFAULT_THREADS;
 	char *path = NULL;
+	int use_log = 0;
 	int verbose = 0;
 	int arg_ct = 0;
 	int rc = 0;
@@ -646,6 +899,8 @@ do_famfs_cli_check(int argc, char *argv[])
 	/* XXX can't use any of the same strings as the global args! */
 	struct option check_options[] = {
 		/* These options set a */
+		{"threads",     required_argument,    0,  't'},
+		{"log",         no_argument,          0,  'l'},
 		{"verbose",     no_argument,          0,  'v'},
 		{0, 0, 0, 0}
 	};
@@ -654,7 +909,7 @@ do_famfs_cli_check(int argc, char *argv[])
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+h?qv",
+	while ((c = getopt_long(argc, argv, "+t:lh?qv",
 				check_options, &optind)) != EOF) {
 
 		arg_ct++;
@@ -665,6 +920,18 @@ do_famfs_cli_check(int argc, char *argv[])
 			famfs_check_usage(argc, argv);
 			return 0;
 
+		case 't':
+			nthreads = strtol(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n", __func__, optarg);
+				return -1;
+			}
+			break;
+
+		case 'l':
+			use_log++;
+			break;
+
 		case 'v':
 			verbose++;
 			break;
@@ -679,7 +946,7 @@ do_famfs_cli_check(int argc, char *argv[])
 
 	path = argv[optind++];
 
-	rc = famfs_check(path, verbose);
+	rc = famfs_check(path, nthreads, use_log, verbose);
 	return rc;
 }
 
@@ -935,6 +1202,141 @@ do_famfs_cli_clone(int argc, char *argv[])
 
 /********************************************************************/
 
+/*
+ * verify, creat --randomize and chkread work on mapped files in FAMFS_VERIFY_CHUNKSIZE
+ * chunks, spread across a thread pool. (The random buffer stream can be started at
+ * any offset, so the chunks are independent.)
+ */
+struct famfs_par;
+
+/* Return value: -1, or the file offset of the first problem in the chunk */
+typedef s64 (*famfs_par_fn)(struct famfs_par *par, u64 offset, u64 len);
+
+struct famfs_par {
+	famfs_par_fn fn;
+	char        *addr;       /* The mapped file */
+	char        *readbuf;    /* chkread: where the file is read() to */
+	int          fd;         /* chkread */
+	s64          seed;
+	s64          bad_offset; /* The lowest offset any chunk failed at, or -1 */
+};
+
+struct famfs_par_chunk {
+	struct famfs_par *par;
+	u64               offset;
+	u64               len;
+};
+
+static void
+famfs_par_worker(void *arg)
+{
+	struct famfs_par_chunk *c = arg;
+	s64 bad = c->par->fn(c->par, c->offset, c->len);
+	s64 cur;
+
+	if (bad >= 0) {
+		cur = __atomic_load_n(&c->par->bad_offset, __ATOMIC_RELAXED);
+		while ((cur < 0 || bad < cur) &&
+		       !__atomic_compare_exchange_n(&c->par->bad_offset, &cur, bad, 0,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+	free(c);
+}
+
+/**
+ * famfs_par_run()
+ *
+ * Run par->fn over [0, @size) with @nthreads threads (1 runs inline), and report the
+ * throughput
+ *
+ * Return value: the lowest offset at which a chunk failed, or -1
+ */
+static s64
+famfs_par_run(struct famfs_par *par, u64 size, int nthreads, const char *cmd)
+{
+	u64 nchunks = (size + FAMFS_VERIFY_CHUNKSIZE - 1) / FAMFS_VERIFY_CHUNKSIZE;
+	struct thpool *pool = NULL;
+	struct timespec start, end;
+	u64 offset;
+	double secs;
+
+	par->bad_offset = -1;
+	if (nchunks < (u64)nthreads)
+		nthreads = (nchunks) ? nchunks : 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (nthreads > 1) {
+		pool = thpool_init(nthreads, 0);
+		if (!pool) {
+			fprintf(stderr, "%s: failed to start %d threads; running inline\n",
+				__func__, nthreads);
+			nthreads = 1;
+		}
+	}
+	for (offset = 0; offset < size; offset += FAMFS_VERIFY_CHUNKSIZE) {
+		struct famfs_par_chunk *c = calloc(1, sizeof(*c));
+
+		assert(c);
+		c->par = par;
+		c->offset = offset;
+		c->len = MIN(FAMFS_VERIFY_CHUNKSIZE, size - offset);
+		if (!pool || thpool_add_work(pool, famfs_par_worker, c))
+			famfs_par_worker(c); /* Inline, or couldn't queue it */
+	}
+	if (pool) {
+		thpool_wait(pool);
+		thpool_destroy(pool);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (double)(end.tv_sec - start.tv_sec) +
+		(double)(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("famfs %s: %lld bytes in %.3f s (%.2f GB/s, %d threads)\n", cmd, size, secs,
+	       (secs > 0) ? (double)size / 1e9 / secs : 0.0, nthreads);
+	return par->bad_offset;
+}
+
+static s64
+famfs_randomize_chunk(struct famfs_par *par, u64 offset, u64 len)
+{
+	randomize_buffer_at(par->addr + offset, len, par->seed, offset);
+	flush_processor_cache(par->addr + offset, len);
+	return -1;
+}
+
+static s64
+famfs_verify_chunk(struct famfs_par *par, u64 offset, u64 len)
+{
+	invalidate_processor_cache(par->addr + offset, len);
+	return validate_random_buffer_at(par->addr + offset, len, par->seed, offset);
+}
+
+static s64
+famfs_chkread_chunk(struct famfs_par *par, u64 offset, u64 len)
+{
+	u64 done = 0;
+	ssize_t rc;
+	u64 i;
+
+	while (done < len) {
+		rc = pread(par->fd, par->readbuf + offset + done, len - done, offset + done);
+		if (rc <= 0) {
+			fprintf(stderr, "%s: read at offset %lld failed (rc %ld errno %d)\n",
+				__func__, offset + done, rc, errno);
+			return offset + done;
+		}
+		done += rc;
+	}
+	if (memcmp(par->readbuf + offset, par->addr + offset, len) == 0)
+		return -1;
+	for (i = 0; par->readbuf[offset + i] == par->addr[offset + i]; i++)
+		;
+	return offset + i;
+}
+
+/********************************************************************/
+
 void
 famfs_creat_usage(int   argc,
 	    char *argv[])
@@ -958,47 +1360,23 @@ famfs_creat_usage(int   argc,
 	       "    -s|--size <size>[kKmMgG] - Required file size\n"
 	       "    -S|--seed <random-seed>  - Optional seed for randomization\n"
 	       "    -r|--randomize           - Optional - will randomize with provided seed\n"
+	       "    -t|--threads <n>         - Threads to randomize with (default %d)\n"
 	       "    -m|--mode <octal-mode>   - Default is 0644\n"
 	       "                               Note: mode is ored with ~umask, so the actual mode\n"
 	       "                               may be less permissive; see umask for more info\n"
 	       "    -u|--uid <int uid>       - Default is caller's uid\n"
 	       "    -g|--gid <int gid>       - Default is caller's gid\n"
+	       "    -P|--policy <policy>     - Allocation policy: first (default), best, next\n"
+	       "                               or stripe\n"
+	       "    -M|--map <opts>          - How the file is mapped to randomize it (see below)\n"
 	       "    -v|--verbose             - Print debugging output while executing the command\n"
 	       "\n"
 	       "NOTE: the --randomize and --seed arguments are useful for testing; the file is\n"
 	       "      randomized based on the seed, making it possible to use the 'famfs verify'\n"
 	       "      command later to validate the contents of the file\n"
 	       "\n",
-	       progname, progname, progname);
-}
-
-static s64 get_multiplier(const char *endptr)
-{
-	size_t multiplier = 1;
-
-	if (!endptr)
-		return 1;
-
-	switch (*endptr) {
-	case 'k':
-	case 'K':
-		multiplier = 1024;
-		break;
-	case 'm':
-	case 'M':
-		multiplier = 1024 * 1024;
-		break;
-	case 'g':
-	case 'G':
-		multiplier = 1024 * 1024 * 1024;
-		break;
-	case 0:
-		return 1;
-	}
-	++endptr;
-	if (*endptr) /* If the unit was not the last char in string, it's an error */
-		return -1;
-	return multiplier;
+	       progname, progname, progname, FAMFS_VERIFY_DEFAULT_THREADS);
+	famfs_mmap_opts_usage();
 }
 
 int
@@ -1016,6 +1394,9 @@ do_famfs_cli_creat(int argc, char *argv[])
 	s64 seed = 0;
 	int randomize = 0;
 	int verbose = 0;
+	int policy = FAMFS_ALLOC_FIRST_FIT;
+	int nthreads = FAMFS_VERIFY_DEFAULT_THREADS;
+	struct famfs_mmap_opts mopts;
 	mode_t current_umask;
 	struct stat st;
 
@@ -1028,6 +1409,9 @@ do_famfs_cli_creat(int argc, char *argv[])
 		{"mode",        required_argument,             0,  'm'},
 		{"uid",         required_argument,             0,  'u'},
 		{"gid",         required_argument,             0,  'g'},
+		{"policy",      required_argument,             0,  'P'},
+		{"threads",     required_argument,             0,  't'},
+		{"map",         required_argument,             0,  'M'},
 		{"verbose",     no_argument,                   0,  'v'},
 		/* These options don't set a flag.
 		 * We distinguish them by their indices.
@@ -1040,7 +1424,8 @@ do_famfs_cli_creat(int argc, char *argv[])
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+s:S:m:u:g:rh?v",
+	famfs_mmap_opts_init(&mopts);
+	while ((c = getopt_long(argc, argv, "+s:S:m:u:g:P:t:M:rh?v",
 				creat_options, &optind)) != EOF) {
 		char *endptr;
 
@@ -1073,6 +1458,27 @@ do_famfs_cli_creat(int argc, char *argv[])
 		case 'r':
 			randomize++;
 			break;
+		case 'P':
+			policy = famfs_alloc_policy_from_name(optarg);
+			if (policy < 0) {
+				fprintf(stderr, "%s: invalid allocation policy (%s)\n",
+					__func__, optarg);
+				famfs_creat_usage(argc, argv);
+				return -1;
+			}
+			break;
+		case 't':
+			nthreads = strtol(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n", __func__, optarg);
+				return -1;
+			}
+			break;
+		case 'M':
+			if (famfs_mmap_opts_parse(&mopts, optarg))
+				return -1;
+			mopts.verbose = 1;
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -1121,7 +1527,7 @@ do_famfs_cli_creat(int argc, char *argv[])
 		current_umask = umask(0022);
 		umask(current_umask);
 		mode &= ~(current_umask);
-		fd = famfs_mkfile(filename, mode, uid, gid, fsize, verbose);
+		fd = famfs_mkfile(filename, mode, uid, gid, fsize, policy, verbose);
 		if (fd < 0) {
 			fprintf(stderr, "%s: failed to create file %s\n", __func__, filename);
 			exit(-1);
@@ -1142,17 +1548,28 @@ do_famfs_cli_creat(int argc, char *argv[])
 			fprintf(stderr, "%s: file size mismatch %ld/%ld\n",
 				__func__, fsize, st.st_size);
 		}
-		addr = mmap(0, fsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (verbose)
+			mopts.verbose = 1;
+		addr = famfs_mmap_fd(fd, fsize, 0 /* writable */, &mopts);
 		if (!addr) {
 			fprintf(stderr, "%s: randomize mmap failed\n", __func__);
 			exit(-1);
 		}
 		buf = (char *)addr;
 
-		if (!seed)
+		if (!seed) {
+			/* A random seed can't be split into chunks */
 			printf("Randomizing buffer with random seed\n");
-		randomize_buffer(buf, fsize, seed);
-		flush_processor_cache(buf, fsize);
+			randomize_buffer(buf, fsize, seed);
+			flush_processor_cache(buf, fsize);
+		} else {
+			struct famfs_par par = { 0 };
+
+			par.fn = famfs_randomize_chunk;
+			par.addr = buf;
+			par.seed = seed;
+			famfs_par_run(&par, fsize, nthreads, "creat --randomize");
+		}
 	}
 
 	close(fd);
@@ -1276,7 +1693,10 @@ famfs_verify_usage(int   argc,
 	       "    -?                        - Print this message\n"
 	       "    -f|--filename <filename>  - Required file path\n"
 	       "    -S|--seed <random-seed>   - Required seed for data verification\n"
-	       "\n", progname);
+	       "    -t|--threads <n>          - Threads to verify with (default %d)\n"
+	       "    -M|--map <opts>           - How the file is mapped (see below)\n"
+	       "\n", progname, FAMFS_VERIFY_DEFAULT_THREADS);
+	famfs_mmap_opts_usage();
 }
 
 int
@@ -1285,11 +1705,13 @@ do_famfs_cli_verify(int argc, char *argv[])
 	int c, fd;
 	char *filename = NULL;
 
+	int nthreads = FAMFS_VERIFY_DEFAULT_THREADS;
+	struct famfs_par par = { 0 };
+	struct famfs_mmap_opts mopts;
 	size_t fsize = 0;
 	int arg_ct = 0;
 	s64 seed = 0;
 	void *addr;
-	char *buf;
 	s64 rc = 0;
 
 	/* XXX can't use any of the same strings as the global args! */
@@ -1297,14 +1719,18 @@ do_famfs_cli_verify(int argc, char *argv[])
 		/* These options set a */
 		{"seed",        required_argument,             0,  'S'},
 		{"filename",    required_argument,             0,  'f'},
+		{"threads",     required_argument,             0,  't'},
+		{"map",         required_argument,             0,  'M'},
 		{0, 0, 0, 0}
 	};
 
+	famfs_mmap_opts_init(&mopts);
+
 	/* Note: the "+" at the beginning of the arg string tells getopt_long
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+f:S:h?",
+	while ((c = getopt_long(argc, argv, "+f:S:t:M:h?",
 				verify_options, &optind)) != EOF) {
 
 		arg_ct++;
@@ -1319,6 +1745,18 @@ do_famfs_cli_verify(int argc, char *argv[])
 			/* TODO: make sure filename is in a famfs file system */
 			break;
 		}
+		case 't':
+			nthreads = strtol(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n", __func__, optarg);
+				return -1;
+			}
+			break;
+		case 'M':
+			if (famfs_mmap_opts_parse(&mopts, optarg))
+				return -1;
+			mopts.verbose = 1;
+			break;
 		case 'h':
 		case '?':
 			famfs_verify_usage(argc, argv);
@@ -1340,14 +1778,15 @@ do_famfs_cli_verify(int argc, char *argv[])
 		exit(-1);
 	}
 
-	addr = famfs_mmap_whole_file(filename, 0, &fsize);
+	addr = famfs_mmap_file(filename, 0, &fsize, &mopts);
 	if (!addr) {
 		fprintf(stderr, "%s: randomize mmap failed\n", __func__);
 		exit(-1);
 	}
-	invalidate_processor_cache(addr, fsize);
-	buf = (char *)addr;
-	rc = validate_random_buffer(buf, fsize, seed);
+	par.fn = famfs_verify_chunk;
+	par.addr = (char *)addr;
+	par.seed = seed;
+	rc = famfs_par_run(&par, fsize, nthreads, "verify");
 	if (rc == -1) {
 		printf("Success: verified %ld bytes in file %s\n", fsize, filename);
 	} else {
@@ -1377,20 +1816,31 @@ famfs_flush_usage(int   argc,
 	       "    %s flush [args] <file> [<file> ...]\n"
 	       "\n"
 	       "Arguments:\n"
-	       "    -v           - Verbose output\n"
-	       "    -?           - Print this message\n"
+	       "    -t|--threads <n>      - Flush threads (default %d; 1 flushes inline)\n"
+	       "    -o|--offset <offset>  - Flush each file starting at this offset\n"
+	       "    -l|--length <length>  - Flush this many bytes of each file (default: to the\n"
+	       "                            end of the file)\n"
+	       "    -r|--recursive        - Flush all the files under directories\n"
+	       "    -v                    - Verbose output (and report flush throughput)\n"
+	       "    -?                    - Print this message\n"
 	       "\nNOTE: this creates a file system error and is for testing only!!\n"
-	       "\n", progname);
+	       "\n", progname, FAMFS_FLUSH_DEFAULT_THREADS);
 }
 
 int
 do_famfs_cli_flush(int argc, char *argv[])
 {
+	int nthreads = FAMFS_FLUSH_DEFAULT_THREADS;
 	char fullpath[PATH_MAX];
+	struct famfs_flush *fl;
 	char *file = NULL;
+	int recursive = 0;
+	u64 offset = 0;
+	u64 length = 0;
 	int verbose = 0;
 	int arg_ct = 0;
 	int errs = 0;
+	s64 mult;
 	int rc;
 	int c;
 
@@ -1398,6 +1848,10 @@ do_famfs_cli_flush(int argc, char *argv[])
 	/* XXX can't use any of the same strings as the global args! */
 	struct option flush_options[] = {
 		/* These options set a */
+		{"threads",     required_argument,             0,  't'},
+		{"offset",      required_argument,             0,  'o'},
+		{"length",      required_argument,             0,  'l'},
+		{"recursive",   no_argument,                   0,  'r'},
 		{0, 0, 0, 0}
 	};
 
@@ -1405,12 +1859,43 @@ do_famfs_cli_flush(int argc, char *argv[])
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+vh?",
+	while ((c = getopt_long(argc, argv, "+t:o:l:rvh?",
 				flush_options, &optind)) != EOF) {
+		char *endptr;
 
 		arg_ct++;
 		switch (c) {
 
+		case 't':
+			nthreads = strtol(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n", __func__, optarg);
+				return -1;
+			}
+			break;
+		case 'o':
+			offset = strtoull(optarg, &endptr, 0);
+			mult = get_multiplier(endptr);
+			if (mult < 0) {
+				fprintf(stderr, "%s: invalid offset (%s)\n", __func__, optarg);
+				famfs_flush_usage(argc, argv);
+				return -1;
+			}
+			offset *= mult;
+			break;
+		case 'l':
+			length = strtoull(optarg, &endptr, 0);
+			mult = get_multiplier(endptr);
+			if (mult < 0) {
+				fprintf(stderr, "%s: invalid length (%s)\n", __func__, optarg);
+				famfs_flush_usage(argc, argv);
+				return -1;
+			}
+			length *= mult;
+			break;
+		case 'r':
+			recursive = 1;
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -1426,6 +1911,7 @@ do_famfs_cli_flush(int argc, char *argv[])
 		famfs_clone_usage(argc, argv);
 		return -1;
 	}
+	fl = famfs_flush_start(nthreads, verbose);
 	while (optind < argc) {
 		file = argv[optind++];
 		if (realpath(file, fullpath) == NULL) {
@@ -1434,10 +1920,11 @@ do_famfs_cli_flush(int argc, char *argv[])
 			continue;
 		}
 
-		rc = famfs_flush_file(file, verbose);
+		rc = famfs_flush_path(fl, file, offset, length, recursive);
 		if (rc)
 			errs++;
 	}
+	famfs_flush_finish(fl);
 	if (errs)
 		printf("%s: %d errors were detected\n", __func__, errs);
 	return -errs;
@@ -1484,7 +1971,10 @@ famfs_chkread_usage(int   argc,
 	       "    -?  - Print this message\n"
 	       "    -s  - File is famfs superblock\n"
 	       "    -l  - File is famfs log\n"
-	       "\n", progname);
+	       "    -t|--threads <n> - Threads to read and compare with (default %d)\n"
+	       "    -M|--map <opts>  - How the file is mapped (see below)\n"
+	       "\n", progname, FAMFS_VERIFY_DEFAULT_THREADS);
+	famfs_mmap_opts_usage();
 }
 
 /**
@@ -1497,6 +1987,9 @@ famfs_chkread_usage(int   argc,
 int
 do_famfs_cli_chkread(int argc, char *argv[])
 {
+	int nthreads = FAMFS_VERIFY_DEFAULT_THREADS;
+	struct famfs_par par = { 0 };
+	struct famfs_mmap_opts mopts;
 	int c, fd;
 	char *filename = NULL;
 	int is_log = 0;
@@ -1505,6 +1998,7 @@ do_famfs_cli_chkread(int argc, char *argv[])
 	int arg_ct = 0;
 	void *addr;
 	char *buf;
+	s64 bad;
 	int rc = 0;
 	char *readbuf = NULL;
 	struct stat st;
@@ -1512,14 +2006,18 @@ do_famfs_cli_chkread(int argc, char *argv[])
 	/* XXX can't use any of the same strings as the global args! */
 	struct option chkread_options[] = {
 		/* These options set a */
+		{"threads",     required_argument,             0,  't'},
+		{"map",         required_argument,             0,  'M'},
 		{0, 0, 0, 0}
 	};
 
+	famfs_mmap_opts_init(&mopts);
+
 	/* Note: the "+" at the beginning of the arg string tells getopt_long
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+slh?",
+	while ((c = getopt_long(argc, argv, "+t:M:slh?",
 				chkread_options, &optind)) != EOF) {
 		arg_ct++;
 		switch (c) {
@@ -1533,6 +2031,18 @@ do_famfs_cli_chkread(int argc, char *argv[])
 		case 'l':
 			is_log = 1;
 			break;
+		case 'M':
+			if (famfs_mmap_opts_parse(&mopts, optarg))
+				return -1;
+			mopts.verbose = 1;
+			break;
+		case 't':
+			nthreads = strtol(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n", __func__, optarg);
+				return -1;
+			}
+			break;
 		}
 	}
 	if (optind > (argc - 1)) {
@@ -1558,21 +2068,21 @@ do_famfs_cli_chkread(int argc, char *argv[])
 	assert(fd > 0);
 
 
-	addr = famfs_mmap_whole_file(filename, 0, &fsize);
+	addr = famfs_mmap_file(filename, 0, &fsize, &mopts);
 	assert(addr);
 
-	rc = lseek(fd, 0, SEEK_SET);
-	assert(rc == 0);
-
 	rc = posix_memalign((void **)&readbuf, 0x200000, fsize);
 	assert(rc == 0);
 	assert(readbuf);
 	printf("readbuf: %p\n", readbuf);
 
-	rc = read(fd, readbuf, fsize);
-	assert(rc == fsize);
+	/* Read the file in chunks, comparing each chunk with the mapping */
+	par.fn = famfs_chkread_chunk;
+	par.addr = (char *)addr;
+	par.readbuf = readbuf;
+	par.fd = fd;
+	bad = famfs_par_run(&par, fsize, nthreads, "chkread");
 
-	printf("read tried=%d got=%d\n", (int)fsize, (int)rc);
 	if (is_superblock) {
 		printf("superblock by mmap\n");
 		famfs_dump_super((struct famfs_superblock *)addr);
@@ -1591,12 +2101,12 @@ do_famfs_cli_chkread(int argc, char *argv[])
 		hex_dump((const u8 *)addr, 64, "Log by mmap");
 		hex_dump((const u8 *)readbuf, 64, "Log by read");
 	}
-	rc = memcmp(readbuf, addr, fsize);
-	if (rc) {
-		fprintf(stderr, "Read and mmap miscompare\n");
+	if (bad >= 0) {
+		fprintf(stderr, "Read and mmap miscompare at offset %lld\n", bad);
 		rc = -1;
 		goto err_exit;
 	}
+	rc = 0;
 	printf("Read and mmap match\n");
 
  err_exit:
@@ -1607,6 +2117,33 @@ do_famfs_cli_chkread(int argc, char *argv[])
 	return rc;
 }
 
+/********************************************************************/
+void
+famfs_stats_usage(int   argc,
+		  char *argv[])
+{
+	char *progname = argv[0];
+
+	printf("\n"
+	       "famfs stats: Run a famfs command, then export its hot-path counters\n"
+	       "\n"
+	       "The counters cover the log lock wait, log commits, bitmap builds, allocator\n"
+	       "searches, bytes flushed, logplay entries, and pcq retries and crc errors. They\n"
+	       "count what this process did, so they describe the command that is run.\n"
+	       "\n"
+	       "    %s stats [args] <command> [command args]\n"
+	       "\n"
+	       "Arguments:\n"
+	       "    -?                      - Print this message\n"
+	       "    -f|--format <json|prom> - JSON (one line), or Prometheus text (default)\n"
+	       "    -o|--output <file>      - Write the counters to <file> rather than stdout\n"
+	       "                              (e.g. for the node_exporter textfile collector)\n"
+	       "\n"
+	       "Example:\n"
+	       "    %s stats -f json logplay /mnt/famfs\n"
+	       "\n", progname, progname);
+}
+
 /********************************************************************/
 
 
@@ -1617,6 +2154,7 @@ struct famfs_cli_cmd {
 };
 
 static void do_famfs_cli_help(int argc, char **argv);
+static int do_famfs_cli_stats(int argc, char **argv);
 
 struct
 famfs_cli_cmd famfs_cli_cmds[] = {
@@ -1631,13 +2169,88 @@ famfs_cli_cmd famfs_cli_cmds[] = {
 	{"verify",  do_famfs_cli_verify,  famfs_verify_usage},
 	{"mkmeta",  do_famfs_cli_mkmeta,  famfs_mkmeta_usage},
 	{"logplay", do_famfs_cli_logplay, famfs_logplay_usage},
+	{"compact", do_famfs_cli_compact, famfs_compact_usage},
 	{"getmap",  do_famfs_cli_getmap,  famfs_getmap_usage},
 	{"clone",   do_famfs_cli_clone,   famfs_clone_usage},
 	{"chkread", do_famfs_cli_chkread, famfs_chkread_usage},
+	{"stats",   do_famfs_cli_stats,   famfs_stats_usage},
 
 	{NULL, NULL, NULL}
 };
 
+static int
+do_famfs_cli_stats(int argc, char **argv)
+{
+	enum famfs_stats_format fmt = FAMFS_STATS_PROM;
+	char *outfile = NULL;
+	FILE *fp = stdout;
+	int c, i, rc;
+
+	/* XXX can't use any of the same strings as the global args! */
+	struct option stats_options[] = {
+		{"format",    required_argument,       0,  'f'},
+		{"output",    required_argument,       0,  'o'},
+		{0, 0, 0, 0}
+	};
+
+	/* The "+" stops at the command to be run, so its own args are left to it */
+	while ((c = getopt_long(argc, argv, "+f:o:h?",
+				stats_options, &optind)) != EOF) {
+		switch (c) {
+		case 'f':
+			rc = famfs_stats_format_from_name(optarg);
+			if (rc < 0) {
+				fprintf(stderr, "famfs stats: invalid format (%s)\n", optarg);
+				famfs_stats_usage(argc, argv);
+				return -1;
+			}
+			fmt = rc;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'h':
+		case '?':
+			famfs_stats_usage(argc, argv);
+			return 0;
+		}
+	}
+
+#ifndef FAMFS_STATS
+	fprintf(stderr, "famfs stats: famfs was built without FAMFS_STATS\n");
+	return -1;
+#endif
+	if (optind > (argc - 1)) {
+		fprintf(stderr, "famfs stats: Must specify a command\n");
+		famfs_stats_usage(argc, argv);
+		return -1;
+	}
+	for (i = 0; (famfs_cli_cmds[i].cmd); i++)
+		if (!strcmp(argv[optind], famfs_cli_cmds[i].cmd))
+			break;
+	if (!famfs_cli_cmds[i].cmd || famfs_cli_cmds[i].run == do_famfs_cli_stats) {
+		fprintf(stderr, "famfs stats: Unrecognized command %s\n", argv[optind]);
+		return -1;
+	}
+
+	optind++; /* move past cmd on cmdline */
+	rc = famfs_cli_cmds[i].run(argc, argv);
+
+	if (outfile) {
+		fp = fopen(outfile, "w");
+		if (!fp) {
+			fprintf(stderr, "famfs stats: unable to open %s (errno %d)\n",
+				outfile, errno);
+			return (rc) ? rc : -1;
+		}
+	}
+	fflush(stdout);
+	famfs_stats_print(fp, fmt);
+	if (outfile)
+		fclose(fp);
+	return rc;
+}
+
 static void
 do_famfs_cli_help(int argc, char **argv)
 {
@@ -1678,6 +2291,10 @@ main(int argc, char **argv)
 				global_options, &optind)) != EOF) {
 
 		switch (c) {
+		case 'A':
+			/* Rebuild the allocation bitmap from the log, and don't save it */
+			famfs_alloc_cache_enable = 0;
+			break;
 		case 'h':
 		case '?':
 			do_famfs_cli_help(argc, argv);
@@ -30,18 +30,33 @@
 #include <sys/file.h>
 #include <dirent.h>
 #include <linux/famfs_ioctl.h>
+#include <time.h>
+#include <aio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include "famfs_meta.h"
 #include "famfs_lib.h"
 #include "famfs_lib_internal.h"
 #include "bitmap.h"
 #include "mu_mem.h"
+#include "mu_crc.h"
+#include "thpool.h"
+#include "mu_histogram.h"
+#include "famfs_stats.h"
 
 int mock_kmod = 0; /* unit tests can set this to avoid ioctl calls and whatnot */
 int mock_flush = 0; /* for unit tests to avoid actual flushing */
 int mock_role = 0; /* for unit tests to specify role rather than testing for it */
 int mock_uuid = 0;
 
+/* Bytes of cache flushed by the most recent famfs_append_log() commit, and in total */
+u64 famfs_log_flush_bytes;
+u64 famfs_log_flush_bytes_total;
+
 struct famfs_log_stats {
 	u64 n_entries;
 	u64 f_logged;
@@ -52,17 +67,13 @@ struct famfs_log_stats {
 	u64 d_existed;
 	u64 d_created;
 	u64 d_errs;
+	u64 f_extents;
+	u64 f_nextents[FAMFS_FC_MAX_EXTENTS + 1]; /* files by number of extents */
+	u64 c_records;  /* entries that came from a log checkpoint */
+	u64 c_bytes;    /* log bytes used by the checkpoint (including its marker) */
+	u64 c_nentries; /* log entries the checkpoint replaced */
 };
 
-static u8 *
-famfs_build_bitmap(const struct famfs_log   *logp,
-		   u64                       dev_size_in,
-		   u64                      *bitmap_nbits_out,
-		   u64                      *alloc_errors_out,
-		   u64                      *size_total_out,
-		   u64                      *alloc_total_out,
-		   struct famfs_log_stats   *log_stats_out,
-		   int                       verbose);
 static int
 famfs_dir_create(
 	const char *mpt,
@@ -72,6 +83,11 @@ famfs_dir_create(
 	gid_t       gid);
 
 static struct famfs_superblock *famfs_map_superblock_by_path(const char *path, int read_only);
+static u8 *famfs_fsck_build_bitmap(const struct famfs_log *logp, u64 dev_size_in,
+				   int nthreads, u64 *bitmap_nbits_out, u64 *alloc_errors_out,
+				   u64 *fsize_total_out, u64 *alloc_sum_out,
+				   struct famfs_log_stats *ls, struct mu_histogram *ext_hist,
+				   int *nranges_out, int *bad_ranges_out, int verbose);
 static int famfs_file_create(const char *path, mode_t mode, uid_t uid, gid_t gid,
 			     int disable_write);
 static int open_log_file_read_only(const char *path, size_t *sizep,
@@ -109,8 +125,12 @@ void famfs_dump_log(struct famfs_log *logp)
 	printf("famfs log: (%p)\n", logp);
 	printf("\tmagic:      %llx\n", logp->famfs_log_magic);
 	printf("\tlen:        %lld\n", logp->famfs_log_len);
-	printf("\tlast index: %lld\n", logp->famfs_log_last_index);
+	printf("\tdata len:   %lld\n", logp->famfs_log_data_len);
 	printf("\tnext index: %lld\n", logp->famfs_log_next_index);
+	printf("\tnext offset: %lld\n", logp->famfs_log_next_offset);
+	printf("\tepoch:      %lld\n", logp->famfs_log_epoch);
+	printf("\tgeneration: %lld\n", logp->famfs_log_gen);
+	printf("\tcrc:        %s\n", mu_crc_alg_name(famfs_log_crc_alg(logp)));
 }
 
 /**
@@ -498,30 +518,32 @@ famfs_gen_superblock_crc(const struct famfs_superblock *sb)
 	return crc;
 }
 
+/**
+ * famfs_gen_log_header_crc()
+ *
+ * The algorithm is selected by the (covered) flags, so a damaged flags field fails
+ * the check either way.
+ */
 unsigned long
 famfs_gen_log_header_crc(const struct famfs_log *logp)
 {
-	unsigned long crc = crc32(0L, Z_NULL, 0);
+	enum mu_crc_alg alg;
+	u32 crc = 0;
 
 	assert(logp);
-	crc = crc32(crc, (const unsigned char *)
-		    &logp->famfs_log_magic, sizeof(logp->famfs_log_magic));
-	crc = crc32(crc, (const unsigned char *)
-		    &logp->famfs_log_len, sizeof(logp->famfs_log_len));
-	crc = crc32(crc, (const unsigned char *)
-		    &logp->famfs_log_last_index, sizeof(logp->famfs_log_last_index));
+	alg = famfs_log_crc_alg(logp);
+	crc = mu_crc(alg, crc, &logp->famfs_log_magic, sizeof(logp->famfs_log_magic));
+	crc = mu_crc(alg, crc, &logp->famfs_log_len, sizeof(logp->famfs_log_len));
+	crc = mu_crc(alg, crc, &logp->famfs_log_data_len, sizeof(logp->famfs_log_data_len));
+	crc = mu_crc(alg, crc, &logp->famfs_log_flags, sizeof(logp->famfs_log_flags));
 	return crc;
 }
 
-static unsigned long
-famfs_gen_log_entry_crc(const struct famfs_log_entry *le)
+static u32
+famfs_gen_log_rec_crc(const struct famfs_log_rec *lr, enum mu_crc_alg alg)
 {
-	unsigned long crc = crc32(0L, Z_NULL, 0);
-	size_t le_size = sizeof(*le);
-	size_t le_crc_size = le_size - sizeof(le->famfs_log_entry_crc);
-
-	crc = crc32(crc, (const unsigned char *)le, le_crc_size);
-	return crc;
+	return mu_crc(alg, 0, (const u8 *)lr + sizeof(lr->lr_crc),
+		      lr->lr_len - sizeof(lr->lr_crc));
 }
 
 /**
@@ -529,21 +551,25 @@ famfs_gen_log_entry_crc(const struct famfs_log_entry *le)
  *
  * * Print info from the superblock
  * * Print log stats
- * * build the log bitmap (which scans the log) and check for errors
+ * * build the log bitmap (which scans and validates the log, with up to @nthreads
+ *   threads) and check for errors
+ * * Print the extent layout, with histograms of the extent and free run sizes
  */
 int
 famfs_fsck_scan(
 	const struct famfs_superblock *sb,
 	const struct famfs_log        *logp,
 	int                            human,
+	int                            nthreads,
 	int                            verbose)
 {
+	struct mu_histogram ext_hist, free_hist;
 	size_t effective_log_size;
 	struct famfs_log_stats ls;
 	u64 alloc_sum, fsize_sum;
-	size_t total_log_size;
 	u64 dev_capacity;
 	u64 errors = 0;
+	int nranges, nbad;
 	u8 *bitmap;
 	u64 nbits;
 	int role;
@@ -553,8 +579,7 @@ famfs_fsck_scan(
 	assert(logp);
 
 	dev_capacity = sb->ts_devlist[0].dd_size;
-	effective_log_size = sizeof(*logp) +
-		(logp->famfs_log_next_index * sizeof(struct famfs_log_entry));
+	effective_log_size = sizeof(*logp) + logp->famfs_log_next_offset;
 
 	/*
 	 * Print superblock info
@@ -584,18 +609,30 @@ famfs_fsck_scan(
 	 * print log info
 	 */
 	printf("\nLog stats:\n");
-	printf("  # of log entries in use: %lld of %lld\n",
-	       logp->famfs_log_next_index, logp->famfs_log_last_index + 1);
-	printf("  Log size in use:          %ld\n", effective_log_size);
+	printf("  # of log entries in use: %lld\n", logp->famfs_log_next_index);
+	printf("  Log size in use:          %llu of %llu\n",
+	       (unsigned long long)effective_log_size,
+	       (unsigned long long)(sizeof(*logp) + logp->famfs_log_data_len));
 
 	/*
 	 * Build the log bitmap to scan for errors
 	 */
-	bitmap = famfs_build_bitmap(logp,  dev_capacity, &nbits, &errors,
-				    &fsize_sum, &alloc_sum, &ls, verbose);
-	if (errors)
-		printf("ERROR: %lld ALLOCATION COLLISIONS FOUND\n", errors);
-	else {
+	mu_hist_init(&ext_hist);
+	bitmap = famfs_fsck_build_bitmap(logp, dev_capacity, nthreads, &nbits, &errors,
+					 &fsize_sum, &alloc_sum, &ls, &ext_hist, &nranges,
+					 &nbad, verbose);
+	if (!bitmap) {
+		fprintf(stderr, "%s: unable to build the allocation bitmap\n", __func__);
+		return -ENOMEM;
+	}
+	printf("  Entries validated:        %lld (%d thread%s)\n", ls.n_entries, nranges,
+	       (nranges > 1) ? "s" : "");
+	if (nbad)
+		printf("ERROR: INVALID LOG RECORDS FOUND (%d of %d ranges not fully checked)\n",
+		       nbad, nranges);
+	if (errors > (u64)nbad)
+		printf("ERROR: %lld ALLOCATION COLLISIONS FOUND\n", errors - nbad);
+	else if (!nbad) {
 		u64 bitmap_capacity = nbits * FAMFS_ALLOC_UNIT;
 		float space_amp = (float)alloc_sum / (float)fsize_sum;
 		float percent_used = 100.0 * (float)alloc_sum /  (float)bitmap_capacity;
@@ -623,9 +660,48 @@ famfs_fsck_scan(
 
 	/* Log stats */
 	printf("Famfs log:\n");
-	printf("  %lld of %lld entries used\n", ls.n_entries, logp->famfs_log_last_index + 1);
+	printf("  %lld entries in %lld of %lld bytes\n", ls.n_entries,
+	       logp->famfs_log_next_offset, logp->famfs_log_data_len);
+	if (ls.n_entries)
+		printf("  %lld bytes per entry\n", logp->famfs_log_next_offset / ls.n_entries);
 	printf("  %lld files\n", ls.f_logged);
-	printf("  %lld directories\n\n", ls.d_logged);
+	printf("  %lld directories\n", ls.d_logged);
+	if (ls.c_bytes) {
+		printf("  Checkpoint: %lld records in %lld bytes (replacing %lld entries)\n",
+		       ls.c_records, ls.c_bytes, ls.c_nentries);
+		printf("  Log tail:   %lld entries after the checkpoint\n",
+		       ls.n_entries - ls.c_records);
+	}
+	printf("\n");
+
+	/* Extent layout: how files are split, and how fragmented the free space is */
+	printf("Extent layout:\n");
+	printf("  %lld extents in %lld files\n", ls.f_extents, ls.f_logged);
+	for (i = 1; i <= FAMFS_FC_MAX_EXTENTS; i++) {
+		if (ls.f_nextents[i])
+			printf("  %lld files with %d extent%s\n",
+			       ls.f_nextents[i], i, (i > 1) ? "s" : "");
+	}
+	{
+		u64 nruns = 0, largest = 0;
+		u64 pos = mu_bitmap_find_first_zero(bitmap, nbits);
+
+		mu_hist_init(&free_hist);
+		while (pos < nbits) {
+			u64 end = mu_bitmap_find_next_set(bitmap, nbits, pos);
+
+			nruns++;
+			if (end - pos > largest)
+				largest = end - pos;
+			mu_hist_record(&free_hist, (end - pos) * FAMFS_ALLOC_UNIT);
+			pos = mu_bitmap_find_next_zero(bitmap, nbits, end);
+		}
+		printf("  %lld free runs, largest %lld bytes\n",
+		       nruns, largest * FAMFS_ALLOC_UNIT);
+	}
+	mu_hist_print(&ext_hist, stdout, "  Extent sizes", "bytes");
+	mu_hist_print(&free_hist, stdout, "  Free run sizes", "bytes");
+	printf("\n");
 
 	free(bitmap);
 
@@ -635,16 +711,10 @@ famfs_fsck_scan(
 		printf("  log_len:           %lld\n", sb->ts_log_len);
 
 		printf("  sizeof(log header) %ld\n", sizeof(struct famfs_log));
-		printf("  sizeof(log_entry)  %ld\n", sizeof(struct famfs_log_entry));
-
-		printf("  last_log_index:    %lld\n", logp->famfs_log_last_index);
-		total_log_size = sizeof(struct famfs_log)
-			+ (sizeof(struct famfs_log_entry) * logp->famfs_log_last_index);
-		printf("  usable log size:   %ld\n", total_log_size);
-		printf("  sizeof(struct famfs_file_creation): %ld\n",
-		       sizeof(struct famfs_file_creation));
-		printf("  sizeof(struct famfs_file_access):   %ld\n",
-		       sizeof(struct famfs_file_access));
+		printf("  sizeof(log record) %ld..%d\n", sizeof(struct famfs_log_rec),
+		       FAMFS_LOG_REC_MAX);
+		printf("  usable log size:   %lld\n", logp->famfs_log_data_len);
+		printf("  log epoch:         %lld\n", logp->famfs_log_epoch);
 		printf("\n");
 	}
 	return errors;
@@ -936,7 +1006,11 @@ famfs_file_map_create(
 	filemap.extent_type    = SIMPLE_DAX_EXTENT;
 	filemap.ext_list_count = nextents;
 
-	/* TODO: check for overflow (nextents > max_extents) */
+	if (nextents > FAMFS_MAX_EXTENTS) {
+		fprintf(stderr, "%s: file %s has %d extents; the map holds %d\n",
+			__func__, path, nextents, FAMFS_MAX_EXTENTS);
+		return -EINVAL;
+	}
 	for (i = 0; i < nextents; i++) {
 		filemap.ext_list[i].offset = ext_list[i].famfs_extent_offset;
 		filemap.ext_list[i].len    = ext_list[i].famfs_extent_len;
@@ -1100,29 +1174,329 @@ famfs_mkmeta(const char *devname)
 	return 0;
 }
 
+/*
+ * Mapping helpers
+ */
+
+/**
+ * famfs_mmap_opts_init()
+ *
+ * Defaults: align as the extents allow, no populate, no advice, no numa policy
+ */
+void
+famfs_mmap_opts_init(struct famfs_mmap_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->align = FAMFS_MMAP_ALIGN_AUTO;
+	opts->advice = FAMFS_MMAP_NO_ADVICE;
+	opts->numa_node = -1;
+}
+
+static const struct {
+	const char *name;
+	int advice;
+} famfs_mmap_advice_names[] = {
+	{ "normal",     MADV_NORMAL },
+	{ "random",     MADV_RANDOM },
+	{ "sequential", MADV_SEQUENTIAL },
+	{ "willneed",   MADV_WILLNEED },
+	{ "hugepage",   MADV_HUGEPAGE },
+	{ "nohugepage", MADV_NOHUGEPAGE },
+};
+
+#define FAMFS_MMAP_NADVICE (sizeof(famfs_mmap_advice_names) / sizeof(famfs_mmap_advice_names[0]))
+
+/**
+ * famfs_mmap_opts_parse()
+ *
+ * Parse a comma-separated list of mapping options into @opts:
+ *   align=auto|none|2m|1g, populate, advice=<normal|random|sequential|willneed|
+ *   hugepage|nohugepage>, node=<n>
+ *
+ * Return value: 0, or -EINVAL if @spec has an unknown or invalid option
+ */
+int
+famfs_mmap_opts_parse(struct famfs_mmap_opts *opts, const char *spec)
+{
+	char *save = NULL;
+	char *val = NULL;
+	char buf[256];
+	char *tok;
+	size_t i;
+
+	if (strlen(spec) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, spec);
+
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = 0;
+
+		if (strcmp(tok, "populate") == 0 && !val) {
+			opts->populate = 1;
+		} else if (strcmp(tok, "align") == 0 && val) {
+			if (strcmp(val, "auto") == 0)
+				opts->align = FAMFS_MMAP_ALIGN_AUTO;
+			else if (strcmp(val, "none") == 0 || strcasecmp(val, "4k") == 0)
+				opts->align = FAMFS_MMAP_ALIGN_NONE;
+			else if (strcasecmp(val, "2m") == 0)
+				opts->align = FAMFS_PMD_SIZE;
+			else if (strcasecmp(val, "1g") == 0)
+				opts->align = FAMFS_PUD_SIZE;
+			else
+				goto bad;
+		} else if (strcmp(tok, "advice") == 0 && val) {
+			for (i = 0; i < FAMFS_MMAP_NADVICE; i++) {
+				if (strcmp(val, famfs_mmap_advice_names[i].name) == 0)
+					break;
+			}
+			if (i == FAMFS_MMAP_NADVICE)
+				goto bad;
+			opts->advice = famfs_mmap_advice_names[i].advice;
+		} else if (strcmp(tok, "node") == 0 && val) {
+			char *end;
+
+			opts->numa_node = strtol(val, &end, 0);
+			if (*end || opts->numa_node < 0 || opts->numa_node >= 1024)
+				goto bad;
+		} else {
+			goto bad;
+		}
+	}
+	return 0;
+
+bad:
+	fprintf(stderr, "%s: invalid mapping option (%s%s%s)\n", __func__, tok,
+		(val) ? "=" : "", (val) ? val : "");
+	return -EINVAL;
+}
+
+/*
+ * The largest page size that the file's layout allows a mapping of it to use: every
+ * extent must start (in the device) and end (in the file) on a page boundary. Files
+ * that aren't famfs files (or mock ones) just go by their size, which lets page cache
+ * files (e.g. tmpfs) use transparent huge pages.
+ */
+static size_t
+famfs_mmap_max_align(int fd, size_t size)
+{
+	struct famfs_ioc_map filemap = {0};
+	size_t align;
+	u64 i;
+
+	align = (size >= FAMFS_PUD_SIZE) ? FAMFS_PUD_SIZE :
+		(size >= FAMFS_PMD_SIZE) ? FAMFS_PMD_SIZE : FAMFS_MMAP_ALIGN_NONE;
+	if (mock_kmod || ioctl(fd, FAMFSIOC_MAP_GET, &filemap))
+		return align;
+
+	for (; align > FAMFS_MMAP_ALIGN_NONE; align = (align == FAMFS_PUD_SIZE) ?
+		     FAMFS_PMD_SIZE : FAMFS_MMAP_ALIGN_NONE) {
+		for (i = 0; i < MIN(filemap.ext_list_count, (u64)FAMFS_MAX_EXTENTS); i++) {
+			const struct famfs_extent *ext = &filemap.ext_list[i];
+
+			if (ext->offset & (align - 1))
+				break;
+			if (i + 1 < filemap.ext_list_count && (ext->len & (align - 1)))
+				break;
+		}
+		if (i == MIN(filemap.ext_list_count, (u64)FAMFS_MAX_EXTENTS))
+			break;
+	}
+	return align;
+}
+
+/*
+ * mmap @size bytes of @fd at a virtual address aligned to @align: reserve @align more
+ * address space than needed, map the file over the aligned part of it, and give back
+ * the rest.
+ */
+static void *
+famfs_mmap_aligned(int fd, size_t size, int prot, int flags, size_t align)
+{
+	size_t pgsz = sysconf(_SC_PAGESIZE);
+	size_t maplen = (size + pgsz - 1) & ~(pgsz - 1);
+	uintptr_t resv, start;
+	void *addr;
+
+	if (align <= pgsz)
+		return mmap(0, size, prot, flags, fd, 0);
+
+	addr = mmap(0, maplen + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		    -1, 0);
+	if (addr == MAP_FAILED)
+		return mmap(0, size, prot, flags, fd, 0);
+
+	resv = (uintptr_t)addr;
+	start = (resv + align - 1) & ~(align - 1);
+	addr = mmap((void *)start, size, prot, flags | MAP_FIXED, fd, 0);
+	if (addr == MAP_FAILED) {
+		munmap((void *)resv, maplen + align);
+		return MAP_FAILED;
+	}
+	if (start > resv)
+		munmap((void *)resv, start - resv);
+	if (resv + align > start)
+		munmap((void *)(start + maplen), resv + align - start);
+	return addr;
+}
+
+/**
+ * famfs_mmap_pagesize()
+ *
+ * The largest page size backing any of the mapping that starts at @addr, from
+ * /proc/self/smaps. Huge pages are visible there for page cache, shmem and hugetlbfs
+ * mappings; DAX huge mappings aren't accounted, so they show up as the base page size.
+ *
+ * Return value: page size in bytes, or 0 if the mapping wasn't found
+ */
+size_t
+famfs_mmap_pagesize(const void *addr)
+{
+	unsigned long start, end;
+	size_t pagesize = 0;
+	char line[256];
+	int found = 0;
+	u64 kb;
+	FILE *fp;
+
+	fp = fopen("/proc/self/smaps", "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		/* A new vma ("start-end perms ..."); none of the field names parse as that */
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			if (found)
+				break;
+			found = (start == (uintptr_t)addr);
+			continue;
+		}
+		if (!found)
+			continue;
+		if (sscanf(line, "KernelPageSize: %llu kB", &kb) == 1)
+			pagesize = MAX(pagesize, (size_t)kb * 1024);
+		else if ((sscanf(line, "FilePmdMapped: %llu kB", &kb) == 1 ||
+			  sscanf(line, "ShmemPmdMapped: %llu kB", &kb) == 1 ||
+			  sscanf(line, "AnonHugePages: %llu kB", &kb) == 1) && kb)
+			pagesize = MAX(pagesize, FAMFS_PMD_SIZE);
+	}
+	fclose(fp);
+	return pagesize;
+}
+
+static const char *
+famfs_size_str(size_t size, char *buf, size_t len)
+{
+	if (size >= FAMFS_PUD_SIZE)
+		snprintf(buf, len, "%zuGiB", size / FAMFS_PUD_SIZE);
+	else if (size >= 1024 * 1024)
+		snprintf(buf, len, "%zuMiB", size / (1024 * 1024));
+	else
+		snprintf(buf, len, "%zuKiB", size / 1024);
+	return buf;
+}
+
+/**
+ * famfs_mmap_fd()
+ *
+ * Map @size bytes of @fd (MAP_SHARED), aligned so it can use huge pages
+ *
+ * @opts - NULL for the defaults (see famfs_mmap_opts_init()); the achieved alignment
+ *         and page size are stored in it
+ *
+ * Return value: the mapping, or NULL on failure. Hints (advice, numa policy) that
+ * can't be applied are reported, but don't fail the mapping.
+ */
+void *
+famfs_mmap_fd(int fd, size_t size, int read_only, struct famfs_mmap_opts *opts)
+{
+	int prot = (read_only) ? PROT_READ : PROT_READ | PROT_WRITE;
+	struct famfs_mmap_opts defaults;
+	int flags = MAP_SHARED;
+	size_t align;
+	void *addr;
+
+	if (!opts) {
+		famfs_mmap_opts_init(&defaults);
+		opts = &defaults;
+	}
+
+	align = famfs_mmap_max_align(fd, size);
+	if (opts->align != FAMFS_MMAP_ALIGN_AUTO) {
+		if (opts->align > align && opts->verbose) {
+			char abuf[16];
+
+			fprintf(stderr, "%s: warning: file layout doesn't allow %s pages\n",
+				__func__, famfs_size_str(opts->align, abuf, sizeof(abuf)));
+		}
+		align = opts->align;
+	}
+
+	/* With a numa policy, populate after the policy is set */
+	if (opts->populate && opts->numa_node < 0)
+		flags |= MAP_POPULATE;
+
+	addr = famfs_mmap_aligned(fd, size, prot, flags, align);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap failed (%s)\n", __func__, strerror(errno));
+		return NULL;
+	}
+
+	if (opts->numa_node >= 0) {
+		unsigned long nodemask[1024 / (8 * sizeof(unsigned long))] = { 0 };
+
+		nodemask[opts->numa_node / (8 * sizeof(unsigned long))] |=
+			1UL << (opts->numa_node % (8 * sizeof(unsigned long)));
+		if (syscall(SYS_mbind, addr, size, MPOL_PREFERRED, nodemask, 1024, 0))
+			fprintf(stderr, "%s: warning: unable to prefer node %d (%s)\n",
+				__func__, opts->numa_node, strerror(errno));
+		if (opts->populate &&
+		    madvise(addr, size, (read_only) ? MADV_POPULATE_READ : MADV_POPULATE_WRITE))
+			fprintf(stderr, "%s: warning: unable to populate mapping (%s)\n",
+				__func__, strerror(errno));
+	}
+	if (opts->advice != FAMFS_MMAP_NO_ADVICE && madvise(addr, size, opts->advice))
+		fprintf(stderr, "%s: warning: madvise(%d) failed (%s)\n",
+			__func__, opts->advice, strerror(errno));
+
+	opts->align_out = ((uintptr_t)addr & (align - 1)) ? FAMFS_MMAP_ALIGN_NONE : align;
+	opts->pagesize = famfs_mmap_pagesize(addr);
+	if (opts->verbose) {
+		char abuf[16], pbuf[16];
+
+		printf("%s: mapped %zu bytes at %p; aligned for %s pages, %s pages seen\n",
+		       __func__, size, addr,
+		       famfs_size_str(opts->align_out, abuf, sizeof(abuf)),
+		       (opts->pagesize) ? famfs_size_str(opts->pagesize, pbuf, sizeof(pbuf)) :
+		       "no");
+	}
+	return addr;
+}
+
 /**
- * mmap_whole_file()
+ * famfs_mmap_file()
+ *
+ * Map a whole file (see famfs_mmap_fd())
  *
- * @fname
  * @read_only - mmap will be read-only if true
- * @size      - size will be stored if this pointer is non-NULL
+ * @sizep     - size will be stored if this pointer is non-NULL
+ * @opts      - NULL for the default options
  *
- * TODO: this is only used by the cli for file verification. Move to CLI?
  * Returns:
  * NULL - failure
  * otherwise - success
  */
 void *
-famfs_mmap_whole_file(
-	const char *fname,
-	int         read_only,
-	size_t     *sizep)
+famfs_mmap_file(
+	const char             *fname,
+	int                     read_only,
+	size_t                 *sizep,
+	struct famfs_mmap_opts *opts)
 {
 	struct stat st;
 	void *addr;
 	int rc, fd;
 	int openmode = (read_only) ? O_RDONLY : O_RDWR;
-	int mapmode  = (read_only) ? PROT_READ : PROT_READ | PROT_WRITE;
 
 	rc = stat(fname, &st);
 	if (rc < 0) {
@@ -1140,20 +1514,30 @@ famfs_mmap_whole_file(
 	fd = open(fname, openmode, 0);
 	if (fd < 0) {
 		fprintf(stderr, "open %s failed; rc %d errno %d\n", fname, rc, errno);
-		rc = -1;
 		return NULL;
 	}
 
-	addr = mmap(0, st.st_size, mapmode, MAP_SHARED, fd, 0);
-	if (addr == MAP_FAILED) {
+	addr = famfs_mmap_fd(fd, st.st_size, read_only, opts);
+	if (!addr)
 		fprintf(stderr, "Failed to mmap file %s\n", fname);
-		rc = -1;
-		close(fd);
-		return NULL;
-	}
+	close(fd); /* The mapping keeps the file open */
 	return addr;
 }
 
+/**
+ * famfs_mmap_whole_file()
+ *
+ * famfs_mmap_file() with the default options
+ */
+void *
+famfs_mmap_whole_file(
+	const char *fname,
+	int         read_only,
+	size_t     *sizep)
+{
+	return famfs_mmap_file(fname, read_only, sizep, NULL);
+}
+
 
 /********************************************************************************
  *
@@ -1181,7 +1565,7 @@ famfs_print_log_stats(const char *msg,
 static inline int
 famfs_log_full(const struct famfs_log *logp)
 {
-	return (logp->famfs_log_next_index > logp->famfs_log_last_index);
+	return (logp->famfs_log_next_offset + FAMFS_LOG_REC_MAX > logp->famfs_log_data_len);
 }
 
 static inline int
@@ -1198,8 +1582,12 @@ famfs_log_entry_md_path_is_relative(const struct famfs_mkdir *md)
 		&& (md->famfs_relpath[0] != '/'));
 }
 
-int
-famfs_validate_log_header(const struct famfs_log *logp)
+/*
+ * The immutable block of the log header (magic through crc). It only changes when the
+ * log is created, so a client that has validated it can skip it on later plays.
+ */
+static int
+famfs_validate_log_meta(const struct famfs_log *logp)
 {
 	unsigned long crc = famfs_gen_log_header_crc(logp);
 
@@ -1211,2074 +1599,5425 @@ famfs_validate_log_header(const struct famfs_log *logp)
 		fprintf(stderr, "%s: invalid crc in log header\n", __func__);
 		return -1;
 	}
+	if (logp->famfs_log_flags & ~FAMFS_LOG_FLAGS_KNOWN) {
+		fprintf(stderr, "%s: unknown log flags 0x%llx\n", __func__,
+			logp->famfs_log_flags & ~FAMFS_LOG_FLAGS_KNOWN);
+		return -1;
+	}
+	if (logp->famfs_log_data_len > logp->famfs_log_len - sizeof(*logp)) {
+		fprintf(stderr, "%s: invalid log size\n", __func__);
+		return -1;
+	}
 	return 0;
 }
 
+/* The cursor block, which moves with every commit */
 static int
-famfs_validate_log_entry(const struct famfs_log_entry *le, u64 index)
+famfs_validate_log_cursor(const struct famfs_log *logp)
+{
+	if (logp->famfs_log_next_offset > logp->famfs_log_data_len) {
+		fprintf(stderr, "%s: invalid log offset\n", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+int
+famfs_validate_log_header(const struct famfs_log *logp)
 {
-	unsigned long crc;
-	int errors = 0;
+	if (famfs_validate_log_meta(logp))
+		return -1;
+	return famfs_validate_log_cursor(logp);
+}
+
+/*
+ * Log records (see struct famfs_log_rec)
+ */
 
-	if (le->famfs_log_entry_seqnum != index) {
-		fprintf(stderr, "%s: bad seqnum; expect %lld found %lld\n",
-			__func__, index, le->famfs_log_entry_seqnum);
-		errors++;
+static inline u8 *
+famfs_put_varint(u8 *p, u64 val)
+{
+	while (val >= 0x80) {
+		*p++ = (u8)val | 0x80;
+		val >>= 7;
 	}
-	crc = famfs_gen_log_entry_crc(le);
-	if (le->famfs_log_entry_crc != crc) {
-		fprintf(stderr, "%s: bad crc at log index %lld\n", __func__, index);
-		errors++;
+	*p++ = (u8)val;
+	return p;
+}
+
+/* Returns: the byte after the varint, or NULL if it runs past @end (or 64 bits) */
+static inline const u8 *
+famfs_get_varint(const u8 *p, const u8 *end, u64 *val)
+{
+	u64 v = 0;
+	int shift;
+
+	for (shift = 0; shift < 64 && p < end; shift += 7) {
+		u8 b = *p++;
+
+		v |= (u64)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*val = v;
+			return p;
+		}
 	}
-	return errors;
+	return NULL;
+}
+
+static const u8 *
+famfs_get_varints(const u8 *p, const u8 *end, u64 *vals, int n)
+{
+	int i;
+
+	for (i = 0; i < n && p; i++)
+		p = famfs_get_varint(p, end, &vals[i]);
+	return p;
+}
+
+static inline u64
+famfs_zigzag(s64 val)
+{
+	return ((u64)val << 1) ^ (u64)(val >> 63);
+}
+
+static inline s64
+famfs_unzigzag(u64 val)
+{
+	return (s64)(val >> 1) ^ -(s64)(val & 1);
 }
 
 /**
- * __famfs_logplay()
+ * famfs_log_rec_encode()
  *
- * Inner function to play the log for a famfs file system
+ * Encode a log entry as a record, including its crc
  *
- * @logp        - pointer to a read-only copy or mmap of the log
- * @mpt         - mount point path
- * @dry_run     - process the log but don't create the files & directories
- * @client_mode - for testing; play the log as if this is a client node, even on master
+ * @buf    - at least FAMFS_LOG_REC_MAX bytes
+ * @le     - the entry (its seqnum is used, but not its path)
+ * @prev   - length of the previous record, or 0
+ * @parent - distance back to the record of the parent directory, or 0
+ * @name   - path relative to the parent directory (or to the mount point)
+ * @alg    - the crc algorithm of the log
  *
- * Returns value: Number of errors detected (0=complete success)
+ * Return value: the length of the record, or -EINVAL
  */
 int
-__famfs_logplay(
-	const struct famfs_log *logp,
-	const char             *mpt,
-	int                     dry_run,
-	int                     client_mode,
-	int                     verbose)
+famfs_log_rec_encode(
+	u8                           *buf,
+	const struct famfs_log_entry *le,
+	u64                           prev,
+	u64                           parent,
+	const char                   *name,
+	enum mu_crc_alg               alg)
 {
-	struct famfs_log_stats ls = { 0 };
-	enum famfs_system_role role;
-	struct famfs_superblock *sb;
-	u64 i, j;
-	int rc;
-
-	sb = famfs_map_superblock_by_path(mpt, 1 /* read-only */);
-	if (!sb)
-		return -1;
+	struct famfs_log_rec *lr = (struct famfs_log_rec *)buf;
+	size_t namelen = strlen(name);
+	u8 *p = lr->lr_data;
+	size_t len;
+	u32 i;
+
+	memset(lr, 0, sizeof(*lr));
+	lr->lr_prev = prev;
+	lr->lr_type = le->famfs_log_entry_type;
+	lr->lr_seqnum = le->famfs_log_entry_seqnum;
+
+	switch (le->famfs_log_entry_type) {
+	case FAMFS_LOG_FILE: {
+		const struct famfs_file_creation *fc = &le->famfs_fc;
+		u64 unit = FAMFS_ALLOC_UNIT;
+		u64 prev_end = 0;
+
+		if (fc->famfs_nextents > FAMFS_FC_MAX_EXTENTS)
+			return -EINVAL;
 
-	if (famfs_check_super(sb)) {
-		fprintf(stderr, "%s: no valid superblock for mpt %s\n", __func__, mpt);
-		return -1;
-	}
+		/* Extents are normally whole allocation units, which encode smaller */
+		lr->lr_flags = FAMFS_LR_EXT_UNITS;
+		for (i = 0; i < fc->famfs_nextents; i++) {
+			const struct famfs_simple_extent *se = &fc->famfs_ext_list[i].se;
 
-	role = (client_mode) ? FAMFS_CLIENT : famfs_get_role(sb);
+			if ((se->famfs_extent_offset | se->famfs_extent_len) % FAMFS_ALLOC_UNIT) {
+				lr->lr_flags = 0;
+				unit = 1;
+				break;
+			}
+		}
 
-	if (logp->famfs_log_magic != FAMFS_LOG_MAGIC) {
-		fprintf(stderr, "%s: log has bad magic number (%llx)\n",
-			__func__, logp->famfs_log_magic);
-		return -1;
+		p = famfs_put_varint(p, parent);
+		p = famfs_put_varint(p, fc->fc_mode);
+		p = famfs_put_varint(p, fc->fc_uid);
+		p = famfs_put_varint(p, fc->fc_gid);
+		p = famfs_put_varint(p, fc->famfs_fc_size);
+		p = famfs_put_varint(p, fc->famfs_fc_flags);
+		p = famfs_put_varint(p, fc->famfs_nextents);
+		for (i = 0; i < fc->famfs_nextents; i++) {
+			const struct famfs_simple_extent *se = &fc->famfs_ext_list[i].se;
+			u64 ofs = se->famfs_extent_offset / unit;
+			u64 elen = se->famfs_extent_len / unit;
+
+			p = famfs_put_varint(p, famfs_zigzag((s64)(ofs - prev_end)));
+			p = famfs_put_varint(p, elen);
+			prev_end = ofs + elen;
+		}
+		break;
 	}
+	case FAMFS_LOG_MKDIR: {
+		const struct famfs_mkdir *md = &le->famfs_md;
 
-	if (famfs_validate_log_header(logp)) {
-		fprintf(stderr, "%s: invalid log header\n", __func__);
-		return -1;
+		p = famfs_put_varint(p, parent);
+		p = famfs_put_varint(p, md->fc_mode);
+		p = famfs_put_varint(p, md->fc_uid);
+		p = famfs_put_varint(p, md->fc_gid);
+		break;
+	}
+	case FAMFS_LOG_CHECKPOINT:
+		p = famfs_put_varint(p, le->famfs_ck.ck_nrecords);
+		p = famfs_put_varint(p, le->famfs_ck.ck_nentries);
+		namelen = 0;
+		goto done;
+	default:
+		return -EINVAL;
 	}
 
-	if (verbose)
-		printf("famfs logplay: log contains %lld entries\n", logp->famfs_log_next_index);
+	if (namelen == 0 || namelen >= FAMFS_MAX_PATHLEN)
+		return -EINVAL;
+	p = famfs_put_varint(p, namelen);
+	memcpy(p, name, namelen);
+	p += namelen;
+
+done:
+	len = roundup(p - buf, FAMFS_LOG_REC_ALIGN);
+	assert(len <= FAMFS_LOG_REC_MAX);
+	memset(p, 0, len - (p - buf));
+	lr->lr_len = len;
+	lr->lr_crc = famfs_gen_log_rec_crc(lr, alg);
+	return len;
+}
 
-	for (i = 0; i < logp->famfs_log_next_index; i++) {
-		struct famfs_log_entry le = logp->entries[i];
+/**
+ * famfs_log_rec_decode()
+ *
+ * Decode a record. The path of the entry is just the name in the record; the caller
+ * resolves the parent (if any).
+ *
+ * @buf       - the record
+ * @avail     - bytes of log starting at @buf (the record must fit)
+ * @le        - the decoded entry
+ * @parent    - distance back to the record of the parent directory, or 0
+ * @check_crc - verify the record crc
+ * @alg       - the crc algorithm of the log
+ *
+ * Return value: 0, or -EINVAL if the record is malformed
+ */
+int
+famfs_log_rec_decode(
+	const u8               *buf,
+	size_t                  avail,
+	struct famfs_log_entry *le,
+	u64                    *parent,
+	int                     check_crc,
+	enum mu_crc_alg         alg)
+{
+	const struct famfs_log_rec *lr = (const struct famfs_log_rec *)buf;
+	const u8 *p = lr->lr_data;
+	const u8 *end;
+	u8 *relpath;
+	u64 namelen;
+	u64 f[7];
+	u32 i;
+
+	if (avail < sizeof(*lr) || lr->lr_len < sizeof(*lr) || lr->lr_len > avail ||
+	    lr->lr_len > FAMFS_LOG_REC_MAX || lr->lr_len % FAMFS_LOG_REC_ALIGN)
+		return -EINVAL;
+	if (check_crc && lr->lr_crc != famfs_gen_log_rec_crc(lr, alg))
+		return -EINVAL;
+	end = buf + lr->lr_len;
 
-		if (famfs_validate_log_entry(&le, i)) {
-			fprintf(stderr, "%s: invalid log entry at index %lld\n", __func__, i);
-			return -1;
-		}
-		ls.n_entries++;
+	le->famfs_log_entry_seqnum = lr->lr_seqnum;
+	le->famfs_log_entry_type = lr->lr_type;
+	le->famfs_log_entry_crc = lr->lr_crc;
+	*parent = 0;
 
-		switch (le.famfs_log_entry_type) {
-		case FAMFS_LOG_FILE: {
-			const struct famfs_file_creation *fc = &le.famfs_fc;
-			struct famfs_simple_extent *el;
-			char fullpath[PATH_MAX];
-			char rpath[PATH_MAX];
-			struct stat st;
-			int skip_file = 0;
-			int fd;
+	switch (lr->lr_type) {
+	case FAMFS_LOG_FILE: {
+		struct famfs_file_creation *fc = &le->famfs_fc;
+		u64 unit = (lr->lr_flags & FAMFS_LR_EXT_UNITS) ? FAMFS_ALLOC_UNIT : 1;
+		u64 prev_end = 0;
 
-			ls.f_logged++;
-			if (verbose > 1)
-				printf("%s: %lld file=%s size=%lld\n", __func__, i,
-				       fc->famfs_relpath, fc->famfs_fc_size);
-
-			if (!famfs_log_entry_fc_path_is_relative(fc)) {
-				fprintf(stderr,
-					"%s: ignoring log entry; path is not relative\n",
-					__func__);
-				ls.f_errs++;
-				skip_file++;
-			}
-
-			/* The only file that should have an extent with offset 0
-			 * is the superblock, which is not in the log. Check for files with
-			 * null offset...
-			 */
-			for (j = 0; j < fc->famfs_nextents; j++) {
-				const struct famfs_simple_extent *se = &fc->famfs_ext_list[j].se;
-
-				if (se->famfs_extent_offset == 0) {
-					fprintf(stderr,
-						"%s: ERROR file %s has extent with 0 offset\n",
-						__func__, fc->famfs_relpath);
-					ls.f_errs++;
-					skip_file++;
-				}
-			}
+		p = famfs_get_varints(p, end, f, 7);
+		if (!p || f[6] > FAMFS_FC_MAX_EXTENTS)
+			return -EINVAL;
+		*parent = f[0];
+		fc->fc_mode = f[1];
+		fc->fc_uid = f[2];
+		fc->fc_gid = f[3];
+		fc->famfs_fc_size = f[4];
+		fc->famfs_fc_flags = f[5];
+		fc->famfs_nextents = f[6];
+
+		for (i = 0; i < fc->famfs_nextents; i++) {
+			struct famfs_log_extent *ext = &fc->famfs_ext_list[i];
+			u64 e[2];
+
+			p = famfs_get_varints(p, end, e, 2);
+			if (!p)
+				return -EINVAL;
+			prev_end += famfs_unzigzag(e[0]);
+			ext->famfs_extent_type = FAMFS_EXT_SIMPLE;
+			ext->se.famfs_extent_offset = prev_end * unit;
+			ext->se.famfs_extent_len = e[1] * unit;
+			prev_end += e[1];
+		}
+		relpath = fc->famfs_relpath;
+		break;
+	}
+	case FAMFS_LOG_MKDIR: {
+		struct famfs_mkdir *md = &le->famfs_md;
 
-			if (skip_file)
-				continue;
+		p = famfs_get_varints(p, end, f, 4);
+		if (!p)
+			return -EINVAL;
+		*parent = f[0];
+		md->fc_mode = f[1];
+		md->fc_uid = f[2];
+		md->fc_gid = f[3];
+		relpath = md->famfs_relpath;
+		break;
+	}
+	case FAMFS_LOG_CHECKPOINT:
+		p = famfs_get_varints(p, end, f, 2);
+		if (!p)
+			return -EINVAL;
+		le->famfs_ck.ck_nrecords = f[0];
+		le->famfs_ck.ck_nentries = f[1];
+		return 0;
+	default:
+		return -EINVAL;
+	}
 
-			snprintf(fullpath, PATH_MAX - 1, "%s/%s", mpt, fc->famfs_relpath);
-			realpath(fullpath, rpath);
-			if (dry_run)
-				continue;
+	p = famfs_get_varint(p, end, &namelen);
+	if (!p || namelen == 0 || namelen >= FAMFS_MAX_PATHLEN || namelen > (u64)(end - p))
+		return -EINVAL;
+	memcpy(relpath, p, namelen);
+	relpath[namelen] = 0;
+	return 0;
+}
 
-			rc = stat(rpath, &st);
-			if (!rc) {
-				if (verbose > 1)
-					fprintf(stderr, "famfs logplay: File %s exists\n",
-						rpath);
-				ls.f_existed++;
-				continue;
-			}
-			if (verbose) {
-				printf("famfs logplay: creating file %s", fc->famfs_relpath);
-				if (verbose > 1)
-					printf(" mode %o", fc->fc_mode);
+/*
+ * Log iterator
+ */
 
-				printf("\n");
-			}
+/* The cursor block of the log header (the fields that the master updates) */
+#define FAMFS_LOG_CURSOR_OFFSET offsetof(struct famfs_log, famfs_log_next_seqnum)
+#define FAMFS_LOG_CURSOR_LEN \
+	(offsetof(struct famfs_log, famfs_log_gen) + sizeof(u64) - FAMFS_LOG_CURSOR_OFFSET)
 
-			fd = famfs_file_create(rpath, fc->fc_mode, fc->fc_uid, fc->fc_gid,
-					       (role == FAMFS_CLIENT) ? 1 : 0);
-			if (fd < 0) {
-				fprintf(stderr,
-					"%s: unable to create destfile (%s)\n",
-					__func__, fc->famfs_relpath);
+/*
+ * Cursor seqlock, writer side (we must hold the log lock, so only readers race with us).
+ * The generation is odd from famfs_log_cursor_begin() until famfs_log_cursor_end(); the
+ * fences keep the cursor stores between the two generation stores.
+ */
+static inline void
+famfs_log_cursor_begin(struct famfs_log *logp)
+{
+	assert(!(logp->famfs_log_gen & 1));
+	__atomic_store_n(&logp->famfs_log_gen, logp->famfs_log_gen + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-				unlink(rpath);
-				ls.f_errs++;
-				continue;
-			}
+static inline void
+famfs_log_cursor_end(struct famfs_log *logp)
+{
+	__atomic_store_n(&logp->famfs_log_gen, logp->famfs_log_gen + 1, __ATOMIC_RELEASE);
+}
 
-			/* Build extent list of famfs_simple_extent; the log entry has a
-			 * different kind of extent list...
-			 */
-			el = calloc(fc->famfs_nextents, sizeof(*el));
-			for (j = 0; j < fc->famfs_nextents; j++) {
-				const struct famfs_log_extent *tle = &fc->famfs_ext_list[j];
+/**
+ * famfs_log_read_cursor()
+ *
+ * Take a consistent copy of the cursor of a log header, without the log lock: a copy
+ * taken between two reads of the same even generation is one that the master committed.
+ * If a commit is in progress, the cursor is invalidated (the master may be on another
+ * host) and read again.
+ *
+ * Return value: 0, or -EAGAIN if no consistent copy was seen in FAMFS_LOG_CURSOR_TRIES
+ *               (a master that died in a commit leaves the generation odd, until the
+ *               next master takes the log lock)
+ */
+int
+famfs_log_read_cursor(const struct famfs_log *logp, struct famfs_log_cursor *c)
+{
+	u64 gen;
+	int i;
 
-				el[j].famfs_extent_offset = tle[j].se.famfs_extent_offset;
-				el[j].famfs_extent_len    = tle[j].se.famfs_extent_len;
-			}
-			famfs_file_map_create(rpath, fd, fc->famfs_fc_size,
-					      fc->famfs_nextents, el, FAMFS_REG);
-			close(fd);
-			free(el);
-			ls.f_created++;
-			break;
+	for (i = 0; i < FAMFS_LOG_CURSOR_TRIES; i++) {
+		if (i) {
+			sched_yield();
+			invalidate_processor_cache(&logp->famfs_log_next_seqnum,
+						   FAMFS_LOG_CURSOR_LEN);
 		}
-		case FAMFS_LOG_MKDIR: {
-			const struct famfs_mkdir *md = &le.famfs_md;
-			char fullpath[PATH_MAX];
-			char rpath[PATH_MAX];
-			int skip_dir = 0;
-			struct stat st;
-
-			ls.d_logged++;
-
-			if (!famfs_log_entry_md_path_is_relative(md)) {
-				fprintf(stderr,
-					"%s: ignoring log mkdir entry; path is not relative\n",
-					__func__);
-				ls.d_errs++;
-				skip_dir++;
-			}
-
-			if (skip_dir)
-				continue;
-
-			if (verbose)
-				printf("%s mkdir: %o %d:%d: %s \n", __func__,
-				       md->fc_mode, md->fc_uid, md->fc_gid, md->famfs_relpath);
+		gen = __atomic_load_n(&logp->famfs_log_gen, __ATOMIC_ACQUIRE);
+		if (gen & 1)
+			continue;
 
-			snprintf(fullpath, PATH_MAX - 1, "%s/%s", mpt, md->famfs_relpath);
-			realpath(fullpath, rpath);
-			if (dry_run)
-				continue;
+		c->next_seqnum = __atomic_load_n(&logp->famfs_log_next_seqnum, __ATOMIC_RELAXED);
+		c->next_index = __atomic_load_n(&logp->famfs_log_next_index, __ATOMIC_RELAXED);
+		c->next_offset = __atomic_load_n(&logp->famfs_log_next_offset, __ATOMIC_RELAXED);
+		c->last_offset = __atomic_load_n(&logp->famfs_log_last_offset, __ATOMIC_RELAXED);
+		c->epoch = __atomic_load_n(&logp->famfs_log_epoch, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&logp->famfs_log_gen, __ATOMIC_RELAXED) == gen) {
+			c->gen = gen;
+			return 0;
+		}
+	}
+	return -EAGAIN;
+}
 
-			rc = stat(rpath, &st);
-			if (!rc) {
-				switch (st.st_mode & S_IFMT) {
-				case S_IFDIR:
-					/* This is normal for log replay */
-					if (verbose > 1) {
-						fprintf(stderr,
-							"famfs logplay: directory %s exists\n",
-							rpath);
-						ls.d_existed++;
-					}
-					break;
+/*
+ * Find the end of the published log. If there's no consistent cursor, fall back to the
+ * index: it's published after the offset (see famfs_log_publish()), so all the records
+ * below the index end before the offset.
+ */
+static void
+famfs_log_end(struct famfs_log_iter *it)
+{
+	const struct famfs_log *logp = it->logp;
+	struct famfs_log_cursor c;
 
-				case S_IFREG:
-					fprintf(stderr,
-						"%s: file (%s) exists where dir should be\n",
-						__func__, rpath);
-					ls.d_errs++;
-					break;
+	if (famfs_log_read_cursor(logp, &c)) {
+		fprintf(stderr, "%s: log commit in progress for too long; reading anyway\n",
+			__func__);
+		c.next_index = __atomic_load_n(&logp->famfs_log_next_index, __ATOMIC_ACQUIRE);
+		c.next_offset = __atomic_load_n(&logp->famfs_log_next_offset, __ATOMIC_RELAXED);
+		c.epoch = logp->famfs_log_epoch;
+		c.gen = logp->famfs_log_gen;
+	}
+	it->end.index = c.next_index;
+	it->end.offset = MIN(c.next_offset, logp->famfs_log_data_len);
+	it->epoch = c.epoch;
+	it->gen = c.gen;
+}
 
-				default:
-					fprintf(stderr,
-						"%s: something (%s) exists where dir should be\n",
-						__func__, rpath);
-					ls.d_errs++;
-					break;
-				}
-				continue;
-			}
+/**
+ * famfs_log_iter_init()
+ *
+ * @first - position to start at: NULL for the start of the log, or a position that an
+ *          earlier iteration reached
+ * @flags - FAMFS_LOG_ITER_*
+ */
+void
+famfs_log_iter_init(
+	struct famfs_log_iter      *it,
+	const struct famfs_log     *logp,
+	const struct famfs_log_pos *first,
+	int                         flags)
+{
+	memset(it, 0, offsetof(struct famfs_log_iter, dir_path));
+	it->logp = logp;
+	if (first)
+		it->pos = *first;
+	famfs_log_end(it);
+	it->flags = flags;
+	it->parent = FAMFS_LOG_NO_PARENT;
+	it->dir_offset = FAMFS_LOG_NO_PARENT;
+}
 
-			if (verbose)
-				printf("famfs logplay: creating directory %s\n", md->famfs_relpath);
+/*
+ * Get the path of the directory whose record is at @offset, building it from the end
+ * back: the directory's name, then its parent's, and so on.
+ */
+static int
+famfs_log_dir_path(struct famfs_log_iter *it, u64 offset, char *path)
+{
+	const struct famfs_log *logp = it->logp;
+	char buf[FAMFS_MAX_PATHLEN];
+	size_t pos = sizeof(buf) - 1;
+	struct famfs_log_entry le;
+	u64 dir = offset;
+	u64 parent;
+	size_t len;
+
+	buf[pos] = 0;
+	for (;;) {
+		const char *name;
+
+		if (offset == it->dir_offset) {
+			name = it->dir_path;
+			parent = 0;
+		} else {
+			if (offset >= it->end.offset ||
+			    famfs_log_rec_decode(&logp->famfs_log_data[offset],
+						 it->end.offset - offset, &le, &parent,
+						 it->flags & FAMFS_LOG_ITER_VALIDATE,
+						 famfs_log_crc_alg(logp)) ||
+			    le.famfs_log_entry_type != FAMFS_LOG_MKDIR)
+				return -EINVAL;
+			name = (const char *)le.famfs_md.famfs_relpath;
+		}
 
-			rc = famfs_dir_create(mpt, (char *)md->famfs_relpath, md->fc_mode,
-					      md->fc_uid, md->fc_gid);
-			if (rc) {
-				fprintf(stderr,
-					"%s: error: unable to create directory (%s)\n",
-					__func__, md->famfs_relpath);
-				ls.d_errs++;
-				continue;
-			}
+		len = strlen(name);
+		if (len > pos)
+			return -ENAMETOOLONG;
+		pos -= len;
+		memcpy(&buf[pos], name, len);
 
-			ls.d_created++;
-			break;
-		}
-		case FAMFS_LOG_ACCESS:
-		default:
-			if (verbose)
-				printf("%s: invalid log entry\n", __func__);
+		if (!parent)
 			break;
-		}
+		/* Parents come first, so this always moves back */
+		if (parent > offset || parent % FAMFS_LOG_REC_ALIGN || pos == 0)
+			return -EINVAL;
+		buf[--pos] = '/';
+		offset -= parent;
 	}
-	famfs_print_log_stats("famfs_logplay", &ls, verbose);
 
-	return (ls.f_errs + ls.d_errs);
+	memcpy(path, &buf[pos], sizeof(buf) - pos);
+	it->dir_offset = dir;
+	memcpy(it->dir_path, path, sizeof(buf) - pos);
+	return 0;
 }
 
 /**
- * famfs_logplay()
+ * famfs_log_iter_path()
  *
- * Outer function to play the log for a famfs file system
+ * Resolve the full relative path of the last entry returned by famfs_log_iter_next()
+ * (which has just its own name if the iterator has FAMFS_LOG_ITER_NOPATHS)
  *
- * @fspath      - mount point, or any path within the famfs file system
- * @use_mmap    - Use mmap rather than reading the log into a buffer
- * @dry_run     - process the log but don't create the files & directories
- * @client_mode - for testing; play the log as if this is a client node, even on master
- * @verbose
+ * Return value: 0, or a negative errno
  */
 int
-famfs_logplay(
-	const char             *fspath,
-	int                     use_mmap,
-	int                     dry_run,
-	int                     client_mode,
-	int                     verbose)
+famfs_log_iter_path(struct famfs_log_iter *it)
 {
-	char mpt_out[PATH_MAX];
-	struct famfs_log *logp;
-	size_t log_size;
-	int lfd;
+	struct famfs_log_entry *le = &it->le;
+	char dir[FAMFS_MAX_PATHLEN];
+	size_t dlen, nlen;
+	u8 *relpath;
 	int rc;
 
-	lfd = open_log_file_read_only(fspath, &log_size, mpt_out, NO_LOCK);
-	if (lfd < 0) {
-		fprintf(stderr, "%s: failed to open log file for filesystem %s\n",
-			__func__, fspath);
-		return -1;
+	switch (le->famfs_log_entry_type) {
+	case FAMFS_LOG_FILE:
+		relpath = le->famfs_fc.famfs_relpath;
+		break;
+	case FAMFS_LOG_MKDIR:
+		relpath = le->famfs_md.famfs_relpath;
+		break;
+	default:
+		return 0;
 	}
 
-	if (use_mmap) {
-		logp = mmap(0, FAMFS_LOG_LEN, PROT_READ, MAP_PRIVATE, lfd, 0);
-		if (logp == MAP_FAILED) {
-			fprintf(stderr, "%s: failed to mmap log file %s/.meta/log\n",
-				__func__, mpt_out);
-			close(lfd);
-			return -1;
-		}
-		/* Note that this dereferences logp to get the length, and then invalidates the
-		 * cache. I think this is ok...
-		 */
-		invalidate_processor_cache(logp, logp->famfs_log_len);
-	} else {
-		size_t resid = 0;
-		size_t total = 0;
-		char *buf;
+	if (it->parent != FAMFS_LOG_NO_PARENT) {
+		rc = famfs_log_dir_path(it, it->parent, dir);
+		if (rc)
+			return rc;
 
-		/* XXX: Hmm, not sure how to invalidate the processor cache before a posix read.
-		 * default is mmap; posix read may not work correctly for non-cache-coherent configs
-		 */
-		/* Get log via posix read */
-		logp = malloc(log_size);
-		if (!logp) {
-			close(lfd);
-			fprintf(stderr, "%s: malloc %ld failed for log\n", __func__, log_size);
-			return -ENOMEM;
-		}
-		resid = log_size;
-		buf = (char *)logp;
-		do {
-			rc = read(lfd, &buf[total], resid);
-			if (rc < 0) {
-				fprintf(stderr, "%s: error %d reading log file\n",
-					__func__, errno);
-				return -errno;
-			}
-			printf("%s: read %d bytes of log\n", __func__, rc);
-			if (rc == 0)
-				goto err_out; /* if we didn't get the whole log, err out */
-			resid -= rc;
-			total += rc;
-		} while (resid > 0);
+		dlen = strlen(dir);
+		nlen = strlen((char *)relpath);
+		if (dlen + 1 + nlen >= FAMFS_MAX_PATHLEN)
+			return -ENAMETOOLONG;
+		memmove(&relpath[dlen + 1], relpath, nlen + 1);
+		memcpy(relpath, dir, dlen);
+		relpath[dlen] = '/';
+		it->parent = FAMFS_LOG_NO_PARENT;
 	}
 
-	rc = __famfs_logplay(logp, mpt_out, dry_run, client_mode, verbose);
-err_out:
-	if (use_mmap)
-		munmap(logp, FAMFS_LOG_LEN);
-	else
-		free(logp);
-	close(lfd);
-	return rc;
+	/* The next few records are likely to be in this directory */
+	if (le->famfs_log_entry_type == FAMFS_LOG_MKDIR) {
+		it->dir_offset = it->cur;
+		strcpy(it->dir_path, (char *)relpath);
+	}
+	return 0;
 }
 
-/********************************************************************************
- *
- * Log maintenance / append
- */
-
 /**
- * famfs_append_log()
+ * famfs_log_iter_refresh()
  *
- * @logp - pointer to struct famfs_log in memory media
- * @e    - pointer to log entry in memory
+ * Extend an iteration to the records committed since it began (or was last refreshed).
+ * Records are only appended, so nothing that has been read can have changed; just the new
+ * records are invalidated, and the iteration carries on from where it was.
  *
- * NOTE: this function is not re-entrant. Must hold a lock or mutex when calling this
- * function if there is any chance of re-entrancy.
+ * Return value: the number of new entries (0 if there are none), -ESTALE if the log was
+ *               rewritten (compacted) since the iteration began, in which case it must
+ *               start over, or -EAGAIN if there's no consistent cursor
  */
-static int
-famfs_append_log(struct famfs_log       *logp,
-		 struct famfs_log_entry *e)
+int
+famfs_log_iter_refresh(struct famfs_log_iter *it)
 {
-	assert(logp);
-	assert(e);
-
-	/* XXX This function is not re-entrant */
-
-	e->famfs_log_entry_seqnum = logp->famfs_log_next_seqnum;
-	e->famfs_log_entry_crc = famfs_gen_log_entry_crc(e);
-
-	memcpy(&logp->entries[logp->famfs_log_next_index], e, sizeof(*e));
+	const struct famfs_log *logp = it->logp;
+	struct famfs_log_cursor c;
+	u64 n;
+
+	invalidate_processor_cache(&logp->famfs_log_next_seqnum, FAMFS_LOG_CURSOR_LEN);
+	if (famfs_log_read_cursor(logp, &c))
+		return -EAGAIN;
+	if (c.gen == it->gen)
+		return 0;
+	if (c.epoch != it->epoch || c.next_index < it->end.index ||
+	    c.next_offset < it->end.offset || c.next_offset > logp->famfs_log_data_len)
+		return -ESTALE;
+
+	n = c.next_index - it->end.index;
+	invalidate_processor_cache(&logp->famfs_log_data[it->end.offset],
+				   c.next_offset - it->end.offset);
+	it->end.index = c.next_index;
+	it->end.offset = c.next_offset;
+	it->gen = c.gen;
+	return n;
+}
 
-	logp->famfs_log_next_seqnum++;
-	logp->famfs_log_next_index++;
+/*
+ * Decode the record at @offset. A record below the end of a committed cursor was
+ * written back before that cursor was published, so one that fails its crc was read
+ * from stale cache lines (cached on this host before the master wrote them): it is
+ * invalidated and read again, rather than failing the iteration. If the log was
+ * rewritten underneath us, that's -ESTALE.
+ */
+static int
+famfs_log_iter_decode(struct famfs_log_iter *it, u64 offset, u64 *parent)
+{
+	const struct famfs_log *logp = it->logp;
+	u64 len = it->end.offset - offset;
+	struct famfs_log_cursor c;
+	int i;
 
-	/* Could flush: 1) the log entry, 2) the log header
-	 * That would be less flushing, but would not guarantee that the entry is visible
-	 * before the log header. If the log header becomes visible first (leading to
-	 * reading a cache-incoherent log entry), the checksum on the log entry will
-	 * save us - and the logplay can be retried.
-	 *
-	 * But now we're just flushing the whole log every time...
-	 */
-	flush_processor_cache(logp, logp->famfs_log_len);
+	for (i = 0; ; i++) {
+		if (!famfs_log_rec_decode(&logp->famfs_log_data[offset], len, &it->le, parent,
+					  it->flags & FAMFS_LOG_ITER_VALIDATE,
+					  famfs_log_crc_alg(logp)))
+			return 0;
+		if (i == FAMFS_LOG_REC_TRIES)
+			return -EINVAL;
 
-	return 0;
+		invalidate_processor_cache(&logp->famfs_log_next_seqnum, FAMFS_LOG_CURSOR_LEN);
+		if (!famfs_log_read_cursor(logp, &c) && c.epoch != it->epoch)
+			return -ESTALE;
+		invalidate_processor_cache(&logp->famfs_log_data[offset],
+					   MIN(len, (u64)FAMFS_LOG_REC_MAX));
+	}
 }
 
-
 /**
- * famfs_relpath_from_fullpath()
+ * famfs_log_iter_next()
  *
- * Returns a pointer to the relpath. This pointer points within the fullpath string
- *
- * @mpt - mount point string (rationalized by realpath())
- * @fullpath
+ * Return value: the next log entry (which is only valid until the next call), or NULL at
+ * the end of the log or on error (in which case it->err is set: -ESTALE if the log was
+ * rewritten during the iteration, otherwise -EINVAL)
  */
-static char *
-famfs_relpath_from_fullpath(
-	const char *mpt,
-	char       *fullpath)
+const struct famfs_log_entry *
+famfs_log_iter_next(struct famfs_log_iter *it)
 {
-	char *relpath;
+	const struct famfs_log *logp = it->logp;
+	struct famfs_log_entry *le = &it->le;
+	const struct famfs_log_rec *lr;
+	u64 offset;
+	u64 parent;
+
+	for (;;) {
+		if (it->pos.index >= it->end.index)
+			return NULL;
 
-	assert(mpt);
-	assert(fullpath);
-	assert(strlen(fullpath) >= strlen(mpt));
+		offset = it->pos.offset;
+		it->err = (offset < it->end.offset) ?
+			famfs_log_iter_decode(it, offset, &parent) : -EINVAL;
+		if (it->err == -ESTALE) {
+			fprintf(stderr, "%s: log was rewritten at record %lld\n",
+				__func__, it->pos.index);
+			return NULL;
+		}
+		if (it->err) {
+			fprintf(stderr, "%s: invalid log record %lld at offset %lld\n",
+				__func__, it->pos.index, offset);
+			goto err;
+		}
+		if (le->famfs_log_entry_seqnum != it->pos.index) {
+			fprintf(stderr, "%s: bad seqnum; expect %lld found %lld\n",
+				__func__, it->pos.index, le->famfs_log_entry_seqnum);
+			goto err;
+		}
 
-	if (strstr(fullpath, mpt) != fullpath) {
-		/* mpt path should be a substring starting at the beginning of fullpath*/
-		fprintf(stderr, "%s: failed to get relpath from mpt=%s fullpath=%s\n",
-			__func__, mpt, fullpath);
-		return NULL;
+		lr = (const struct famfs_log_rec *)&logp->famfs_log_data[offset];
+		if ((it->pos.index == 0 && lr->lr_prev) ||
+		    (it->prev_len && lr->lr_prev != it->prev_len)) {
+			fprintf(stderr, "%s: bad back link in log record %lld\n",
+				__func__, it->pos.index);
+			goto err;
+		}
+		it->cur = offset;
+		it->prev_len = lr->lr_len;
+		it->pos.index++;
+		it->pos.offset += lr->lr_len;
+
+		if (le->famfs_log_entry_type != FAMFS_LOG_CHECKPOINT)
+			break;
+
+		if (offset != 0) {
+			fprintf(stderr, "%s: checkpoint at log index %lld\n",
+				__func__, it->pos.index - 1);
+			goto err;
+		}
+		it->have_ck = 1;
+		it->ck = le->famfs_ck;
+		it->ck_left = it->ck.ck_nrecords;
+		it->ck_bytes = it->pos.offset;
 	}
 
-	/* This assumes relpath() removed any duplicate '/' characters: */
-	relpath = &fullpath[strlen(mpt) + 1];
-	return relpath;
+	it->in_ckpt = (it->ck_left > 0);
+	if (it->in_ckpt) {
+		it->ck_left--;
+		it->ck_bytes = it->pos.offset;
+	}
+
+	it->parent = FAMFS_LOG_NO_PARENT;
+	if (parent) {
+		if (parent > offset || parent % FAMFS_LOG_REC_ALIGN) {
+			fprintf(stderr, "%s: bad parent reference in log record %lld\n",
+				__func__, it->pos.index - 1);
+			goto err;
+		}
+		it->parent = offset - parent;
+	}
+
+	if (!(it->flags & FAMFS_LOG_ITER_NOPATHS) && famfs_log_iter_path(it)) {
+		fprintf(stderr, "%s: unable to resolve the path of log record %lld\n",
+			__func__, it->pos.index - 1);
+		goto err;
+	}
+	return le;
+
+err:
+	it->err = -EINVAL;
+	return NULL;
 }
 
-/**
- * famfs_log_file_creation()
+/*
+ * Logplay checkpoint
  *
- * Returns 0 on success
- * On error, returns <0. (all failures here should abort multi-file operations)
+ * Clients play the log periodically, and nearly all of the entries have normally been
+ * applied already. Each host keeps a small local checkpoint per mount point, recording
+ * how far into the log it has successfully played. The checkpoint is only trusted if it
+ * still describes the same file system, the same mount instance (the .meta/.log file is
+ * re-created by mkmeta on every mount), and the same log contents (the header crc and
+ * the crc of the last applied entry must still match). Otherwise we play the whole log.
  */
-/* TODO: UI would be cleaner if this accepted a fullpath and the mpt, and did the
- * conversion itself. Then pretty much all calls would use the same stuff.
+#define FAMFS_LOGPLAY_CKPT_MAGIC 0x6b637079616c706cULL /* "lplaypck" */
+
+struct famfs_logplay_ckpt {
+	u64           lc_magic;
+	uuid_le       lc_fs_uuid;
+	char          lc_mpt[PATH_MAX];
+	u64           lc_log_dev;         /* Identity of the mounted .meta/.log file */
+	u64           lc_log_ino;
+	s64           lc_log_ctime_sec;
+	s64           lc_log_ctime_nsec;
+	unsigned long lc_log_crc;         /* famfs_log_crc of the log header */
+	u64           lc_log_epoch;
+	u64           lc_next_index;      /* Entries below this index have been applied */
+	u64           lc_next_offset;
+	u64           lc_last_offset;     /* Offset and crc of the last applied record */
+	u32           lc_last_rec_crc;
+	unsigned long lc_crc;             /* crc of this struct, up to this field */
+};
+
+static unsigned long
+famfs_gen_logplay_ckpt_crc(const struct famfs_logplay_ckpt *ck)
+{
+	unsigned long crc = crc32(0L, Z_NULL, 0);
+
+	return crc32(crc, (const unsigned char *)ck, offsetof(struct famfs_logplay_ckpt, lc_crc));
+}
+
+static void
+famfs_logplay_ckpt_path(const char *mpt, char *path_out, size_t len)
+{
+	unsigned long crc = crc32(0L, Z_NULL, 0);
+
+	crc = crc32(crc, (const unsigned char *)mpt, strlen(mpt));
+	snprintf(path_out, len, "%s/logplay.%08lx", SYS_UUID_DIR, crc);
+}
+
+/*
+ * Fill in the parts of a checkpoint that identify the file system and mount instance
  */
 static int
-famfs_log_file_creation(
-	struct famfs_log           *logp,
-	u64                         nextents,
-	struct famfs_simple_extent *ext_list,
-	const char                 *relpath,
-	mode_t                      mode,
-	uid_t                       uid,
-	gid_t                       gid,
-	size_t                      size)
+famfs_logplay_ckpt_ident(
+	const struct famfs_superblock *sb,
+	const struct famfs_log        *logp,
+	const char                    *mpt,
+	struct famfs_logplay_ckpt     *ck)
 {
-	struct famfs_log_entry le = {0};
-	struct famfs_file_creation *fc = &le.famfs_fc;
-	int i;
+	char logpath[PATH_MAX];
+	struct stat st;
 
-	assert(logp);
-	assert(ext_list);
-	assert(nextents >= 1);
-	assert(relpath[0] != '/');
+	snprintf(logpath, PATH_MAX - 1, "%s/%s", mpt, LOG_FILE_RELPATH);
+	if (stat(logpath, &st))
+		return -errno;
 
-	if (famfs_log_full(logp)) {
-		fprintf(stderr, "%s: log full\n", __func__);
-		//assert(0);
-		return -ENOMEM;
-	}
+	memset(ck, 0, sizeof(*ck));
+	ck->lc_magic = FAMFS_LOGPLAY_CKPT_MAGIC;
+	memcpy(&ck->lc_fs_uuid, &sb->ts_uuid, sizeof(ck->lc_fs_uuid));
+	strncpy(ck->lc_mpt, mpt, PATH_MAX - 1);
+	ck->lc_log_dev = st.st_dev;
+	ck->lc_log_ino = st.st_ino;
+	ck->lc_log_ctime_sec = st.st_ctim.tv_sec;
+	ck->lc_log_ctime_nsec = st.st_ctim.tv_nsec;
+	ck->lc_log_crc = logp->famfs_log_crc;
+	ck->lc_log_epoch = logp->famfs_log_epoch;
+	return 0;
+}
 
-	le.famfs_log_entry_type = FAMFS_LOG_FILE;
+/*
+ * A saved log position @pos is still valid if the record before it (at @last_offset,
+ * with crc @last_crc) is still in the log, unchanged.
+ */
+static int
+famfs_log_pos_valid(
+	const struct famfs_log     *logp,
+	const struct famfs_log_pos *pos,
+	u64                         last_offset,
+	u32                         last_crc)
+{
+	const struct famfs_log_rec *lr;
 
-	fc->famfs_fc_size = size;
-	fc->famfs_nextents = nextents;
-	fc->famfs_fc_flags = FAMFS_FC_ALL_HOSTS_RW; /* XXX hard coded access for now */
+	if (pos->index == 0)
+		return (pos->offset == 0);
 
-	strncpy((char *)fc->famfs_relpath, relpath, FAMFS_MAX_PATHLEN - 1);
+	if (pos->index > logp->famfs_log_next_index ||
+	    pos->offset > logp->famfs_log_next_offset ||
+	    last_offset % FAMFS_LOG_REC_ALIGN ||
+	    last_offset + sizeof(*lr) > pos->offset)
+		return 0;
 
-	fc->fc_mode = mode;
-	fc->fc_uid  = uid;
-	fc->fc_gid  = gid;
+	lr = (const struct famfs_log_rec *)&logp->famfs_log_data[last_offset];
+	return (lr->lr_seqnum == pos->index - 1 &&
+		lr->lr_crc == last_crc &&
+		last_offset + lr->lr_len == pos->offset);
+}
 
-	/* Copy extents into log entry */
-	for (i = 0; i < nextents; i++) {
-		struct famfs_log_extent *ext = &fc->famfs_ext_list[i];
+/**
+ * famfs_logplay_ckpt_load()
+ *
+ * Find the first log record that has not been played on this host for this mount.
+ *
+ * @first - set to the position to start playing from (the start of the log if there is
+ *          no usable checkpoint)
+ */
+static void
+famfs_logplay_ckpt_load(
+	const struct famfs_superblock *sb,
+	const struct famfs_log        *logp,
+	const char                    *mpt,
+	struct famfs_log_pos          *first,
+	int                            verbose)
+{
+	struct famfs_logplay_ckpt cur;
+	struct famfs_logplay_ckpt ck;
+	struct famfs_log_pos pos;
+	char path[PATH_MAX];
+	ssize_t rc;
+	int fd;
 
-		ext->famfs_extent_type = FAMFS_EXT_SIMPLE;
-		ext->se.famfs_extent_offset = ext_list[i].famfs_extent_offset;
-		ext->se.famfs_extent_len    = ext_list[i].famfs_extent_len;
-	}
+	memset(first, 0, sizeof(*first));
+	if (famfs_logplay_ckpt_ident(sb, logp, mpt, &cur))
+		return;
+
+	famfs_logplay_ckpt_path(mpt, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	rc = read(fd, &ck, sizeof(ck));
+	close(fd);
+	if (rc != sizeof(ck))
+		goto stale;
+
+	if (ck.lc_magic != FAMFS_LOGPLAY_CKPT_MAGIC ||
+	    ck.lc_crc != famfs_gen_logplay_ckpt_crc(&ck))
+		goto stale;
+
+	/* Same file system, mount instance and log? */
+	if (memcmp(&ck, &cur, offsetof(struct famfs_logplay_ckpt, lc_next_index)))
+		goto stale;
 
-	return famfs_append_log(logp, &le);
+	/* The last record we applied must still be in the log, unchanged */
+	pos.index = ck.lc_next_index;
+	pos.offset = ck.lc_next_offset;
+	if (pos.index == 0 ||
+	    !famfs_log_pos_valid(logp, &pos, ck.lc_last_offset, ck.lc_last_rec_crc))
+		goto stale;
+
+	if (verbose)
+		printf("%s: resuming at log index %lld\n", __func__, ck.lc_next_index);
+	*first = pos;
+	return;
+
+stale:
+	if (verbose)
+		printf("%s: checkpoint %s does not match log; playing whole log\n",
+		       __func__, path);
 }
 
 /**
- * famfs_log_dir_creation()
- */
-/* TODO: UI would be cleaner if this accepted a fullpath and the mpt, and did the
- * conversion itself. Then pretty much all calls would use the same stuff.
+ * famfs_logplay_ckpt_save()
+ *
+ * Record that the log has been played up to (not including) @next, where the record
+ * before @next is at @last_offset. Failure to save a checkpoint is not fatal; the next
+ * logplay just does more work.
  */
-/* XXX should take famfs_locked_log struct as input */
 static int
-famfs_log_dir_creation(
-	struct famfs_log           *logp,
-	const char                 *relpath,
-	mode_t                      mode,
-	uid_t                       uid,
-	gid_t                       gid)
+famfs_logplay_ckpt_save(
+	const struct famfs_superblock *sb,
+	const struct famfs_log        *logp,
+	const char                    *mpt,
+	const struct famfs_log_pos    *next,
+	u64                            last_offset,
+	int                            verbose)
 {
-	struct famfs_log_entry le = {0};
-	struct famfs_mkdir *md = &le.famfs_md;
+	const struct famfs_log_rec *lr;
+	struct famfs_logplay_ckpt ck;
+	char tmppath[PATH_MAX + 8];
+	char path[PATH_MAX];
+	ssize_t rc;
+	int fd;
 
-	assert(logp);
-	assert(relpath[0] != '/');
+	if (next->index == 0)
+		return 0;
 
-	if (famfs_log_full(logp)) {
-		fprintf(stderr, "%s: log full\n", __func__);
-		//assert(0);
-		return -ENOMEM;
-	}
+	rc = famfs_logplay_ckpt_ident(sb, logp, mpt, &ck);
+	if (rc)
+		return rc;
 
-	le.famfs_log_entry_type = FAMFS_LOG_MKDIR;
+	lr = (const struct famfs_log_rec *)&logp->famfs_log_data[last_offset];
+	ck.lc_next_index = next->index;
+	ck.lc_next_offset = next->offset;
+	ck.lc_last_offset = last_offset;
+	ck.lc_last_rec_crc = lr->lr_crc;
+	ck.lc_crc = famfs_gen_logplay_ckpt_crc(&ck);
 
-	strncpy((char *)md->famfs_relpath, relpath, FAMFS_MAX_PATHLEN - 1);
+	if (mkdir(SYS_UUID_DIR, 0755) && errno != EEXIST)
+		return -errno;
 
-	md->fc_mode = mode;
-	md->fc_uid  = uid;
-	md->fc_gid  = gid;
+	famfs_logplay_ckpt_path(mpt, path, sizeof(path));
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		if (verbose)
+			fprintf(stderr, "%s: unable to create %s (errno %d)\n",
+				__func__, tmppath, errno);
+		return -errno;
+	}
+	rc = write(fd, &ck, sizeof(ck));
+	close(fd);
+	if (rc != sizeof(ck)) {
+		unlink(tmppath);
+		return -EIO;
+	}
 
-	return famfs_append_log(logp, &le);
+	/* rename() makes the update atomic; a torn checkpoint just fails validation */
+	if (rename(tmppath, path)) {
+		unlink(tmppath);
+		return -errno;
+	}
+	return 0;
 }
 
-/**
- * find_real_parent_path()
- *
- * travel up a path until a real component is found.
- * The returned path was malloc'd by realpath, and should be freed by the caller
- * This is useful in mkdir -p, where the path might be several layers deeper than
- * the deepest existing dir.
+/********************************************************************************
  *
- * @path
+ * Logplay namespace
  *
- * Returns: a real sub-path, if found
+ * Logplay first builds the namespace described by the log entries it is playing, as a
+ * tree of path components (arena-allocated, and hashed by parent + name). It then walks
+ * the tree against the mounted file system with one readdir pass per directory, and
+ * creates only what is missing - parents before children. That way the syscalls scale
+ * with the number of directories and missing nodes, rather than costing a realpath()
+ * and stat() per log entry.
  */
-static char *
-find_real_parent_path(const char *path)
+
+#define FAMFS_NS_ARENA_BLK (64 * 1024)
+
+struct famfs_ns_arena_blk {
+	struct famfs_ns_arena_blk *next;
+	size_t                     used;
+	size_t                     size;
+	char                       mem[];
+};
+
+struct famfs_ns_node {
+	struct famfs_ns_node         *parent;
+	struct famfs_ns_node         *child;   /* first child */
+	struct famfs_ns_node         *sibling; /* next child of parent */
+	struct famfs_ns_node         *hnext;   /* hash chain */
+	const struct famfs_log_entry *le;      /* entry that creates this node, or NULL if it
+						* is only a path component of other entries
+						*/
+	int                           on_disk; /* DT_* type found by readdir, or DT_UNKNOWN */
+	int                           created; /* created by this logplay (so it's empty) */
+	u32                           hash;
+	u32                           namelen;
+	char                          name[];
+};
+
+/* A file for a logplay worker thread to create (see famfs_ns_play_dir()) */
+struct famfs_ns_file_job {
+	struct famfs_ns_file_job         *next;
+	const struct famfs_file_creation *fc;
+	enum famfs_system_role            role;
+	int                               verbose;
+	int                               rc;
+	char                              path[];
+};
+
+struct famfs_ns {
+	struct famfs_ns_arena_blk *arena;
+	struct famfs_ns_node     **buckets;
+	u64                        nbuckets; /* power of 2 */
+	struct thpool             *pool;     /* if files are created in parallel */
+	struct famfs_ns_file_job  *jobs;
+	struct famfs_ns_node       root;     /* the mount point itself */
+};
+
+static void *
+famfs_ns_alloc(struct famfs_ns *ns, size_t size)
 {
-	char path_copy[PATH_MAX];
-	char *pc = &path_copy[0];
-	int loop_ct = 64; /* This is the max depth the function can handle */
-	char *rpath;
+	struct famfs_ns_arena_blk *blk = ns->arena;
+	void *p;
 
-	strncpy(path_copy, path, PATH_MAX - 1);
-	while (1) {
-		if (strlen(pc) <= 1) {
-			fprintf(stderr, "%s: path %s appears not to be in a famfs mount\n",
-				__func__, path);
+	size = (size + 7) & ~7UL;
+	if (!blk || blk->used + size > blk->size) {
+		size_t blksize = MAX((size_t)FAMFS_NS_ARENA_BLK, size);
+
+		blk = malloc(sizeof(*blk) + blksize);
+		if (!blk)
 			return NULL;
-		}
+		blk->next = ns->arena;
+		blk->used = 0;
+		blk->size = blksize;
+		ns->arena = blk;
+	}
+	p = &blk->mem[blk->used];
+	blk->used += size;
+	return p;
+}
 
-		rpath = realpath(pc, NULL);
-		if (rpath)
-			return rpath;  /* found a valid path */
+static void
+famfs_ns_free(struct famfs_ns *ns)
+{
+	struct famfs_ns_arena_blk *blk, *next;
 
-		pc = dirname(pc);
-		if (--loop_ct == 0) {
-			fprintf(stderr,
-				"%s: bailed from possible infinite loop; path=%s path_copy=%s\n",
-				__func__, path, pc);
-			return NULL;
-		}
+	if (!ns)
+		return;
+	thpool_destroy(ns->pool);
+	for (blk = ns->arena; blk; blk = next) {
+		next = blk->next;
+		free(blk);
 	}
-	return NULL;
+	free(ns->buckets);
+	free(ns);
 }
 
 /**
- * __open_relpath()
- *
- * This functionn starts with @path and ascends until @relpath is a valid
- * sub-path from the ascended subset of @path.
- *
- * This is intended for ascending from @path until (e.g.) @relpath=".meta/.superblock"
- * is valid - and opening that.
- *
- * It is also important to verify that the @relpath file is in a famfs file system,
- * but there are also (unit test) cases where it is useful to exercise this logic
- * even if the ascended @path is not in a famfs file system.
+ * famfs_ns_init()
  *
- * @path       - any path within a famfs file system (from mount pt on down)
- * @relpath    - the relative path to open (relative to the mount point)
- * @read_only
- * @size_out   - File size will be returned if this pointer is non-NULL
- * @mpt_out    - Mount point will be returned if this pointer is non-NULL
- *               (the string space is assumed to be of size PATH_MAX)
- * @no_fscheck - For unit tests only - don't check whether the file with @relpath
- *               is actually in a famfs file system.
+ * @nentries - number of log entries that will be added (sizes the hash table)
  */
-int
-__open_relpath(
-	const char *path,
-	const char *relpath,
-	int         read_only,
-	size_t     *size_out,
-	char       *mpt_out,
-	enum lock_opt lockopt,
-	int         no_fscheck)
+static struct famfs_ns *
+famfs_ns_init(u64 nentries)
 {
-	int openmode = (read_only) ? O_RDONLY : O_RDWR;
-	char *rpath;
-	struct stat st;
-	int rc, fd;
+	struct famfs_ns *ns = calloc(1, sizeof(*ns) + 1); /* +1: root has an empty name */
 
-	/*
-	 * If path does not exist, ascend canonically until we find something that does
-	 * exist, or until that remaining path string is too short, or until it looks like
-	 * we might be in an infinite loop
-	 */
-	rpath = find_real_parent_path(path);
-	if (!rpath)
-		return -1;
+	if (!ns)
+		return NULL;
 
-	/*
-	 * At this point rpath does exist, and is a root-based path. Continue to ascend as
-	 * necessary to find the mount point which contains the meta files
-	 */
-	while (1) {
-		char fullpath[PATH_MAX] = {0};
+	ns->nbuckets = 64;
+	while (ns->nbuckets < 2 * nentries)
+		ns->nbuckets <<= 1;
+	ns->buckets = calloc(ns->nbuckets, sizeof(*ns->buckets));
+	if (!ns->buckets) {
+		free(ns);
+		return NULL;
+	}
+	ns->root.on_disk = DT_DIR;
+	return ns;
+}
 
-		rc = stat(rpath, &st);
-		if (rc < 0)
-			goto next;
-		if ((st.st_mode & S_IFMT) == S_IFDIR) {
-			/* It's a dir; does it have <relpath> under it? */
-			snprintf(fullpath, PATH_MAX - 1, "%s/%s", rpath, relpath);
-			rc = stat(fullpath, &st);
-			if ((rc == 0) && ((st.st_mode & S_IFMT) == S_IFREG)) {
-				/* We found it. */
-				if (size_out)
-					*size_out = st.st_size;
-				if (mpt_out)
-					strncpy(mpt_out, rpath, PATH_MAX - 1);
-				fd = open(fullpath, openmode, 0);
-				free(rpath);
+static u32
+famfs_ns_hash(const struct famfs_ns_node *parent, const char *name, size_t len)
+{
+	u64 h = 0xcbf29ce484222325ULL ^ (u64)(uintptr_t)parent; /* FNV-1a, seeded by parent */
+	size_t i;
 
-				if (lockopt) {
-					int operation = LOCK_EX;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 0x100000001b3ULL;
+	}
+	return (u32)(h ^ (h >> 32));
+}
 
-					if (lockopt == NON_BLOCKING_LOCK)
-						operation |= LOCK_NB;
-					rc = flock(fd, operation);
-					if (rc) {
-						fprintf(stderr, "%s: failed to get lock on %s\n",
-							__func__, fullpath);
-						close(fd);
-						return -1;
-					}
-				}
-				/* Check whether the file we found is actually in famfs;
-				 * Unit tests can disable this check but production code
-				 * should not.
-				 */
-				if (!no_fscheck && __file_not_famfs(fd)) {
-					fprintf(stderr,
-						"%s: found file %s but it is not in famfs\n",
-						__func__, fullpath);
-					close(fd);
-					return -1;
-				}
-				return fd;
-			}
-			/* no */
-		}
+static struct famfs_ns_node *
+famfs_ns_lookup(const struct famfs_ns *ns, const struct famfs_ns_node *parent,
+		const char *name, size_t len)
+{
+	u32 hash = famfs_ns_hash(parent, name, len);
+	struct famfs_ns_node *n;
 
-next:
-		/* Pop up one level; exit if we're at the top */
-		rpath = dirname(rpath);
-		if (strcmp(rpath, "/") == 0)
-			break;
+	for (n = ns->buckets[hash & (ns->nbuckets - 1)]; n; n = n->hnext) {
+		if (n->hash == hash && n->parent == parent && n->namelen == len &&
+		    !memcmp(n->name, name, len))
+			return n;
 	}
-	free(rpath);
-	return -1;
+	return NULL;
 }
 
-
 /**
- * open_log_file(path)
- *
- * @path - any path within a famfs file system (from mount pt on down)
+ * famfs_ns_get()
  *
- * This will traverse upward from path, looking for a directory containing a .meta/.log
- * If found, it opens the log.
+ * Find or add the child @name of @parent
  */
-static int
-__open_log_file(
-	const char *path,
-	int         read_only,
-	size_t     *sizep,
-	char       *mpt_out,
-	enum lock_opt lockopt)
+static struct famfs_ns_node *
+famfs_ns_get(struct famfs_ns *ns, struct famfs_ns_node *parent, const char *name, size_t len)
 {
-	return __open_relpath(path, LOG_FILE_RELPATH, read_only, sizep, mpt_out, lockopt, 0);
+	struct famfs_ns_node *n = famfs_ns_lookup(ns, parent, name, len);
+	u64 b;
+
+	if (n)
+		return n;
+
+	n = famfs_ns_alloc(ns, sizeof(*n) + len + 1);
+	if (!n)
+		return NULL;
+	memset(n, 0, sizeof(*n));
+	memcpy(n->name, name, len);
+	n->name[len] = 0;
+	n->namelen = len;
+	n->parent = parent;
+	n->on_disk = DT_UNKNOWN;
+	n->hash = famfs_ns_hash(parent, name, len);
+
+	b = n->hash & (ns->nbuckets - 1);
+	n->hnext = ns->buckets[b];
+	ns->buckets[b] = n;
+	n->sibling = parent->child;
+	parent->child = n;
+	return n;
 }
 
-int
-static open_log_file_read_only(
-	const char *path,
-	size_t     *sizep,
-	char       *mpt_out,
-	enum lock_opt lockopt)
+/**
+ * famfs_ns_add_entry()
+ *
+ * Add the node for a file or directory log entry (and any path components above it).
+ * Entries whose path has "." or ".." components are rejected, as are paths logged more
+ * than once: a second creation of the same file has no effect (as if the file existed),
+ * anything else is an error.
+ */
+static void
+famfs_ns_add_entry(struct famfs_ns              *ns,
+		   const char                   *relpath,
+		   const struct famfs_log_entry *le,
+		   struct famfs_log_stats       *ls)
 {
-	return __open_log_file(path, 1, sizep, mpt_out, lockopt);
+	int is_file = (le->famfs_log_entry_type == FAMFS_LOG_FILE);
+	struct famfs_ns_node *n = &ns->root;
+	size_t plen = strnlen(relpath, FAMFS_MAX_PATHLEN);
+	const char *p = relpath;
+	const char *end = relpath + plen;
+
+	while (p < end) {
+		const char *slash = memchr(p, '/', end - p);
+		size_t len = (slash) ? (size_t)(slash - p) : (size_t)(end - p);
+
+		if (len == 0) { /* Duplicate '/' */
+			p++;
+			continue;
+		}
+		if ((len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+			fprintf(stderr, "%s: ignoring log entry with '.' or '..' in path (%s)\n",
+				__func__, relpath);
+			goto err;
+		}
+		if (n != &ns->root && n->le && n->le->famfs_log_entry_type == FAMFS_LOG_FILE) {
+			fprintf(stderr, "%s: path component is a file (%s)\n", __func__, relpath);
+			goto err;
+		}
+
+		n = famfs_ns_get(ns, n, p, len);
+		if (!n) {
+			fprintf(stderr, "%s: out of memory\n", __func__);
+			goto err;
+		}
+		p += len + 1;
+	}
+
+	if (n == &ns->root) {
+		fprintf(stderr, "%s: ignoring log entry for the mount point\n", __func__);
+		goto err;
+	}
+
+	if (n->le) {
+		if (is_file && n->le->famfs_log_entry_type == FAMFS_LOG_FILE) {
+			ls->f_existed++;
+			return;
+		}
+		fprintf(stderr, "%s: conflicting log entries for path (%s)\n",
+			__func__, relpath);
+		goto err;
+	}
+	if (is_file && n->child) {
+		fprintf(stderr, "%s: file path is a directory (%s)\n", __func__, relpath);
+		goto err;
+	}
+	n->le = le;
+	return;
+
+err:
+	if (is_file)
+		ls->f_errs++;
+	else
+		ls->d_errs++;
 }
 
-static int
-open_log_file_writable(
-	const char *path,
-	size_t     *sizep,
-	char       *mpt_out,
-	enum lock_opt lockopt)
+/* Count the logged nodes under @n as errors; they can't be created */
+static void
+famfs_ns_fail_subtree(const struct famfs_ns_node *n, const char *path,
+		      struct famfs_log_stats *ls)
 {
-	return __open_log_file(path, 0, sizep, mpt_out, lockopt);
+	const struct famfs_ns_node *c;
+
+	for (c = n->child; c; c = c->sibling) {
+		if (c->le) {
+			fprintf(stderr, "%s: no directory to create %s in (%s)\n",
+				__func__, c->name, path);
+			if (c->le->famfs_log_entry_type == FAMFS_LOG_FILE)
+				ls->f_errs++;
+			else
+				ls->d_errs++;
+		}
+		famfs_ns_fail_subtree(c, path, ls);
+	}
 }
 
 static int
-__open_superblock_file(
-	const char *path,
-	int         read_only,
-	size_t     *sizep,
-	char       *mpt_out)
+famfs_ns_create_file(const char                       *fullpath,
+		     const struct famfs_file_creation *fc,
+		     enum famfs_system_role            role,
+		     int                               verbose)
 {
-	/* No need to plumb locking for the superblock; use the log for locking */
-	return __open_relpath(path, SB_FILE_RELPATH, read_only, sizep, mpt_out, NO_LOCK, 0);
+	struct famfs_simple_extent el[FAMFS_FC_MAX_EXTENTS];
+	int fd;
+	int j;
+
+	if (verbose) {
+		printf("famfs logplay: creating file %s", fullpath);
+		if (verbose > 1)
+			printf(" mode %o", fc->fc_mode);
+
+		printf("\n");
+	}
+
+	fd = famfs_file_create(fullpath, fc->fc_mode, fc->fc_uid, fc->fc_gid,
+			       (role == FAMFS_CLIENT) ? 1 : 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: unable to create destfile (%s)\n",
+			__func__, fullpath);
+
+		unlink(fullpath);
+		return -1;
+	}
+
+	/* Build extent list of famfs_simple_extent; the log entry has a
+	 * different kind of extent list...
+	 */
+	for (j = 0; j < fc->famfs_nextents && j < FAMFS_FC_MAX_EXTENTS; j++) {
+		const struct famfs_log_extent *tle = &fc->famfs_ext_list[j];
+
+		el[j].famfs_extent_offset = tle->se.famfs_extent_offset;
+		el[j].famfs_extent_len    = tle->se.famfs_extent_len;
+	}
+	famfs_file_map_create(fullpath, fd, fc->famfs_fc_size, j, el, FAMFS_REG);
+	close(fd);
+	return 0;
 }
 
-static int
-open_superblock_file_read_only(
-	const char *path,
-	size_t     *sizep,
-	char       *mpt_out)
+static void
+famfs_ns_file_worker(void *arg)
 {
-	return __open_superblock_file(path, 1, sizep, mpt_out);
+	struct famfs_ns_file_job *job = arg;
+
+	job->rc = famfs_ns_create_file(job->path, job->fc, job->role, job->verbose);
 }
 
-static struct famfs_superblock *
-famfs_map_superblock_by_path(
-	const char *path,
-	int         read_only)
+/**
+ * famfs_ns_queue_file()
+ *
+ * Hand a file creation off to the worker pool. The job lives in the arena, which only
+ * this thread allocates from; the results are tallied by famfs_ns_finish_files().
+ *
+ * Return value: 0 if the job was queued (otherwise the caller creates the file itself)
+ */
+static int
+famfs_ns_queue_file(
+	struct famfs_ns                  *ns,
+	const char                       *fullpath,
+	const struct famfs_file_creation *fc,
+	enum famfs_system_role            role,
+	int                               verbose)
 {
-	struct famfs_superblock *sb;
-	int prot = (read_only) ? PROT_READ : PROT_READ | PROT_WRITE;
-	size_t sb_size;
-	void *addr;
-	int fd;
+	size_t len = strlen(fullpath);
+	struct famfs_ns_file_job *job;
 
-	fd = __open_superblock_file(path, read_only,
-				    &sb_size, NULL);
-	if (fd < 0) {
-		fprintf(stderr, "%s: failed to open superblock file %s for filesystem %s\n",
-			__func__, read_only ? "read-only" : "writable",	path);
-		return NULL;
-	}
-	addr = mmap(0, sb_size, prot, MAP_SHARED, fd, 0);
-	close(fd);
-	if (addr == MAP_FAILED) {
-		fprintf(stderr, "%s: Failed to mmap superblock file %s\n", __func__, path);
-		return NULL;
-	}
-	sb = (struct famfs_superblock *)addr;
-	flush_processor_cache(sb, sb_size); /* invalidate processor cache */
-	return sb;
+	job = famfs_ns_alloc(ns, sizeof(*job) + len + 1);
+	if (!job)
+		return -1;
+
+	memcpy(job->path, fullpath, len + 1);
+	job->fc = fc;
+	job->role = role;
+	job->verbose = verbose;
+	job->rc = 0;
+	if (thpool_add_work(ns->pool, famfs_ns_file_worker, job))
+		return -1;
+
+	job->next = ns->jobs;
+	ns->jobs = job;
+	return 0;
 }
 
-static struct famfs_log *
-famfs_map_log_by_path(
-	const char *path,
-	int         read_only,
-	enum lock_opt lockopt)
+/* Wait for the queued file creations, and merge their results into @ls */
+static void
+famfs_ns_finish_files(struct famfs_ns *ns, struct famfs_log_stats *ls)
 {
-	struct famfs_log *logp;
-	int prot = (read_only) ? PROT_READ : PROT_READ | PROT_WRITE;
-	size_t log_size;
-	void *addr;
-	int fd;
+	struct famfs_ns_file_job *job;
 
-	fd = __open_log_file(path, 1 /* read only */, &log_size, NULL, lockopt);
-	if (fd < 0) {
-		fprintf(stderr, "%s: failed to open log file for filesystem %s\n",
-			__func__, path);
-		return NULL;
-	}
-	addr = mmap(0, log_size, prot, MAP_SHARED, fd, 0);
-	close(fd);
-	if (addr == MAP_FAILED) {
-		fprintf(stderr, "%s: Failed to mmap log file %s\n", __func__, path);
-		return NULL;
-	}
-	logp = (struct famfs_log *)addr;
-	if (log_size != logp->famfs_log_len) {
-		fprintf(stderr, "%s: log file length is invalid (%lld / %lld)\n",
-			__func__, (s64)log_size, logp->famfs_log_len);
-		munmap(addr, log_size);
-		return NULL;
+	if (!ns->pool)
+		return;
+
+	thpool_wait(ns->pool);
+	for (job = ns->jobs; job; job = job->next) {
+		if (job->rc)
+			ls->f_errs++;
+		else
+			ls->f_created++;
 	}
-	flush_processor_cache(logp, log_size);  /* invalidate processor cache */
-	return logp;
+	ns->jobs = NULL;
 }
 
-int
-famfs_fsck(
-	const char *path,
-	int use_mmap,
-	int human,
-	int verbose)
+/**
+ * famfs_ns_play_dir()
+ *
+ * Create the missing children of directory node @dir (and recurse into the directories).
+ * The caller guarantees that @dir exists in the file system.
+ *
+ * Directories are always created here, so every directory exists before anything is
+ * created in it. If there is a worker pool, files are queued to it rather than created
+ * inline; the map ioctl is the expensive part, and the files don't depend on each other.
+ *
+ * @path    - full path of @dir (a PATH_MAX buffer, which is used to build child paths)
+ * @pathlen - strlen(path)
+ * @mptlen  - strlen of the mount point prefix of @path
+ */
+static void
+famfs_ns_play_dir(struct famfs_ns        *ns,
+		  struct famfs_ns_node   *dir,
+		  char                   *path,
+		  size_t                  pathlen,
+		  size_t                  mptlen,
+		  enum famfs_system_role  role,
+		  struct famfs_log_stats *ls,
+		  int                     verbose)
 {
-	struct famfs_superblock *sb;
-	struct famfs_log *logp;
-	struct stat st;
-	int malloc_sb_log = 0;
-	size_t size;
+	struct famfs_ns_node *c;
+	struct dirent *de;
+	DIR *d;
 	int rc;
 
-	assert(path);
-	assert(strlen(path) > 1);
-
-	rc = stat(path, &st);
-	if (rc < 0) {
-		fprintf(stderr, "%s: failed to stat path %s (%s)\n",
-			__func__, path, strerror(errno));
-		return -errno;
-	}
+	if (!dir->child)
+		return;
 
-	/*
-	 * Lots of options here;
-	 * * If a dax device (either pmem or /dev/dax) we'll fsck that - but only if the fs
-	 *   is not currently mounted.
-	 * * If any file path from the mount point on down in a mounted famfs file system is
-	 *   specified, we will find the superblock and log files and fsck the mounted
-	 *   file system.
+	/* One pass over the directory marks which children already exist; a directory
+	 * that was just created is empty, so there is no need to read it
 	 */
-	switch (st.st_mode & S_IFMT) {
-	case S_IFBLK:
-	case S_IFCHR: {
-		char *mpt;
-		/* Check if there is a mounted famfs file system on this device;
-		 * fail if so - if mounted, have to fsck by mount pt rather than device
-		 */
-		mpt = famfs_get_mpt_by_dev(path);
-		if (mpt) {
-			fprintf(stderr, "%s: error - cannot fsck by device (%s) when mounted\n",
-				__func__, path);
-			free(mpt);
-			return -EBUSY;
+	if (!dir->created) {
+		d = opendir(path);
+		if (!d) {
+			fprintf(stderr, "%s: unable to read directory %s\n", __func__, path);
+			famfs_ns_fail_subtree(dir, path, ls);
+			return;
 		}
-		/* If it's a device, we'll try to mmap superblock and log from the device */
-		rc = famfs_get_device_size(path, &size, NULL);
-		if (rc < 0)
-			return -1;
+		while ((de = readdir(d)) != NULL) {
+			c = famfs_ns_lookup(ns, dir, de->d_name, strlen(de->d_name));
+			if (!c)
+				continue;
+			c->on_disk = de->d_type;
+			if (c->on_disk == DT_UNKNOWN) {
+				struct stat st;
 
-		rc = famfs_mmap_superblock_and_log_raw(path, &sb, &logp, 1 /* read-only */);
-		break;
-	}
-	case S_IFREG:
-	case S_IFDIR: {
-		/*
-		 * More options: default is to read the superblock and log into local buffers
-		 * (which is useful to spot check that posix read is not broken). But if the
-		 * use_mmap open is provided, we will mmap the superblock and logs files
-		 * rather than reading them into a local buffer.
-		 */
-		if (use_mmap) {
-			/* If it's a file or directory, we'll try to mmap the sb and
-			 * log from their files
-			 *
-			 * Note that this tends to fail
-			 */
-			sb =   famfs_map_superblock_by_path(path, 1 /* read only */);
-			if (!sb) {
-				fprintf(stderr, "%s: failed to map superblock from file %s\n",
-					__func__, path);
-				return -1;
+				/* Some file systems don't report d_type */
+				if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+					c->on_disk = IFTODT(st.st_mode);
 			}
+		}
+		closedir(d);
+	}
 
-			logp = famfs_map_log_by_path(path, 1 /* read only */, NO_LOCK);
-			if (!logp) {
-				fprintf(stderr, "%s: failed to map log from file %s\n",
-					__func__, path);
-				return -1;
-			}
-			break;
-		} else {
-			int sfd;
-			int lfd;
-			char *buf;
-			int resid;
-			int total = 0;
+	for (c = dir->child; c; c = c->sibling) {
+		int is_file = (c->le && c->le->famfs_log_entry_type == FAMFS_LOG_FILE);
 
-			malloc_sb_log = 1;
+		if (pathlen + 1 + c->namelen >= PATH_MAX) {
+			fprintf(stderr, "%s: path too long under %s\n", __func__, path);
+			if (c->le)
+				(is_file) ? ls->f_errs++ : ls->d_errs++;
+			famfs_ns_fail_subtree(c, path, ls);
+			continue;
+		}
+		path[pathlen] = '/';
+		memcpy(&path[pathlen + 1], c->name, c->namelen + 1);
 
-			sfd = open_superblock_file_read_only(path, NULL, NULL);
-			if (sfd < 0) {
-				fprintf(stderr, "%s: failed to open superblock file\n", __func__);
-				return -1;
+		if (is_file) {
+			if (c->on_disk == DT_REG) {
+				if (verbose > 1)
+					fprintf(stderr, "famfs logplay: File %s exists\n", path);
+				ls->f_existed++;
+			} else if (c->on_disk != DT_UNKNOWN) {
+				fprintf(stderr, "%s: something (%s) exists where file should be\n",
+					__func__, path);
+				ls->f_errs++;
+			} else if (ns->pool &&
+				   !famfs_ns_queue_file(ns, path, &c->le->famfs_fc, role,
+							verbose)) {
+				/* Tallied by famfs_ns_finish_files() */
+			} else if (famfs_ns_create_file(path, &c->le->famfs_fc, role, verbose)) {
+				ls->f_errs++;
+			} else {
+				ls->f_created++;
 			}
-			/* Over-allocate so we can read 2MiB multiple */
-			sb = calloc(1, FAMFS_LOG_OFFSET);
-			assert(sb);
+			path[pathlen] = 0;
+			continue;
+		}
 
-			/* Read a copy of the superblock */
-			rc = read(sfd, sb, FAMFS_LOG_OFFSET); /* 2MiB multiple */
-			if (rc < 0) {
-				free(sb);
-				close(sfd);
-				fprintf(stderr, "%s: error %d reading superblock file\n",
-					__func__, errno);
-				return -errno;
-			} else if (rc < sizeof(*sb)) {
-				free(sb);
-				close(sfd);
-				fprintf(stderr, "%s: error: short read of superblock %d/%ld\n",
-					__func__, rc, sizeof(*sb));
-				return -1;
+		/* Directory (logged, or only a path component) */
+		switch (c->on_disk) {
+		case DT_DIR:
+			/* This is normal for log replay */
+			if (c->le) {
+				if (verbose > 1)
+					fprintf(stderr, "famfs logplay: directory %s exists\n",
+						path);
+				ls->d_existed++;
 			}
-			close(sfd);
+			famfs_ns_play_dir(ns, c, path, pathlen + 1 + c->namelen, mptlen, role,
+					  ls, verbose);
+			break;
 
-			lfd = open_log_file_read_only(path, NULL, NULL, NO_LOCK);
-			if (lfd < 0) {
-				free(sb);
-				close(sfd);
-				fprintf(stderr, "%s: failed to open log file\n", __func__);
-				return -1;
+		case DT_UNKNOWN:
+			if (!c->le) {
+				/* Not logged in this replay, and not there */
+				famfs_ns_fail_subtree(c, path, ls);
+				break;
 			}
+			if (verbose)
+				printf("famfs logplay: creating directory %s\n",
+				       &path[mptlen + 1]);
 
-			logp = calloc(1, sb->ts_log_len);
-			assert(logp);
-
-			/* Read a copy of the log */
-			resid = sb->ts_log_len;
-			buf = (char *)logp;
-			do {
-				rc = read(lfd, &buf[total], resid);
-				if (rc < 0) {
-					free(sb);
-					free(logp);
-					close(lfd);
-					fprintf(stderr, "%s: error %d reading log file\n",
-						__func__, errno);
-					return -errno;
-				}
-				if (verbose)
-					printf("%s: read %d bytes of log\n", __func__, rc);
-
-				if (rc == 0) {
-					fprintf(stderr, "%s: failed to read the full log\n",
-						__func__);
-					rc = -1;
-					close(lfd);
-					goto err_out;
-				}
-				resid -= rc;
-				total += rc;
-			} while (resid > 0);
+			rc = famfs_dir_create(path, "", c->le->famfs_md.fc_mode,
+					      c->le->famfs_md.fc_uid, c->le->famfs_md.fc_gid);
+			if (rc) {
+				fprintf(stderr,
+					"%s: error: unable to create directory (%s)\n",
+					__func__, &path[mptlen + 1]);
+				ls->d_errs++;
+				famfs_ns_fail_subtree(c, path, ls);
+				break;
+			}
+			ls->d_created++;
+			c->created = 1;
+			famfs_ns_play_dir(ns, c, path, pathlen + 1 + c->namelen, mptlen, role,
+					  ls, verbose);
+			break;
 
-			close(lfd);
+		default:
+			fprintf(stderr, "%s: %s (%s) exists where dir should be\n", __func__,
+				(c->on_disk == DT_REG) ? "file" : "something", path);
+			if (c->le)
+				ls->d_errs++;
+			famfs_ns_fail_subtree(c, path, ls);
+			break;
 		}
+		path[pathlen] = 0;
 	}
-		break;
-	default:
-		fprintf(stderr, "invalid path or dax device: %s\n", path);
-		return -EINVAL;
-	}
-
-	if (famfs_check_super(sb)) {
-		fprintf(stderr, "%s: no valid famfs superblock on device %s\n", __func__, path);
-		return -1;
-	}
-	rc = famfs_fsck_scan(sb, logp, human, verbose);
-	if (malloc_sb_log) {
-		free(sb);
-		free(logp);
-	}
-err_out:
-	return rc;
-}
-
-/**
- * famfs_validate_superblock_by_path()
- *
- * @path
- *
- * Validate the superblock and return the dax device size, or -1 if sb or size invalid
- */
-static ssize_t
-famfs_validate_superblock_by_path(const char *path)
-{
-	int sfd;
-	void *addr;
-	size_t sb_size;
-	ssize_t daxdevsize;
-	struct famfs_superblock *sb;
-
-	sfd = open_superblock_file_read_only(path, &sb_size, NULL);
-	if (sfd < 0)
-		return sfd;
-
-	addr = mmap(0, sb_size, PROT_READ, MAP_SHARED, sfd, 0);
-	if (addr == MAP_FAILED) {
-		fprintf(stderr, "%s: Failed to mmap superblock file\n", __func__);
-		close(sfd);
-		return -1;
-	}
-	sb = (struct famfs_superblock *)addr;
-	flush_processor_cache(sb, sb_size); /* Invalidate the processor cache for the superblock */
-
-	if (famfs_check_super(sb)) {
-		fprintf(stderr, "%s: invalid superblock\n", __func__);
-		return -1;
-	}
-	daxdevsize = sb->ts_devlist[0].dd_size;
-	munmap(sb, FAMFS_SUPERBLOCK_SIZE);
-	close(sfd);
-	return daxdevsize;
 }
 
 /**
- * put_sb_log_into_bitmap()
+ * famfs_ns_build()
  *
- * The two files that are not in the log are the superblock and the log. So these
- * files need to be manually added to the allocation bitmap. This function does that.
- */
-static inline void
-put_sb_log_into_bitmap(u8 *bitmap)
-{
-	int i;
-
-	/* Mark superblock and log as allocated */
-	mu_bitmap_set(bitmap, 0);
-
-	for (i = 1; i < ((FAMFS_LOG_OFFSET + FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT); i++)
-		mu_bitmap_set(bitmap, i);
-}
-
-/**
- * famfs_build_bitmap()
+ * Validate the log entries from @it onward, and build the namespace they describe
  *
- * XXX: this is only aware of the first daxdev in the superblock's list
- * @logp
- * @size_in          - total size of allocation space in bytes
- * @bitmap_nbits_out - output: size of the bitmap
- * @alloc_errors_out - output: number of times a file referenced a bit that was already set
- * @fsize_total_out  - output: if ptr non-null, this is the sum of the file sizes
- * @alloc_sum_out    - output: if ptr non-null, this is the sum of all allocation sizes
- *                    (excluding double-allocations; space amplification is
- *                     @alloc_sum / @size_total provided there are no double allocations,
- *                     b/c those will increase size_total but not alloc_sum)
- * @log_stats_out    - Optional pointer to struct log_stats to be copied out
- * @verbose
+ * Return value: the namespace, or NULL if the log is invalid (or we're out of memory)
  */
-/* XXX: should get log size from superblock */
-static u8 *
-famfs_build_bitmap(const struct famfs_log   *logp,
-		   u64                       dev_size_in,
-		   u64                      *bitmap_nbits_out,
-		   u64                      *alloc_errors_out,
-		   u64                      *fsize_total_out,
-		   u64                      *alloc_sum_out,
-		   struct famfs_log_stats   *log_stats_out,
-		   int                       verbose)
+static struct famfs_ns *
+famfs_ns_build(struct famfs_log_iter  *it,
+	       struct famfs_log_stats *ls,
+	       int                     verbose)
 {
-	u64 nbits = (dev_size_in - FAMFS_SUPERBLOCK_SIZE - FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT;
-	u64 bitmap_nbytes = mu_bitmap_size(nbits);
-	u8 *bitmap = calloc(1, bitmap_nbytes);
-	struct famfs_log_stats ls = { 0 }; /* We collect a subset of stats collected by logplay */
-	u64 errors = 0;
-	u64 alloc_sum = 0;
-	u64 fsize_sum  = 0;
-	int i, j;
-	int rc;
-
-	if (verbose > 1)
-		printf("%s: dev_size %lld nbits %lld bitmap_nbytes %lld\n",
-		       __func__, dev_size_in, nbits, bitmap_nbytes);
+	const struct famfs_log_entry *le;
+	struct famfs_ns *ns;
+	u64 i, j;
 
-	if (!bitmap)
+	ns = famfs_ns_init(it->end.index - it->pos.index);
+	if (!ns)
 		return NULL;
 
-	put_sb_log_into_bitmap(bitmap);
-
-	if (verbose > 1) {
-		printf("%s: superblock and log in bitmap:", __func__);
-		mu_print_bitmap(bitmap, nbits);
-	}
-	/* This loop is over all log entries */
-	for (i = 0; i < logp->famfs_log_next_index; i++) {
-		const struct famfs_log_entry *le = &logp->entries[i];
+	while ((le = famfs_log_iter_next(it)) != NULL) {
+		struct famfs_log_entry *copy;
+		size_t copy_len;
 
-		ls.n_entries++;
+		i = it->pos.index - 1;
+		ls->n_entries++;
+		if (it->in_ckpt)
+			ls->c_records++;
 
-		/* TODO: validate log sequence number */
+		/* The namespace keeps pointers to the decoded entries, but not their paths
+		 * (which the tree already has)
+		 */
+		if (le->famfs_log_entry_type == FAMFS_LOG_FILE)
+			copy_len = offsetof(struct famfs_log_entry, famfs_fc.famfs_relpath);
+		else
+			copy_len = offsetof(struct famfs_log_entry, famfs_md.famfs_relpath);
+		copy = famfs_ns_alloc(ns, copy_len);
+		if (!copy) {
+			famfs_ns_free(ns);
+			return NULL;
+		}
+		memcpy(copy, le, copy_len);
 
 		switch (le->famfs_log_entry_type) {
 		case FAMFS_LOG_FILE: {
 			const struct famfs_file_creation *fc = &le->famfs_fc;
-			const struct famfs_log_extent *ext = fc->famfs_ext_list;
+			int skip_file = 0;
 
-			ls.f_logged++;
-			fsize_sum += fc->famfs_fc_size;
+			ls->f_logged++;
 			if (verbose > 1)
-				printf("%s: file=%s size=%lld\n", __func__,
+				printf("%s: %lld file=%s size=%lld\n", __func__, i,
 				       fc->famfs_relpath, fc->famfs_fc_size);
 
-			/* For each extent in this log entry, mark the bitmap as allocated */
+			if (!famfs_log_entry_fc_path_is_relative(fc)) {
+				fprintf(stderr,
+					"%s: ignoring log entry; path is not relative\n",
+					__func__);
+				ls->f_errs++;
+				skip_file++;
+			}
+
+			/* The only file that should have an extent with offset 0
+			 * is the superblock, which is not in the log. Check for files with
+			 * null offset...
+			 */
 			for (j = 0; j < fc->famfs_nextents; j++) {
-				s64 page_num;
-				s64 np;
-				s64 k;
+				const struct famfs_simple_extent *se = &fc->famfs_ext_list[j].se;
 
-				assert(!(ext[j].se.famfs_extent_offset % FAMFS_ALLOC_UNIT));
-				page_num = ext[j].se.famfs_extent_offset / FAMFS_ALLOC_UNIT;
-				np = (ext[j].se.famfs_extent_len + FAMFS_ALLOC_UNIT - 1)
-					/ FAMFS_ALLOC_UNIT;
-
-				for (k = page_num; k < (page_num + np); k++) {
-					rc = mu_bitmap_test_and_set(bitmap, k);
-					if (rc == 0) {
-						errors++; /* bit was already set */
-					} else {
-						/* Don't count double allocations */
-						alloc_sum += FAMFS_ALLOC_UNIT;
-					}
+				if (se->famfs_extent_offset == 0) {
+					fprintf(stderr,
+						"%s: ERROR file %s has extent with 0 offset\n",
+						__func__, fc->famfs_relpath);
+					ls->f_errs++;
+					skip_file++;
 				}
 			}
+
+			if (skip_file)
+				continue;
+
+			famfs_ns_add_entry(ns, (const char *)fc->famfs_relpath, copy, ls);
 			break;
 		}
-		case FAMFS_LOG_MKDIR:
-			ls.d_logged++;
-			/* Ignore directory log entries - no space is used */
-			break;
+		case FAMFS_LOG_MKDIR: {
+			const struct famfs_mkdir *md = &le->famfs_md;
+
+			ls->d_logged++;
+
+			if (!famfs_log_entry_md_path_is_relative(md)) {
+				fprintf(stderr,
+					"%s: ignoring log mkdir entry; path is not relative\n",
+					__func__);
+				ls->d_errs++;
+				continue;
+			}
+
+			if (verbose)
+				printf("%s mkdir: %o %d:%d: %s \n", __func__,
+				       md->fc_mode, md->fc_uid, md->fc_gid, md->famfs_relpath);
 
+			famfs_ns_add_entry(ns, (const char *)md->famfs_relpath, copy, ls);
+			break;
+		}
 		case FAMFS_LOG_ACCESS:
 		default:
-			printf("%s: invalid log entry\n", __func__);
+			if (verbose)
+				printf("%s: invalid log entry\n", __func__);
 			break;
 		}
 	}
-	if (bitmap_nbits_out)
-		*bitmap_nbits_out = nbits;
-	if (alloc_errors_out)
-		*alloc_errors_out = errors;
-	if (fsize_total_out)
-		*fsize_total_out = fsize_sum;
-	if (alloc_sum_out)
-		*alloc_sum_out = alloc_sum;
-	if (log_stats_out)
-		memcpy(log_stats_out, &ls, sizeof(ls));
-	return bitmap;
+	if (it->err) {
+		famfs_ns_free(ns);
+		return NULL;
+	}
+	return ns;
 }
 
-/**
- * bitmap_alloc_contiguous()
- *
- * @bitmap
- * @nbits - number of bits in the bitmap
- * @alloc_size - size to allocate in bytes (must convert to bits)
- *
- * Return value: the offset in bytes
+
+/*
+ * Play the log. If @meta_valid, the caller has already validated the immutable block of
+ * the log header (and it can't have changed since), so only the cursor is checked. If
+ * @sb_in is null, the superblock is mapped (and validated) for the play.
  */
-static s64
-bitmap_alloc_contiguous(u8 *bitmap,
-			u64 nbits,
-			u64 alloc_size)
+static int
+famfs_logplay_common(
+	const struct famfs_log *logp,
+	const struct famfs_superblock *sb_in,
+	const char             *mpt,
+	int                     dry_run,
+	int                     client_mode,
+	int                     incremental,
+	int                     nthreads,
+	int                     meta_valid,
+	int                     verbose)
 {
-	u64 i, j;
-	u64 alloc_bits = (alloc_size + FAMFS_ALLOC_UNIT - 1) /  FAMFS_ALLOC_UNIT;
-	u64 bitmap_remainder;
-
-	for (i = 0; i < nbits; i++) {
-		/* Skip bits that are set... */
-		if (mu_bitmap_test(bitmap, i))
-			continue;
+	struct famfs_log_stats ls = { 0 };
+	u64 start = FAMFS_STAT_NOW();
+	enum famfs_system_role role;
+	struct famfs_superblock *sb;
+	struct famfs_log_pos first = { 0 };
+	struct famfs_log_iter it;
+	struct famfs_ns *ns;
+	int rc = -1;
+	int tries;
 
-		bitmap_remainder = nbits - i;
-		if (alloc_bits > bitmap_remainder) /* Remaining space is not enough */
+	sb = (struct famfs_superblock *)sb_in;
+	if (!sb) {
+		sb = famfs_map_superblock_by_path(mpt, 1 /* read-only */);
+		if (!sb)
 			return -1;
 
-		for (j = i; j < (i+alloc_bits); j++) {
-			if (mse_bitmap_test32(bitmap, j))
-				goto next;
+		if (famfs_check_super(sb)) {
+			fprintf(stderr, "%s: no valid superblock for mpt %s\n", __func__, mpt);
+			goto out;
 		}
-		/* If we get here, we didn't hit the "continue" which means that bits
-		 * i-(i+alloc_bits) are available
-		 */
-		for (j = i; j < (i+alloc_bits); j++)
-			mse_bitmap_set32(bitmap, j);
+	}
 
-		return i * FAMFS_ALLOC_UNIT;
-next:
+	role = (client_mode) ? FAMFS_CLIENT : famfs_get_role(sb);
+
+	if (!meta_valid && logp->famfs_log_magic != FAMFS_LOG_MAGIC) {
+		fprintf(stderr, "%s: log has bad magic number (%llx)\n",
+			__func__, logp->famfs_log_magic);
+		goto out;
 	}
-	fprintf(stderr, "%s: alloc failed\n", __func__);
-	return -1;
-}
 
-/**
- * famfs_init_locked_log()
- *
- * @lp
- * @fspath - the mount point full path, or any full path within a mounted famfs FS
- */
-int
-famfs_init_locked_log(struct famfs_locked_log *lp,
-		      const char *fspath,
-		      int verbose)
-{
-	size_t log_size;
-	void *addr;
-	int role;
-	int rc;
+	if ((meta_valid) ? famfs_validate_log_cursor(logp) : famfs_validate_log_header(logp)) {
+		fprintf(stderr, "%s: invalid log header\n", __func__);
+		goto out;
+	}
 
-	memset(lp, 0, sizeof(*lp));
+	if (verbose)
+		printf("famfs logplay: log contains %lld entries\n", logp->famfs_log_next_index);
 
-	lp->devsize = famfs_validate_superblock_by_path(fspath);
-	if (lp->devsize < 0)
-		return -1;
+	if (incremental && !dry_run)
+		famfs_logplay_ckpt_load(sb, logp, mpt, &first, verbose);
 
-	/* famfs_get_role also validates the superblock */
-	role = famfs_get_role_by_path(fspath, NULL);
-	if (role != FAMFS_MASTER) {
-		fprintf(stderr, "%s: Error not running on FAMFS_MASTER node for this FS\n",
-			__func__);
-		rc = -1;
-		goto err_out;
+	/* Pass 1: validate the entries and build the namespace they describe. Commits
+	 * during the play don't disturb it (it plays the log as of when it started), but if
+	 * the log is rewritten (compacted) underneath it, it starts over.
+	 */
+	for (tries = 0; ; tries++) {
+		famfs_log_iter_init(&it, logp, &first, FAMFS_LOG_ITER_VALIDATE);
+		ns = famfs_ns_build(&it, &ls, verbose);
+		if (ns)
+			break;
+		if (it.err != -ESTALE || tries == FAMFS_LOG_REC_TRIES)
+			goto out;
+		memset(&ls, 0, sizeof(ls));
+		memset(&first, 0, sizeof(first));
+		invalidate_processor_cache(logp, logp->famfs_log_len);
 	}
 
-	/* Log file */
-	lp->lfd = open_log_file_writable(fspath, &log_size, lp->mpt, BLOCKING_LOCK);
-	if (lp->lfd < 0) {
-		fprintf(stderr, "%s: Unable to open famfs log for writing\n", __func__);
-		/* If we can't open the log file for writing, don't allocate */
-		rc = lp->lfd;
-		goto err_out;
-	}
+	/* Pass 2: diff the namespace against the mounted tree, creating what's missing */
+	if (!dry_run) {
+		char path[PATH_MAX];
 
-	addr = mmap(0, log_size, PROT_READ | PROT_WRITE, MAP_SHARED, lp->lfd, 0);
-	if (addr == MAP_FAILED) {
-		fprintf(stderr, "%s: Failed to mmap log file\n", __func__);
-		rc = -1;
-		goto err_out;
+		/* Not worth starting threads for a handful of files */
+		if (nthreads > 1 && ls.f_logged > (u64)nthreads) {
+			ns->pool = thpool_init(nthreads, 0);
+			if (!ns->pool)
+				fprintf(stderr, "%s: creating files serially\n", __func__);
+		}
+
+		strncpy(path, mpt, PATH_MAX - 1);
+		path[PATH_MAX - 1] = 0;
+		famfs_ns_play_dir(ns, &ns->root, path, strlen(path), strlen(path), role,
+				  &ls, verbose);
+		famfs_ns_finish_files(ns, &ls);
 	}
-	lp->logp = (struct famfs_log *)addr;
-	flush_processor_cache(lp->logp, log_size); /* Invalidate the processor cache for the log */
-	return 0;
+	famfs_ns_free(ns);
 
-err_out:
-	if (lp->lfd)
-		close(lp->lfd);
+	famfs_print_log_stats("famfs_logplay", &ls, verbose);
+	if (verbose && first.index)
+		printf("\tSkipped %llu entries that were already played\n", first.index);
+
+	/* Only a clean replay can be checkpointed; otherwise retry everything next time */
+	if (!dry_run && !ls.f_errs && !ls.d_errs && it.pos.index > first.index)
+		famfs_logplay_ckpt_save(sb, logp, mpt, &it.pos, it.cur, verbose);
+
+	FAMFS_STAT_ADD(logplay_entries, it.pos.index - first.index);
+	FAMFS_STAT_TIME(logplay, start);
+	rc = ls.f_errs + ls.d_errs;
+out:
+	if (!sb_in)
+		munmap(sb, FAMFS_SUPERBLOCK_SIZE);
 	return rc;
 }
 
 /**
- * famfs_alloc_contiguous()
+ * __famfs_logplay()
  *
- * @lp      - locked log struct. Will perform bitmap build if no already done
- * @size
- * @verbose
+ * Inner function to play the log for a famfs file system
+ *
+ * @logp        - pointer to a read-only copy or mmap of the log
+ * @mpt         - mount point path
+ * @dry_run     - process the log but don't create the files & directories
+ * @client_mode - for testing; play the log as if this is a client node, even on master
+ * @incremental - skip entries that a valid local checkpoint says were already played
+ * @nthreads    - number of threads creating files (<= 1 creates them in this thread)
+ *
+ * Returns value: Number of errors detected (0=complete success)
  */
-static s64
-famfs_alloc_contiguous(struct famfs_locked_log *lp, u64 size, int verbose)
+int
+__famfs_logplay(
+	const struct famfs_log *logp,
+	const char             *mpt,
+	int                     dry_run,
+	int                     client_mode,
+	int                     incremental,
+	int                     nthreads,
+	int                     verbose)
 {
-	if (!lp->bitmap) {
-		/* Bitmap is needed and hasn't been built yet */
-		lp->bitmap = famfs_build_bitmap(lp->logp, lp->devsize, &lp->nbits,
-						NULL, NULL, NULL, NULL, verbose);
-		if (!lp->bitmap) {
-			fprintf(stderr, "%s: failed to allocate bitmap\n", __func__);
-			return -1;
-		}
-	}
-	return bitmap_alloc_contiguous(lp->bitmap, lp->nbits, size);
+	return famfs_logplay_common(logp, NULL, mpt, dry_run, client_mode, incremental,
+				    nthreads, 0, verbose);
 }
 
+/*
+ * famfs logplay --follow
+ *
+ * A client that follows the log polls just the header's cursor block, rather than
+ * re-mapping and invalidating the whole log. The immutable block is validated once, when
+ * the follower catches up (and again if the log is rewritten); after that its crc is
+ * trusted and the block stays cached. The poll interval backs off (doubling) while the
+ * log is idle, and drops back to the minimum when it moves. Only the new records are
+ * invalidated and played.
+ */
+volatile sig_atomic_t famfs_follow_stop;   /* set (e.g. by a signal handler) to stop */
+volatile sig_atomic_t famfs_follow_report; /* set to print the latency histogram */
 
-int
-famfs_release_locked_log(struct famfs_locked_log *lp)
+static u64
+famfs_follow_now_us(void)
 {
-	int rc;
-
-	if (lp->bitmap)
-		free(lp->bitmap);
+	struct timespec ts;
 
-	assert(lp->lfd > 0);
-	rc = flock(lp->lfd, LOCK_UN);
-	if (rc)
-		fprintf(stderr, "%s: unlock returned an error\n", __func__);
-
-	close(lp->lfd);
-	return rc;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /**
- * famfs_file_alloc()
+ * __famfs_logfollow()
  *
- * Alllocate space for a file, making it ready to use
+ * Play new log entries as they are committed, until famfs_follow_stop is set.
  *
- * Caller has already done the following:
- * * Verify that master role via the superblock
- * * Create the stub of the new file and verify that it is in a famfs file system
+ * The log has no commit timestamps, so the latency recorded for each update is measured
+ * from the last poll that did not see it (the commit happened after that) until its
+ * entries have been played. It's an upper bound on commit-to-visible latency, which is
+ * tight when the poll interval is short.
  *
- * @lp       - Struct famfs_locked_log or NULL
- * @fd       - File descriptor for newly-created empty target file
- * @path     - Full path of file to allocate (needed for log entry).
- *             Caller should use realpath to get this.
- * @mode     -
- * @uid      -
- * @gid      -
- * @size     - size to alloacte
- * @verbose  -
+ * @logp     - mmap of the log (it must stay coherent with the master's updates)
+ * @mpt      - mount point path
+ * @hist     - latency histogram (usec) to record into; may be NULL
  *
- * Returns 0 on success
- * On error, returns:
- * >0 - Errors that should not abort a multi-file operation
- * <0 - Errors that should cause an abort (such as out of space or log full)
+ * Return value: total number of errors from playing the log
  */
-static int
-famfs_file_alloc(
-	struct famfs_locked_log *lp,
-	int                      fd,
-	const char              *path,
-	mode_t                   mode,
-	uid_t                    uid,
-	gid_t                    gid,
-	u64                      size,
-	int                      verbose)
+int
+__famfs_logfollow(
+	const struct famfs_log *logp,
+	const char             *mpt,
+	int                     client_mode,
+	int                     nthreads,
+	struct mu_histogram    *hist,
+	int                     verbose)
 {
-	struct famfs_simple_extent ext = {0};
-	struct famfs_log *logp;
-	char mpt[PATH_MAX];
-	char *relpath;
-	char *rpath = strdup(path);
-	s64 offset;
-	int rc = 0;
+	u64 poll_us = FAMFS_FOLLOW_MIN_POLL_US;
+	struct famfs_log_cursor c = { 0 };
+	u64 last_poll_us;
+	u64 seqnum, offset, epoch;
+	u64 errs = 0;
+	int rc;
 
-	assert(lp);
-	assert(fd > 0);
+	/* Catch up first (the checkpoint is updated by every clean play) */
+	invalidate_processor_cache(logp, logp->famfs_log_len);
+	if (famfs_log_read_cursor(logp, &c))
+		fprintf(stderr, "%s: no consistent log cursor yet\n", __func__);
+	seqnum = c.next_seqnum;
+	offset = c.next_offset;
+	epoch = c.epoch;
+	rc = famfs_logplay_common(logp, NULL, mpt, 0, client_mode, 1, nthreads, 0, verbose);
+	if (rc < 0)
+		return rc;
+	errs += rc;
+	last_poll_us = famfs_follow_now_us();
 
-	/* XXX do we need the non-locked-log case? */
-	logp = lp->logp;
-	strncpy(mpt, lp->mpt, PATH_MAX - 1);
+	while (!famfs_follow_stop) {
+		u64 cur, next, now;
+		int meta_valid;
 
-	/* For the log, we need the path relative to the mount point.
-	 * getting this before we allocate is cleaner if the path is sombhow bogus
-	 */
-	relpath = famfs_relpath_from_fullpath(mpt, rpath);
-	if (!relpath)
-		return -EINVAL;
+		if (famfs_follow_report && hist) {
+			famfs_follow_report = 0;
+			mu_hist_print(hist, stdout, "famfs logplay: commit-to-visible", "us");
+			fflush(stdout);
+		}
 
-	offset = famfs_alloc_contiguous(lp, size, verbose);
-	if (offset < 0) {
-		rc = -ENOMEM;
-		fprintf(stderr, "%s: Out of space!\n", __func__);
-		//assert(0);
-		goto out;
-	}
-	/* Allocation at offset 0 is always wrong - the superblock lives there */
-	assert(offset != 0);
+		/* A commit that is still in progress is picked up by a later poll */
+		invalidate_processor_cache(&logp->famfs_log_next_seqnum, FAMFS_LOG_CURSOR_LEN);
+		if (famfs_log_read_cursor(logp, &c))
+			c.next_seqnum = seqnum;
+		cur = c.next_seqnum;
+		if (cur == seqnum) {
+			struct timespec ts = {
+				.tv_sec  = poll_us / 1000000,
+				.tv_nsec = (poll_us % 1000000) * 1000,
+			};
+
+			last_poll_us = famfs_follow_now_us();
+			nanosleep(&ts, NULL);
+			poll_us = MIN(poll_us * 2, (u64)FAMFS_FOLLOW_MAX_POLL_US);
+			continue;
+		}
 
-	ext.famfs_extent_len    = round_size_to_alloc_unit(size);
-	ext.famfs_extent_offset = offset;
+		/* Records are published (flushed) before the cursor, so once we see the
+		 * new seqnum, the records before the new offset are valid in memory. If the
+		 * log was rewritten (compacted), all of it is new.
+		 */
+		next = c.next_offset;
+		meta_valid = (c.epoch == epoch && next > offset &&
+			      next <= logp->famfs_log_data_len);
+		if (meta_valid)
+			invalidate_processor_cache(&logp->famfs_log_data[offset], next - offset);
+		else
+			invalidate_processor_cache(logp, logp->famfs_log_len);
+		offset = next;
+		epoch = c.epoch;
 
-	rc = famfs_log_file_creation(logp, 1, &ext,
-				     relpath, mode, uid, gid, size);
-	if (rc)
-		goto out;
+		rc = famfs_logplay_common(logp, NULL, mpt, 0, client_mode, 1, nthreads,
+					  meta_valid, verbose);
+		if (rc < 0)
+			return rc;
+		errs += rc;
 
-	if (!mock_kmod)
-		rc =  famfs_file_map_create(path, fd, size, 1, &ext, FAMFS_REG);
-out:
-	free(rpath);
-	return rc;
+		now = famfs_follow_now_us();
+		if (hist)
+			mu_hist_record(hist, now - last_poll_us);
+		if (verbose)
+			printf("famfs logplay: seqnum %lld -> %lld in <= %lld us\n",
+			       seqnum, cur, now - last_poll_us);
+
+		seqnum = cur;
+		last_poll_us = now;
+		poll_us = FAMFS_FOLLOW_MIN_POLL_US;
+	}
+	return errs;
 }
 
 /**
- * famfs_file_create()
- *
- * Create a file but don't allocate dax space yet
- *
- * @path
- * @mode
- * @uid  - used if both uid and gid are non-null
- * @gid  - used if both uid and gid are non-null
- * @disable_write - if this flag is non-zero, write permissions will be removed from the mode
- *                  (we default files to read-only on client systems)
+ * famfs_logplay()
  *
- * Returns a file descriptior or -EBADF if the path is not in a famfs file system
+ * Outer function to play the log for a famfs file system
  *
- * TODO: append "_empty" to function name
+ * @fspath      - mount point, or any path within the famfs file system
+ * @use_mmap    - Use mmap rather than reading the log into a buffer
+ * @dry_run     - process the log but don't create the files & directories
+ * @client_mode - for testing; play the log as if this is a client node, even on master
+ * @full        - ignore the local logplay checkpoint and play the whole log
+ * @nthreads    - number of threads creating files
+ * @follow      - keep playing new entries as they are logged (see __famfs_logfollow()),
+ *                until famfs_follow_stop is set; requires @use_mmap
+ * @verbose
  */
-static int
-famfs_file_create(const char *path,
-		  mode_t      mode,
-		  uid_t       uid,
-		  gid_t       gid,
-		  int         disable_write)
+int
+famfs_logplay(
+	const char             *fspath,
+	int                     use_mmap,
+	int                     dry_run,
+	int                     client_mode,
+	int                     full,
+	int                     nthreads,
+	int                     follow,
+	int                     verbose)
 {
-	struct stat st;
-	int rc = 0;
-	int fd;
+	char mpt_out[PATH_MAX];
+	struct famfs_log *logp;
+	size_t log_size;
+	int lfd;
+	int rc;
 
-	rc = stat(path, &st);
-	if (rc == 0) {
-		fprintf(stderr, "%s: file already exists: %s\n", __func__, path);
+	if (follow && (!use_mmap || dry_run)) {
+		fprintf(stderr, "%s: follow mode requires mmap, and can't be a dry run\n",
+			__func__);
+		return -EINVAL;
+	}
+
+	lfd = open_log_file_read_only(fspath, &log_size, mpt_out, NO_LOCK);
+	if (lfd < 0) {
+		fprintf(stderr, "%s: failed to open log file for filesystem %s\n",
+			__func__, fspath);
 		return -1;
 	}
 
-	if (disable_write)
-		mode = mode & ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	if (use_mmap) {
+		logp = mmap(0, FAMFS_LOG_LEN, PROT_READ, MAP_PRIVATE, lfd, 0);
+		if (logp == MAP_FAILED) {
+			fprintf(stderr, "%s: failed to mmap log file %s/.meta/log\n",
+				__func__, mpt_out);
+			close(lfd);
+			return -1;
+		}
+		/* Note that this dereferences logp to get the length, and then invalidates the
+		 * cache. I think this is ok...
+		 */
+		invalidate_processor_cache(logp, logp->famfs_log_len);
+	} else {
+		size_t resid = 0;
+		size_t total = 0;
+		char *buf;
 
-	fd = open(path, O_RDWR | O_CREAT, mode); /* TODO: open as temp file,
-						  * move into place after alloc
-						  */
-	if (fd < 0) {
-		fprintf(stderr, "%s: open/creat %s failed fd %d\n",
-			__func__, path, fd);
-		return fd;
+		/* XXX: Hmm, not sure how to invalidate the processor cache before a posix read.
+		 * default is mmap; posix read may not work correctly for non-cache-coherent configs
+		 */
+		/* Get log via posix read */
+		logp = malloc(log_size);
+		if (!logp) {
+			close(lfd);
+			fprintf(stderr, "%s: malloc %ld failed for log\n", __func__, log_size);
+			return -ENOMEM;
+		}
+		resid = log_size;
+		buf = (char *)logp;
+		do {
+			rc = read(lfd, &buf[total], resid);
+			if (rc < 0) {
+				fprintf(stderr, "%s: error %d reading log file\n",
+					__func__, errno);
+				return -errno;
+			}
+			if (verbose)
+				printf("%s: read %d bytes of log\n", __func__, rc);
+			if (rc == 0)
+				goto err_out; /* if we didn't get the whole log, err out */
+			resid -= rc;
+			total += rc;
+		} while (resid > 0);
 	}
 
-	/* XXX is this necessary? Have we already checked if it's in famfs? */
-	if (__file_not_famfs(fd)) {
-		close(fd);
-		unlink(path);
-		fprintf(stderr, "%s: file %s not in a famfs mount\n",
-			__func__, path);
-		return -EBADF;
-	}
+	rc = __famfs_logplay(logp, mpt_out, dry_run, client_mode, !full, nthreads, verbose);
+	if (follow && rc >= 0) {
+		struct mu_histogram hist;
+		int frc;
 
-	if (uid && gid) {
-		rc = fchown(fd, uid, gid);
-		if (rc)
-			fprintf(stderr, "%s: fchown returned %d errno %d\n",
-				__func__, rc, errno);
+		mu_hist_init(&hist);
+		frc = __famfs_logfollow(logp, mpt_out, client_mode, nthreads, &hist, verbose);
+		mu_hist_print(&hist, stdout, "famfs logplay: commit-to-visible", "us");
+		rc = (frc < 0) ? frc : rc + frc;
 	}
-	return fd;
+err_out:
+	if (use_mmap)
+		munmap(logp, FAMFS_LOG_LEN);
+	else
+		free(logp);
+	close(lfd);
+	return rc;
 }
 
-/**
- * __famfs_mkfile()
- *
- * Inner function to create *and* allocate a file, and logs it.
+/********************************************************************************
  *
- * @locked_logp - We have a writable lock, which also means we're running on the master node
- * @filename
- * @mode
- * @mode
- * @uid
- * @gid
- * @size
- * @verbose
+ * Log maintenance / append
+ */
+
+/*
+ * Directory index
  *
- * Returns an open file descriptor if successful.
- * On failure, returns:
- *  0 - The operation failed but it's not fatal to a multi-file operationn
- * <0 - The operation failed due to a fatal condition like log full or out of space, so
- *      multi-file operations should abort
+ * Paths are logged as a reference to the record of the parent directory plus a name
+ * (see struct famfs_log_rec), so the writer needs to find directory records by path.
+ * Each locked log has an index of the directories it has logged, or found in the log
+ * by searching its tail. A path whose parent isn't found (e.g. it was logged long ago) is
+ * just logged in full.
  */
-int
-__famfs_mkfile(
-	struct famfs_locked_log *lp,
-	const char              *filename,
-	mode_t                   mode,
-	uid_t                    uid,
-	gid_t                    gid,
-	size_t                   size,
-	int                      verbose)
-{
-	//struct famfs_superblock *sb;
-	char fullpath[PATH_MAX];
-	int fd, rc;
+struct famfs_dir_ent {
+	struct famfs_dir_ent *next;
+	u64                   offset; /* of the MKDIR record */
+	u32                   hash;
+	u32                   len;
+	char                  path[];
+};
 
-	assert(lp);
-	assert(size > 0);
+struct famfs_dir_index {
+	struct famfs_dir_ent **buckets;
+	u64                    nbuckets; /* power of 2 */
+	u64                    nents;
+};
 
-	/* Create the file */
-	fd = famfs_file_create(filename, mode, uid, gid, 0);
-	if (fd <= 0)
-		return fd;
+#define FAMFS_DIR_INDEX_MIN_BUCKETS 256
 
-	/* Clean up the filename path. (Can't call realpath until the file exists) */
-	assert(realpath(filename, fullpath));
+static void
+famfs_dir_index_free(struct famfs_dir_index *di)
+{
+	struct famfs_dir_ent *d, *next;
+	u64 i;
 
-	/* If the file doesn't fit, it will be created but then unlinked
-	 * (and never logged). This is probably OK
-	 */
-	rc = famfs_file_alloc(lp, fd, fullpath, mode, uid, gid, size, verbose);
-	if (rc) {
-		fprintf(stderr, "%s: famfs_file_alloc(%s, size=%ld) failed\n",
-			__func__, fullpath, size);
-		close(fd);
-		unlink(fullpath);
-		return -1;
+	if (!di)
+		return;
+	for (i = 0; i < di->nbuckets; i++) {
+		for (d = di->buckets[i]; d; d = next) {
+			next = d->next;
+			free(d);
+		}
 	}
-	return fd;
+	free(di->buckets);
+	free(di);
 }
 
-int
-famfs_mkfile(
-	const char       *filename,
-	mode_t            mode,
-	uid_t             uid,
-	gid_t             gid,
-	size_t            size,
-	int               verbose)
+static struct famfs_dir_ent *
+famfs_dir_index_find(const struct famfs_dir_index *di, const char *path, size_t len)
 {
-	struct famfs_locked_log ll;
-	int rc;
+	u32 hash = famfs_ns_hash(NULL, path, len);
+	struct famfs_dir_ent *d;
 
-	if (size == 0) {
-		/* We don't allow empty files; what would be the point? */
-		fprintf(stderr, "%s: Creating empty file (%s) not allowed\n",
-			__func__, filename);
-		return -EINVAL;
+	for (d = di->buckets[hash & (di->nbuckets - 1)]; d; d = d->next) {
+		if (d->hash == hash && d->len == len && !memcmp(d->path, path, len))
+			return d;
 	}
+	return NULL;
+}
 
-	rc = famfs_init_locked_log(&ll, filename, verbose);
-	if (rc)
-		return rc;
-
-	rc  = __famfs_mkfile(&ll, filename, mode, uid, gid, size, verbose);
+/* Double the number of buckets; if that fails, the chains just get longer */
+static void
+famfs_dir_index_grow(struct famfs_dir_index *di)
+{
+	u64 nbuckets = di->nbuckets * 2;
+	struct famfs_dir_ent **buckets = calloc(nbuckets, sizeof(*buckets));
+	struct famfs_dir_ent *d, *next;
+	u64 i;
 
-	famfs_release_locked_log(&ll);
-	return rc;
+	if (!buckets)
+		return;
+	for (i = 0; i < di->nbuckets; i++) {
+		for (d = di->buckets[i]; d; d = next) {
+			next = d->next;
+			d->next = buckets[d->hash & (nbuckets - 1)];
+			buckets[d->hash & (nbuckets - 1)] = d;
+		}
+	}
+	free(di->buckets);
+	di->buckets = buckets;
+	di->nbuckets = nbuckets;
 }
 
-/**
- * famfs_dir_create()
- *
- * Create a directory
- *
- * @mpt
- * @path
- * @mode
- * @uid  - used if both uid and gid are non-null
- * @gid  - used if both uid and gid are non-null
- * @size
- *
- *
- */
 static int
-famfs_dir_create(
-	const char *mpt,
-	const char *rpath,
-	mode_t      mode,
-	uid_t       uid,
-	gid_t       gid)
+famfs_dir_index_add(struct famfs_dir_index *di, const char *path, u64 offset)
 {
-	int rc = 0;
-	char fullpath[PATH_MAX];
+	size_t len = strlen(path);
+	struct famfs_dir_ent *d = famfs_dir_index_find(di, path, len);
 
-	snprintf(fullpath, PATH_MAX - 1, "%s/%s", mpt, rpath);
-	rc = mkdir(fullpath, mode);
-	if (rc) {
-		fprintf(stderr, "%s: failed to mkdir %s (rc %d errno %d)\n",
-			__func__, fullpath, rc, errno);
-		return -1;
+	if (d) {
+		d->offset = offset;
+		return 0;
 	}
 
-	/* Check if dir is in famfs mount? */
+	d = malloc(sizeof(*d) + len + 1);
+	if (!d)
+		return -ENOMEM;
+	d->offset = offset;
+	d->hash = famfs_ns_hash(NULL, path, len);
+	d->len = len;
+	memcpy(d->path, path, len + 1);
+	d->next = di->buckets[d->hash & (di->nbuckets - 1)];
+	di->buckets[d->hash & (di->nbuckets - 1)] = d;
+	if (++di->nents > di->nbuckets)
+		famfs_dir_index_grow(di);
+	return 0;
+}
 
-	if (uid && gid) {
-		rc = chown(fullpath, uid, gid);
-		if (rc) {
-			fprintf(stderr, "%s: chown returned %d errno %d\n",
-				__func__, rc, errno);
-			return -1;
-		}
+static struct famfs_dir_index *
+famfs_dir_index_alloc(void)
+{
+	struct famfs_dir_index *di = calloc(1, sizeof(*di));
+
+	if (!di)
+		return NULL;
+	di->nbuckets = FAMFS_DIR_INDEX_MIN_BUCKETS;
+	di->buckets = calloc(di->nbuckets, sizeof(*di->buckets));
+	if (!di->buckets) {
+		free(di);
+		return NULL;
 	}
-	return 0;
+	return di;
 }
 
-/**
- * __famfs_mkdir()
- *
- * This should become the mid-level mkdir function; verify that target is a directory
- * with a parent that exists and is in a famfs FS. Inner function should rely on these
- * checks, and use the famsf_locked_log.
- *
- * Inner function would also be callled by 'cp -r' (which doesn't exist quite yet)
- *
- * @lp         - XXX make lp mandatory?
- * @dirpath
- * @mode
- * @uid
- * @gid
- * @verbose
+/*
+ * Is the record at @offset the MKDIR record of directory @path? The path is matched from
+ * its last component back, following the parent references.
  */
-
-int
-__famfs_mkdir(
-	struct famfs_locked_log *lp,
-	const char *dirpath,
-	mode_t      mode,
-	uid_t       uid,
-	gid_t       gid,
-	int         verbose)
+static int
+famfs_log_dir_match(const struct famfs_log *logp, u64 offset, const char *path, size_t len)
 {
-	char realparent[PATH_MAX];
-	char fullpath[PATH_MAX];
-	char mpt_out[PATH_MAX] = { 0 };
-	char realdirpath[PATH_MAX];
-	char *dirdupe   = NULL;
-	char *parentdir = NULL;
-	char *basedupe  = NULL;
-	char *newdir    = NULL;
-	char *relpath   = NULL;
-	struct stat st;
-	int rc;
+	struct famfs_log_entry le;
+	u64 parent;
 
-	assert(lp);
-
-	/* Rationalize dirpath; if it exists, get role based on that */
-	if (realpath(dirpath, realdirpath)) {
-		/* if dirpath already exists in "non -p" mkdir, that's an error */
-		return -1;
-	}
+	for (;;) {
+		const char *name = (const char *)le.famfs_md.famfs_relpath;
+		size_t nlen;
 
-	dirdupe  = strdup(dirpath);  /* call dirname() on this dupe */
-	basedupe = strdup(dirpath); /* call basename() on this dupe */
-	newdir   = basename(basedupe);
+		if (famfs_log_rec_decode(&logp->famfs_log_data[offset],
+					 logp->famfs_log_data_len - offset, &le, &parent, 0,
+					 famfs_log_crc_alg(logp)) ||
+		    le.famfs_log_entry_type != FAMFS_LOG_MKDIR)
+			return 0;
 
-	/* full dirpath should not exist, but the parentdir path must exist and
-	 * be a directory
-	 */
-	parentdir = dirname(dirdupe);
-	rc = stat(parentdir, &st);
-	if (rc) {
-		fprintf(stderr, "%s: parent path (%s) stat failed\n", __func__, parentdir);
-	} else if ((st.st_mode & S_IFMT) != S_IFDIR) {
-		fprintf(stderr, "%s: parent (%s) of path %s is not a directory\n",
-			__func__, dirpath, parentdir);
-		rc = -1;
-		goto err_out;
+		nlen = strlen(name);
+		if (!parent)
+			return (nlen == len && !memcmp(name, path, len));
+		if (nlen >= len || path[len - nlen - 1] != '/' ||
+		    memcmp(name, &path[len - nlen], nlen) || parent > offset)
+			return 0;
+		len -= nlen + 1;
+		offset -= parent;
 	}
+}
 
-	/* Parentdir exists and is a directory; rationalize the path with realpath */
-	if (realpath(parentdir, realparent) == 0) {
-		fprintf(stderr, "%s: failed to rationalize parentdir path (%s)\n",
-			__func__, parentdir);
-		rc = -1;
-		goto err_out;
-	}
+/*
+ * Look for the MKDIR record of @path in the tail of the log (the last
+ * FAMFS_LOG_PARENT_WINDOW bytes, following the back links), where the parents of new
+ * files and directories almost always are.
+ *
+ * Return value: the offset of the record, or FAMFS_LOG_NO_PARENT
+ */
+#define FAMFS_LOG_PARENT_WINDOW (64 * 1024)
 
-	/* Rebuild full path of to-be-createed directory from the rationalized
-	 * parent dir path
-	 */
-	rc = snprintf(fullpath, PATH_MAX - 1, "%s/%s", realparent, newdir);
-	if (rc < 0) {
-		fprintf(stderr, "%s: fullpath overflow\n", __func__);
-		goto err_out;
-	}
+static u64
+famfs_log_find_dir(const struct famfs_locked_log *lp, const char *path, size_t len)
+{
+	const struct famfs_log *logp = lp->logp;
+	const char *last = memrchr(path, '/', len);
+	const char *base = (last) ? last + 1 : path;
+	size_t blen = len - (base - path);
+	u64 end = logp->famfs_log_next_offset + lp->txn_nbytes;
+	u64 offset;
+
+	if (lp->txn_nstaged)
+		offset = lp->txn_last;
+	else if (logp->famfs_log_next_index)
+		offset = logp->famfs_log_last_offset;
+	else
+		return FAMFS_LOG_NO_PARENT;
 
-	strncpy(mpt_out, lp->mpt, PATH_MAX - 1);
+	while (offset + FAMFS_LOG_PARENT_WINDOW >= end) {
+		const struct famfs_log_rec *lr =
+			(const struct famfs_log_rec *)&logp->famfs_log_data[offset];
 
-	if (verbose)
-		printf("famfs mkdir: created directory \'%s\'\n", fullpath);
+		/* Cheap checks first: the record's name has to be the last component */
+		if (lr->lr_type == FAMFS_LOG_MKDIR && lr->lr_len > sizeof(*lr) + blen &&
+		    memmem(lr->lr_data, lr->lr_len - sizeof(*lr), base, blen) &&
+		    famfs_log_dir_match(logp, offset, path, len))
+			return offset;
 
-	relpath = famfs_relpath_from_fullpath(mpt_out, fullpath);
-	if (strcmp(mpt_out, fullpath) == 0) {
-		fprintf(stderr, "%s: failed to create mount point dir: EALREADY\n", __func__);
-		rc = -1;
-		goto err_out;
-	}
-	rc = famfs_dir_create(mpt_out, relpath, mode, uid, gid);
-	if (rc) {
-		fprintf(stderr, "%s: failed to mkdir %s\n", __func__, fullpath);
-		rc = -1;
-		goto err_out;
+		if (!lr->lr_prev || lr->lr_prev > offset)
+			break;
+		offset -= lr->lr_prev;
 	}
-
-	/* Should it be logged before it's locally created? */
-	rc = famfs_log_dir_creation(lp->logp, relpath, mode, uid, gid);
-
-err_out:
-	if (dirdupe)
-		free(dirdupe);
-	if (basedupe)
-		free(basedupe);
-	return rc;
+	return FAMFS_LOG_NO_PARENT;
 }
 
-int
-famfs_mkdir(
-	const char *dirpath,
-	mode_t      mode,
-	uid_t       uid,
-	gid_t       gid,
-	int         verbose)
+/*
+ * Find the record of the parent directory of @relpath, and the name of @relpath relative
+ * to it.
+ *
+ * Return value: the offset of the parent's record, or FAMFS_LOG_NO_PARENT (in which
+ *               case *@name is all of @relpath)
+ */
+static u64
+famfs_log_parent(struct famfs_locked_log *lp, const char *relpath, const char **name)
 {
-	char *cwd = get_current_dir_name();
-	struct famfs_locked_log ll;
-	char abspath[PATH_MAX];
-	int rc;
+	const char *slash = strrchr(relpath, '/');
+	const struct famfs_dir_ent *d;
+	size_t len;
+	u64 offset;
 
-	if (dirpath[0] == '/')
-		strncpy(abspath, dirpath, PATH_MAX - 1);
-	else
-		snprintf(abspath, PATH_MAX - 1, "%s/%s", cwd, dirpath);
+	*name = relpath;
+	if (!slash || slash == relpath || !slash[1])
+		return FAMFS_LOG_NO_PARENT;
+	len = slash - relpath;
 
-	rc = famfs_init_locked_log(&ll, abspath, verbose);
-	if (rc) {
-		free(cwd);
-		return rc;
+	if (!lp->dirs) {
+		lp->dirs = famfs_dir_index_alloc();
+		if (!lp->dirs)
+			return FAMFS_LOG_NO_PARENT;
 	}
 
-	rc = __famfs_mkdir(&ll, dirpath, mode, uid, gid, verbose);
+	d = famfs_dir_index_find(lp->dirs, relpath, len);
+	if (d) {
+		offset = d->offset;
+	} else {
+		char dir[FAMFS_MAX_PATHLEN];
 
-	famfs_release_locked_log(&ll);
-	free(cwd);
-	return rc;
+		offset = famfs_log_find_dir(lp, relpath, len);
+		if (offset == FAMFS_LOG_NO_PARENT)
+			return offset;
+
+		memcpy(dir, relpath, len);
+		dir[len] = 0;
+		famfs_dir_index_add(lp->dirs, dir, offset);
+	}
+	*name = slash + 1;
+	return offset;
 }
 
 /**
- * famfs_make_parent_dir()
+ * famfs_log_stage()
  *
- * Recurse upwards through the path till we find a directory that exists
- * On the way back, create the missing directories for "mkdir -p"
- * If the first vallid path we find is not a directory, that's an error.
+ * Write a log record after the staged records of @lp, without publishing it. Staged
+ * records are invisible to logplay until famfs_log_publish() bumps the log header, so
+ * it's fine if they're not flushed yet.
  *
- * @lp
- * @path
- * @mode
- * @uid
- * @gid
- * @depth
+ * @lp     - locked log (we must hold the log lock)
+ * @e      - log entry to encode (its path is @name)
+ * @parent - offset of the parent directory's record, or FAMFS_LOG_NO_PARENT
+ * @name   - path relative to the parent (or the mount point)
+ *
+ * Return value: 0, -EINVAL if the entry can't be encoded, or -ENOMEM if the log is full
  */
 static int
-famfs_make_parent_dir(
-	struct famfs_locked_log *lp,
-	const char *path,
-	mode_t mode,
-	uid_t uid,
-	gid_t gid,
-	int depth,
-	int verbose)
+famfs_log_stage(struct famfs_locked_log *lp,
+		struct famfs_log_entry  *e,
+		u64                      parent,
+		const char              *name)
 {
-	char *dirdupe = strdup(path);
-	char *parentdir;
-	struct stat st;
-	int rc;
+	struct famfs_log *logp = lp->logp;
+	u64 offset = logp->famfs_log_next_offset + lp->txn_nbytes;
+	u8 rec[FAMFS_LOG_REC_MAX];
+	u64 prev = 0;
+	int len;
+
+	if (lp->txn_nstaged)
+		prev = offset - lp->txn_last;
+	else if (logp->famfs_log_next_index)
+		prev = offset - logp->famfs_log_last_offset;
+
+	e->famfs_log_entry_seqnum = logp->famfs_log_next_seqnum + lp->txn_nstaged;
+	len = famfs_log_rec_encode(rec, e, prev,
+				   (parent == FAMFS_LOG_NO_PARENT) ? 0 : offset - parent, name,
+				   famfs_log_crc_alg(logp));
+	if (len < 0) {
+		fprintf(stderr, "%s: unable to encode log entry (%s)\n", __func__, name);
+		return len;
+	}
+
+	if (offset + len > logp->famfs_log_data_len) {
+		fprintf(stderr, "%s: log full\n", __func__);
+		return -ENOMEM;
+	}
 
-	assert(lp);
+	memcpy(&logp->famfs_log_data[offset], rec, len);
+	lp->txn_last = offset;
+	lp->txn_nstaged++;
+	lp->txn_nbytes += len;
+	return 0;
+}
 
-	/* Does path already exist? */
-	if (stat(path, &st) == 0) {
-		free(dirdupe);
-		switch (st.st_mode & S_IFMT) {
-		case S_IFDIR:
-			return 0;
-		default:
-			fprintf(stderr, "%s: path %s is not a directory\n", __func__, path);
-			return -1;
-		}
-	}
+/**
+ * famfs_log_publish()
+ *
+ * Make the staged records of @lp visible: one flush of the (contiguous) staged records,
+ * and one header update.
+ */
+static void
+famfs_log_publish(struct famfs_locked_log *lp)
+{
+	struct famfs_log *logp = lp->logp;
+	u64 start = FAMFS_STAT_NOW();
+	u8 *first;
 
-	/* get parent path */
-	parentdir = dirname(dirdupe);
-	 /* Recurse up :D */
-	rc = famfs_make_parent_dir(lp, parentdir, mode, uid, gid, depth + 1, verbose);
-	if (rc) {
-		fprintf(stderr, "%s: bad path component above (%s)\n", __func__, path);
-		free(dirdupe);
-		return -1;
-	}
+	if (!lp->txn_nstaged)
+		return;
 
-	/* Parent dir exists; now we can mkdir path! */
-	free(dirdupe);
-	if (verbose > 2)
-		printf("%s: dir %s depth %d\n", __func__, path, depth);
+	first = &logp->famfs_log_data[logp->famfs_log_next_offset];
 
-	/* Parent of path is guaranteed to exist */
-	rc = __famfs_mkdir(lp, path, mode, uid, gid, verbose);
-	return rc;
+	/* Commit protocol: 1) write back the new records, 2) fence, 3) publish them by
+	 * bumping the cursor fields of the log header, inside an odd generation, 4) write
+	 * back just that header line. (The fences are in writeback_processor_cache()). The
+	 * master keeps using the log, so the lines stay cached where the cpu can do that.
+	 *
+	 * The fence keeps the header update from becoming visible before the records on
+	 * this side. Readers take the cursor with famfs_log_read_cursor(), so they never see
+	 * half of an update; one that still has stale record lines cached fails the record
+	 * crc and re-reads just that record (see famfs_log_iter_decode()). The index is
+	 * stored last, for readers that can't get a consistent cursor (see famfs_log_end()).
+	 */
+	writeback_processor_cache(first, lp->txn_nbytes);
+
+	famfs_log_cursor_begin(logp);
+	logp->famfs_log_next_offset += lp->txn_nbytes;
+	logp->famfs_log_last_offset = lp->txn_last;
+	__atomic_store_n(&logp->famfs_log_next_index,
+			 logp->famfs_log_next_index + lp->txn_nstaged, __ATOMIC_RELEASE);
+	logp->famfs_log_next_seqnum += lp->txn_nstaged;
+	famfs_log_cursor_end(logp);
+	writeback_processor_cache(&logp->famfs_log_next_seqnum, FAMFS_LOG_CURSOR_LEN);
+
+	famfs_log_flush_bytes = mu_cl_span(first, lp->txn_nbytes) +
+		mu_cl_span(&logp->famfs_log_next_seqnum, FAMFS_LOG_CURSOR_LEN);
+	famfs_log_flush_bytes_total += famfs_log_flush_bytes;
+	FAMFS_STAT_ADD(log_commit_entries, lp->txn_nstaged);
+	FAMFS_STAT_TIME(log_commit, start);
+	lp->txn_nstaged = 0;
+	lp->txn_nbytes = 0;
 }
 
-int
-famfs_mkdir_parents(
-	const char *dirpath,
-	mode_t      mode,
-	uid_t       uid,
-	gid_t       gid,
-	int         verbose)
+/**
+ * famfs_append_log()
+ *
+ * Append an entry to the log. Outside a transaction the entry is published immediately;
+ * inside one it is staged, and published by famfs_log_txn_commit().
+ *
+ * @lp     - locked log
+ * @e      - pointer to log entry in memory
+ * @parent - see famfs_log_stage()
+ * @name
+ *
+ * NOTE: this function is not re-entrant. Must hold a lock or mutex when calling this
+ * function if there is any chance of re-entrancy.
+ */
+static int
+famfs_append_log(struct famfs_locked_log *lp,
+		 struct famfs_log_entry  *e,
+		 u64                      parent,
+		 const char              *name)
 {
-	struct famfs_locked_log ll = { 0 };
-	char *cwd = get_current_dir_name();
-	char abspath[PATH_MAX];
-	char *rpath;
 	int rc;
 
-	/* dirpath as an indeterminate number of nonexistent dirs, under a path that
-	 * must exist. But the immediate parent may not exist. All existing elements
-	 * in the path must be dirs. By opening the log, we can get the mount point path...
-	 */
-
-	if (dirpath[0] == '/')
-		strncpy(abspath, dirpath, PATH_MAX - 1);
-	else
-		snprintf(abspath, PATH_MAX - 1, "%s/%s", cwd, dirpath);
-
-	if (verbose)
-		printf("%s: cwd %s abspath %s\n", __func__, cwd, abspath);
+	assert(lp);
+	assert(lp->logp);
+	assert(e);
 
-	rpath = find_real_parent_path(abspath);
-	if (!rpath) {
-		fprintf(stderr, "%s: failed to find real parent dir\n", __func__);
-		return -1;
-	}
+	/* XXX This function is not re-entrant */
 
-	/* OK, we know were in a FAMFS instance. get a locked log struct */
-	rc = famfs_init_locked_log(&ll, rpath, verbose);
-	if (rc) {
-		free(rpath);
+	rc = famfs_log_stage(lp, e, parent, name);
+	if (rc)
 		return rc;
-	}
 
-	/* Now recurse up fromm abspath till we find an existing parent, and mkdir back down */
-	rc = famfs_make_parent_dir(&ll, abspath, mode, uid, gid, 0, verbose);
-
-	/* Separate function should release ll and lock */
-	famfs_release_locked_log(&ll);
-	free(rpath);
-	if (cwd)
-		free(cwd);
+	if (!lp->txn_open)
+		famfs_log_publish(lp);
 
-	return rc;
+	return 0;
 }
 
 /**
- * __famfs_cp()
+ * famfs_log_txn_begin()
  *
- * Inner file copy function
+ * Start batching log entries: until famfs_log_txn_commit(), entries logged through @lp
+ * are staged in the log and published together with one flush and one header update.
  *
- * Copy a file from any file system into famfs. A destination file is created and
- * allocated, and the data is copied info it.
- *
- * Biggest current shortcoming is that globbing and recursion is not suported.
- * Hopefully we'll get there soon.
- *
- * @lp       - famfs_locked_log struct
- * @srcfile  - must exist and be a regular file
- * @destfile - must not exist (and will be a regular file). If @destfile does not fall
- *             within a famfs file system, we will clean up and fail
- * @mode     - If mode is NULL, mode is inherited fro msource file
- * @uid
- * @gid
- * @verbose
- *
- * Return values:
- * 0  - Success
- * >0 - Something failed but if it is a multi-file copy, it should continue
- * <0 - A failure that should cause multi-file operations to bail out (such as out of space or
- *      log full...
+ * Files and directories in the transaction exist locally as soon as they're created,
+ * but other nodes see them only after the commit - so data can be written into the files
+ * before clients see them. If the master dies before the commit, the next holder of the
+ * log lock removes them (see famfs_log_txn_recover()).
  */
 int
-__famfs_cp(
-	struct famfs_locked_log  *lp,
-	const char               *srcfile,
-	const char               *destfile,
-	mode_t                    mode,
-	uid_t                     uid,
-	gid_t                     gid,
-	int                       verbose)
+famfs_log_txn_begin(struct famfs_locked_log *lp)
 {
-	size_t chunksize, remainder, offset;
-	int rc, srcfd, destfd;
-	struct stat srcstat;
-	ssize_t bytes;
-	char *destp;
-
 	assert(lp);
 
-	/* Validate source file */
-	rc = stat(srcfile, &srcstat);
-	if (rc) {
-		fprintf(stderr, "%s: unable to stat srcfile (%s)\n", __func__, srcfile);
-		return 1; /* not an abort condition */
+	if (lp->txn_open) {
+		fprintf(stderr, "%s: transaction already open\n", __func__);
+		return -EBUSY;
 	}
-	switch (srcstat.st_mode & S_IFMT) {
-	case S_IFREG:
-		/* Source is a file - all good */
-		if (srcstat.st_size == 0) {
-			if (verbose > 1)
-				fprintf(stderr, "%s: skipping empty file %s\n", __func__, srcfile);
-
-			return 1;
-		}
-		break;
-
-	case S_IFDIR:
-		/* source is a directory; fail for now
-		 * (should this be mkdir? Probably... at least if it's a recursive copy)
-		 */
-		fprintf(stderr, "%s: -r not specified; omitting directory '%s'\n",
-			__func__, srcfile);
-		return 1;
+	lp->txn_open = 1;
+	return 0;
+}
 
-	default:
-		fprintf(stderr,
-			"%s: error: src %s is not a regular file\n", __func__, srcfile);
-		return 1;
-	}
+/**
+ * famfs_log_txn_commit()
+ *
+ * Publish the staged entries and close the transaction
+ *
+ * Return value: the number of entries published
+ */
+int
+famfs_log_txn_commit(struct famfs_locked_log *lp)
+{
+	int n;
 
-	/*
-	 * Make sure we can open and read the source file
-	 */
-	srcfd = open(srcfile, O_RDONLY, 0);
-	if (srcfd < 0) {
-		fprintf(stderr, "%s: unable to open srcfile (%s)\n", __func__, srcfile);
-		return 1;
-	}
+	assert(lp);
 
-	/* XXX famfs_mkfile() calls famfs_file_alloc()
-	 * famfs_file_alloc() allocates and logs the file under log lock
-	 * but this function copies the data into the file after the log lock is released
-	 * Need a way of holding the lock until the data is copied.
-	 */
-	destfd = __famfs_mkfile(lp, destfile, (mode == 0) ? srcstat.st_mode : mode,
-				uid, gid, srcstat.st_size, verbose);
-	if (destfd <= 0) {
-		fprintf(stderr, "%s: failed in __famfs_mkfile\n", __func__);
-		return destfd;
-	}
+	n = lp->txn_nstaged;
+	famfs_log_publish(lp);
+	lp->txn_open = 0;
+	return n;
+}
 
-	destp = mmap(0, srcstat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, destfd, 0);
-	if (destp == MAP_FAILED) {
-		fprintf(stderr, "%s: dest mmap failed (%s) size %ld\n",
-			__func__, destfile, srcstat.st_size);
-		unlink(destfile);
-		return -1; /* XXX */
-	}
+/**
+ * famfs_relpath_from_fullpath()
+ *
+ * Returns a pointer to the relpath. This pointer points within the fullpath string
+ *
+ * @mpt - mount point string (rationalized by realpath())
+ * @fullpath
+ */
+static char *
+famfs_relpath_from_fullpath(
+	const char *mpt,
+	char       *fullpath)
+{
+	char *relpath;
 
-	/* Copy the data */
-	chunksize = 0x100000; /* 1 MiB copy chunks */
-	offset = 0;
-	remainder = srcstat.st_size;
-	for ( ; remainder > 0; ) {
-		size_t cur_chunksize = MIN(chunksize, remainder);
-
-		/* read into mmapped destination */
-		bytes = read(srcfd, &destp[offset], cur_chunksize);
-		if (bytes < 0) {
-			fprintf(stderr, "%s: copy fail: "
-				"ofs %ld cur_chunksize %ld remainder %ld\n",
-				__func__, offset, cur_chunksize, remainder);
-			printf("rc=%ld errno=%d\n", bytes, errno);
-			munmap(destp, srcstat.st_size);
-			return -1;
-		}
-		if (bytes < cur_chunksize) {
-			fprintf(stderr, "%s: short read: "
-				"ofs %ld cur_chunksize %ld remainder %ld\n",
-				__func__, offset, cur_chunksize, remainder);
-		}
+	assert(mpt);
+	assert(fullpath);
+	assert(strlen(fullpath) >= strlen(mpt));
 
-		/* Update offset and remainder */
-		offset += bytes;
-		remainder -= bytes;
+	if (strstr(fullpath, mpt) != fullpath) {
+		/* mpt path should be a substring starting at the beginning of fullpath*/
+		fprintf(stderr, "%s: failed to get relpath from mpt=%s fullpath=%s\n",
+			__func__, mpt, fullpath);
+		return NULL;
 	}
-	/* Flush the processor cache for the dest file */
-	flush_processor_cache(destp, srcstat.st_size);
 
-	munmap(destp, srcstat.st_size);
-	close(srcfd);
-	close(destfd);
-	return 0;
+	/* This assumes relpath() removed any duplicate '/' characters: */
+	relpath = &fullpath[strlen(mpt) + 1];
+	return relpath;
 }
 
 /**
- * famfs_cp()
- *
- * Mid layer file copy function
+ * famfs_log_file_creation()
  *
- * @lp       - Locked Log struct (required)
- * @srcfile  - skipped unless it's a regular file
- * @destfile - Nonexistent file, or existing directory. If destfile is a directory, this
- *             function fill append basename(srcfile) to destfile to get a nonexistent file path
- * @verbose
+ * Returns 0 on success
+ * On error, returns <0. (all failures here should abort multi-file operations)
+ */
+/* TODO: UI would be cleaner if this accepted a fullpath and the mpt, and did the
+ * conversion itself. Then pretty much all calls would use the same stuff.
  */
 static int
-famfs_cp(struct famfs_locked_log *lp,
-	 const char              *srcfile,
-	 const char              *destfile,
-	 mode_t                   mode,
-	 uid_t                    uid,
-	 gid_t                    gid,
-	 int                      verbose)
+famfs_log_file_creation(
+	struct famfs_locked_log    *lp,
+	u64                         nextents,
+	struct famfs_simple_extent *ext_list,
+	const char                 *relpath,
+	mode_t                      mode,
+	uid_t                       uid,
+	gid_t                       gid,
+	size_t                      size)
 {
-	char actual_destfile[PATH_MAX] = { 0 };
-	struct stat deststat;
-	int rc;
+	struct famfs_log_entry le = {0};
+	struct famfs_file_creation *fc = &le.famfs_fc;
+	const char *name;
+	u64 parent;
+	int i;
 
 	assert(lp);
+	assert(ext_list);
+	assert(nextents >= 1);
+	assert(relpath[0] != '/');
 
-	/* Figure out what the destination is; possibilities:
-	 *
-	 * * A non-existing path whose parent directory is in famfs
-	 * * An existing path do a directory in famfs
-	 */
-	rc = stat(destfile, &deststat);
-	if (!rc) {
-		switch (deststat.st_mode & S_IFMT) {
-		case S_IFDIR: {
-			char destpath[PATH_MAX];
-			char src[PATH_MAX];
+	if (strlen(relpath) >= FAMFS_MAX_PATHLEN) {
+		fprintf(stderr, "%s: path too long for the log (%s)\n", __func__, relpath);
+		return -ENAMETOOLONG;
+	}
 
-			if (verbose > 1)
-				printf("%s: (%s) -> (%s/)\n", __func__, srcfile, destfile);
+	le.famfs_log_entry_type = FAMFS_LOG_FILE;
 
-			/* Destination is directory;  get the realpath and append the basename
-			 * from the source
-			 */
-			if (realpath(destfile, destpath) == 0) {
-				fprintf(stderr, "%s: failed to rationalize destath path (%s)\n",
-					__func__, destfile);
-				return 1;
-			}
-			strncpy(src, srcfile, PATH_MAX - 1);
-			snprintf(destpath, PATH_MAX - 1, "%s/%s", destfile, basename(src));
-			strncpy(actual_destfile, destpath, PATH_MAX - 1);
-			break;
-		}
-		default:
-			fprintf(stderr,
-				"%s: error: destination file (%s) exists and is not a directory\n",
-				__func__, destfile);
-			return -EEXIST;
-		}
-	} else {
-		/* File does not exist;
-		 * the check whether it is in famfs will happen after the file is created
-		 */
-		if (verbose > 1)
-			printf("%s: (%s) -> (%s)\n", __func__, srcfile, destfile);
+	fc->famfs_fc_size = size;
+	fc->famfs_nextents = nextents;
+	fc->famfs_fc_flags = FAMFS_FC_ALL_HOSTS_RW; /* XXX hard coded access for now */
 
-		strncpy(actual_destfile, destfile, PATH_MAX - 1);
+	fc->fc_mode = mode;
+	fc->fc_uid  = uid;
+	fc->fc_gid  = gid;
+
+	/* Copy extents into log entry */
+	for (i = 0; i < nextents; i++) {
+		struct famfs_log_extent *ext = &fc->famfs_ext_list[i];
+
+		ext->famfs_extent_type = FAMFS_EXT_SIMPLE;
+		ext->se.famfs_extent_offset = ext_list[i].famfs_extent_offset;
+		ext->se.famfs_extent_len    = ext_list[i].famfs_extent_len;
 	}
 
-	return __famfs_cp(lp, srcfile, actual_destfile, mode, uid, gid, verbose);
+	parent = famfs_log_parent(lp, relpath, &name);
+	return famfs_append_log(lp, &le, parent, name);
 }
 
 /**
- * famfs_cp_dir()
- *
- * Copy a directory and its contents to a target path
- *
- * @lp       - (required)
- * @src      - src path (must exist and be a directory)
- * @dest     - Must be a directory if it exists; if dest does not exist, its parent dir
- *             is required to exist.
- * @mode
- * @uid
- * @gid
- * @verbose
+ * famfs_log_dir_creation()
  */
-int famfs_cp_dir(
-	struct famfs_locked_log *lp,
-	const char *src,
-	const char *dest,
-	mode_t mode,
-	uid_t uid,
-	gid_t gid,
-	int verbose)
+/* TODO: UI would be cleaner if this accepted a fullpath and the mpt, and did the
+ * conversion itself. Then pretty much all calls would use the same stuff.
+ */
+int
+famfs_log_dir_creation(
+	struct famfs_locked_log    *lp,
+	const char                 *relpath,
+	mode_t                      mode,
+	uid_t                       uid,
+	gid_t                       gid)
 {
-	struct dirent *entry;
-	DIR *directory;
-	struct stat st;
+	struct famfs_log_entry le = {0};
+	struct famfs_mkdir *md = &le.famfs_md;
+	const char *name;
+	u64 parent;
 	int rc;
-	int err = 0;
 
 	assert(lp);
-	if (verbose > 1)
-		printf("%s: (%s) -> (%s)\n", __func__, src, dest);
+	assert(relpath[0] != '/');
 
-	/* Does the dest dir exist? */
-	rc = stat(dest, &st);
+	if (strlen(relpath) >= FAMFS_MAX_PATHLEN) {
+		fprintf(stderr, "%s: path too long for the log (%s)\n", __func__, relpath);
+		return -ENAMETOOLONG;
+	}
+
+	le.famfs_log_entry_type = FAMFS_LOG_MKDIR;
+
+	md->fc_mode = mode;
+	md->fc_uid  = uid;
+	md->fc_gid  = gid;
+
+	if (!lp->dirs)
+		lp->dirs = famfs_dir_index_alloc();
+
+	parent = famfs_log_parent(lp, relpath, &name);
+	rc = famfs_append_log(lp, &le, parent, name);
+	if (!rc && lp->dirs)
+		famfs_dir_index_add(lp->dirs, relpath, lp->txn_last);
+	return rc;
+}
+
+/**
+ * find_real_parent_path()
+ *
+ * travel up a path until a real component is found.
+ * The returned path was malloc'd by realpath, and should be freed by the caller
+ * This is useful in mkdir -p, where the path might be several layers deeper than
+ * the deepest existing dir.
+ *
+ * @path
+ *
+ * Returns: a real sub-path, if found
+ */
+static char *
+find_real_parent_path(const char *path)
+{
+	char path_copy[PATH_MAX];
+	char *pc = &path_copy[0];
+	int loop_ct = 64; /* This is the max depth the function can handle */
+	char *rpath;
+
+	strncpy(path_copy, path, PATH_MAX - 1);
+	while (1) {
+		if (strlen(pc) <= 1) {
+			fprintf(stderr, "%s: path %s appears not to be in a famfs mount\n",
+				__func__, path);
+			return NULL;
+		}
+
+		rpath = realpath(pc, NULL);
+		if (rpath)
+			return rpath;  /* found a valid path */
+
+		pc = dirname(pc);
+		if (--loop_ct == 0) {
+			fprintf(stderr,
+				"%s: bailed from possible infinite loop; path=%s path_copy=%s\n",
+				__func__, path, pc);
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * __open_relpath()
+ *
+ * This functionn starts with @path and ascends until @relpath is a valid
+ * sub-path from the ascended subset of @path.
+ *
+ * This is intended for ascending from @path until (e.g.) @relpath=".meta/.superblock"
+ * is valid - and opening that.
+ *
+ * It is also important to verify that the @relpath file is in a famfs file system,
+ * but there are also (unit test) cases where it is useful to exercise this logic
+ * even if the ascended @path is not in a famfs file system.
+ *
+ * @path       - any path within a famfs file system (from mount pt on down)
+ * @relpath    - the relative path to open (relative to the mount point)
+ * @read_only
+ * @size_out   - File size will be returned if this pointer is non-NULL
+ * @mpt_out    - Mount point will be returned if this pointer is non-NULL
+ *               (the string space is assumed to be of size PATH_MAX)
+ * @no_fscheck - For unit tests only - don't check whether the file with @relpath
+ *               is actually in a famfs file system.
+ */
+int
+__open_relpath(
+	const char *path,
+	const char *relpath,
+	int         read_only,
+	size_t     *size_out,
+	char       *mpt_out,
+	enum lock_opt lockopt,
+	int         no_fscheck)
+{
+	int openmode = (read_only) ? O_RDONLY : O_RDWR;
+	char *rpath;
+	struct stat st;
+	int rc, fd;
+
+	/*
+	 * If path does not exist, ascend canonically until we find something that does
+	 * exist, or until that remaining path string is too short, or until it looks like
+	 * we might be in an infinite loop
+	 */
+	rpath = find_real_parent_path(path);
+	if (!rpath)
+		return -1;
+
+	/*
+	 * At this point rpath does exist, and is a root-based path. Continue to ascend as
+	 * necessary to find the mount point which contains the meta files
+	 */
+	while (1) {
+		char fullpath[PATH_MAX] = {0};
+
+		rc = stat(rpath, &st);
+		if (rc < 0)
+			goto next;
+		if ((st.st_mode & S_IFMT) == S_IFDIR) {
+			/* It's a dir; does it have <relpath> under it? */
+			snprintf(fullpath, PATH_MAX - 1, "%s/%s", rpath, relpath);
+			rc = stat(fullpath, &st);
+			if ((rc == 0) && ((st.st_mode & S_IFMT) == S_IFREG)) {
+				/* We found it. */
+				if (size_out)
+					*size_out = st.st_size;
+				if (mpt_out)
+					strncpy(mpt_out, rpath, PATH_MAX - 1);
+				fd = open(fullpath, openmode, 0);
+				free(rpath);
+
+				if (lockopt) {
+					int operation = LOCK_EX;
+					u64 start = FAMFS_STAT_NOW();
+
+					if (lockopt == NON_BLOCKING_LOCK)
+						operation |= LOCK_NB;
+					rc = flock(fd, operation);
+					FAMFS_STAT_TIME(log_lock, start);
+					if (rc) {
+						fprintf(stderr, "%s: failed to get lock on %s\n",
+							__func__, fullpath);
+						close(fd);
+						return -1;
+					}
+				}
+				/* Check whether the file we found is actually in famfs;
+				 * Unit tests can disable this check but production code
+				 * should not.
+				 */
+				if (!no_fscheck && __file_not_famfs(fd)) {
+					fprintf(stderr,
+						"%s: found file %s but it is not in famfs\n",
+						__func__, fullpath);
+					close(fd);
+					return -1;
+				}
+				return fd;
+			}
+			/* no */
+		}
+
+next:
+		/* Pop up one level; exit if we're at the top */
+		rpath = dirname(rpath);
+		if (strcmp(rpath, "/") == 0)
+			break;
+	}
+	free(rpath);
+	return -1;
+}
+
+
+/**
+ * open_log_file(path)
+ *
+ * @path - any path within a famfs file system (from mount pt on down)
+ *
+ * This will traverse upward from path, looking for a directory containing a .meta/.log
+ * If found, it opens the log.
+ */
+static int
+__open_log_file(
+	const char *path,
+	int         read_only,
+	size_t     *sizep,
+	char       *mpt_out,
+	enum lock_opt lockopt)
+{
+	return __open_relpath(path, LOG_FILE_RELPATH, read_only, sizep, mpt_out, lockopt, 0);
+}
+
+int
+static open_log_file_read_only(
+	const char *path,
+	size_t     *sizep,
+	char       *mpt_out,
+	enum lock_opt lockopt)
+{
+	return __open_log_file(path, 1, sizep, mpt_out, lockopt);
+}
+
+static int
+open_log_file_writable(
+	const char *path,
+	size_t     *sizep,
+	char       *mpt_out,
+	enum lock_opt lockopt)
+{
+	return __open_log_file(path, 0, sizep, mpt_out, lockopt);
+}
+
+static int
+__open_superblock_file(
+	const char *path,
+	int         read_only,
+	size_t     *sizep,
+	char       *mpt_out)
+{
+	/* No need to plumb locking for the superblock; use the log for locking */
+	return __open_relpath(path, SB_FILE_RELPATH, read_only, sizep, mpt_out, NO_LOCK, 0);
+}
+
+static int
+open_superblock_file_read_only(
+	const char *path,
+	size_t     *sizep,
+	char       *mpt_out)
+{
+	return __open_superblock_file(path, 1, sizep, mpt_out);
+}
+
+static struct famfs_superblock *
+famfs_map_superblock_by_path(
+	const char *path,
+	int         read_only)
+{
+	struct famfs_superblock *sb;
+	int prot = (read_only) ? PROT_READ : PROT_READ | PROT_WRITE;
+	size_t sb_size;
+	void *addr;
+	int fd;
+
+	fd = __open_superblock_file(path, read_only,
+				    &sb_size, NULL);
+	if (fd < 0) {
+		fprintf(stderr, "%s: failed to open superblock file %s for filesystem %s\n",
+			__func__, read_only ? "read-only" : "writable",	path);
+		return NULL;
+	}
+	addr = mmap(0, sb_size, prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: Failed to mmap superblock file %s\n", __func__, path);
+		return NULL;
+	}
+	sb = (struct famfs_superblock *)addr;
+	invalidate_processor_cache(sb, sb_size);
+	return sb;
+}
+
+static struct famfs_log *
+famfs_map_log_by_path(
+	const char *path,
+	int         read_only,
+	enum lock_opt lockopt)
+{
+	struct famfs_log *logp;
+	int prot = (read_only) ? PROT_READ : PROT_READ | PROT_WRITE;
+	size_t log_size;
+	void *addr;
+	int fd;
+
+	fd = __open_log_file(path, 1 /* read only */, &log_size, NULL, lockopt);
+	if (fd < 0) {
+		fprintf(stderr, "%s: failed to open log file for filesystem %s\n",
+			__func__, path);
+		return NULL;
+	}
+	addr = mmap(0, log_size, prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: Failed to mmap log file %s\n", __func__, path);
+		return NULL;
+	}
+	logp = (struct famfs_log *)addr;
+	if (log_size != logp->famfs_log_len) {
+		fprintf(stderr, "%s: log file length is invalid (%lld / %lld)\n",
+			__func__, (s64)log_size, logp->famfs_log_len);
+		munmap(addr, log_size);
+		return NULL;
+	}
+	invalidate_processor_cache(logp, log_size);
+	return logp;
+}
+
+int
+famfs_fsck(
+	const char *path,
+	int use_mmap,
+	int human,
+	int nthreads,
+	int verbose)
+{
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	struct stat st;
+	int malloc_sb_log = 0;
+	size_t size;
+	int rc;
+
+	assert(path);
+	assert(strlen(path) > 1);
+
+	rc = stat(path, &st);
+	if (rc < 0) {
+		fprintf(stderr, "%s: failed to stat path %s (%s)\n",
+			__func__, path, strerror(errno));
+		return -errno;
+	}
+
+	/*
+	 * Lots of options here;
+	 * * If a dax device (either pmem or /dev/dax) we'll fsck that - but only if the fs
+	 *   is not currently mounted.
+	 * * If any file path from the mount point on down in a mounted famfs file system is
+	 *   specified, we will find the superblock and log files and fsck the mounted
+	 *   file system.
+	 */
+	switch (st.st_mode & S_IFMT) {
+	case S_IFBLK:
+	case S_IFCHR: {
+		char *mpt;
+		/* Check if there is a mounted famfs file system on this device;
+		 * fail if so - if mounted, have to fsck by mount pt rather than device
+		 */
+		mpt = famfs_get_mpt_by_dev(path);
+		if (mpt) {
+			fprintf(stderr, "%s: error - cannot fsck by device (%s) when mounted\n",
+				__func__, path);
+			free(mpt);
+			return -EBUSY;
+		}
+		/* If it's a device, we'll try to mmap superblock and log from the device */
+		rc = famfs_get_device_size(path, &size, NULL);
+		if (rc < 0)
+			return -1;
+
+		rc = famfs_mmap_superblock_and_log_raw(path, &sb, &logp, 1 /* read-only */);
+		break;
+	}
+	case S_IFREG:
+	case S_IFDIR: {
+		/*
+		 * More options: default is to read the superblock and log into local buffers
+		 * (which is useful to spot check that posix read is not broken). But if the
+		 * use_mmap open is provided, we will mmap the superblock and logs files
+		 * rather than reading them into a local buffer.
+		 */
+		if (use_mmap) {
+			/* If it's a file or directory, we'll try to mmap the sb and
+			 * log from their files
+			 *
+			 * Note that this tends to fail
+			 */
+			sb =   famfs_map_superblock_by_path(path, 1 /* read only */);
+			if (!sb) {
+				fprintf(stderr, "%s: failed to map superblock from file %s\n",
+					__func__, path);
+				return -1;
+			}
+
+			logp = famfs_map_log_by_path(path, 1 /* read only */, NO_LOCK);
+			if (!logp) {
+				fprintf(stderr, "%s: failed to map log from file %s\n",
+					__func__, path);
+				return -1;
+			}
+			break;
+		} else {
+			int sfd;
+			int lfd;
+			char *buf;
+			int resid;
+			int total = 0;
+
+			malloc_sb_log = 1;
+
+			sfd = open_superblock_file_read_only(path, NULL, NULL);
+			if (sfd < 0) {
+				fprintf(stderr, "%s: failed to open superblock file\n", __func__);
+				return -1;
+			}
+			/* Over-allocate so we can read 2MiB multiple */
+			sb = calloc(1, FAMFS_LOG_OFFSET);
+			assert(sb);
+
+			/* Read a copy of the superblock */
+			rc = read(sfd, sb, FAMFS_LOG_OFFSET); /* 2MiB multiple */
+			if (rc < 0) {
+				free(sb);
+				close(sfd);
+				fprintf(stderr, "%s: error %d reading superblock file\n",
+					__func__, errno);
+				return -errno;
+			} else if (rc < sizeof(*sb)) {
+				free(sb);
+				close(sfd);
+				fprintf(stderr, "%s: error: short read of superblock %d/%ld\n",
+					__func__, rc, sizeof(*sb));
+				return -1;
+			}
+			close(sfd);
+
+			lfd = open_log_file_read_only(path, NULL, NULL, NO_LOCK);
+			if (lfd < 0) {
+				free(sb);
+				close(sfd);
+				fprintf(stderr, "%s: failed to open log file\n", __func__);
+				return -1;
+			}
+
+			logp = calloc(1, sb->ts_log_len);
+			assert(logp);
+
+			/* Read a copy of the log */
+			resid = sb->ts_log_len;
+			buf = (char *)logp;
+			do {
+				rc = read(lfd, &buf[total], resid);
+				if (rc < 0) {
+					free(sb);
+					free(logp);
+					close(lfd);
+					fprintf(stderr, "%s: error %d reading log file\n",
+						__func__, errno);
+					return -errno;
+				}
+				if (verbose)
+					printf("%s: read %d bytes of log\n", __func__, rc);
+
+				if (rc == 0) {
+					fprintf(stderr, "%s: failed to read the full log\n",
+						__func__);
+					rc = -1;
+					close(lfd);
+					goto err_out;
+				}
+				resid -= rc;
+				total += rc;
+			} while (resid > 0);
+
+			close(lfd);
+		}
+	}
+		break;
+	default:
+		fprintf(stderr, "invalid path or dax device: %s\n", path);
+		return -EINVAL;
+	}
+
+	if (famfs_check_super(sb)) {
+		fprintf(stderr, "%s: no valid famfs superblock on device %s\n", __func__, path);
+		return -1;
+	}
+	rc = famfs_fsck_scan(sb, logp, human, nthreads, verbose);
+	if (malloc_sb_log) {
+		free(sb);
+		free(logp);
+	}
+err_out:
+	return rc;
+}
+
+/**
+ * famfs_validate_superblock_by_path()
+ *
+ * @path
+ *
+ * Validate the superblock and return the dax device size, or -1 if sb or size invalid
+ */
+static ssize_t
+famfs_validate_superblock_by_path(const char *path)
+{
+	int sfd;
+	void *addr;
+	size_t sb_size;
+	ssize_t daxdevsize;
+	struct famfs_superblock *sb;
+
+	sfd = open_superblock_file_read_only(path, &sb_size, NULL);
+	if (sfd < 0)
+		return sfd;
+
+	addr = mmap(0, sb_size, PROT_READ, MAP_SHARED, sfd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: Failed to mmap superblock file\n", __func__);
+		close(sfd);
+		return -1;
+	}
+	sb = (struct famfs_superblock *)addr;
+	invalidate_processor_cache(sb, sb_size);
+
+	if (famfs_check_super(sb)) {
+		fprintf(stderr, "%s: invalid superblock\n", __func__);
+		return -1;
+	}
+	daxdevsize = sb->ts_devlist[0].dd_size;
+	munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+	close(sfd);
+	return daxdevsize;
+}
+
+/**
+ * put_sb_log_into_bitmap()
+ *
+ * The two files that are not in the log are the superblock and the log. So these
+ * files need to be manually added to the allocation bitmap. This function does that.
+ */
+static inline void
+put_sb_log_into_bitmap(u8 *bitmap)
+{
+	int i;
+
+	/* Mark superblock and log as allocated */
+	mu_bitmap_set(bitmap, 0);
+
+	for (i = 1; i < ((FAMFS_LOG_OFFSET + FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT); i++)
+		mu_bitmap_set(bitmap, i);
+}
+
+/**
+ * famfs_build_bitmap()
+ *
+ * XXX: this is only aware of the first daxdev in the superblock's list
+ * @logp
+ * @size_in          - total size of allocation space in bytes
+ * @bitmap_nbits_out - output: size of the bitmap
+ * @alloc_errors_out - output: number of times a file referenced a bit that was already set
+ * @fsize_total_out  - output: if ptr non-null, this is the sum of the file sizes
+ * @alloc_sum_out    - output: if ptr non-null, this is the sum of all allocation sizes
+ *                    (excluding double-allocations; space amplification is
+ *                     @alloc_sum / @size_total provided there are no double allocations,
+ *                     b/c those will increase size_total but not alloc_sum)
+ * @log_stats_out    - Optional pointer to struct log_stats to be copied out
+ * @verbose
+ */
+/* XXX: should get log size from superblock */
+/**
+ * famfs_bitmap_add_log_entries()
+ *
+ * Mark the extents of the log entries that @it returns as allocated in @bitmap
+ *
+ * @it            - iterator over the entries (the iterator checks their seqnums, and
+ *                  their crcs if it has FAMFS_LOG_ITER_VALIDATE)
+ * @errors_out    - incremented for each allocation unit that was already allocated, and
+ *                  if the iteration stopped at a bad record
+ * @fsize_sum_out - incremented by the size of each logged file
+ * @alloc_sum_out - incremented by the space allocated (not counting collisions)
+ * @ls            - log stats to update
+ * @ext_hist      - if non-null, the extent sizes (bytes) are recorded here
+ */
+static void
+famfs_bitmap_add_log_entries(
+	u8                       *bitmap,
+	u64                       nbits,
+	struct famfs_log_iter    *it,
+	u64                      *errors_out,
+	u64                      *fsize_sum_out,
+	u64                      *alloc_sum_out,
+	struct famfs_log_stats   *ls,
+	struct mu_histogram      *ext_hist,
+	int                       verbose)
+{
+	const struct famfs_log_entry *le;
+	int j;
+	int rc;
+
+	while ((le = famfs_log_iter_next(it)) != NULL) {
+		ls->n_entries++;
+		if (it->in_ckpt)
+			ls->c_records++;
+
+		switch (le->famfs_log_entry_type) {
+		case FAMFS_LOG_FILE: {
+			const struct famfs_file_creation *fc = &le->famfs_fc;
+			const struct famfs_log_extent *ext = fc->famfs_ext_list;
+
+			ls->f_logged++;
+			*fsize_sum_out += fc->famfs_fc_size;
+			ls->f_extents += fc->famfs_nextents;
+			if (fc->famfs_nextents <= FAMFS_FC_MAX_EXTENTS)
+				ls->f_nextents[fc->famfs_nextents]++;
+			if (verbose > 1)
+				printf("%s: file=%s size=%lld\n", __func__,
+				       fc->famfs_relpath, fc->famfs_fc_size);
+
+			/* For each extent in this log entry, mark the bitmap as allocated */
+			for (j = 0; j < fc->famfs_nextents; j++) {
+				s64 page_num;
+				s64 np;
+				s64 k;
+
+				assert(!(ext[j].se.famfs_extent_offset % FAMFS_ALLOC_UNIT));
+				page_num = ext[j].se.famfs_extent_offset / FAMFS_ALLOC_UNIT;
+				np = (ext[j].se.famfs_extent_len + FAMFS_ALLOC_UNIT - 1)
+					/ FAMFS_ALLOC_UNIT;
+				if (ext_hist)
+					mu_hist_record(ext_hist, ext[j].se.famfs_extent_len);
+
+				for (k = page_num; k < (page_num + np); k++) {
+					if (k >= nbits) {
+						(*errors_out)++; /* extent is past end of device */
+						continue;
+					}
+					rc = mu_bitmap_test_and_set(bitmap, k);
+					if (rc == 0) {
+						(*errors_out)++; /* bit was already set */
+					} else {
+						/* Don't count double allocations */
+						*alloc_sum_out += FAMFS_ALLOC_UNIT;
+					}
+				}
+			}
+			break;
+		}
+		case FAMFS_LOG_MKDIR:
+			ls->d_logged++;
+			/* Ignore directory log entries - no space is used */
+			break;
+
+		case FAMFS_LOG_ACCESS:
+		default:
+			printf("%s: invalid log entry\n", __func__);
+			break;
+		}
+	}
+	if (it->err)
+		(*errors_out)++;
+	if (it->have_ck) {
+		ls->c_bytes = it->ck_bytes;
+		ls->c_nentries = it->ck.ck_nentries;
+	}
+}
+
+u8 *
+famfs_build_bitmap(const struct famfs_log   *logp,
+		   u64                       dev_size_in,
+		   u64                      *bitmap_nbits_out,
+		   u64                      *alloc_errors_out,
+		   u64                      *fsize_total_out,
+		   u64                      *alloc_sum_out,
+		   struct famfs_log_stats   *log_stats_out,
+		   int                       verbose)
+{
+	u64 start = FAMFS_STAT_NOW();
+	u64 nbits = (dev_size_in - FAMFS_SUPERBLOCK_SIZE - FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT;
+	u64 bitmap_nbytes = mu_bitmap_size(nbits);
+	u8 *bitmap = calloc(1, bitmap_nbytes);
+	struct famfs_log_stats ls = { 0 }; /* We collect a subset of stats collected by logplay */
+	struct famfs_log_iter it;
+	u64 errors = 0;
+	u64 alloc_sum = 0;
+	u64 fsize_sum  = 0;
+
+	if (verbose > 1)
+		printf("%s: dev_size %lld nbits %lld bitmap_nbytes %lld\n",
+		       __func__, dev_size_in, nbits, bitmap_nbytes);
+
+	if (!bitmap)
+		return NULL;
+
+	put_sb_log_into_bitmap(bitmap);
+
+	if (verbose > 1) {
+		printf("%s: superblock and log in bitmap:", __func__);
+		mu_print_bitmap(bitmap, nbits);
+	}
+
+	/* This loop is over all log entries; paths aren't needed */
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_NOPATHS);
+	famfs_bitmap_add_log_entries(bitmap, nbits, &it, &errors, &fsize_sum, &alloc_sum,
+				     &ls, NULL, verbose);
+
+	if (bitmap_nbits_out)
+		*bitmap_nbits_out = nbits;
+	if (alloc_errors_out)
+		*alloc_errors_out = errors;
+	if (fsize_total_out)
+		*fsize_total_out = fsize_sum;
+	if (alloc_sum_out)
+		*alloc_sum_out = alloc_sum;
+	if (log_stats_out)
+		memcpy(log_stats_out, &ls, sizeof(ls));
+	FAMFS_STAT_TIME(bitmap_build, start);
+	return bitmap;
+}
+
+/*
+ * fsck: parallel validation of the log
+ *
+ * The log is split into ranges of entries, one per thread. Each thread checks the crcs,
+ * seqnums and back links of its range and marks its extents in a bitmap of its own, so
+ * the threads share nothing. Collisions within a range are found as the bits are set;
+ * collisions between ranges are found when the bitmaps are merged, a word at a time
+ * (AND to count them, OR to combine).
+ *
+ * Records are variable length, so finding where the ranges start takes a walk along the
+ * record lengths. That only loads the first word of each record; the decoding and crcs
+ * are what the threads split.
+ */
+struct famfs_fsck_range {
+	const struct famfs_log *logp;
+	struct famfs_log_pos    first;
+	struct famfs_log_pos    last;     /* end of the range */
+	u64                     prev_len; /* length of the record before first */
+	u64                     nbits;
+	u8                     *bitmap;
+	u64                     errors;
+	u64                     fsize_sum;
+	u64                     alloc_sum;
+	struct famfs_log_stats  ls;
+	struct mu_histogram     ext_hist;
+	int                     err;      /* the range has a bad record */
+	int                     verbose;
+};
+
+static void
+famfs_fsck_range_worker(void *arg)
+{
+	struct famfs_fsck_range *r = arg;
+	struct famfs_log_iter it;
+
+	famfs_log_iter_init(&it, r->logp, &r->first,
+			    FAMFS_LOG_ITER_VALIDATE | FAMFS_LOG_ITER_NOPATHS);
+	it.end = r->last;
+	it.prev_len = r->prev_len;
+	famfs_bitmap_add_log_entries(r->bitmap, r->nbits, &it, &r->errors, &r->fsize_sum,
+				     &r->alloc_sum, &r->ls, &r->ext_hist, r->verbose);
+	r->err = (it.err != 0);
+}
+
+/*
+ * Split the log into (up to) @nranges ranges of about the same number of entries, and
+ * return how many there are. A checkpoint and its records stay in the first range (its
+ * iterator accounts for them). If a record length is bad, the rest of the log goes in
+ * the last range found, where the bad record will be reported.
+ */
+static int
+famfs_fsck_split_log(const struct famfs_log *logp, struct famfs_fsck_range *r, int nranges)
+{
+	const struct famfs_log_rec *lr;
+	struct famfs_log_entry le;
+	struct famfs_log_iter it;
+	u64 index, offset, prev = 0;
+	u64 min_first = 1;
+	u64 parent;
+	int n = 0;
+
+	famfs_log_iter_init(&it, logp, NULL, 0);
+	r[0].first.index = 0;
+	r[0].first.offset = 0;
+
+	if (it.end.index && !famfs_log_rec_decode(logp->famfs_log_data, it.end.offset, &le,
+						  &parent, 0, famfs_log_crc_alg(logp)) &&
+	    le.famfs_log_entry_type == FAMFS_LOG_CHECKPOINT)
+		min_first = 1 + le.famfs_ck.ck_nrecords;
+
+	for (index = 0, offset = 0; index < it.end.index && n + 1 < nranges; index++) {
+		u64 next = MAX(min_first, it.end.index * (n + 1) / nranges);
+
+		if (index == next && index > r[n].first.index) {
+			r[n].last.index = index;
+			r[n].last.offset = offset;
+			n++;
+			r[n].first.index = index;
+			r[n].first.offset = offset;
+			r[n].prev_len = prev;
+		}
+
+		lr = (const struct famfs_log_rec *)&logp->famfs_log_data[offset];
+		if (offset + sizeof(*lr) > it.end.offset || lr->lr_len < sizeof(*lr) ||
+		    lr->lr_len % FAMFS_LOG_REC_ALIGN || offset + lr->lr_len > it.end.offset)
+			break;
+		prev = lr->lr_len;
+		offset += lr->lr_len;
+	}
+	r[n].last = it.end;
+	return n + 1;
+}
+
+/**
+ * famfs_fsck_build_bitmap()
+ *
+ * Like famfs_build_bitmap(), but every record is validated (crc, seqnum and back link),
+ * the log is scanned by up to @nthreads threads, and the extent sizes are recorded in
+ * @ext_hist. A bad record ends the scan of its range; @bad_ranges_out counts those (and
+ * they're included in @alloc_errors_out, as with famfs_build_bitmap()).
+ *
+ * Return value: the bitmap, or NULL if out of memory
+ */
+static u8 *
+famfs_fsck_build_bitmap(const struct famfs_log   *logp,
+			u64                       dev_size_in,
+			int                       nthreads,
+			u64                      *bitmap_nbits_out,
+			u64                      *alloc_errors_out,
+			u64                      *fsize_total_out,
+			u64                      *alloc_sum_out,
+			struct famfs_log_stats   *ls,
+			struct mu_histogram      *ext_hist,
+			int                      *nranges_out,
+			int                      *bad_ranges_out,
+			int                       verbose)
+{
+	u64 start = FAMFS_STAT_NOW();
+	u64 nbits = (dev_size_in - FAMFS_SUPERBLOCK_SIZE - FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT;
+	u64 nbytes = mu_bitmap_size(nbits);
+	u64 nentries = __atomic_load_n(&logp->famfs_log_next_index, __ATOMIC_ACQUIRE);
+	struct famfs_fsck_range *r;
+	struct thpool *pool = NULL;
+	u8 *reserved = NULL;
+	u8 *bitmap = NULL;
+	int nranges;
+	u64 w, b;
+	int i, j;
+
+	nranges = MAX(1, MIN((u64)nthreads, nentries / FAMFS_FSCK_THREAD_ENTRIES));
+	r = calloc(nranges, sizeof(*r));
+	reserved = calloc(1, nbytes);
+	if (!r || !reserved)
+		goto out;
+	put_sb_log_into_bitmap(reserved);
+
+	nranges = famfs_fsck_split_log(logp, r, nranges);
+	for (i = 0; i < nranges; i++) {
+		r[i].logp = logp;
+		r[i].nbits = nbits;
+		r[i].verbose = verbose;
+		mu_hist_init(&r[i].ext_hist);
+		/* Each range's bitmap has the superblock and log, so it sees files that
+		 * collide with them
+		 */
+		r[i].bitmap = malloc(nbytes);
+		if (!r[i].bitmap)
+			goto out;
+		memcpy(r[i].bitmap, reserved, nbytes);
+	}
+	if (verbose > 1)
+		for (i = 0; i < nranges; i++)
+			printf("%s: range %d: entries %lld..%lld, offsets %lld..%lld\n", __func__,
+			       i, r[i].first.index, r[i].last.index,
+			       r[i].first.offset, r[i].last.offset);
+
+	if (nranges > 1)
+		pool = thpool_init(nranges, 0);
+	for (i = 0; i < nranges; i++) {
+		if (!pool || thpool_add_work(pool, famfs_fsck_range_worker, &r[i]))
+			famfs_fsck_range_worker(&r[i]);
+	}
+	if (pool) {
+		thpool_wait(pool);
+		thpool_destroy(pool);
+	}
+
+	/* Merge into the first range's bitmap. The superblock and log are in all of them,
+	 * so they aren't collisions.
+	 */
+	bitmap = r[0].bitmap;
+	r[0].bitmap = NULL;
+	*alloc_errors_out = r[0].errors;
+	*fsize_total_out = r[0].fsize_sum;
+	*alloc_sum_out = r[0].alloc_sum;
+	*ls = r[0].ls;
+	*bad_ranges_out = r[0].err;
+	mu_hist_merge(ext_hist, &r[0].ext_hist);
+	for (i = 1; i < nranges; i++) {
+		u64 collisions = 0;
+
+		for (w = 0; w < nbytes / sizeof(u64); w++) {
+			u64 acc, part, res;
+
+			memcpy(&acc, &bitmap[w * sizeof(u64)], sizeof(u64));
+			memcpy(&part, &r[i].bitmap[w * sizeof(u64)], sizeof(u64));
+			memcpy(&res, &reserved[w * sizeof(u64)], sizeof(u64));
+			collisions += __builtin_popcountll(acc & part & ~res);
+			acc |= part;
+			memcpy(&bitmap[w * sizeof(u64)], &acc, sizeof(u64));
+		}
+		for (b = w * sizeof(u64); b < nbytes; b++) {
+			collisions += __builtin_popcount(bitmap[b] & r[i].bitmap[b] & ~reserved[b]);
+			bitmap[b] |= r[i].bitmap[b];
+		}
+
+		*alloc_errors_out += r[i].errors + collisions;
+		*bad_ranges_out += r[i].err;
+		*fsize_total_out += r[i].fsize_sum;
+		*alloc_sum_out += r[i].alloc_sum - collisions * FAMFS_ALLOC_UNIT;
+		ls->n_entries += r[i].ls.n_entries;
+		ls->f_logged += r[i].ls.f_logged;
+		ls->d_logged += r[i].ls.d_logged;
+		ls->f_extents += r[i].ls.f_extents;
+		for (j = 0; j <= FAMFS_FC_MAX_EXTENTS; j++)
+			ls->f_nextents[j] += r[i].ls.f_nextents[j];
+		mu_hist_merge(ext_hist, &r[i].ext_hist);
+	}
+	*bitmap_nbits_out = nbits;
+	*nranges_out = nranges;
+	FAMFS_STAT_TIME(bitmap_build, start);
+
+out:
+	if (r) {
+		for (i = 0; i < nranges; i++)
+			free(r[i].bitmap);
+		free(r);
+	}
+	free(reserved);
+	return bitmap;
+}
+
+/*
+ * Allocation map cache
+ *
+ * Every command that allocates needs the allocation bitmap, and building it walks every
+ * extent of every entry in the log. On the master we keep the bitmap from the last
+ * allocating command in a local file, tagged with the log position it reflects. The next
+ * command validates the tag against the log and only adds the extents from entries that
+ * were logged since. If anything doesn't match, the bitmap is rebuilt from the log.
+ *
+ * The log is the authority: fsck never uses the cache.
+ */
+int famfs_alloc_cache_enable = 1;
+
+#define FAMFS_ALLOC_CACHE_MAGIC 0x6568636163636c61ULL /* "allccache" */
+
+struct famfs_alloc_cache_hdr {
+	u64           ac_magic;
+	uuid_le       ac_fs_uuid;
+	u64           ac_devsize;
+	u64           ac_nbits;
+	unsigned long ac_log_crc;         /* famfs_log_crc of the log header */
+	u64           ac_log_epoch;
+	u64           ac_next_index;      /* Bitmap reflects log entries below this index */
+	u64           ac_next_offset;
+	u64           ac_last_offset;     /* Offset and crc of record ac_next_index - 1 */
+	u32           ac_last_rec_crc;
+	u64           ac_next_fit;        /* Next-fit allocation cursor */
+	unsigned long ac_bitmap_crc;
+	unsigned long ac_crc;             /* crc of this struct, up to this field */
+};
+
+static unsigned long
+famfs_gen_alloc_cache_crc(const struct famfs_alloc_cache_hdr *ac)
+{
+	unsigned long crc = crc32(0L, Z_NULL, 0);
+
+	return crc32(crc, (const unsigned char *)ac,
+		     offsetof(struct famfs_alloc_cache_hdr, ac_crc));
+}
+
+static void
+famfs_alloc_cache_path(const char *mpt, char *path_out, size_t len)
+{
+	unsigned long crc = crc32(0L, Z_NULL, 0);
+
+	crc = crc32(crc, (const unsigned char *)mpt, strlen(mpt));
+	snprintf(path_out, len, "%s/alloc.%08lx", SYS_UUID_DIR, crc);
+}
+
+/**
+ * famfs_alloc_cache_load()
+ *
+ * Load the cached bitmap for this file system and bring it up to date with the log
+ *
+ * Returns: the bitmap (and sets lp->nbits), or NULL if there is no valid cache
+ */
+static u8 *
+famfs_alloc_cache_load(struct famfs_locked_log *lp, int verbose)
+{
+	const struct famfs_log *logp = lp->logp;
+	struct famfs_log_stats ls = { 0 };
+	struct famfs_alloc_cache_hdr ac;
+	struct famfs_log_iter it;
+	struct famfs_log_pos pos;
+	u64 errors = 0, fsize_sum = 0, alloc_sum = 0;
+	u8 *bitmap = NULL;
+	char path[PATH_MAX];
+	u64 nbytes;
+	ssize_t rc;
+	int fd;
+
+	famfs_alloc_cache_path(lp->mpt, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	rc = read(fd, &ac, sizeof(ac));
+	if (rc != sizeof(ac))
+		goto stale;
+
+	if (ac.ac_magic != FAMFS_ALLOC_CACHE_MAGIC ||
+	    ac.ac_crc != famfs_gen_alloc_cache_crc(&ac) ||
+	    memcmp(&ac.ac_fs_uuid, &lp->fs_uuid, sizeof(ac.ac_fs_uuid)) ||
+	    ac.ac_devsize != lp->devsize ||
+	    ac.ac_nbits != (lp->devsize - FAMFS_SUPERBLOCK_SIZE - FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT ||
+	    ac.ac_log_crc != logp->famfs_log_crc ||
+	    ac.ac_log_epoch != logp->famfs_log_epoch)
+		goto stale;
+
+	/* The last record the bitmap reflects must still be in the log, unchanged */
+	pos.index = ac.ac_next_index;
+	pos.offset = ac.ac_next_offset;
+	if (!famfs_log_pos_valid(logp, &pos, ac.ac_last_offset, ac.ac_last_rec_crc))
+		goto stale;
+
+	nbytes = mu_bitmap_size(ac.ac_nbits);
+	bitmap = malloc(nbytes);
+	if (!bitmap)
+		goto stale;
+
+	rc = read(fd, bitmap, nbytes);
+	if (rc != nbytes ||
+	    ac.ac_bitmap_crc != crc32(crc32(0L, Z_NULL, 0), bitmap, nbytes))
+		goto stale;
+
+	close(fd);
+
+	/* Catch up with entries that were logged after the cache was saved */
+	famfs_log_iter_init(&it, logp, &pos, FAMFS_LOG_ITER_NOPATHS);
+	famfs_bitmap_add_log_entries(bitmap, ac.ac_nbits, &it, &errors, &fsize_sum,
+				     &alloc_sum, &ls, NULL, verbose);
+	if (verbose)
+		printf("%s: using cached bitmap at log index %lld (+%lld entries)\n",
+		       __func__, ac.ac_next_index, ls.n_entries);
+
+	lp->nbits = ac.ac_nbits;
+	lp->next_fit = ac.ac_next_fit;
+	return bitmap;
+
+stale:
+	if (verbose)
+		printf("%s: allocation cache %s is not valid; rebuilding bitmap\n",
+		       __func__, path);
+	free(bitmap);
+	close(fd);
+	return NULL;
+}
+
+/**
+ * famfs_alloc_cache_save()
+ *
+ * Save the bitmap, which must reflect exactly the current contents of the log
+ * (allocations that were not logged must have been freed). Failing to save is
+ * not an error; the next command just rebuilds the bitmap.
+ */
+static int
+famfs_alloc_cache_save(struct famfs_locked_log *lp, int verbose)
+{
+	const struct famfs_log *logp = lp->logp;
+	struct famfs_alloc_cache_hdr ac = { 0 };
+	u64 nbytes = mu_bitmap_size(lp->nbits);
+	char tmppath[PATH_MAX + 8];
+	char path[PATH_MAX];
+	struct stat st;
+	ssize_t rc;
+	int fd;
+
+	/* Don't trust (or fault on) a log file that has been truncated out from under us */
+	if (fstat(lp->lfd, &st) || st.st_size < FAMFS_LOG_LEN)
+		return -EINVAL;
+
+	ac.ac_magic = FAMFS_ALLOC_CACHE_MAGIC;
+	memcpy(&ac.ac_fs_uuid, &lp->fs_uuid, sizeof(ac.ac_fs_uuid));
+	ac.ac_devsize = lp->devsize;
+	ac.ac_nbits = lp->nbits;
+	ac.ac_log_crc = logp->famfs_log_crc;
+	ac.ac_log_epoch = logp->famfs_log_epoch;
+	ac.ac_next_index = logp->famfs_log_next_index;
+	ac.ac_next_offset = logp->famfs_log_next_offset;
+	if (ac.ac_next_index > 0) {
+		const struct famfs_log_rec *lr = (const struct famfs_log_rec *)
+			&logp->famfs_log_data[logp->famfs_log_last_offset];
+
+		ac.ac_last_offset = logp->famfs_log_last_offset;
+		ac.ac_last_rec_crc = lr->lr_crc;
+	}
+	ac.ac_next_fit = lp->next_fit;
+	ac.ac_bitmap_crc = crc32(crc32(0L, Z_NULL, 0), lp->bitmap, nbytes);
+	ac.ac_crc = famfs_gen_alloc_cache_crc(&ac);
+
+	if (mkdir(SYS_UUID_DIR, 0755) && errno != EEXIST)
+		return -errno;
+
+	famfs_alloc_cache_path(lp->mpt, path, sizeof(path));
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		if (verbose)
+			fprintf(stderr, "%s: unable to create %s (errno %d)\n",
+				__func__, tmppath, errno);
+		return -errno;
+	}
+	rc = write(fd, &ac, sizeof(ac));
+	if (rc == sizeof(ac))
+		rc = write(fd, lp->bitmap, nbytes);
+	close(fd);
+	if (rc != nbytes) {
+		unlink(tmppath);
+		return -EIO;
+	}
+	if (rename(tmppath, path)) {
+		unlink(tmppath);
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Allocation policies
+ *
+ * Files are allocated in FAMFS_ALLOC_UNIT bits. Each policy decides where a file's
+ * extent(s) go; when no single free run is big enough, a file is split across up to
+ * FAMFS_ALLOC_MAX_EXTENTS extents, taken from the largest free runs first.
+ */
+static const char *famfs_alloc_policy_names[] = {
+	[FAMFS_ALLOC_FIRST_FIT] = "first",
+	[FAMFS_ALLOC_BEST_FIT]  = "best",
+	[FAMFS_ALLOC_NEXT_FIT]  = "next",
+	[FAMFS_ALLOC_STRIPE]    = "stripe",
+};
+
+/**
+ * famfs_alloc_policy_from_name()
+ *
+ * Returns: an enum famfs_alloc_policy, or -EINVAL if @name is not a policy
+ */
+int
+famfs_alloc_policy_from_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < FAMFS_ALLOC_NPOLICIES; i++) {
+		if (!strcmp(name, famfs_alloc_policy_names[i]))
+			return i;
+	}
+	return -EINVAL;
+}
+
+const char *
+famfs_alloc_policy_name(enum famfs_alloc_policy policy)
+{
+	if (policy < 0 || policy >= FAMFS_ALLOC_NPOLICIES)
+		return "invalid";
+	return famfs_alloc_policy_names[policy];
+}
+
+/**
+ * bitmap_find_fit()
+ *
+ * Find the first free run of at least @alloc_bits bits within [@start, @end)
+ *
+ * Return value: the first bit of the run, or -1
+ */
+static s64
+bitmap_find_fit(const u8 *bitmap,
+		u64 start,
+		u64 end,
+		u64 alloc_bits)
+{
+	u64 nruns = 0;
+	s64 found = -1;
+	u64 i = start;
+	u64 j;
+
+	while (i < end) {
+		/* Skip whole runs of allocated bits */
+		i = mu_bitmap_find_next_zero(bitmap, end, i);
+		if (i >= end)
+			break;
+
+		nruns++;
+		if (alloc_bits > end - i) /* Remaining space is not enough */
+			break;
+
+		/* Is [i, i + alloc_bits) clear? If not, j is the first set bit in the way,
+		 * and no run starting before j can fit either.
+		 */
+		j = mu_bitmap_find_next_set(bitmap, i + alloc_bits, i);
+		if (j == i + alloc_bits) {
+			found = i;
+			break;
+		}
+		i = j;
+	}
+	FAMFS_STAT_ADD(alloc_search_runs, nruns);
+	return found;
+}
+
+/**
+ * bitmap_find_best_fit()
+ *
+ * Find the smallest free run that holds @alloc_bits bits (the lowest one, if there's a tie)
+ *
+ * Return value: the first bit of the run, or -1
+ */
+static s64
+bitmap_find_best_fit(const u8 *bitmap,
+		     u64 nbits,
+		     u64 alloc_bits)
+{
+	u64 best_len = 0;
+	u64 nruns = 0;
+	s64 best = -1;
+	u64 i = 0;
+	u64 len;
+
+	while (i < nbits) {
+		i = mu_bitmap_find_next_zero(bitmap, nbits, i);
+		if (i >= nbits)
+			break;
+
+		nruns++;
+		len = mu_bitmap_find_next_set(bitmap, nbits, i) - i;
+		if (len >= alloc_bits && (best < 0 || len < best_len)) {
+			best = i;
+			best_len = len;
+			if (len == alloc_bits)
+				break; /* Can't do better than exact */
+		}
+		i += len;
+	}
+	FAMFS_STAT_ADD(alloc_search_runs, nruns);
+	return best;
+}
+
+/**
+ * bitmap_find_largest_runs()
+ *
+ * Find the @max largest free runs, largest first
+ *
+ * Return value: the number of runs found (<= @max)
+ */
+static int
+bitmap_find_largest_runs(const u8 *bitmap,
+			 u64 nbits,
+			 int max,
+			 u64 *run_start,
+			 u64 *run_len)
+{
+	u64 nseen = 0;
+	int nruns = 0;
+	u64 i = 0;
+	u64 len;
+	int k;
+
+	while (i < nbits) {
+		i = mu_bitmap_find_next_zero(bitmap, nbits, i);
+		if (i >= nbits)
+			break;
+
+		nseen++;
+		len = mu_bitmap_find_next_set(bitmap, nbits, i) - i;
+
+		/* Insertion into the (short) sorted list of runs */
+		for (k = nruns; k > 0 && run_len[k - 1] < len; k--) {
+			if (k < max) {
+				run_start[k] = run_start[k - 1];
+				run_len[k]   = run_len[k - 1];
+			}
+		}
+		if (k < max) {
+			run_start[k] = i;
+			run_len[k]   = len;
+			if (nruns < max)
+				nruns++;
+		}
+		i += len;
+	}
+	FAMFS_STAT_ADD(alloc_search_runs, nseen);
+	return nruns;
+}
+
+/**
+ * bitmap_alloc_extents()
+ *
+ * Allocate @alloc_bits bits from @bitmap, in up to @max_extents runs, according to @policy
+ *
+ * @cursor - next-fit position; updated on success
+ *
+ * Return value: the number of extents (bit offsets and lengths in @ext_start/@ext_len),
+ *               or -1 if the space is not available
+ */
+int
+bitmap_alloc_extents(u8 *bitmap,
+		     u64 nbits,
+		     u64 alloc_bits,
+		     enum famfs_alloc_policy policy,
+		     u64 *cursor,
+		     int max_extents,
+		     u64 *ext_start,
+		     u64 *ext_len)
+{
+	u64 run_start[FAMFS_ALLOC_MAX_EXTENTS];
+	u64 run_len[FAMFS_ALLOC_MAX_EXTENTS];
+	u64 remainder;
+	int nruns;
+	s64 bit = -1;
+	int n = 0;
+	int i;
+
+	assert(max_extents >= 1 && max_extents <= FAMFS_ALLOC_MAX_EXTENTS);
+
+	switch (policy) {
+	case FAMFS_ALLOC_STRIPE:
+		if (max_extents > 1 && alloc_bits > 1) {
+			u64 nstripes = MIN((u64)max_extents, alloc_bits);
+			u64 stripe_bits = (alloc_bits + nstripes - 1) / nstripes;
+
+			/* Equal-sized extents, each placed first-fit */
+			for (remainder = alloc_bits; remainder > 0; n++) {
+				u64 len = MIN(stripe_bits, remainder);
+
+				bit = bitmap_find_fit(bitmap, 0, nbits, len);
+				if (bit < 0)
+					goto undo;
+				mu_bitmap_set_range(bitmap, bit, len);
+				ext_start[n] = bit;
+				ext_len[n] = len;
+				remainder -= len;
+			}
+			return n;
+		}
+		bit = bitmap_find_fit(bitmap, 0, nbits, alloc_bits);
+		break;
+	case FAMFS_ALLOC_BEST_FIT:
+		bit = bitmap_find_best_fit(bitmap, nbits, alloc_bits);
+		break;
+	case FAMFS_ALLOC_NEXT_FIT:
+		if (*cursor < nbits)
+			bit = bitmap_find_fit(bitmap, *cursor, nbits, alloc_bits);
+		if (bit < 0)
+			bit = bitmap_find_fit(bitmap, 0, nbits, alloc_bits);
+		break;
+	case FAMFS_ALLOC_FIRST_FIT:
+	default:
+		bit = bitmap_find_fit(bitmap, 0, nbits, alloc_bits);
+		break;
+	}
+
+	if (bit >= 0) {
+		mu_bitmap_set_range(bitmap, bit, alloc_bits);
+		ext_start[0] = bit;
+		ext_len[0] = alloc_bits;
+		*cursor = bit + alloc_bits;
+		return 1;
+	}
+
+	/* No single run is big enough; split across the largest runs */
+	if (max_extents == 1)
+		return -1;
+
+	nruns = bitmap_find_largest_runs(bitmap, nbits, max_extents, run_start, run_len);
+	for (i = 0, remainder = alloc_bits; i < nruns && remainder > 0; i++, n++) {
+		u64 len = MIN(run_len[i], remainder);
+
+		mu_bitmap_set_range(bitmap, run_start[i], len);
+		ext_start[n] = run_start[i];
+		ext_len[n] = len;
+		remainder -= len;
+	}
+	if (remainder == 0) {
+		*cursor = ext_start[n - 1] + ext_len[n - 1];
+		return n;
+	}
+
+undo:
+	for (i = 0; i < n; i++)
+		mu_bitmap_clear_range(bitmap, ext_start[i], ext_len[i]);
+	return -1;
+}
+
+/**
+ * famfs_log_cursor_rebuild()
+ *
+ * A master that died in the middle of a commit left the generation odd, and possibly
+ * only some of the cursor fields stored (the offsets are stored before the index and
+ * seqnum). None of them can be trusted, so the cursor is rebuilt from the records: the
+ * records of a commit are written back before its cursor update begins, so the commit
+ * that was interrupted is complete in the log. Walk the log from the start, while each
+ * record passes its crc and continues the sequence and the back links. The caller holds
+ * the log lock.
+ */
+static void
+famfs_log_cursor_rebuild(struct famfs_log *logp)
+{
+	const struct famfs_log_rec *lr;
+	struct famfs_log_entry le;
+	u64 offset = 0;
+	u64 last = 0;
+	u64 index = 0;
+	u64 parent;
+	u16 prev = 0;
+
+	while (offset < logp->famfs_log_data_len) {
+		lr = (const struct famfs_log_rec *)&logp->famfs_log_data[offset];
+		if (famfs_log_rec_decode(&logp->famfs_log_data[offset],
+					 logp->famfs_log_data_len - offset, &le, &parent, 1,
+					 famfs_log_crc_alg(logp)) ||
+		    lr->lr_seqnum != (u32)index || lr->lr_prev != prev)
+			break;
+		prev = lr->lr_len;
+		last = offset;
+		offset += lr->lr_len;
+		index++;
+	}
+
+	fprintf(stderr, "%s: completing an interrupted log commit: %lld entries, "
+		"%lld bytes (the cursor said %lld entries, %lld bytes)\n", __func__,
+		index, offset, logp->famfs_log_next_index, logp->famfs_log_next_offset);
+	logp->famfs_log_next_offset = offset;
+	logp->famfs_log_last_offset = last;
+	logp->famfs_log_next_index = index;
+	logp->famfs_log_next_seqnum = index;
+	famfs_log_cursor_end(logp);
+	writeback_processor_cache(&logp->famfs_log_next_seqnum, FAMFS_LOG_CURSOR_LEN);
+}
+
+/**
+ * famfs_log_txn_recover()
+ *
+ * A master that died in a transaction left records staged past the end of the log. The
+ * files and directories they describe were created (and mapped) locally, but their space
+ * was never published as allocated, so it would be handed out again. Remove them, newest
+ * first, and clear the records. The caller holds the log lock.
+ *
+ * A transaction can fill the log, so nothing is kept per record: the records are walked
+ * back from the last one by their back links, and each path is resolved as it's reached.
+ *
+ * Return value: the number of staged records found
+ */
+static u64
+famfs_log_txn_recover(struct famfs_locked_log *lp, int verbose)
+{
+	struct famfs_log *logp = lp->logp;
+	const struct famfs_log_entry *le;
+	const struct famfs_log_rec *lr;
+	struct famfs_log_pos first;
+	struct famfs_log_iter it;
+	u64 offset, prev, cur, n, i;
+	char path[PATH_MAX];
+	const u8 *relpath;
+	int is_dir;
+
+	first.index = logp->famfs_log_next_index;
+	first.offset = logp->famfs_log_next_offset;
+	prev = (first.index) ? first.offset - logp->famfs_log_last_offset : 0;
+
+	/* Cheap checks first: the headers of staged records continue the log's sequence
+	 * and back links
+	 */
+	offset = first.offset;
+	for (n = 0; offset + sizeof(*lr) <= logp->famfs_log_data_len; n++) {
+		lr = (const struct famfs_log_rec *)&logp->famfs_log_data[offset];
+		if (lr->lr_seqnum != (u32)(logp->famfs_log_next_seqnum + n) ||
+		    lr->lr_prev != prev || lr->lr_len < sizeof(*lr) ||
+		    lr->lr_len % FAMFS_LOG_REC_ALIGN ||
+		    offset + lr->lr_len > logp->famfs_log_data_len)
+			break;
+		prev = lr->lr_len;
+		offset += lr->lr_len;
+	}
+	if (!n)
+		return 0;
+
+	fprintf(stderr, "%s: removing %llu entries of an uncommitted log transaction\n",
+		__func__, n);
+
+	/* One record at a time, newest first, so a directory is emptied before it goes.
+	 * Parents are resolved back from each record, within the staged end of the log.
+	 */
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+	it.end.index = first.index + n;
+	it.end.offset = offset;
+	cur = offset - prev;
+	for (i = n; i-- > 0; cur -= lr->lr_prev) {
+		lr = (const struct famfs_log_rec *)&logp->famfs_log_data[cur];
+		it.pos.index = first.index + i;
+		it.pos.offset = cur;
+		it.prev_len = 0; /* The back links were checked above */
+		le = famfs_log_iter_next(&it);
+		if (!le)
+			continue;
+
+		is_dir = (le->famfs_log_entry_type == FAMFS_LOG_MKDIR);
+		relpath = (is_dir) ? le->famfs_md.famfs_relpath : le->famfs_fc.famfs_relpath;
+		if (snprintf(path, sizeof(path), "%s/%s", lp->mpt, relpath) >= PATH_MAX) {
+			fprintf(stderr, "%s: path too long: %s\n", __func__, relpath);
+			continue;
+		}
+		if (verbose)
+			printf("%s: removing %s\n", __func__, path);
+		if (((is_dir) ? rmdir(path) : unlink(path)) && errno != ENOENT)
+			fprintf(stderr, "%s: failed to remove %s (errno %d)\n",
+				__func__, path, errno);
+	}
+
+	/* So they can't be mistaken for staged records again */
+	memset(&logp->famfs_log_data[first.offset], 0, offset - first.offset);
+	flush_processor_cache(&logp->famfs_log_data[first.offset], offset - first.offset);
+	return n;
+}
+
+/**
+ * famfs_init_locked_log()
+ *
+ * @lp
+ * @fspath - the mount point full path, or any full path within a mounted famfs FS
+ */
+int
+famfs_init_locked_log(struct famfs_locked_log *lp,
+		      const char *fspath,
+		      int verbose)
+{
+	size_t log_size;
+	void *addr;
+	int role;
+	int rc;
+
+	memset(lp, 0, sizeof(*lp));
+
+	lp->devsize = famfs_validate_superblock_by_path(fspath);
+	if (lp->devsize < 0)
+		return -1;
+
+	/* famfs_get_role also validates the superblock */
+	role = famfs_get_role_by_path(fspath, &lp->fs_uuid);
+	if (role != FAMFS_MASTER) {
+		fprintf(stderr, "%s: Error not running on FAMFS_MASTER node for this FS\n",
+			__func__);
+		rc = -1;
+		goto err_out;
+	}
+
+	/* Log file */
+	lp->lfd = open_log_file_writable(fspath, &log_size, lp->mpt, BLOCKING_LOCK);
+	if (lp->lfd < 0) {
+		fprintf(stderr, "%s: Unable to open famfs log for writing\n", __func__);
+		/* If we can't open the log file for writing, don't allocate */
+		rc = lp->lfd;
+		goto err_out;
+	}
+
+	addr = mmap(0, log_size, PROT_READ | PROT_WRITE, MAP_SHARED, lp->lfd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: Failed to mmap log file\n", __func__);
+		rc = -1;
+		goto err_out;
+	}
+	lp->logp = (struct famfs_log *)addr;
+	lp->log_size = log_size;
+	invalidate_processor_cache(lp->logp, log_size);
+
+	/* A master that died in the middle of a commit left the generation odd, and
+	 * readers would wait for it. Both repairs walk the log data, so they need a log
+	 * header that can be trusted; a bad one is for the caller to report.
+	 */
+	if (famfs_validate_log_meta(lp->logp) || lp->logp->famfs_log_len > log_size)
+		return 0;
+	if (lp->logp->famfs_log_gen & 1)
+		famfs_log_cursor_rebuild(lp->logp);
+	famfs_log_txn_recover(lp, verbose);
+	return 0;
+
+err_out:
+	if (lp->lfd)
+		close(lp->lfd);
+	return rc;
+}
+
+/**
+ * famfs_alloc_extents()
+ *
+ * Allocate space for a file, according to lp->policy
+ *
+ * @lp      - locked log struct. Will perform bitmap build if no already done
+ * @size
+ * @ext     - extent list to fill in (offsets and lengths in bytes)
+ * @max_extents
+ * @verbose
+ *
+ * Return value: number of extents, or -1 if the space could not be allocated
+ */
+static int
+famfs_alloc_extents(struct famfs_locked_log    *lp,
+		    u64                         size,
+		    struct famfs_simple_extent *ext,
+		    int                         max_extents,
+		    int                         verbose)
+{
+	u64 alloc_bits = (size + FAMFS_ALLOC_UNIT - 1) /  FAMFS_ALLOC_UNIT;
+	u64 ext_start[FAMFS_ALLOC_MAX_EXTENTS];
+	u64 ext_len[FAMFS_ALLOC_MAX_EXTENTS];
+	int nextents;
+	u64 start;
+	int i;
+
+	if (!lp->bitmap && famfs_alloc_cache_enable)
+		lp->bitmap = famfs_alloc_cache_load(lp, verbose);
+
+	if (!lp->bitmap) {
+		/* Bitmap is needed and hasn't been built yet */
+		lp->bitmap = famfs_build_bitmap(lp->logp, lp->devsize, &lp->nbits,
+						NULL, NULL, NULL, NULL, verbose);
+		if (!lp->bitmap) {
+			fprintf(stderr, "%s: failed to allocate bitmap\n", __func__);
+			return -1;
+		}
+	}
+
+	start = FAMFS_STAT_NOW();
+	nextents = bitmap_alloc_extents(lp->bitmap, lp->nbits, alloc_bits, lp->policy,
+					&lp->next_fit, max_extents, ext_start, ext_len);
+	FAMFS_STAT_TIME(alloc, start);
+	if (nextents < 0) {
+		FAMFS_STAT_ADD(alloc_failures, 1);
+		fprintf(stderr, "%s: alloc failed\n", __func__);
+		return -1;
+	}
+
+	for (i = 0; i < nextents; i++) {
+		ext[i].famfs_extent_offset = ext_start[i] * FAMFS_ALLOC_UNIT;
+		ext[i].famfs_extent_len    = ext_len[i] * FAMFS_ALLOC_UNIT;
+		if (verbose > 1)
+			printf("%s: extent %d: offset 0x%llx len 0x%llx\n", __func__, i,
+			       ext[i].famfs_extent_offset, ext[i].famfs_extent_len);
+	}
+	return nextents;
+}
+
+
+int
+famfs_release_locked_log(struct famfs_locked_log *lp)
+{
+	int rc;
+
+	/* Anything still staged gets published before we drop the lock */
+	if (lp->txn_open || lp->txn_nstaged)
+		famfs_log_txn_commit(lp);
+
+	if (lp->bitmap) {
+		/* Save the bitmap while we still hold the log lock */
+		if (famfs_alloc_cache_enable)
+			famfs_alloc_cache_save(lp, 0);
+		free(lp->bitmap);
+	}
+	famfs_dir_index_free(lp->dirs);
+	lp->dirs = NULL;
+
+	assert(lp->lfd > 0);
+	rc = flock(lp->lfd, LOCK_UN);
+	if (rc)
+		fprintf(stderr, "%s: unlock returned an error\n", __func__);
+
+	close(lp->lfd);
+	return rc;
+}
+
+/*
+ * Log compaction
+ *
+ * Every creation ever logged stays in the log, so it eventually fills up, and playing it
+ * gets slower the longer a file system lives. Compaction rewrites the log as a checkpoint
+ * record followed by one record per file and directory, re-encoded so their parent
+ * references point into the new log, and numbered from 0 again. The log continues after
+ * them. Each rewrite bumps the log epoch, so positions saved against the old log (by
+ * logplay and the allocation cache) are recognized as stale.
+ *
+ * The log is rewritten in place, so this must only be done while the file system is
+ * quiesced: the log lock keeps other writers out, but clients must not be playing the log
+ * while it is compacted.
+ */
+
+/**
+ * famfs_log_compact()
+ *
+ * Replace the contents of the log with a checkpoint (see above)
+ *
+ * Return value: the number of log bytes reclaimed (0 if compaction would not free any),
+ *               or a negative errno
+ */
+int
+famfs_log_compact(struct famfs_locked_log *lp, int verbose)
+{
+	struct famfs_log *logp = lp->logp;
+	u64 old_len = logp->famfs_log_next_offset;
+	struct famfs_log_entry ck = { 0 };
+	const struct famfs_log_entry *le;
+	struct famfs_locked_log nlp = { 0 };
+	struct famfs_log *newlog;
+	struct famfs_log_iter it;
+	u64 nrecords = 0;
+	u64 nentries = 0;
+	u64 new_len;
+	int rc = 0;
+
+	assert(lp);
+
+	/* Anything staged goes into the checkpoint */
+	famfs_log_publish(lp);
+
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+	while ((le = famfs_log_iter_next(&it)) != NULL) {
+		nrecords++;
+		nentries += (it.in_ckpt) ? 0 : 1;
+	}
+	if (it.err) {
+		fprintf(stderr, "%s: not compacting an invalid log\n", __func__);
+		return it.err;
+	}
+	if (it.have_ck)
+		nentries += it.ck.ck_nentries;
+
+	/* Build the new log in memory, by logging everything again through a locked log
+	 * of its own (which resolves the parent references in the new log)
+	 */
+	newlog = calloc(1, sizeof(*logp) + logp->famfs_log_data_len);
+	if (!newlog)
+		return -ENOMEM;
+	newlog->famfs_log_data_len = logp->famfs_log_data_len;
+	newlog->famfs_log_flags = logp->famfs_log_flags;
+	nlp.logp = newlog;
+	nlp.dirs = famfs_dir_index_alloc();
+
+	ck.famfs_log_entry_type = FAMFS_LOG_CHECKPOINT;
+	ck.famfs_ck.ck_nrecords = nrecords;
+	ck.famfs_ck.ck_nentries = nentries;
+	rc = famfs_log_stage(&nlp, &ck, FAMFS_LOG_NO_PARENT, "");
+
+	famfs_log_iter_init(&it, logp, NULL, 0);
+	while (!rc && (le = famfs_log_iter_next(&it)) != NULL) {
+		const char *relpath;
+		struct famfs_log_entry e;
+		const char *name;
+		u64 parent;
+
+		memcpy(&e, le, sizeof(e));
+		relpath = (le->famfs_log_entry_type == FAMFS_LOG_FILE) ?
+			(const char *)le->famfs_fc.famfs_relpath :
+			(const char *)le->famfs_md.famfs_relpath;
+		parent = famfs_log_parent(&nlp, relpath, &name);
+		rc = famfs_log_stage(&nlp, &e, parent, name);
+		if (!rc && nlp.dirs && le->famfs_log_entry_type == FAMFS_LOG_MKDIR)
+			famfs_dir_index_add(nlp.dirs, relpath, nlp.txn_last);
+	}
+	famfs_dir_index_free(nlp.dirs);
+	if (rc || it.err) {
+		free(newlog);
+		return (rc) ? rc : it.err;
+	}
+
+	new_len = nlp.txn_nbytes;
+	if (new_len >= old_len) {
+		if (verbose)
+			printf("%s: log is already compact (%lld bytes)\n", __func__, old_len);
+		free(newlog);
+		return 0;
+	}
+
+	/* Empty the log while it is rewritten, so a reader sees an empty log rather than
+	 * a mix of old records and new ones. The stale tail is zeroed, so nothing past the
+	 * new end still looks like a record.
+	 */
+	famfs_log_cursor_begin(logp);
+	logp->famfs_log_next_index = 0;
+	logp->famfs_log_next_seqnum = 0;
+	logp->famfs_log_next_offset = 0;
+	logp->famfs_log_epoch++;
+	famfs_log_cursor_end(logp);
+	flush_processor_cache(&logp->famfs_log_next_seqnum, FAMFS_LOG_CURSOR_LEN);
+
+	memcpy(logp->famfs_log_data, newlog->famfs_log_data, new_len);
+	memset(&logp->famfs_log_data[new_len], 0, old_len - new_len);
+	flush_processor_cache(logp->famfs_log_data, old_len);
+
+	famfs_log_cursor_begin(logp);
+	logp->famfs_log_next_offset = new_len;
+	logp->famfs_log_last_offset = nlp.txn_last;
+	logp->famfs_log_next_index = nlp.txn_nstaged;
+	logp->famfs_log_next_seqnum = nlp.txn_nstaged;
+	famfs_log_cursor_end(logp);
+	flush_processor_cache(&logp->famfs_log_next_seqnum, FAMFS_LOG_CURSOR_LEN);
+	free(newlog);
+
+	/* Directory records moved */
+	famfs_dir_index_free(lp->dirs);
+	lp->dirs = NULL;
+
+	/* The allocations didn't change, but a saved bitmap no longer matches the log */
+	if (!lp->bitmap) {
+		char path[PATH_MAX];
+
+		famfs_alloc_cache_path(lp->mpt, path, sizeof(path));
+		unlink(path);
+	}
+
+	if (verbose)
+		printf("%s: %lld records (from %lld log entries) in %lld bytes; "
+		       "%lld bytes reclaimed\n", __func__, nrecords, nentries, new_len,
+		       old_len - new_len);
+	return old_len - new_len;
+}
+
+/**
+ * famfs_compact()
+ *
+ * Compact the log of a (quiesced) famfs file system
+ *
+ * @fspath - mount point, or any path within the famfs file system
+ *
+ * Return value: 0, or a negative errno
+ */
+int
+famfs_compact(const char *fspath, int verbose)
+{
+	struct famfs_locked_log ll;
+	int rc;
+
+	rc = famfs_init_locked_log(&ll, fspath, verbose);
+	if (rc)
+		return rc;
+
+	rc = famfs_log_compact(&ll, verbose);
+	if (rc >= 0) {
+		printf("famfs compact: %d log bytes reclaimed\n", rc);
+		rc = 0;
+	}
+	famfs_release_locked_log(&ll);
+	return rc;
+}
+
+/**
+ * famfs_file_alloc()
+ *
+ * Alllocate space for a file, making it ready to use
+ *
+ * Caller has already done the following:
+ * * Verify that master role via the superblock
+ * * Create the stub of the new file and verify that it is in a famfs file system
+ *
+ * @lp       - Struct famfs_locked_log or NULL
+ * @fd       - File descriptor for newly-created empty target file
+ * @path     - Full path of file to allocate (needed for log entry).
+ *             Caller should use realpath to get this.
+ * @mode     -
+ * @uid      -
+ * @gid      -
+ * @size     - size to alloacte
+ * @verbose  -
+ *
+ * Returns 0 on success
+ * On error, returns:
+ * >0 - Errors that should not abort a multi-file operation
+ * <0 - Errors that should cause an abort (such as out of space or log full)
+ */
+static int
+famfs_file_alloc(
+	struct famfs_locked_log *lp,
+	int                      fd,
+	const char              *path,
+	mode_t                   mode,
+	uid_t                    uid,
+	gid_t                    gid,
+	u64                      size,
+	int                      verbose)
+{
+	struct famfs_simple_extent ext[FAMFS_ALLOC_MAX_EXTENTS] = {0};
+	char mpt[PATH_MAX];
+	char *relpath;
+	char *rpath = strdup(path);
+	int nextents;
+	int rc = 0;
+	int i;
+
+	assert(lp);
+	assert(fd > 0);
+
+	strncpy(mpt, lp->mpt, PATH_MAX - 1);
+
+	/* For the log, we need the path relative to the mount point.
+	 * getting this before we allocate is cleaner if the path is sombhow bogus
+	 */
+	relpath = famfs_relpath_from_fullpath(mpt, rpath);
+	if (!relpath)
+		return -EINVAL;
+
+	nextents = famfs_alloc_extents(lp, size, ext, FAMFS_ALLOC_MAX_EXTENTS, verbose);
+	if (nextents < 0) {
+		rc = -ENOMEM;
+		fprintf(stderr, "%s: Out of space!\n", __func__);
+		//assert(0);
+		goto out;
+	}
+	/* Allocation at offset 0 is always wrong - the superblock lives there */
+	for (i = 0; i < nextents; i++)
+		assert(ext[i].famfs_extent_offset != 0);
+
+	rc = famfs_log_file_creation(lp, nextents, ext,
+				     relpath, mode, uid, gid, size);
+	if (rc) {
+		/* Not logged, so give the space back; the bitmap must match the log */
+		for (i = 0; i < nextents; i++)
+			mu_bitmap_clear_range(lp->bitmap,
+					      ext[i].famfs_extent_offset / FAMFS_ALLOC_UNIT,
+					      ext[i].famfs_extent_len / FAMFS_ALLOC_UNIT);
+		goto out;
+	}
+
+	if (!mock_kmod)
+		rc =  famfs_file_map_create(path, fd, size, nextents, ext, FAMFS_REG);
+	else if (ftruncate(fd, size)) /* A mock file has its size, so it can be mapped */
+		rc = -errno;
+out:
+	free(rpath);
+	return rc;
+}
+
+/**
+ * famfs_file_create()
+ *
+ * Create a file but don't allocate dax space yet
+ *
+ * @path
+ * @mode
+ * @uid  - used if both uid and gid are non-null
+ * @gid  - used if both uid and gid are non-null
+ * @disable_write - if this flag is non-zero, write permissions will be removed from the mode
+ *                  (we default files to read-only on client systems)
+ *
+ * Returns a file descriptior or -EBADF if the path is not in a famfs file system
+ *
+ * TODO: append "_empty" to function name
+ */
+static int
+famfs_file_create(const char *path,
+		  mode_t      mode,
+		  uid_t       uid,
+		  gid_t       gid,
+		  int         disable_write)
+{
+	struct stat st;
+	int rc = 0;
+	int fd;
+
+	rc = stat(path, &st);
+	if (rc == 0) {
+		fprintf(stderr, "%s: file already exists: %s\n", __func__, path);
+		return -1;
+	}
+
+	if (disable_write)
+		mode = mode & ~(S_IWUSR | S_IWGRP | S_IWOTH);
+
+	fd = open(path, O_RDWR | O_CREAT, mode); /* TODO: open as temp file,
+						  * move into place after alloc
+						  */
+	if (fd < 0) {
+		fprintf(stderr, "%s: open/creat %s failed fd %d\n",
+			__func__, path, fd);
+		return fd;
+	}
+
+	/* XXX is this necessary? Have we already checked if it's in famfs? */
+	if (__file_not_famfs(fd)) {
+		close(fd);
+		unlink(path);
+		fprintf(stderr, "%s: file %s not in a famfs mount\n",
+			__func__, path);
+		return -EBADF;
+	}
+
+	if (uid && gid) {
+		rc = fchown(fd, uid, gid);
+		if (rc)
+			fprintf(stderr, "%s: fchown returned %d errno %d\n",
+				__func__, rc, errno);
+	}
+	return fd;
+}
+
+/**
+ * __famfs_mkfile()
+ *
+ * Inner function to create *and* allocate a file, and logs it.
+ *
+ * @locked_logp - We have a writable lock, which also means we're running on the master node
+ * @filename
+ * @mode
+ * @mode
+ * @uid
+ * @gid
+ * @size
+ * @verbose
+ *
+ * Returns an open file descriptor if successful.
+ * On failure, returns:
+ *  0 - The operation failed but it's not fatal to a multi-file operationn
+ * <0 - The operation failed due to a fatal condition like log full or out of space, so
+ *      multi-file operations should abort
+ */
+int
+__famfs_mkfile(
+	struct famfs_locked_log *lp,
+	const char              *filename,
+	mode_t                   mode,
+	uid_t                    uid,
+	gid_t                    gid,
+	size_t                   size,
+	int                      verbose)
+{
+	//struct famfs_superblock *sb;
+	char fullpath[PATH_MAX];
+	int fd, rc;
+
+	assert(lp);
+	assert(size > 0);
+
+	/* Create the file */
+	fd = famfs_file_create(filename, mode, uid, gid, 0);
+	if (fd <= 0)
+		return fd;
+
+	/* Clean up the filename path. (Can't call realpath until the file exists) */
+	assert(realpath(filename, fullpath));
+
+	/* If the file doesn't fit, it will be created but then unlinked
+	 * (and never logged). This is probably OK
+	 */
+	rc = famfs_file_alloc(lp, fd, fullpath, mode, uid, gid, size, verbose);
+	if (rc) {
+		fprintf(stderr, "%s: famfs_file_alloc(%s, size=%ld) failed\n",
+			__func__, fullpath, size);
+		close(fd);
+		unlink(fullpath);
+		return -1;
+	}
+	return fd;
+}
+
+int
+famfs_mkfile(
+	const char       *filename,
+	mode_t            mode,
+	uid_t             uid,
+	gid_t             gid,
+	size_t            size,
+	enum famfs_alloc_policy policy,
+	int               verbose)
+{
+	struct famfs_locked_log ll;
+	int rc;
+
+	if (size == 0) {
+		/* We don't allow empty files; what would be the point? */
+		fprintf(stderr, "%s: Creating empty file (%s) not allowed\n",
+			__func__, filename);
+		return -EINVAL;
+	}
+
+	rc = famfs_init_locked_log(&ll, filename, verbose);
+	if (rc)
+		return rc;
+
+	ll.policy = policy;
+	famfs_log_txn_begin(&ll);
+	rc  = __famfs_mkfile(&ll, filename, mode, uid, gid, size, verbose);
+
+	famfs_release_locked_log(&ll); /* Commits the transaction */
+	return rc;
+}
+
+/**
+ * famfs_dir_create()
+ *
+ * Create a directory
+ *
+ * @mpt
+ * @path
+ * @mode
+ * @uid  - used if both uid and gid are non-null
+ * @gid  - used if both uid and gid are non-null
+ * @size
+ *
+ *
+ */
+static int
+famfs_dir_create(
+	const char *mpt,
+	const char *rpath,
+	mode_t      mode,
+	uid_t       uid,
+	gid_t       gid)
+{
+	int rc = 0;
+	char fullpath[PATH_MAX];
+
+	snprintf(fullpath, PATH_MAX - 1, "%s/%s", mpt, rpath);
+	rc = mkdir(fullpath, mode);
+	if (rc) {
+		fprintf(stderr, "%s: failed to mkdir %s (rc %d errno %d)\n",
+			__func__, fullpath, rc, errno);
+		return -1;
+	}
+
+	/* Check if dir is in famfs mount? */
+
+	if (uid && gid) {
+		rc = chown(fullpath, uid, gid);
+		if (rc) {
+			fprintf(stderr, "%s: chown returned %d errno %d\n",
+				__func__, rc, errno);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * __famfs_mkdir()
+ *
+ * This should become the mid-level mkdir function; verify that target is a directory
+ * with a parent that exists and is in a famfs FS. Inner function should rely on these
+ * checks, and use the famsf_locked_log.
+ *
+ * Inner function would also be callled by 'cp -r' (which doesn't exist quite yet)
+ *
+ * @lp         - XXX make lp mandatory?
+ * @dirpath
+ * @mode
+ * @uid
+ * @gid
+ * @verbose
+ */
+
+int
+__famfs_mkdir(
+	struct famfs_locked_log *lp,
+	const char *dirpath,
+	mode_t      mode,
+	uid_t       uid,
+	gid_t       gid,
+	int         verbose)
+{
+	char realparent[PATH_MAX];
+	char fullpath[PATH_MAX];
+	char mpt_out[PATH_MAX] = { 0 };
+	char realdirpath[PATH_MAX];
+	char *dirdupe   = NULL;
+	char *parentdir = NULL;
+	char *basedupe  = NULL;
+	char *newdir    = NULL;
+	char *relpath   = NULL;
+	struct stat st;
+	int rc;
+
+	assert(lp);
+
+	/* Rationalize dirpath; if it exists, get role based on that */
+	if (realpath(dirpath, realdirpath)) {
+		/* if dirpath already exists in "non -p" mkdir, that's an error */
+		return -1;
+	}
+
+	dirdupe  = strdup(dirpath);  /* call dirname() on this dupe */
+	basedupe = strdup(dirpath); /* call basename() on this dupe */
+	newdir   = basename(basedupe);
+
+	/* full dirpath should not exist, but the parentdir path must exist and
+	 * be a directory
+	 */
+	parentdir = dirname(dirdupe);
+	rc = stat(parentdir, &st);
+	if (rc) {
+		fprintf(stderr, "%s: parent path (%s) stat failed\n", __func__, parentdir);
+	} else if ((st.st_mode & S_IFMT) != S_IFDIR) {
+		fprintf(stderr, "%s: parent (%s) of path %s is not a directory\n",
+			__func__, dirpath, parentdir);
+		rc = -1;
+		goto err_out;
+	}
+
+	/* Parentdir exists and is a directory; rationalize the path with realpath */
+	if (realpath(parentdir, realparent) == 0) {
+		fprintf(stderr, "%s: failed to rationalize parentdir path (%s)\n",
+			__func__, parentdir);
+		rc = -1;
+		goto err_out;
+	}
+
+	/* Rebuild full path of to-be-createed directory from the rationalized
+	 * parent dir path
+	 */
+	rc = snprintf(fullpath, PATH_MAX - 1, "%s/%s", realparent, newdir);
+	if (rc < 0) {
+		fprintf(stderr, "%s: fullpath overflow\n", __func__);
+		goto err_out;
+	}
+
+	strncpy(mpt_out, lp->mpt, PATH_MAX - 1);
+
+	if (verbose)
+		printf("famfs mkdir: created directory \'%s\'\n", fullpath);
+
+	relpath = famfs_relpath_from_fullpath(mpt_out, fullpath);
+	if (strcmp(mpt_out, fullpath) == 0) {
+		fprintf(stderr, "%s: failed to create mount point dir: EALREADY\n", __func__);
+		rc = -1;
+		goto err_out;
+	}
+	rc = famfs_dir_create(mpt_out, relpath, mode, uid, gid);
+	if (rc) {
+		fprintf(stderr, "%s: failed to mkdir %s\n", __func__, fullpath);
+		rc = -1;
+		goto err_out;
+	}
+
+	/* Should it be logged before it's locally created? */
+	rc = famfs_log_dir_creation(lp, relpath, mode, uid, gid);
+
+err_out:
+	if (dirdupe)
+		free(dirdupe);
+	if (basedupe)
+		free(basedupe);
+	return rc;
+}
+
+int
+famfs_mkdir(
+	const char *dirpath,
+	mode_t      mode,
+	uid_t       uid,
+	gid_t       gid,
+	int         verbose)
+{
+	char *cwd = get_current_dir_name();
+	struct famfs_locked_log ll;
+	char abspath[PATH_MAX];
+	int rc;
+
+	if (dirpath[0] == '/')
+		strncpy(abspath, dirpath, PATH_MAX - 1);
+	else
+		snprintf(abspath, PATH_MAX - 1, "%s/%s", cwd, dirpath);
+
+	rc = famfs_init_locked_log(&ll, abspath, verbose);
+	if (rc) {
+		free(cwd);
+		return rc;
+	}
+
+	rc = __famfs_mkdir(&ll, dirpath, mode, uid, gid, verbose);
+
+	famfs_release_locked_log(&ll);
+	free(cwd);
+	return rc;
+}
+
+/**
+ * famfs_make_parent_dir()
+ *
+ * Recurse upwards through the path till we find a directory that exists
+ * On the way back, create the missing directories for "mkdir -p"
+ * If the first vallid path we find is not a directory, that's an error.
+ *
+ * @lp
+ * @path
+ * @mode
+ * @uid
+ * @gid
+ * @depth
+ */
+static int
+famfs_make_parent_dir(
+	struct famfs_locked_log *lp,
+	const char *path,
+	mode_t mode,
+	uid_t uid,
+	gid_t gid,
+	int depth,
+	int verbose)
+{
+	char *dirdupe = strdup(path);
+	char *parentdir;
+	struct stat st;
+	int rc;
+
+	assert(lp);
+
+	/* Does path already exist? */
+	if (stat(path, &st) == 0) {
+		free(dirdupe);
+		switch (st.st_mode & S_IFMT) {
+		case S_IFDIR:
+			return 0;
+		default:
+			fprintf(stderr, "%s: path %s is not a directory\n", __func__, path);
+			return -1;
+		}
+	}
+
+	/* get parent path */
+	parentdir = dirname(dirdupe);
+	 /* Recurse up :D */
+	rc = famfs_make_parent_dir(lp, parentdir, mode, uid, gid, depth + 1, verbose);
+	if (rc) {
+		fprintf(stderr, "%s: bad path component above (%s)\n", __func__, path);
+		free(dirdupe);
+		return -1;
+	}
+
+	/* Parent dir exists; now we can mkdir path! */
+	free(dirdupe);
+	if (verbose > 2)
+		printf("%s: dir %s depth %d\n", __func__, path, depth);
+
+	/* Parent of path is guaranteed to exist */
+	rc = __famfs_mkdir(lp, path, mode, uid, gid, verbose);
+	return rc;
+}
+
+int
+famfs_mkdir_parents(
+	const char *dirpath,
+	mode_t      mode,
+	uid_t       uid,
+	gid_t       gid,
+	int         verbose)
+{
+	struct famfs_locked_log ll = { 0 };
+	char *cwd = get_current_dir_name();
+	char abspath[PATH_MAX];
+	char *rpath;
+	int rc;
+
+	/* dirpath as an indeterminate number of nonexistent dirs, under a path that
+	 * must exist. But the immediate parent may not exist. All existing elements
+	 * in the path must be dirs. By opening the log, we can get the mount point path...
+	 */
+
+	if (dirpath[0] == '/')
+		strncpy(abspath, dirpath, PATH_MAX - 1);
+	else
+		snprintf(abspath, PATH_MAX - 1, "%s/%s", cwd, dirpath);
+
+	if (verbose)
+		printf("%s: cwd %s abspath %s\n", __func__, cwd, abspath);
+
+	rpath = find_real_parent_path(abspath);
+	if (!rpath) {
+		fprintf(stderr, "%s: failed to find real parent dir\n", __func__);
+		return -1;
+	}
+
+	/* OK, we know were in a FAMFS instance. get a locked log struct */
+	rc = famfs_init_locked_log(&ll, rpath, verbose);
+	if (rc) {
+		free(rpath);
+		return rc;
+	}
+
+	/* Now recurse up fromm abspath till we find an existing parent, and mkdir back down.
+	 * All of the new directories are logged in one transaction
+	 */
+	famfs_log_txn_begin(&ll);
+	rc = famfs_make_parent_dir(&ll, abspath, mode, uid, gid, 0, verbose);
+
+	/* Separate function should release ll and lock */
+	famfs_release_locked_log(&ll);
+	free(rpath);
+	if (cwd)
+		free(cwd);
+
+	return rc;
+}
+
+/********************************************************************************
+ *
+ * Data copy engine
+ *
+ * If the locked log has a copy pool (lp->cp_pool), file data is copied by the pool's
+ * workers in lp->cp_chunksize chunks, so big files are copied by several threads and
+ * small files overlap with each other. Allocation and logging stay in the caller's thread
+ * under the log lock. Otherwise data is copied inline.
+ */
+
+struct famfs_cp_job {
+	struct famfs_locked_log *lp;
+	int                      srcfd;
+	int                      destfd;
+	char                    *destp;
+	size_t                   size;
+	int                      direct;      /* Use famfs_cp_range_direct() */
+	int                      chunks_left; /* The last chunk to finish cleans up */
+	int                      err;
+};
+
+struct famfs_cp_chunk {
+	struct famfs_cp_job *job;
+	size_t               offset;
+	size_t               len;
+};
+
+/**
+ * famfs_cp_range()
+ *
+ * Read [@offset, @offset + @len) of @srcfd into the same range of @destp, and flush it
+ *
+ * Return value: 0, or -1 on a read error or premature EOF
+ */
+static int
+famfs_cp_range(int srcfd, char *destp, size_t offset, size_t len)
+{
+	size_t resid = len;
+	size_t ofs = offset;
+	ssize_t bytes;
+
+	while (resid > 0) {
+		size_t cur = MIN((size_t)FAMFS_CP_IO_SIZE, resid);
+
+		bytes = pread(srcfd, &destp[ofs], cur, ofs);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0) {
+			fprintf(stderr, "%s: copy fail: ofs %ld len %ld resid %ld rc %ld errno %d\n",
+				__func__, ofs, len, resid, bytes, (bytes < 0) ? errno : 0);
+			return -1;
+		}
+		ofs += bytes;
+		resid -= bytes;
+	}
+
+	/* Flush the processor cache for this range of the dest file */
+	flush_processor_cache(&destp[offset], len);
+	return 0;
+}
+
+/*
+ * Direct copy mode: the source is read into aligned staging buffers (with O_DIRECT if
+ * the source file system supports it), and the buffers are written into the destination
+ * with non-temporal stores - so data goes through the cache zero times instead of twice,
+ * and there is no flush pass. Two buffers are in flight, so the read of the next buffer
+ * overlaps with storing the current one.
+ */
+struct famfs_cp_stage {
+	struct aiocb cb;
+	char        *buf;
+	size_t       len;      /* Bytes of the destination this read is for */
+	int          inflight;
+};
+
+static int
+famfs_cp_stage_read(struct famfs_cp_stage *st, int srcfd, size_t ofs, size_t len)
+{
+	memset(&st->cb, 0, sizeof(st->cb));
+	st->cb.aio_fildes = srcfd;
+	st->cb.aio_buf = st->buf;
+	/* O_DIRECT needs whole blocks; reading past EOF just comes up short */
+	st->cb.aio_nbytes = (len + FAMFS_CP_DIRECT_ALIGN - 1) & ~(FAMFS_CP_DIRECT_ALIGN - 1);
+	st->cb.aio_offset = ofs;
+	st->len = len;
+
+	if (aio_read(&st->cb)) {
+		fprintf(stderr, "%s: aio_read failed (errno %d)\n", __func__, errno);
+		return -1;
+	}
+	st->inflight = 1;
+	return 0;
+}
+
+static ssize_t
+famfs_cp_stage_wait(struct famfs_cp_stage *st)
+{
+	const struct aiocb *list[1] = { &st->cb };
+
+	while (aio_error(&st->cb) == EINPROGRESS)
+		aio_suspend(list, 1, NULL);
+	st->inflight = 0;
+	return aio_return(&st->cb);
+}
+
+/**
+ * famfs_cp_range_direct()
+ *
+ * Same contract as famfs_cp_range(), but see "Direct copy mode" above.
+ * @offset must be a multiple of FAMFS_CP_DIRECT_ALIGN.
+ */
+static int
+famfs_cp_range_direct(int srcfd, char *destp, size_t offset, size_t len)
+{
+	struct famfs_cp_stage st[2] = { 0 };
+	size_t issued = 0;
+	size_t done = 0;
+	int cur = 0;
+	int rc = -1;
+	int i;
+
+	assert(!(offset % FAMFS_CP_DIRECT_ALIGN));
+
+	for (i = 0; i < 2; i++) {
+		if (posix_memalign((void **)&st[i].buf, FAMFS_CP_DIRECT_ALIGN,
+				   FAMFS_CP_IO_SIZE)) {
+			fprintf(stderr, "%s: failed to allocate staging buffer\n", __func__);
+			goto out;
+		}
+	}
+
+	/* Prime the pipeline */
+	if (famfs_cp_stage_read(&st[0], srcfd, offset, MIN((size_t)FAMFS_CP_IO_SIZE, len)))
+		goto out;
+	issued = st[0].len;
+
+	while (done < len) {
+		ssize_t bytes = famfs_cp_stage_wait(&st[cur]);
+
+		if (bytes < (ssize_t)st[cur].len) {
+			fprintf(stderr, "%s: copy fail: ofs %ld len %ld rc %ld errno %d\n",
+				__func__, offset + done, st[cur].len, bytes,
+				(bytes < 0) ? aio_error(&st[cur].cb) : 0);
+			goto out;
+		}
+
+		/* Start the next read before storing this buffer */
+		if (issued < len) {
+			if (famfs_cp_stage_read(&st[cur ^ 1], srcfd, offset + issued,
+						MIN((size_t)FAMFS_CP_IO_SIZE, len - issued)))
+				goto out;
+			issued += st[cur ^ 1].len;
+		}
+
+		mu_memcpy_nt(&destp[offset + done], st[cur].buf, st[cur].len);
+		done += st[cur].len;
+		cur ^= 1;
+	}
+	rc = 0;
+
+out:
+	for (i = 0; i < 2; i++) {
+		if (st[i].inflight) {
+			aio_cancel(srcfd, &st[i].cb);
+			famfs_cp_stage_wait(&st[i]);
+		}
+		free(st[i].buf);
+	}
+	return rc;
+}
+
+static void
+famfs_cp_job_done(struct famfs_cp_job *job)
+{
+	struct famfs_locked_log *lp = job->lp;
+
+	munmap(job->destp, job->size);
+	close(job->srcfd);
+	close(job->destfd);
+
+	if (job->err)
+		__atomic_add_fetch(&lp->cp_errors, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&lp->cp_files, 1, __ATOMIC_RELAXED);
+	free(job);
+}
+
+static void
+famfs_cp_chunk_worker(void *arg)
+{
+	struct famfs_cp_chunk *c = arg;
+	struct famfs_cp_job *job = c->job;
+	int rc;
+
+	if (job->direct)
+		rc = famfs_cp_range_direct(job->srcfd, job->destp, c->offset, c->len);
+	else
+		rc = famfs_cp_range(job->srcfd, job->destp, c->offset, c->len);
+	if (rc)
+		__atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&job->lp->cp_bytes, c->len, __ATOMIC_RELAXED);
+
+	if (__atomic_sub_fetch(&job->chunks_left, 1, __ATOMIC_ACQ_REL) == 0)
+		famfs_cp_job_done(job);
+	free(c);
+}
+
+/**
+ * famfs_cp_data()
+ *
+ * Copy @size bytes of @srcfd into the mapped destination file @destp. Takes ownership of
+ * @srcfd, @destfd and the mapping; they are released when the copy completes.
+ *
+ * With a copy pool, this returns after queueing the work; errors are counted in
+ * lp->cp_errors, which is final after famfs_cp_pool_finish().
+ *
+ * Return value: 0, or -1 if an inline copy failed
+ */
+int
+famfs_cp_data(struct famfs_locked_log *lp,
+	      int                      srcfd,
+	      int                      destfd,
+	      char                    *destp,
+	      size_t                   size,
+	      int                      verbose)
+{
+	size_t chunksize = (lp->cp_chunksize) ? lp->cp_chunksize : FAMFS_CP_DEFAULT_CHUNKSIZE;
+	struct famfs_cp_job *job;
+	size_t offset;
+	int nchunks;
+	int rc;
+
+	/* Direct reads need block-aligned file offsets */
+	if (lp->cp_direct)
+		chunksize = (chunksize + FAMFS_CP_DIRECT_ALIGN - 1) &
+			~((size_t)FAMFS_CP_DIRECT_ALIGN - 1);
+
+	if (!lp->cp_pool) {
+		if (lp->cp_direct)
+			rc = famfs_cp_range_direct(srcfd, destp, 0, size);
+		else
+			rc = famfs_cp_range(srcfd, destp, 0, size);
+		munmap(destp, size);
+		close(srcfd);
+		close(destfd);
+		if (rc) {
+			lp->cp_errors++;
+			return -1;
+		}
+		lp->cp_bytes += size;
+		lp->cp_files++;
+		return 0;
+	}
+
+	job = calloc(1, sizeof(*job));
+	assert(job);
+	nchunks = (size + chunksize - 1) / chunksize;
+	job->lp = lp;
+	job->srcfd = srcfd;
+	job->destfd = destfd;
+	job->destp = destp;
+	job->size = size;
+	job->direct = lp->cp_direct;
+	job->chunks_left = nchunks;
+
+	if (verbose > 1)
+		printf("%s: size %ld in %d chunks\n", __func__, size, nchunks);
+
+	for (offset = 0; offset < size; offset += chunksize) {
+		struct famfs_cp_chunk *c = calloc(1, sizeof(*c));
+
+		assert(c);
+		c->job = job;
+		c->offset = offset;
+		c->len = MIN(chunksize, size - offset);
+		if (thpool_add_work(lp->cp_pool, famfs_cp_chunk_worker, c))
+			famfs_cp_chunk_worker(c); /* Couldn't queue it; do it here */
+	}
+	return 0;
+}
+
+/**
+ * famfs_cp_pool_start()
+ *
+ * Give @lp a pool of @nthreads copy workers (if @nthreads > 1), and start the clock
+ * for the throughput report
+ *
+ * @direct - Use direct copy mode (see famfs_cp_range_direct())
+ */
+int
+famfs_cp_pool_start(struct famfs_locked_log *lp, int nthreads, size_t chunksize, int direct)
+{
+	lp->cp_chunksize = chunksize;
+	lp->cp_direct = direct;
+	clock_gettime(CLOCK_MONOTONIC, &lp->cp_start);
+
+	if (nthreads <= 1)
+		return 0;
+
+	lp->cp_pool = thpool_init(nthreads, 0);
+	if (!lp->cp_pool) {
+		fprintf(stderr, "%s: failed to start %d copy threads\n", __func__, nthreads);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * famfs_cp_pool_finish()
+ *
+ * Wait for outstanding copies, stop the workers, and report throughput if @verbose
+ *
+ * Return value: the number of files whose data copy failed
+ */
+u64
+famfs_cp_pool_finish(struct famfs_locked_log *lp, int verbose)
+{
+	struct timespec end;
+	double secs;
+
+	if (lp->cp_pool) {
+		thpool_wait(lp->cp_pool);
+		thpool_destroy(lp->cp_pool);
+		lp->cp_pool = NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (double)(end.tv_sec - lp->cp_start.tv_sec) +
+		(double)(end.tv_nsec - lp->cp_start.tv_nsec) / 1e9;
+	if (verbose)
+		printf("famfs cp: %lld files, %lld bytes in %.3f s (%.1f MiB/s)\n",
+		       lp->cp_files, lp->cp_bytes, secs,
+		       (secs > 0) ? (double)lp->cp_bytes / (1024.0 * 1024.0) / secs : 0.0);
+	if (lp->cp_errors)
+		fprintf(stderr, "famfs cp: data copy failed for %lld files\n", lp->cp_errors);
+
+	return lp->cp_errors;
+}
+
+/**
+ * __famfs_cp()
+ *
+ * Inner file copy function
+ *
+ * Copy a file from any file system into famfs. A destination file is created and
+ * allocated, and the data is copied info it.
+ *
+ * Biggest current shortcoming is that globbing and recursion is not suported.
+ * Hopefully we'll get there soon.
+ *
+ * @lp       - famfs_locked_log struct
+ * @srcfile  - must exist and be a regular file
+ * @destfile - must not exist (and will be a regular file). If @destfile does not fall
+ *             within a famfs file system, we will clean up and fail
+ * @mode     - If mode is NULL, mode is inherited fro msource file
+ * @uid
+ * @gid
+ * @verbose
+ *
+ * Return values:
+ * 0  - Success
+ * >0 - Something failed but if it is a multi-file copy, it should continue
+ * <0 - A failure that should cause multi-file operations to bail out (such as out of space or
+ *      log full...
+ */
+int
+__famfs_cp(
+	struct famfs_locked_log  *lp,
+	const char               *srcfile,
+	const char               *destfile,
+	mode_t                    mode,
+	uid_t                     uid,
+	gid_t                     gid,
+	int                       verbose)
+{
+	int rc, srcfd, destfd;
+	struct stat srcstat;
+	char *destp;
+
+	assert(lp);
+
+	/* Validate source file */
+	rc = stat(srcfile, &srcstat);
+	if (rc) {
+		fprintf(stderr, "%s: unable to stat srcfile (%s)\n", __func__, srcfile);
+		return 1; /* not an abort condition */
+	}
+	switch (srcstat.st_mode & S_IFMT) {
+	case S_IFREG:
+		/* Source is a file - all good */
+		if (srcstat.st_size == 0) {
+			if (verbose > 1)
+				fprintf(stderr, "%s: skipping empty file %s\n", __func__, srcfile);
+
+			return 1;
+		}
+		break;
+
+	case S_IFDIR:
+		/* source is a directory; fail for now
+		 * (should this be mkdir? Probably... at least if it's a recursive copy)
+		 */
+		fprintf(stderr, "%s: -r not specified; omitting directory '%s'\n",
+			__func__, srcfile);
+		return 1;
+
+	default:
+		fprintf(stderr,
+			"%s: error: src %s is not a regular file\n", __func__, srcfile);
+		return 1;
+	}
+
+	/*
+	 * Make sure we can open and read the source file. Direct copies bypass the page
+	 * cache if the source file system allows it (otherwise they read through it)
+	 */
+	srcfd = -1;
+	if (lp->cp_direct)
+		srcfd = open(srcfile, O_RDONLY | O_DIRECT, 0);
+	if (srcfd < 0)
+		srcfd = open(srcfile, O_RDONLY, 0);
+	if (srcfd < 0) {
+		fprintf(stderr, "%s: unable to open srcfile (%s)\n", __func__, srcfile);
+		return 1;
+	}
+
+	/* XXX famfs_mkfile() calls famfs_file_alloc()
+	 * famfs_file_alloc() allocates and logs the file under log lock
+	 * but this function copies the data into the file after the log lock is released
+	 * Need a way of holding the lock until the data is copied.
+	 */
+	destfd = __famfs_mkfile(lp, destfile, (mode == 0) ? srcstat.st_mode : mode,
+				uid, gid, srcstat.st_size, verbose);
+	if (destfd <= 0) {
+		fprintf(stderr, "%s: failed in __famfs_mkfile\n", __func__);
+		return destfd;
+	}
+
+	destp = famfs_mmap_fd(destfd, srcstat.st_size, 0 /* writable */, lp->cp_mmap);
+	if (!destp) {
+		fprintf(stderr, "%s: dest mmap failed (%s) size %ld\n",
+			__func__, destfile, srcstat.st_size);
+		unlink(destfile);
+		return -1; /* XXX */
+	}
+
+	/* Copy the data; this takes over srcfd, destfd and the mapping */
+	return famfs_cp_data(lp, srcfd, destfd, destp, srcstat.st_size, verbose);
+}
+
+/**
+ * famfs_cp()
+ *
+ * Mid layer file copy function
+ *
+ * @lp       - Locked Log struct (required)
+ * @srcfile  - skipped unless it's a regular file
+ * @destfile - Nonexistent file, or existing directory. If destfile is a directory, this
+ *             function fill append basename(srcfile) to destfile to get a nonexistent file path
+ * @verbose
+ */
+static int
+famfs_cp(struct famfs_locked_log *lp,
+	 const char              *srcfile,
+	 const char              *destfile,
+	 mode_t                   mode,
+	 uid_t                    uid,
+	 gid_t                    gid,
+	 int                      verbose)
+{
+	char actual_destfile[PATH_MAX] = { 0 };
+	struct stat deststat;
+	int rc;
+
+	assert(lp);
+
+	/* Figure out what the destination is; possibilities:
+	 *
+	 * * A non-existing path whose parent directory is in famfs
+	 * * An existing path do a directory in famfs
+	 */
+	rc = stat(destfile, &deststat);
+	if (!rc) {
+		switch (deststat.st_mode & S_IFMT) {
+		case S_IFDIR: {
+			char destpath[PATH_MAX];
+			char src[PATH_MAX];
+
+			if (verbose > 1)
+				printf("%s: (%s) -> (%s/)\n", __func__, srcfile, destfile);
+
+			/* Destination is directory;  get the realpath and append the basename
+			 * from the source
+			 */
+			if (realpath(destfile, destpath) == 0) {
+				fprintf(stderr, "%s: failed to rationalize destath path (%s)\n",
+					__func__, destfile);
+				return 1;
+			}
+			strncpy(src, srcfile, PATH_MAX - 1);
+			snprintf(destpath, PATH_MAX - 1, "%s/%s", destfile, basename(src));
+			strncpy(actual_destfile, destpath, PATH_MAX - 1);
+			break;
+		}
+		default:
+			fprintf(stderr,
+				"%s: error: destination file (%s) exists and is not a directory\n",
+				__func__, destfile);
+			return -EEXIST;
+		}
+	} else {
+		/* File does not exist;
+		 * the check whether it is in famfs will happen after the file is created
+		 */
+		if (verbose > 1)
+			printf("%s: (%s) -> (%s)\n", __func__, srcfile, destfile);
+
+		strncpy(actual_destfile, destfile, PATH_MAX - 1);
+	}
+
+	return __famfs_cp(lp, srcfile, actual_destfile, mode, uid, gid, verbose);
+}
+
+/**
+ * famfs_cp_dir()
+ *
+ * Copy a directory and its contents to a target path
+ *
+ * @lp       - (required)
+ * @src      - src path (must exist and be a directory)
+ * @dest     - Must be a directory if it exists; if dest does not exist, its parent dir
+ *             is required to exist.
+ * @mode
+ * @uid
+ * @gid
+ * @verbose
+ */
+int famfs_cp_dir(
+	struct famfs_locked_log *lp,
+	const char *src,
+	const char *dest,
+	mode_t mode,
+	uid_t uid,
+	gid_t gid,
+	int verbose)
+{
+	struct dirent *entry;
+	DIR *directory;
+	struct stat st;
+	int rc;
+	int err = 0;
+
+	assert(lp);
+	if (verbose > 1)
+		printf("%s: (%s) -> (%s)\n", __func__, src, dest);
+
+	/* Does the dest dir exist? */
+	rc = stat(dest, &st);
 	if (rc) {
 		/* The directory doesn't exist yet */
 		rc = __famfs_mkdir(lp, dest, mode, uid, gid, verbose);
@@ -3362,7 +7101,12 @@ bailout:
  * @uid
  * @gid
  * @recursive - Recursive copy if true
- * @verbose -
+ * @policy  - allocation policy for the new files
+ * @nthreads - data copy threads (<= 1 copies inline)
+ * @chunksize - unit of work for the copy threads (0 for the default)
+ * @direct  - read the sources with O_DIRECT and store with non-temporal stores
+ * @mmap_opts - how the destination files are mapped, or NULL for the defaults
+ * @verbose - (also reports copy throughput)
  *
  * Rules:
  * * non-recuraive
@@ -3390,6 +7134,11 @@ famfs_cp_multi(
 	uid_t uid,
 	gid_t gid,
 	int recursive,
+	enum famfs_alloc_policy policy,
+	int nthreads,
+	size_t chunksize,
+	int direct,
+	struct famfs_mmap_opts *mmap_opts,
 	int verbose)
 {
 	struct famfs_locked_log ll = { 0 };
@@ -3477,6 +7226,17 @@ famfs_cp_multi(
 		free(dirdupe);
 		return rc;
 	}
+	ll.policy = policy;
+	ll.cp_mmap = mmap_opts;
+
+	/* Batch the log entries; they're published when the lock is released */
+	famfs_log_txn_begin(&ll);
+
+	rc = famfs_cp_pool_start(&ll, nthreads, chunksize, direct);
+	if (rc) {
+		err = rc;
+		goto err_out;
+	}
 
 	for (i = 0; i < src_argc; i++) {
 		struct stat src_stat;
@@ -3536,525 +7296,1494 @@ famfs_cp_multi(
 		/* cp continues even if some files were not copied */
 	}
 
-err_out:
-	/* Separate function should release ll and lock */
-	free(dirdupe);
-	famfs_release_locked_log(&ll);
-	free(dest_parent_path);
-	return err;
+err_out:
+	/* All data must be copied before the log entries are published, which the
+	 * transaction holds off until famfs_release_locked_log()
+	 */
+	if (famfs_cp_pool_finish(&ll, verbose) && !err)
+		err = -1;
+
+	/* Separate function should release ll and lock */
+	free(dirdupe);
+	famfs_release_locked_log(&ll);
+	free(dest_parent_path);
+	return err;
+}
+
+/**
+ * famfs_clone()
+ *
+ *
+ * This function is for generating cross-linked file errors, and should be compiled out
+ * of the library when not needed for that purpose.
+ */
+int
+famfs_clone(const char *srcfile,
+	    const char *destfile,
+	    int   verbose)
+{
+	struct famfs_ioc_map filemap = {0};
+	struct famfs_extent *ext_list = NULL;
+	char srcfullpath[PATH_MAX];
+	char destfullpath[PATH_MAX];
+	struct famfs_locked_log ll;
+	int locked = 0;
+	int sfd = 0;
+	int dfd = 0;
+	char *relpath = NULL;
+	struct famfs_simple_extent *se = NULL;
+	int src_role, dest_role;
+	uuid_le src_fs_uuid, dest_fs_uuid;
+	struct stat src_stat;
+	int rc;
+
+	/* srcfile must already exist; Go ahead and check that first */
+	if (realpath(srcfile, srcfullpath) == NULL) {
+		fprintf(stderr, "%s: bad source path %s\n", __func__, srcfile);
+		return -1;
+	}
+	/* and srcfile must be in famfs... */
+	if (file_not_famfs(srcfullpath)) {
+		fprintf(stderr, "%s: source path (%s) not in a famfs file system\n",
+			__func__, srcfullpath);
+		return -1;
+	}
+	rc = stat(srcfullpath, &src_stat);
+	if (rc < 0) {
+		fprintf(stderr, "%s: unable to stat srcfile %s\n", __func__, srcfullpath);
+		return -1;
+	}
+
+	/*
+	 * Need to confirm that both files are inn the same file system. Otherwise,
+	 * the cloned extents will be double-invalid on the second file :(
+	 */
+	src_role = famfs_get_role_by_path(srcfile, &src_fs_uuid);
+	dest_role = famfs_get_role_by_path(destfile, &dest_fs_uuid);
+	if (src_role < 0) {
+		fprintf(stderr, "%s: Error: unable to check role for src file %s\n",
+			__func__, srcfullpath);
+		return -1;
+	}
+	if (dest_role < 0) {
+		fprintf(stderr, "%s: Error: unable to check role for src file %s\n",
+			__func__, destfile);
+		return -1;
+	}
+	if ((src_role != dest_role) ||
+	    memcmp(&src_fs_uuid, &dest_fs_uuid, sizeof(src_fs_uuid)) != 0) {
+		fprintf(stderr,
+			"%s: Error: source and destination must be in the same file system\n",
+			__func__);
+		return -1;
+	}
+	if (src_role != FAMFS_MASTER) {
+		fprintf(stderr, "%s: file creation not allowed on client systems\n", __func__);
+		return -EPERM;
+	}
+	/* FAMFS_MASTER role now confirmed, and the src and destination are in the same famfs */
+
+	/*
+	 * Open source file and make sure it's a famfs file
+	 */
+	sfd = open(srcfullpath, O_RDONLY, 0);
+	if (sfd < 0) {
+		fprintf(stderr, "%s: failed to open source file %s\n",
+			__func__, srcfullpath);
+		return -1;
+	}
+	if (__file_not_famfs(sfd)) {
+		fprintf(stderr, "%s: source file %s is not a famfs file\n",
+			__func__, srcfullpath);
+		return -1;
+	}
+
+	/*
+	 * Get map for source file
+	 */
+	rc = ioctl(sfd, FAMFSIOC_MAP_GET, &filemap);
+	if (rc) {
+		fprintf(stderr, "%s: MAP_GET returned %d errno %d\n", __func__, rc, errno);
+		goto err_out;
+	}
+	ext_list = calloc(filemap.ext_list_count, sizeof(struct famfs_extent));
+	rc = ioctl(sfd, FAMFSIOC_MAP_GETEXT, ext_list);
+	if (rc) {
+		fprintf(stderr, "%s: GETEXT returned %d errno %d\n", __func__, rc, errno);
+		goto err_out;
+	}
+
+	/*
+	 * For this operation we need to lock the log, which also gets us
+	 * the mount point path
+	 */
+	rc = famfs_init_locked_log(&ll, srcfullpath, verbose);
+	if (rc) {
+		rc = -1;
+		goto err_out;
+	}
+	locked = 1;
+
+	/* Create the destination file. This will be unlinked later if we don't get all
+	 * the way through the operation.
+	 */
+	dfd = famfs_file_create(destfile, src_stat.st_mode, src_stat.st_uid, src_stat.st_gid, 0);
+	if (dfd < 0) {
+		fprintf(stderr, "%s: failed to create file %s\n", __func__, destfile);
+		rc = -1;
+		goto err_out;
+	}
+
+	/*
+	 * Create the file before logging, so we can avoid a BS log entry if the
+	 * kernel rejects the caller-supplied allocation ext list
+	 */
+	/* Ugh need to unify extent types... XXX */
+	se = famfs_ext_to_simple_ext(ext_list, filemap.ext_list_count);
+	if (!se) {
+		rc = -ENOMEM;
+		goto err_out;
+	}
+	rc = famfs_file_map_create(destfile, dfd, filemap.file_size, filemap.ext_list_count,
+				   se, FAMFS_REG);
+	if (rc) {
+		fprintf(stderr, "%s: failed to create destination file\n", __func__);
+		goto err_out;
+	}
+
+	/* Now have created the destination file (and therefore we know it is in a famfs
+	 * mount, we need its relative path of
+	 */
+	assert(realpath(destfile, destfullpath));
+
+	relpath = famfs_relpath_from_fullpath(ll.mpt, destfullpath);
+	if (!relpath) {
+		rc = -1;
+		unlink(destfullpath);
+		goto err_out;
+	}
+
+	rc = famfs_log_file_creation(&ll, filemap.ext_list_count, se,
+				     relpath, src_stat.st_mode, src_stat.st_uid, src_stat.st_gid,
+				     filemap.file_size);
+	if (rc) {
+		fprintf(stderr,
+			"%s: failed to log caller-specified allocation\n",
+			__func__);
+		rc = -1;
+		unlink(destfullpath);
+		goto err_out;
+	}
+
+	rc = 0;
+	famfs_release_locked_log(&ll);
+	locked = 0;
+	/***************/
+
+err_out:
+	free(ext_list);
+	free(se);
+	if (locked)
+		famfs_release_locked_log(&ll);
+	if (sfd > 0)
+		close(sfd);
+	if (dfd > 0)
+		close(dfd);
+	return rc;
+}
+
+/**
+ * __famfs_mkfs()
+ *
+ * This handller can be called by unit tests; the actual device open/mmap is
+ * done by the caller, so an alternate caller can arrange for a superblock and log
+ * to be written to alternate files/locations.
+ */
+int
+__famfs_mkfs(const char              *daxdev,
+	     struct famfs_superblock *sb,
+	     struct famfs_log        *logp,
+	     u64                      device_size,
+	     int                      force,
+	     int                      kill)
+
+{
+	int rc;
+
+	if ((famfs_check_super(sb) == 0) && !force) {
+		fprintf(stderr, "Device %s already has a famfs superblock\n", daxdev);
+		return -1;
+	}
+
+	if (kill) {
+		printf("Famfs superblock killed\n");
+		sb->ts_magic = 0;
+		flush_processor_cache(sb, sb->ts_log_offset);
+		return 0;
+	}
+
+	rc = famfs_get_system_uuid(&sb->ts_system_uuid);
+	if (rc) {
+		fprintf(stderr, "mkfs.famfs: unable to get system uuid");
+		return -1;
+	}
+	sb->ts_magic      = FAMFS_SUPER_MAGIC;
+	sb->ts_version    = FAMFS_CURRENT_VERSION;
+	sb->ts_log_offset = FAMFS_LOG_OFFSET;
+	sb->ts_log_len    = FAMFS_LOG_LEN;
+	famfs_uuidgen(&sb->ts_uuid);
+
+	/* Configure the first daxdev */
+	sb->ts_num_daxdevs = 1;
+	sb->ts_devlist[0].dd_size = device_size;
+	strncpy(sb->ts_devlist[0].dd_daxdev, daxdev, FAMFS_DEVNAME_LEN);
+
+	/* Calculate superblock crc */
+	sb->ts_crc = famfs_gen_superblock_crc(sb); /* gotta do this last! */
+
+	/* Zero and setup the log */
+	memset(logp, 0, FAMFS_LOG_LEN);
+	logp->famfs_log_magic      = FAMFS_LOG_MAGIC;
+	logp->famfs_log_len        = FAMFS_LOG_LEN;
+	logp->famfs_log_data_len   = FAMFS_LOG_LEN - sizeof(struct famfs_log);
+	logp->famfs_log_next_seqnum    = 0;
+	logp->famfs_log_next_index = 0;
+	logp->famfs_log_next_offset = 0;
+	logp->famfs_log_flags      = FAMFS_LOG_CRC32C;
+
+	logp->famfs_log_crc = famfs_gen_log_header_crc(logp);
+	famfs_fsck_scan(sb, logp, 1, 1, 0);
+
+	/* Force a writeback of the log followed by the superblock */
+	flush_processor_cache(logp, logp->famfs_log_len);
+	flush_processor_cache(sb, sb->ts_log_offset);
+	return 0;
 }
 
-/**
- * famfs_clone()
- *
- *
- * This function is for generating cross-linked file errors, and should be compiled out
- * of the library when not needed for that purpose.
- */
 int
-famfs_clone(const char *srcfile,
-	    const char *destfile,
-	    int   verbose)
+famfs_mkfs(const char *daxdev,
+	   int         kill,
+	   int         force)
 {
-	struct famfs_ioc_map filemap = {0};
-	struct famfs_extent *ext_list = NULL;
-	char srcfullpath[PATH_MAX];
-	char destfullpath[PATH_MAX];
-	int lfd = 0;
-	int sfd = 0;
-	int dfd = 0;
-	char mpt_out[PATH_MAX];
-	char *relpath = NULL;
-	struct famfs_log *logp;
-	void *addr;
-	size_t log_size;
-	struct famfs_simple_extent *se = NULL;
-	int src_role, dest_role;
-	uuid_le src_fs_uuid, dest_fs_uuid;
-	struct stat src_stat;
 	int rc;
+	size_t devsize;
+	enum famfs_extent_type type = SIMPLE_DAX_EXTENT;
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	u64 min_devsize = 4 * 1024ll * 1024ll * 1024ll;
+	char *mpt = NULL;
 
-	/* srcfile must already exist; Go ahead and check that first */
-	if (realpath(srcfile, srcfullpath) == NULL) {
-		fprintf(stderr, "%s: bad source path %s\n", __func__, srcfile);
+	mpt = famfs_get_mpt_by_dev(daxdev);
+	if (mpt) {
+		fprintf(stderr, "%s: cannot mkfs while %s is mounted on %s\n",
+				__func__, daxdev, mpt);
 		return -1;
 	}
-	/* and srcfile must be in famfs... */
-	if (file_not_famfs(srcfullpath)) {
-		fprintf(stderr, "%s: source path (%s) not in a famfs file system\n",
-			__func__, srcfullpath);
-		return -1;
+
+	if (kill) {
+		rc = famfs_mmap_superblock_and_log_raw(daxdev, &sb, &logp, 0 /* read/write */);
+		if (rc) {
+			fprintf(stderr, "Failed to mmap superblock\n");
+			return -1;
+		}
+		printf("Famfs superblock killed\n");
+		sb->ts_magic = 0;
+		flush_processor_cache(&sb->ts_magic, sizeof(sb->ts_magic));
+		return 0;
 	}
-	rc = stat(srcfullpath, &src_stat);
+
+	rc = famfs_get_role_by_dev(daxdev);
 	if (rc < 0) {
-		fprintf(stderr, "%s: unable to stat srcfile %s\n", __func__, srcfullpath);
-		return -1;
+		fprintf(stderr, "%s: failed to establish role\n", __func__);
+		return rc;
 	}
 
-	/*
-	 * Need to confirm that both files are inn the same file system. Otherwise,
-	 * the cloned extents will be double-invalid on the second file :(
+	/* If the role is FAMFS_CLIENT, there is a superblock already;
+	 * if the role is not FAMFS_CLIENT, its' either FAMFS_MASTER OR FAMFS_NOSUPER;
+	 * In either of those cases it's ok to mkfs.
+	 *
+	 * If the role is FAMFS_CLIENT, they'll have to manually blow away the superblock
+	 * if they want to do a new mkfs.
 	 */
-	src_role = famfs_get_role_by_path(srcfile, &src_fs_uuid);
-	dest_role = famfs_get_role_by_path(destfile, &dest_fs_uuid);
-	if (src_role < 0) {
-		fprintf(stderr, "%s: Error: unable to check role for src file %s\n",
-			__func__, srcfullpath);
-		return -1;
+	if (rc == FAMFS_CLIENT) {
+		fprintf(stderr, "Error: Device %s has a superblock owned by"
+				" another host.\n", daxdev);
+		return rc;
 	}
-	if (dest_role < 0) {
-		fprintf(stderr, "%s: Error: unable to check role for src file %s\n",
-			__func__, destfile);
+
+	rc = famfs_get_device_size(daxdev, &devsize, &type);
+	if (rc)
 		return -1;
+
+	printf("devsize: %ld\n", devsize);
+
+	if (devsize < min_devsize) {
+		fprintf(stderr, "%s: unsupported memory device size (<4GiB)\n", __func__);
+		return -EINVAL;
 	}
-	if ((src_role != dest_role) ||
-	    memcmp(&src_fs_uuid, &dest_fs_uuid, sizeof(src_fs_uuid)) != 0) {
-		fprintf(stderr,
-			"%s: Error: source and destination must be in the same file system\n",
-			__func__);
+
+	/* XXX Get role first via read-only sb. If daxdev contains a fs that was not
+	 * created on this host, fail unless force is specified
+	 */
+
+	rc = famfs_mmap_superblock_and_log_raw(daxdev, &sb, &logp, 0 /* read/write */);
+	if (rc)
 		return -1;
+
+	return __famfs_mkfs(daxdev, sb, logp, devsize, force, kill);
+}
+
+/*
+ * famfs check
+ *
+ * The tree is walked by a set of threads, each with a deque of directories still to be
+ * read. A thread pushes the subdirectories it finds onto the tail of its own deque and
+ * pops from the tail, so it goes depth first and its deque stays short; when its deque
+ * is empty it steals from the head of another thread's deque, where the oldest (and
+ * usually largest) subtrees are. Entries are stat'ed and opened relative to their
+ * directory's fd: the only path built is each directory's relative path.
+ *
+ * With the log, each entry is also looked up in the namespace the log describes (see
+ * famfs_ns_build()). Files must be logged as files, with the same size (and number of
+ * extents), directories must be in the log, and logged files or directories that
+ * weren't found are reported at the end. The .meta directory isn't logged.
+ */
+struct famfs_check_dir {
+	struct famfs_ns_node *node;   /* in the log namespace, or NULL */
+	int                   meta;   /* .meta, or under it */
+	size_t                len;
+	char                  relpath[]; /* "" for the mount point */
+};
+
+struct famfs_check_deque {
+	pthread_mutex_t          lock;
+	struct famfs_check_dir **dirs; /* ring */
+	u64                      head; /* thieves take from here... */
+	u64                      tail; /* ...and the owner pushes and pops here */
+	u64                      size; /* power of 2 */
+};
+
+struct famfs_check;
+
+struct famfs_check_thread {
+	struct famfs_check       *ck;
+	int                       id;
+	struct famfs_check_deque  dq;
+	u64                       nfiles;
+	u64                       ndirs;
+	u64                       nerrs;
+	u64                       nsteals;
+};
+
+struct famfs_check {
+	const char                *mpt;
+	int                        mptfd;
+	const struct famfs_ns     *ns;      /* NULL unless checking against the log */
+	u64                        pending; /* directories queued or being read */
+	int                        nthreads;
+	int                        verbose;
+	struct famfs_check_thread *threads;
+};
+
+#define FAMFS_CHECK_DEQUE_MIN 64
+
+static int
+famfs_check_push(struct famfs_check_deque *dq, struct famfs_check_dir *d)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail - dq->head == dq->size) {
+		u64 size = (dq->size) ? 2 * dq->size : FAMFS_CHECK_DEQUE_MIN;
+		struct famfs_check_dir **dirs = malloc(size * sizeof(*dirs));
+		u64 i;
+
+		if (!dirs) {
+			pthread_mutex_unlock(&dq->lock);
+			return -ENOMEM;
+		}
+		for (i = dq->head; i < dq->tail; i++)
+			dirs[i & (size - 1)] = dq->dirs[i & (dq->size - 1)];
+		free(dq->dirs);
+		dq->dirs = dirs;
+		dq->size = size;
+	}
+	dq->dirs[dq->tail++ & (dq->size - 1)] = d;
+	pthread_mutex_unlock(&dq->lock);
+	return 0;
+}
+
+/* Take from the tail (@steal == 0) or the head */
+static struct famfs_check_dir *
+famfs_check_pop(struct famfs_check_deque *dq, int steal)
+{
+	struct famfs_check_dir *d = NULL;
+
+	/* Racy peek; an empty deque isn't worth the lock */
+	if (__atomic_load_n(&dq->tail, __ATOMIC_RELAXED) ==
+	    __atomic_load_n(&dq->head, __ATOMIC_RELAXED))
+		return NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		if (steal)
+			d = dq->dirs[dq->head++ & (dq->size - 1)];
+		else
+			d = dq->dirs[--dq->tail & (dq->size - 1)];
 	}
-	if (src_role != FAMFS_MASTER) {
-		fprintf(stderr, "%s: file creation not allowed on client systems\n", __func__);
-		return -EPERM;
+	pthread_mutex_unlock(&dq->lock);
+	return d;
+}
+
+/* Queue the subdirectory @name of @parent (NULL: the mount point) */
+static int
+famfs_check_queue(struct famfs_check_thread *t,
+		  const struct famfs_check_dir *parent,
+		  const char *name,
+		  struct famfs_ns_node *node,
+		  int meta)
+{
+	size_t nlen = (parent) ? strlen(name) : 0;
+	size_t len = (parent && parent->len) ? parent->len + 1 + nlen : nlen;
+	struct famfs_check_dir *d;
+
+	if (len >= PATH_MAX)
+		return -ENAMETOOLONG;
+	d = malloc(sizeof(*d) + len + 1);
+	if (!d)
+		return -ENOMEM;
+	d->node = node;
+	d->meta = meta;
+	d->len = len;
+	if (parent && parent->len) {
+		memcpy(d->relpath, parent->relpath, parent->len);
+		d->relpath[parent->len] = '/';
+	}
+	memcpy(&d->relpath[len - nlen], name, nlen);
+	d->relpath[len] = 0;
+
+	/* Count it before the parent is done, so pending can't drop to 0 early */
+	__atomic_add_fetch(&t->ck->pending, 1, __ATOMIC_ACQ_REL);
+	if (famfs_check_push(&t->dq, d)) {
+		__atomic_sub_fetch(&t->ck->pending, 1, __ATOMIC_ACQ_REL);
+		free(d);
+		return -ENOMEM;
 	}
-	/* FAMFS_MASTER role now confirmed, and the src and destination are in the same famfs */
+	return 0;
+}
 
-	/*
-	 * Open source file and make sure it's a famfs file
-	 */
-	sfd = open(srcfullpath, O_RDONLY, 0);
-	if (sfd < 0) {
-		fprintf(stderr, "%s: failed to open source file %s\n",
-			__func__, srcfullpath);
-		return -1;
+/* Check a regular file against its map and the log */
+static void
+famfs_check_file(struct famfs_check_thread *t,
+		 const struct famfs_check_dir *d,
+		 int dfd,
+		 const char *name,
+		 const struct stat *st,
+		 struct famfs_ns_node *n)
+{
+	const char *sep = (d->len) ? "/" : "";
+	struct famfs_check *ck = t->ck;
+	struct famfs_ioc_map filemap = {0};
+	const struct famfs_file_creation *fc;
+	int fd;
+
+	t->nfiles++;
+	if (!mock_kmod) {
+		fd = openat(dfd, name, O_RDONLY, 0);
+		if (fd < 0) {
+			fprintf(stderr, "famfs_check: failed to open file %s/%s%s%s\n",
+				ck->mpt, d->relpath, sep, name);
+			return;
+		}
+		if (ioctl(fd, FAMFSIOC_MAP_GET, &filemap)) {
+			fprintf(stderr, "famfs_check: Error file not mapped: %s/%s%s%s\n",
+				ck->mpt, d->relpath, sep, name);
+			t->nerrs++;
+			close(fd);
+			return;
+		}
+		close(fd);
 	}
-	if (__file_not_famfs(sfd)) {
-		fprintf(stderr, "%s: source file %s is not a famfs file\n",
-			__func__, srcfullpath);
-		return -1;
+
+	if (!ck->ns || d->meta)
+		return;
+
+	if (!n || !n->le || n->le->famfs_log_entry_type != FAMFS_LOG_FILE) {
+		fprintf(stderr, "famfs_check: file not in log: %s/%s%s%s\n",
+			ck->mpt, d->relpath, sep, name);
+		t->nerrs++;
+		return;
 	}
+	n->on_disk = DT_REG;
+	fc = &n->le->famfs_fc;
+	if ((u64)st->st_size != fc->famfs_fc_size ||
+	    (!mock_kmod && filemap.ext_list_count != fc->famfs_nextents)) {
+		fprintf(stderr, "famfs_check: file doesn't match log (size %lld/%lld, "
+			"%lld/%lld extents): %s/%s%s%s\n",
+			(s64)st->st_size, fc->famfs_fc_size,
+			(mock_kmod) ? (s64)fc->famfs_nextents : (s64)filemap.ext_list_count,
+			(s64)fc->famfs_nextents, ck->mpt, d->relpath, sep, name);
+		t->nerrs++;
+	}
+}
 
-	/*
-	 * Get map for source file
-	 */
-	rc = ioctl(sfd, FAMFSIOC_MAP_GET, &filemap);
-	if (rc) {
-		fprintf(stderr, "%s: MAP_GET returned %d errno %d\n", __func__, rc, errno);
-		goto err_out;
+static void
+famfs_check_dir(struct famfs_check_thread *t, const struct famfs_check_dir *d)
+{
+	const char *sep = (d->len) ? "/" : "";
+	struct famfs_check *ck = t->ck;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int fd;
+
+	fd = (d->len) ? openat(ck->mptfd, d->relpath, O_RDONLY | O_DIRECTORY) :
+		dup(ck->mptfd);
+	dir = (fd >= 0) ? fdopendir(fd) : NULL;
+	if (!dir) {
+		fprintf(stderr, "famfs_check: failed to open dir %s/%s\n", ck->mpt, d->relpath);
+		if (fd >= 0)
+			close(fd);
+		t->nerrs++;
+		return;
 	}
-	ext_list = calloc(filemap.ext_list_count, sizeof(struct famfs_extent));
-	rc = ioctl(sfd, FAMFSIOC_MAP_GETEXT, ext_list);
-	if (rc) {
-		fprintf(stderr, "%s: GETEXT returned %d errno %d\n", __func__, rc, errno);
-		goto err_out;
+
+	while ((de = readdir(dir)) != NULL) {
+		const char *name = de->d_name;
+		struct famfs_ns_node *n = NULL;
+		int meta = d->meta;
+
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+
+		if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW)) {
+			fprintf(stderr, "famfs_check: failed to stat %s/%s%s%s\n",
+				ck->mpt, d->relpath, sep, name);
+			t->nerrs++;
+			continue;
+		}
+
+		if (ck->verbose)
+			printf("famfs_check:  %s/%s%s%s\n", ck->mpt, d->relpath, sep, name);
+
+		if (ck->ns && d->node)
+			n = famfs_ns_lookup(ck->ns, d->node, name, strlen(name));
+
+		switch (st.st_mode & S_IFMT) {
+		case S_IFREG:
+			famfs_check_file(t, d, dirfd(dir), name, &st, n);
+			break;
+
+		case S_IFDIR:
+			t->ndirs++;
+			if (!d->len && strcmp(name, ".meta") == 0)
+				meta = 1;
+			if (ck->ns && !meta) {
+				if (!n || (n->le &&
+					   n->le->famfs_log_entry_type != FAMFS_LOG_MKDIR)) {
+					fprintf(stderr,
+						"famfs_check: directory not in log: %s/%s%s%s\n",
+						ck->mpt, d->relpath, sep, name);
+					t->nerrs++;
+					n = NULL;
+				} else {
+					n->on_disk = DT_DIR;
+				}
+			}
+			if (famfs_check_queue(t, d, name, n, meta)) {
+				fprintf(stderr, "famfs_check: unable to queue dir %s/%s%s%s\n",
+					ck->mpt, d->relpath, sep, name);
+				t->nerrs++;
+			}
+			break;
+
+		default:
+			if (ck->verbose)
+				fprintf(stderr,
+					"famfs_check: skipping non-file or directory %s/%s%s%s\n",
+					ck->mpt, d->relpath, sep, name);
+		}
 	}
+	closedir(dir);
+}
+
+static void
+famfs_check_worker(void *arg)
+{
+	struct famfs_check_thread *t = arg;
+	struct famfs_check *ck = t->ck;
+	struct famfs_check_dir *d;
+	int idle = 0;
+	int i;
 
-	/*
-	 * For this operation we need to open the log file, which also gets us
-	 * the mount point path
-	 */
-	lfd = open_log_file_writable(srcfullpath, &log_size, mpt_out, BLOCKING_LOCK);
-	addr = mmap(0, log_size, PROT_READ | PROT_WRITE, MAP_SHARED, lfd, 0);
-	if (addr == MAP_FAILED) {
-		fprintf(stderr, "%s: Failed to mmap log file\n", __func__);
-		rc = -1;
-		goto err_out;
+	for (;;) {
+		d = famfs_check_pop(&t->dq, 0);
+		for (i = 1; !d && i < ck->nthreads; i++) {
+			d = famfs_check_pop(&ck->threads[(t->id + i) % ck->nthreads].dq, 1);
+			if (d)
+				t->nsteals++;
+		}
+		if (d) {
+			famfs_check_dir(t, d);
+			free(d);
+			__atomic_sub_fetch(&ck->pending, 1, __ATOMIC_ACQ_REL);
+			idle = 0;
+			continue;
+		}
+
+		/* Nothing to steal; done when nobody is reading a dir that might have more */
+		if (__atomic_load_n(&ck->pending, __ATOMIC_ACQUIRE) == 0)
+			break;
+		if (idle++ < 64)
+			sched_yield();
+		else
+			usleep(100);
 	}
-	logp = (struct famfs_log *)addr;
+}
 
-	/* Clone is only allowed on the master, so we don't need to invalidate the cache */
+/* Count the logged nodes under @n that weren't found */
+static u64
+famfs_check_missing(const struct famfs_ns_node *n, char *path, size_t pathlen)
+{
+	const struct famfs_ns_node *c;
+	u64 nerrs = 0;
 
-	/* Create the destination file. This will be unlinked later if we don't get all
-	 * the way through the operation.
-	 */
-	dfd = famfs_file_create(destfile, src_stat.st_mode, src_stat.st_uid, src_stat.st_gid, 0);
-	if (dfd < 0) {
-		fprintf(stderr, "%s: failed to create file %s\n", __func__, destfile);
-		rc = -1;
-		goto err_out;
+	for (c = n->child; c; c = c->sibling) {
+		if (pathlen + 1 + c->namelen >= PATH_MAX)
+			continue;
+		path[pathlen] = '/';
+		memcpy(&path[pathlen + 1], c->name, c->namelen + 1);
+		if (c->le && c->on_disk == DT_UNKNOWN) {
+			fprintf(stderr, "famfs_check: logged %s not found: %s\n",
+				(c->le->famfs_log_entry_type == FAMFS_LOG_FILE) ?
+				"file" : "directory", path);
+			nerrs++;
+		}
+		nerrs += famfs_check_missing(c, path, pathlen + 1 + c->namelen);
+		path[pathlen] = 0;
 	}
+	return nerrs;
+}
 
-	/*
-	 * Create the file before logging, so we can avoid a BS log entry if the
-	 * kernel rejects the caller-supplied allocation ext list
-	 */
-	/* Ugh need to unify extent types... XXX */
-	se = famfs_ext_to_simple_ext(ext_list, filemap.ext_list_count);
-	if (!se) {
-		rc = -ENOMEM;
-		goto err_out;
+/**
+ * __famfs_check()
+ *
+ * Check every file under @mpt
+ *
+ * @logp     - if non-NULL, also check the tree against this log
+ * @nthreads - threads walking the tree (<= 1 walks it in this thread)
+ * @stats    - nfiles, ndirs, nerrs (out)
+ *
+ * Return value: 0 if no errors were found, 1 if some were, or a negative errno if the
+ * check couldn't be done
+ */
+int
+__famfs_check(const char             *mpt,
+	      const struct famfs_log *logp,
+	      int                     nthreads,
+	      u64                    *stats,
+	      int                     verbose)
+{
+	struct famfs_log_stats ls = { 0 };
+	struct famfs_check ck = { 0 };
+	struct famfs_log_iter it;
+	struct famfs_ns *ns = NULL;
+	struct thpool *pool = NULL;
+	int rc = 0;
+	int i;
+
+	memset(stats, 0, 3 * sizeof(*stats));
+	if (nthreads < 1)
+		nthreads = 1;
+
+	if (logp) {
+		famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+		ns = famfs_ns_build(&it, &ls, 0);
+		if (!ns) {
+			fprintf(stderr, "%s: unable to read the log\n", __func__);
+			return -EINVAL;
+		}
+		/* Invalid log entries are errors too */
+		stats[2] += ls.f_errs + ls.d_errs;
+	}
+
+	ck.mpt = mpt;
+	ck.ns = ns;
+	ck.nthreads = nthreads;
+	ck.verbose = verbose;
+	ck.mptfd = open(mpt, O_RDONLY | O_DIRECTORY);
+	if (ck.mptfd < 0) {
+		fprintf(stderr, "%s: failed to open %s\n", __func__, mpt);
+		famfs_ns_free(ns);
+		return -errno;
 	}
-	rc = famfs_file_map_create(destfile, dfd, filemap.file_size, filemap.ext_list_count,
-				   se, FAMFS_REG);
-	if (rc) {
-		fprintf(stderr, "%s: failed to create destination file\n", __func__);
-		goto err_out;
+	ck.threads = calloc(nthreads, sizeof(*ck.threads));
+	assert(ck.threads);
+	for (i = 0; i < nthreads; i++) {
+		ck.threads[i].ck = &ck;
+		ck.threads[i].id = i;
+		pthread_mutex_init(&ck.threads[i].dq.lock, NULL);
 	}
 
-	/* Now have created the destination file (and therefore we know it is in a famfs
-	 * mount, we need its relative path of
-	 */
-	assert(realpath(destfile, destfullpath));
-
-	relpath = famfs_relpath_from_fullpath(mpt_out, destfullpath);
-	if (!relpath) {
-		rc = -1;
-		unlink(destfullpath);
-		goto err_out;
+	if (famfs_check_queue(&ck.threads[0], NULL, "", (ns) ? &ns->root : NULL, 0)) {
+		rc = -ENOMEM;
+		goto out;
 	}
 
-	rc = famfs_log_file_creation(logp, filemap.ext_list_count, se,
-				     relpath, src_stat.st_mode, src_stat.st_uid, src_stat.st_gid,
-				     filemap.file_size);
-	if (rc) {
-		fprintf(stderr,
-			"%s: failed to log caller-specified allocation\n",
-			__func__);
-		rc = -1;
-		unlink(destfullpath);
-		goto err_out;
+	if (nthreads > 1) {
+		pool = thpool_init(nthreads, 0);
+		if (!pool)
+			fprintf(stderr, "%s: checking in a single thread\n", __func__);
+	}
+	for (i = 0; i < nthreads; i++) {
+		/* Without workers, this thread takes everything they would have */
+		if (!pool || thpool_add_work(pool, famfs_check_worker, &ck.threads[i]))
+			famfs_check_worker(&ck.threads[i]);
+	}
+	if (pool) {
+		thpool_wait(pool);
+		thpool_destroy(pool);
 	}
 
-	rc = 0;
-	close(lfd); /* Closing releases the lock */
-	lfd = 0;
-	/***************/
+	if (ns) {
+		char path[PATH_MAX];
 
-err_out:
-	free(ext_list);
-	free(se);
-	if (lfd > 0)
-		close(lfd);
-	if (sfd > 0)
-		close(sfd);
-	if (dfd > 0)
-		close(dfd);
-	return rc;
+		strncpy(path, mpt, PATH_MAX - 1);
+		path[PATH_MAX - 1] = 0;
+		stats[2] += famfs_check_missing(&ns->root, path, strlen(path));
+	}
+
+out:
+	for (i = 0; i < nthreads; i++) {
+		struct famfs_check_thread *t = &ck.threads[i];
+
+		stats[0] += t->nfiles;
+		stats[1] += t->ndirs;
+		stats[2] += t->nerrs;
+		if (verbose > 1 && nthreads > 1)
+			printf("%s: thread %d: %lld files, %lld directories, %lld steals\n",
+			       __func__, i, t->nfiles, t->ndirs, t->nsteals);
+		free(t->dq.dirs);
+		pthread_mutex_destroy(&t->dq.lock);
+	}
+	free(ck.threads);
+	close(ck.mptfd);
+	famfs_ns_free(ns);
+	if (rc)
+		return rc;
+	return (stats[2]) ? 1 : 0;
 }
 
 /**
- * __famfs_mkfs()
+ * famfs_check()
  *
- * This handller can be called by unit tests; the actual device open/mmap is
- * done by the caller, so an alternate caller can arrange for a superblock and log
- * to be written to alternate files/locations.
+ * @nthreads - threads walking the tree
+ * @use_log  - also check the tree against the log
+ *
+ * Return value: 0 if everything checks out, otherwise the bitwise or of 1 (a bad file),
+ * 2 (superblock missing) and 4 (log missing or invalid); or -1 if @path isn't a famfs
+ * mount point with metadata
  */
 int
-__famfs_mkfs(const char              *daxdev,
-	     struct famfs_superblock *sb,
-	     struct famfs_log        *logp,
-	     u64                      device_size,
-	     int                      force,
-	     int                      kill)
-
+famfs_check(const char *path,
+	    int         nthreads,
+	    int         use_log,
+	    int         verbose)
 {
-	int rc;
+	struct famfs_log *logp = NULL;
+	char metadir[PATH_MAX];
+	char logpath[PATH_MAX];
+	char dev_out[PATH_MAX];
+	char sbpath[PATH_MAX];
+	struct stat st;
+	u64 stats[3];
+	u64 nerrs = 0;
+	int rc = 0;
 
-	if ((famfs_check_super(sb) == 0) && !force) {
-		fprintf(stderr, "Device %s already has a famfs superblock\n", daxdev);
+	if (path[0] != '/') {
+		fprintf(stderr, "%s: must use absolute path of mount point\n", __func__);
 		return -1;
 	}
-
-	if (kill) {
-		printf("Famfs superblock killed\n");
-		sb->ts_magic = 0;
-		flush_processor_cache(sb, sb->ts_log_offset);
-		return 0;
+	if (!famfs_path_is_mount_pt(path, dev_out)) {
+		fprintf(stderr, "%s: path (%s) is not a famfs mount point\n", __func__, path);
+		return -1;
 	}
 
-	rc = famfs_get_system_uuid(&sb->ts_system_uuid);
-	if (rc) {
-		fprintf(stderr, "mkfs.famfs: unable to get system uuid");
+	snprintf(metadir, PATH_MAX - 1, "%s/.meta", path);
+	snprintf(sbpath, PATH_MAX - 1, "%s/.meta/.superblock", path);
+	snprintf(logpath, PATH_MAX - 1, "%s/.meta/.log", path);
+	if (stat(metadir, &st)) {
+		fprintf(stderr, "%s: Need to run mkmeta on device %s for this file system\n",
+			__func__, dev_out);
 		return -1;
 	}
-	sb->ts_magic      = FAMFS_SUPER_MAGIC;
-	sb->ts_version    = FAMFS_CURRENT_VERSION;
-	sb->ts_log_offset = FAMFS_LOG_OFFSET;
-	sb->ts_log_len    = FAMFS_LOG_LEN;
-	famfs_uuidgen(&sb->ts_uuid);
+	if (stat(sbpath, &st)) {
+		fprintf(stderr, "%s: superblock file not found for file system %s\n",
+			__func__, path);
+		nerrs++;
+		rc |= 2;
+	}
+	if (stat(logpath, &st)) {
+		fprintf(stderr, "%s: log file not found for file system %s\n",
+			__func__, path);
+		nerrs++;
+		rc |= 4;
+	} else if (use_log) {
+		logp = famfs_map_log_by_path(path, 1 /* read only */, NO_LOCK);
+		if (!logp || famfs_validate_log_header(logp)) {
+			fprintf(stderr, "%s: invalid log for file system %s\n", __func__, path);
+			nerrs++;
+			rc |= 4;
+			if (logp)
+				munmap(logp, logp->famfs_log_len);
+			logp = NULL;
+		}
+	}
 
-	/* Configure the first daxdev */
-	sb->ts_num_daxdevs = 1;
-	sb->ts_devlist[0].dd_size = device_size;
-	strncpy(sb->ts_devlist[0].dd_daxdev, daxdev, FAMFS_DEVNAME_LEN);
+	if (__famfs_check(path, logp, nthreads, stats, verbose))
+		rc |= 1;
+	if (logp)
+		munmap(logp, logp->famfs_log_len);
+	nerrs += stats[2];
+	printf("%s: %lld files, %lld directories, %lld errors\n", __func__,
+	       stats[0], stats[1], nerrs);
+	return rc;
+}
 
-	/* Calculate superblock crc */
-	sb->ts_crc = famfs_gen_superblock_crc(sb); /* gotta do this last! */
+/*
+ * famfs flush
+ *
+ * Files are mapped once, and shared by the ranges they're split into. Large files are
+ * split into FAMFS_FLUSH_CHUNKSIZE chunks, and small files (or the ends of large ones)
+ * are batched up to that size, so the work spreads evenly across the threads. Each
+ * batch gets one barrier on each side, rather than two per file.
+ */
+struct famfs_flush_map {
+	void   *addr;
+	size_t  size;
+	int     refs;  /* Ranges still to be flushed, plus the caller while adding them */
+};
 
-	/* Zero and setup the log */
-	memset(logp, 0, FAMFS_LOG_LEN);
-	logp->famfs_log_magic      = FAMFS_LOG_MAGIC;
-	logp->famfs_log_len        = FAMFS_LOG_LEN;
-	logp->famfs_log_next_seqnum    = 0;
-	logp->famfs_log_next_index = 0;
-	logp->famfs_log_last_index = (((FAMFS_LOG_LEN - offsetof(struct famfs_log, entries))
-				      / sizeof(struct famfs_log_entry)) - 1);
+struct famfs_flush_batch {
+	int nranges;
+	u64 nbytes;
+	struct {
+		struct famfs_flush_map *map;
+		u64 offset;
+		u64 len;
+	} r[FAMFS_FLUSH_BATCH_RANGES];
+};
 
-	logp->famfs_log_crc = famfs_gen_log_header_crc(logp);
-	famfs_fsck_scan(sb, logp, 1, 0);
+struct famfs_flush {
+	struct thpool            *pool;   /* NULL to flush inline */
+	struct famfs_flush_batch *batch;  /* Being filled */
+	struct timespec           start;
+	u64                       nfiles;
+	u64                       nbytes;
+	u64                       nerrors;
+	int                       verbose;
+};
 
-	/* Force a writeback of the log followed by the superblock */
-	flush_processor_cache(logp, logp->famfs_log_len);
-	flush_processor_cache(sb, sb->ts_log_offset);
-	return 0;
+static void
+famfs_flush_map_put(struct famfs_flush_map *map)
+{
+	if (__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		munmap(map->addr, map->size);
+		free(map);
+	}
 }
 
-int
-famfs_mkfs(const char *daxdev,
-	   int         kill,
-	   int         force)
+static void
+famfs_flush_batch_worker(void *arg)
 {
-	int rc;
-	size_t devsize;
-	enum famfs_extent_type type = SIMPLE_DAX_EXTENT;
-	struct famfs_superblock *sb;
-	struct famfs_log *logp;
-	u64 min_devsize = 4 * 1024ll * 1024ll * 1024ll;
-	char *mpt = NULL;
+	struct famfs_flush_batch *b = arg;
+	int i;
 
-	mpt = famfs_get_mpt_by_dev(daxdev);
-	if (mpt) {
-		fprintf(stderr, "%s: cannot mkfs while %s is mounted on %s\n",
-				__func__, daxdev, mpt);
-		return -1;
-	}
+	/* We don't know if the caller needs a flush or an invalidate; barriers on both sides */
+	if (!mock_flush)
+		__builtin_ia32_mfence();
+	for (i = 0; i < b->nranges; i++) {
+		__flush_processor_cache((char *)b->r[i].map->addr + b->r[i].offset,
+					b->r[i].len);
+		if (!mock_flush)
+			FAMFS_STAT_ADD(flush_bytes, b->r[i].len);
+	}
+	if (!mock_flush)
+		__builtin_ia32_mfence();
+
+	for (i = 0; i < b->nranges; i++)
+		famfs_flush_map_put(b->r[i].map);
+	free(b);
+}
 
-	if (kill) {
-		rc = famfs_mmap_superblock_and_log_raw(daxdev, &sb, &logp, 0 /* read/write */);
-		if (rc) {
-			fprintf(stderr, "Failed to mmap superblock\n");
-			return -1;
-		}
-		printf("Famfs superblock killed\n");
-		sb->ts_magic = 0;
-		flush_processor_cache(&sb->ts_magic, sizeof(sb->ts_magic));
-		return 0;
-	}
+static void
+famfs_flush_submit(struct famfs_flush *fl)
+{
+	struct famfs_flush_batch *b = fl->batch;
 
-	rc = famfs_get_role_by_dev(daxdev);
-	if (rc < 0) {
-		fprintf(stderr, "%s: failed to establish role\n", __func__);
-		return rc;
-	}
+	if (!b)
+		return;
+	fl->batch = NULL;
+	if (!fl->pool || thpool_add_work(fl->pool, famfs_flush_batch_worker, b))
+		famfs_flush_batch_worker(b); /* Inline, or couldn't queue it */
+}
 
-	/* If the role is FAMFS_CLIENT, there is a superblock already;
-	 * if the role is not FAMFS_CLIENT, its' either FAMFS_MASTER OR FAMFS_NOSUPER;
-	 * In either of those cases it's ok to mkfs.
-	 *
-	 * If the role is FAMFS_CLIENT, they'll have to manually blow away the superblock
-	 * if they want to do a new mkfs.
-	 */
-	if (rc == FAMFS_CLIENT) {
-		fprintf(stderr, "Error: Device %s has a superblock owned by"
-				" another host.\n", daxdev);
-		return rc;
+static void
+famfs_flush_add(struct famfs_flush *fl, struct famfs_flush_map *map, u64 offset, u64 len)
+{
+	struct famfs_flush_batch *b = fl->batch;
+
+	if (!b) {
+		b = calloc(1, sizeof(*b));
+		assert(b);
+		fl->batch = b;
+	}
+	__atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+	b->r[b->nranges].map = map;
+	b->r[b->nranges].offset = offset;
+	b->r[b->nranges].len = len;
+	b->nranges++;
+	b->nbytes += len;
+	if (b->nranges == FAMFS_FLUSH_BATCH_RANGES || b->nbytes >= FAMFS_FLUSH_CHUNKSIZE)
+		famfs_flush_submit(fl);
+}
+
+/**
+ * famfs_flush_start()
+ *
+ * @nthreads - Flush threads (1 flushes inline, as ranges are added)
+ */
+struct famfs_flush *
+famfs_flush_start(int nthreads, int verbose)
+{
+	struct famfs_flush *fl = calloc(1, sizeof(*fl));
+
+	assert(fl);
+	fl->verbose = verbose;
+	clock_gettime(CLOCK_MONOTONIC, &fl->start);
+	if (nthreads > 1) {
+		fl->pool = thpool_init(nthreads, 0);
+		if (!fl->pool)
+			fprintf(stderr, "%s: failed to start %d flush threads; flushing inline\n",
+				__func__, nthreads);
+	}
+	return fl;
+}
+
+/**
+ * famfs_flush_range()
+ *
+ * Queue a flush (write back and invalidate) of part of a file
+ *
+ * @len - 0 means to the end of the file; ranges past the end are trimmed
+ *
+ * Return value: 0 if queued, 1 if the file couldn't be mapped, 2 if it's not a regular
+ * file, 3 if it doesn't exist
+ */
+int
+famfs_flush_range(struct famfs_flush *fl, const char *filename, u64 offset, u64 len)
+{
+	struct famfs_flush_map *map;
+	struct stat st;
+	u64 end;
+	int rc;
+
+	rc = stat(filename, &st);
+	if (rc < 0) {
+		fprintf(stderr, "%s: file not found (%s)\n", __func__, filename);
+		return 3;
+	}
+	if ((st.st_mode & S_IFMT) != S_IFREG) {
+		if (fl->verbose)
+			fprintf(stderr, "%s: not a regular file: (%s)\n", __func__, filename);
+		return 2;
 	}
 
-	rc = famfs_get_device_size(daxdev, &devsize, &type);
-	if (rc)
-		return -1;
-
-	printf("devsize: %ld\n", devsize);
+	/* Only flush regular files */
 
-	if (devsize < min_devsize) {
-		fprintf(stderr, "%s: unsupported memory device size (<4GiB)\n", __func__);
-		return -EINVAL;
+	map = calloc(1, sizeof(*map));
+	assert(map);
+	map->addr = famfs_mmap_whole_file(filename, 1, &map->size);
+	if (!map->addr) {
+		free(map);
+		fl->nerrors++;
+		return 1;
 	}
+	map->refs = 1;
 
-	/* XXX Get role first via read-only sb. If daxdev contains a fs that was not
-	 * created on this host, fail unless force is specified
-	 */
+	end = (len && offset + len < map->size) ? offset + len : map->size;
+	if (fl->verbose > 1)
+		printf("%s: flushing: %s [%lld, %lld)\n", __func__, filename,
+		       MIN(offset, end), end);
 
-	rc = famfs_mmap_superblock_and_log_raw(daxdev, &sb, &logp, 0 /* read/write */);
-	if (rc)
-		return -1;
+	fl->nfiles++;
+	for (; offset < end; offset += FAMFS_FLUSH_CHUNKSIZE) {
+		u64 n = MIN(FAMFS_FLUSH_CHUNKSIZE, end - offset);
 
-	return __famfs_mkfs(daxdev, sb, logp, devsize, force, kill);
+		famfs_flush_add(fl, map, offset, n);
+		fl->nbytes += n;
+	}
+	famfs_flush_map_put(map);
+	return 0;
 }
 
+/**
+ * famfs_flush_path()
+ *
+ * Like famfs_flush_range(), but with @recursive, a directory means the same range of
+ * every file under it
+ *
+ * Return value: as for famfs_flush_range(); 1 if any file under a directory failed
+ */
 int
-famfs_recursive_check(const char *dirpath,
-		      u64 *nfiles_out,
-		      u64 *ndirs_out,
-		      u64 *nerrs_out,
-		      int verbose)
+famfs_flush_path(
+	struct famfs_flush *fl,
+	const char         *path,
+	u64                 offset,
+	u64                 len,
+	int                 recursive)
 {
 	struct dirent *entry;
 	DIR *directory;
 	struct stat st;
-	u64 nfiles = 0;
-	u64 ndirs = 0;
 	int nerrs = 0;
 	int rc;
 
-	directory = opendir(dirpath);
+	if (!recursive || stat(path, &st) || (st.st_mode & S_IFMT) != S_IFDIR)
+		return famfs_flush_range(fl, path, offset, len);
+
+	directory = opendir(path);
 	if (directory == NULL) {
-		/* XXX is it possible to get here since we created the dir if it didn't exist? */
-		fprintf(stderr, "%s: failed to open src dir (%s)\n", __func__, dirpath);
-		return -1;
+		fprintf(stderr, "%s: failed to open dir (%s)\n", __func__, path);
+		return 1;
 	}
-
-	/* Loop through the directry entries */
 	while ((entry = readdir(directory)) != NULL) {
 		char fullpath[PATH_MAX];
-		struct famfs_ioc_map filemap = {0};
-		int fd;
 
 		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
 			continue;
 
-		snprintf(fullpath, PATH_MAX - 1, "%s/%s", dirpath, entry->d_name);
-		rc = stat(fullpath, &st);
-		if (rc) {
-			fprintf(stderr, "%s: failed to stat source path (%s)\n",
-				__func__, fullpath);
+		snprintf(fullpath, PATH_MAX - 1, "%s/%s", path, entry->d_name);
+		rc = famfs_flush_path(fl, fullpath, offset, len, recursive);
+		if (rc && rc != 2) /* Skip anything that isn't a file or directory */
 			nerrs++;
-			continue;
-		}
+	}
+	closedir(directory);
+	return (nerrs) ? 1 : 0;
+}
 
-		if (verbose)
-			printf("%s:  %s\n", __func__, fullpath);
+/**
+ * famfs_flush_finish()
+ *
+ * Flush anything still queued, wait for the threads and stop them, and report the
+ * throughput if verbose. @fl is freed.
+ *
+ * Return value: the number of files that couldn't be flushed
+ */
+u64
+famfs_flush_finish(struct famfs_flush *fl)
+{
+	struct timespec end;
+	u64 nerrors;
+	double secs;
+
+	famfs_flush_submit(fl);
+	if (fl->pool) {
+		thpool_wait(fl->pool);
+		thpool_destroy(fl->pool);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (double)(end.tv_sec - fl->start.tv_sec) +
+		(double)(end.tv_nsec - fl->start.tv_nsec) / 1e9;
+	if (fl->verbose)
+		printf("famfs flush: %lld files, %lld bytes in %.3f s (%.2f GB/s)\n",
+		       fl->nfiles, fl->nbytes, secs,
+		       (secs > 0) ? (double)fl->nbytes / 1e9 / secs : 0.0);
+
+	nerrors = fl->nerrors;
+	free(fl);
+	return nerrors;
+}
 
-		switch (st.st_mode & S_IFMT) {
-		case S_IFREG:
-			nfiles++;
-			fd = open(fullpath, O_RDONLY, 0);
-			if (fd <= 0) {
-				fprintf(stderr, "%s: failed to open file %s\n",
-					__func__, fullpath);
-				//nerrs++;
-				continue;
-			}
-			rc = ioctl(fd, FAMFSIOC_MAP_GET, &filemap);
-			if (rc) {
-				fprintf(stderr, "%s: Error file not mapped: %s\n",
-					__func__, fullpath);
-				nerrs++;
+int
+famfs_flush_file(const char *filename, int verbose)
+{
+	struct famfs_flush *fl = famfs_flush_start(1, verbose);
+	int rc;
+
+	rc = famfs_flush_range(fl, filename, 0, 0);
+	famfs_flush_finish(fl);
+	return rc;
+}
+
+/*
+ * Library context (see famfs_lib.h)
+ *
+ * The context holds a famfs_locked_log whose log stays mapped, but whose log lock is only
+ * held during a call. Between calls, other processes may log; at the start of each call,
+ * the records they added are invalidated and (if it's cached) added to the bitmap, so
+ * the cost is proportional to what changed rather than to the size of the log.
+ */
+struct famfs_ctx {
+	pthread_mutex_t          lock;     /* Serializes calls on the context */
+	struct famfs_locked_log  ll;
+	struct famfs_superblock *sb;
+	int                      writable; /* Master: the log is mapped writable */
+	struct famfs_log_pos     pos;      /* End of the log that the caches reflect */
+	u64                      epoch;
+	int                      verbose;
+};
+
+/*
+ * Bring the context up to date with the log. A rewritten (compacted) log drops the
+ * caches, which are rebuilt when they're next needed.
+ */
+static int
+famfs_ctx_catch_up(struct famfs_ctx *ctx)
+{
+	struct famfs_locked_log *lp = &ctx->ll;
+	struct famfs_log *logp = lp->logp;
+	u64 errors = 0, fsize_sum = 0, alloc_sum = 0;
+	struct famfs_log_stats ls = { 0 };
+	struct famfs_log_cursor c;
+	struct famfs_log_iter it;
+	int rc;
+
+	invalidate_processor_cache(&logp->famfs_log_next_seqnum, FAMFS_LOG_CURSOR_LEN);
+	rc = famfs_log_read_cursor(logp, &c);
+	if (rc) {
+		fprintf(stderr, "%s: log commit in progress for too long\n", __func__);
+		return rc;
+	}
+
+	if (c.epoch != ctx->epoch) {
+		invalidate_processor_cache(logp, logp->famfs_log_len);
+		free(lp->bitmap);
+		lp->bitmap = NULL;
+		famfs_dir_index_free(lp->dirs);
+		lp->dirs = NULL;
+	} else if (c.next_offset > ctx->pos.offset) {
+		invalidate_processor_cache(&logp->famfs_log_data[ctx->pos.offset],
+					   c.next_offset - ctx->pos.offset);
+		if (lp->bitmap) {
+			famfs_log_iter_init(&it, logp, &ctx->pos, FAMFS_LOG_ITER_NOPATHS);
+			famfs_bitmap_add_log_entries(lp->bitmap, lp->nbits, &it, &errors,
+						     &fsize_sum, &alloc_sum, &ls, NULL,
+						     ctx->verbose);
+			if (errors) {
+				fprintf(stderr, "%s: %lld errors in new log entries; "
+					"rebuilding bitmap\n", __func__, errors);
+				free(lp->bitmap);
+				lp->bitmap = NULL;
 			}
-			close(fd);
-			break;
+			if (ctx->verbose > 1)
+				printf("%s: %lld entries logged elsewhere\n",
+				       __func__, ls.n_entries);
+		}
+	}
+	ctx->pos.index = c.next_index;
+	ctx->pos.offset = c.next_offset;
+	ctx->epoch = c.epoch;
+	return 0;
+}
 
-		case S_IFDIR: {
-			u64 nfiles_out = 0;
-			u64 ndirs_out = 0;
-			u64 nerrs_out = 0;
-
-			ndirs++;
-			/* Recurse :D */
-			rc = famfs_recursive_check(fullpath, &nfiles_out, &ndirs_out,
-						   &nerrs_out, verbose);
-			nfiles += nfiles_out;
-			ndirs += ndirs_out;
-			nerrs += nerrs_out;
-			break;
+/*
+ * Start a call on the context; @log_lock takes the log lock too, for calls that log
+ */
+static int
+famfs_ctx_lock(struct famfs_ctx *ctx, int log_lock)
+{
+	u64 start;
+	int rc;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (log_lock) {
+		if (!ctx->writable) {
+			fprintf(stderr, "%s: not the master node for %s\n",
+				__func__, ctx->ll.mpt);
+			rc = -EROFS;
+			goto err_out;
 		}
-		default:
-			if (verbose)
-				fprintf(stderr,
-					"%s: skipping non-file or directory %s\n",
-					__func__, fullpath);
+		start = FAMFS_STAT_NOW();
+		rc = flock(ctx->ll.lfd, LOCK_EX);
+		FAMFS_STAT_TIME(log_lock, start);
+		if (rc) {
+			rc = -errno;
+			fprintf(stderr, "%s: failed to lock the log of %s\n",
+				__func__, ctx->ll.mpt);
+			goto err_out;
 		}
+		/* Another process may have died in a commit or a transaction since our
+		 * last call
+		 */
+		if (ctx->ll.logp->famfs_log_gen & 1)
+			famfs_log_cursor_rebuild(ctx->ll.logp);
+		famfs_log_txn_recover(&ctx->ll, ctx->verbose);
+	}
+	rc = famfs_ctx_catch_up(ctx);
+	if (rc) {
+		if (log_lock)
+			flock(ctx->ll.lfd, LOCK_UN);
+		goto err_out;
 	}
+	return 0;
 
-	closedir(directory);
-	if (nfiles_out)
-		*nfiles_out = nfiles;
-	if (ndirs_out)
-		*ndirs_out = ndirs;
-	if (nerrs_out)
-		*nerrs_out = nerrs;
-	rc = (nerrs) ? 1 : 0;
+err_out:
+	pthread_mutex_unlock(&ctx->lock);
 	return rc;
 }
 
-int
-famfs_check(const char *path,
-	    int verbose)
+static void
+famfs_ctx_unlock(struct famfs_ctx *ctx, int log_lock)
 {
-	char metadir[PATH_MAX];
-	char logpath[PATH_MAX];
-	char dev_out[PATH_MAX];
-	char sbpath[PATH_MAX];
-	struct stat st;
-	u64 nfiles_out = 0;
-	u64 ndirs_out = 0;
-	u64 nerrs_out = 0;
-	u64 nfiles = 0;
-	u64 ndirs = 0;
-	u64 nerrs = 0;
-	int rc;
+	struct famfs_log_cursor c;
 
-	if (path[0] != '/') {
-		fprintf(stderr, "%s: must use absolute path of mount point\n", __func__);
-		return -1;
-	}
-	if (!famfs_path_is_mount_pt(path, dev_out)) {
-		fprintf(stderr, "%s: path (%s) is not a famfs mount point\n", __func__, path);
-		return -1;
+	if (log_lock) {
+		if (ctx->ll.txn_open || ctx->ll.txn_nstaged)
+			famfs_log_txn_commit(&ctx->ll);
+
+		/* The caches now reflect our own entries too */
+		if (!famfs_log_read_cursor(ctx->ll.logp, &c)) {
+			ctx->pos.index = c.next_index;
+			ctx->pos.offset = c.next_offset;
+		}
+		if (flock(ctx->ll.lfd, LOCK_UN))
+			fprintf(stderr, "%s: unlock returned an error\n", __func__);
 	}
+	pthread_mutex_unlock(&ctx->lock);
+}
 
-	snprintf(metadir, PATH_MAX - 1, "%s/.meta", path);
-	snprintf(sbpath, PATH_MAX - 1, "%s/.meta/.superblock", path);
-	snprintf(logpath, PATH_MAX - 1, "%s/.meta/.log", path);
-	rc = stat(metadir, &st);
-	if (rc) {
-		fprintf(stderr, "%s: Need to run mkmeta on device %s for this file system\n",
-			__func__, dev_out);
-		ndirs++;
-		return -1;
+/**
+ * famfs_ctx_open()
+ *
+ * Open a context on a mounted famfs file system
+ *
+ * @mpt     - the mount point, or any path within the file system
+ * @policy  - allocation policy for the files the context creates
+ * @verbose
+ *
+ * Return value: the context, or NULL if @mpt isn't in a valid famfs file system
+ */
+struct famfs_ctx *
+famfs_ctx_open(const char *mpt, enum famfs_alloc_policy policy, int verbose)
+{
+	struct famfs_ctx *ctx = calloc(1, sizeof(*ctx));
+	struct famfs_log_cursor c;
+	size_t log_size;
+	void *addr;
+	int role;
+	int lfd;
+
+	assert(ctx);
+	ctx->verbose = verbose;
+
+	role = famfs_get_role_by_path(mpt, NULL);
+	if (role == FAMFS_MASTER) {
+		if (famfs_init_locked_log(&ctx->ll, mpt, verbose))
+			goto err_free;
+
+		/* Only held during calls */
+		flock(ctx->ll.lfd, LOCK_UN);
+		ctx->writable = 1;
+	} else if (role == FAMFS_CLIENT) {
+		lfd = open_log_file_read_only(mpt, &log_size, ctx->ll.mpt, NO_LOCK);
+		if (lfd < 0) {
+			fprintf(stderr, "%s: failed to open log file for filesystem %s\n",
+				__func__, mpt);
+			goto err_free;
+		}
+		addr = mmap(0, log_size, PROT_READ, MAP_SHARED, lfd, 0);
+		close(lfd);
+		if (addr == MAP_FAILED) {
+			fprintf(stderr, "%s: failed to mmap log file %s/.meta/log\n",
+				__func__, ctx->ll.mpt);
+			goto err_free;
+		}
+		ctx->ll.logp = (struct famfs_log *)addr;
+		ctx->ll.log_size = log_size;
+		invalidate_processor_cache(ctx->ll.logp, log_size);
+	} else {
+		fprintf(stderr, "%s: no valid famfs file system at %s\n", __func__, mpt);
+		goto err_free;
 	}
-	rc = stat(sbpath, &st);
-	if (rc) {
-		fprintf(stderr, "%s: superblock file not found for file system %s\n",
-			__func__, path);
-		nerrs++;
+	ctx->ll.policy = policy;
+
+	if (famfs_validate_log_header(ctx->ll.logp)) {
+		fprintf(stderr, "%s: invalid log header\n", __func__);
+		goto err_unmap;
+	}
+	ctx->sb = famfs_map_superblock_by_path(ctx->ll.mpt, 1 /* read-only */);
+	if (!ctx->sb)
+		goto err_unmap;
+
+	if (famfs_log_read_cursor(ctx->ll.logp, &c)) {
+		fprintf(stderr, "%s: log commit in progress for too long\n", __func__);
+		goto err_unmap;
+	}
+	ctx->pos.index = c.next_index;
+	ctx->pos.offset = c.next_offset;
+	ctx->epoch = c.epoch;
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	return ctx;
+
+err_unmap:
+	if (ctx->sb)
+		munmap(ctx->sb, FAMFS_SUPERBLOCK_SIZE);
+	if (ctx->writable)
+		close(ctx->ll.lfd);
+	munmap(ctx->ll.logp, ctx->ll.log_size); /* Not the header's length: it's invalid */
+err_free:
+	free(ctx);
+	return NULL;
+}
+
+/**
+ * famfs_ctx_close()
+ *
+ * Close a context, saving its bitmap in the allocation cache
+ *
+ * Return value: 0, or an error from releasing the log
+ */
+int
+famfs_ctx_close(struct famfs_ctx *ctx)
+{
+	struct famfs_log *logp;
+	int rc = 0;
+
+	if (!ctx)
+		return 0;
+
+	logp = ctx->ll.logp;
+	if (ctx->writable) {
+		rc = famfs_ctx_lock(ctx, 1);
+		if (rc) {
+			/* Out of date with the log; don't save it */
+			free(ctx->ll.bitmap);
+			ctx->ll.bitmap = NULL;
+			flock(ctx->ll.lfd, LOCK_EX);
+			pthread_mutex_lock(&ctx->lock);
+		}
+		famfs_release_locked_log(&ctx->ll); /* Saves the bitmap, and unlocks */
+		pthread_mutex_unlock(&ctx->lock);
 	}
+	munmap(logp, ctx->ll.log_size);
+	munmap(ctx->sb, FAMFS_SUPERBLOCK_SIZE);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+	return rc;
+}
 
-	rc = stat(logpath, &st);
-	if (rc) {
-		fprintf(stderr, "%s: log file not found for file system %s\n",
-			__func__, path);
-		nerrs++;
+/**
+ * famfs_ctx_mkfile()
+ *
+ * Create and allocate a file (see __famfs_mkfile())
+ *
+ * Return value: an open file descriptor; 0 if the file couldn't be created, or <0 if
+ * there is no space (or log) left, or the context is on a client
+ */
+int
+famfs_ctx_mkfile(
+	struct famfs_ctx *ctx,
+	const char       *filename,
+	mode_t            mode,
+	uid_t             uid,
+	gid_t             gid,
+	size_t            size)
+{
+	int rc;
+
+	if (size == 0) {
+		fprintf(stderr, "%s: Creating empty file (%s) not allowed\n",
+			__func__, filename);
+		return -EINVAL;
 	}
 
-	rc = famfs_recursive_check(path, &nfiles_out, &ndirs_out, &nerrs_out, verbose);
-	nfiles += nfiles_out;
-	ndirs += ndirs_out;
-	nerrs += nerrs_out;
-	printf("%s: %lld files, %lld directories, %lld errors\n", __func__, nfiles, ndirs, nerrs);
+	rc = famfs_ctx_lock(ctx, 1);
+	if (rc)
+		return rc;
+
+	famfs_log_txn_begin(&ctx->ll);
+	rc = __famfs_mkfile(&ctx->ll, filename, mode, uid, gid, size, ctx->verbose);
+	famfs_ctx_unlock(ctx, 1); /* Commits the transaction */
 	return rc;
 }
 
+/**
+ * famfs_ctx_mkdir()
+ *
+ * Create a directory, whose parent must exist (see __famfs_mkdir())
+ */
 int
-famfs_flush_file(const char *filename, int verbose)
+famfs_ctx_mkdir(
+	struct famfs_ctx *ctx,
+	const char       *dirpath,
+	mode_t            mode,
+	uid_t             uid,
+	gid_t             gid)
 {
-	struct stat st;
-	size_t size;
-	void *addr;
 	int rc;
 
-	rc = stat(filename, &st);
-	if (rc < 0) {
-		fprintf(stderr, "%s: file not found (%s)\n", __func__, filename);
-		return 3;
-	}
-	if ((st.st_mode & S_IFMT) != S_IFREG) {
-		if (verbose)
-			fprintf(stderr, "%s: not a regular file: (%s)\n", __func__, filename);
-		return 2;
-	}
+	rc = famfs_ctx_lock(ctx, 1);
+	if (rc)
+		return rc;
 
-	/* Only flush regular files */
+	rc = __famfs_mkdir(&ctx->ll, dirpath, mode, uid, gid, ctx->verbose);
+	famfs_ctx_unlock(ctx, 1);
+	return rc;
+}
 
-	addr = famfs_mmap_whole_file(filename, 1, &size);
-	if (!addr)
-		return 1;
+/**
+ * famfs_ctx_cp()
+ *
+ * Copy a file into famfs (see __famfs_cp())
+ *
+ * @destfile - the path of the new file (not a directory to copy into)
+ * @mode     - 0 to use the mode of @srcfile
+ *
+ * Return value: 0 on success, >0 if the copy failed, <0 if there is no space (or log)
+ * left, or the context is on a client
+ */
+int
+famfs_ctx_cp(
+	struct famfs_ctx *ctx,
+	const char       *srcfile,
+	const char       *destfile,
+	mode_t            mode,
+	uid_t             uid,
+	gid_t             gid)
+{
+	int rc;
 
-	if (verbose > 1)
-		printf("%s: flushing: %s\n", __func__, filename);
+	rc = famfs_ctx_lock(ctx, 1);
+	if (rc)
+		return rc;
 
-	/* We don't know caller needs a flush or an invalidate, so barriers on both sides */
-	hard_flush_processor_cache(addr, size);
-	return 0;
+	rc = __famfs_cp(&ctx->ll, srcfile, destfile, mode, uid, gid, ctx->verbose);
+	famfs_ctx_unlock(ctx, 1);
+	return rc;
+}
+
+/**
+ * famfs_ctx_logplay()
+ *
+ * Play the log, incrementally (see famfs_logplay()). Works on clients and the master.
+ *
+ * @nthreads - number of threads creating files
+ *
+ * Return value: the number of errors (0=complete success), or <0 if the log couldn't
+ * be played
+ */
+int
+famfs_ctx_logplay(struct famfs_ctx *ctx, int nthreads)
+{
+	int rc;
+
+	rc = famfs_ctx_lock(ctx, 0);
+	if (rc)
+		return rc;
+
+	rc = famfs_logplay_common(ctx->ll.logp, ctx->sb, ctx->ll.mpt, 0, 0, 1, nthreads,
+				  1 /* header validated at open */, ctx->verbose);
+	famfs_ctx_unlock(ctx, 0);
+	return rc;
 }
@@ -8,6 +8,7 @@
 
 #include <linux/uuid.h> /* Our preferred UUID format */
 #include <uuid/uuid.h>  /* for uuid_generate / libuuid */
+#include <signal.h>
 #include <linux/famfs_ioctl.h>
 
 #include "famfs.h"
@@ -24,33 +25,147 @@ enum famfs_extent_type {
 };
 #endif
 
+extern int famfs_alloc_cache_enable;
+
+/* Where a new file's extent(s) are placed */
+enum famfs_alloc_policy {
+	FAMFS_ALLOC_FIRST_FIT = 0, /* Lowest free run that fits */
+	FAMFS_ALLOC_BEST_FIT,      /* Smallest free run that fits */
+	FAMFS_ALLOC_NEXT_FIT,      /* First fit, starting after the previous allocation */
+	FAMFS_ALLOC_STRIPE,        /* Split evenly across the maximum number of extents */
+	FAMFS_ALLOC_NPOLICIES,
+};
+
+/* famfs cp data copy engine */
+#define FAMFS_CP_DEFAULT_THREADS   4
+#define FAMFS_CP_DEFAULT_CHUNKSIZE (32 * 1024 * 1024) /* Unit of work for copy threads */
+#define FAMFS_CP_IO_SIZE           (1024 * 1024)      /* Max size of each read() */
+#define FAMFS_CP_DIRECT_ALIGN      4096               /* O_DIRECT offset/size alignment */
+
+/* Threads (and their unit of work) for verify, creat --randomize and chkread */
+#define FAMFS_VERIFY_DEFAULT_THREADS 4
+#define FAMFS_VERIFY_CHUNKSIZE       (32 * 1024 * 1024)
+
+/* famfs flush: big files are split into chunks, and small files batched up to a chunk */
+#define FAMFS_FLUSH_DEFAULT_THREADS 4
+#define FAMFS_FLUSH_CHUNKSIZE       (32 * 1024 * 1024)
+#define FAMFS_FLUSH_BATCH_RANGES    64
+
+/* Threads walking the tree in famfs check */
+#define FAMFS_CHECK_DEFAULT_THREADS 4
+
+/* fsck validates and scans the log with up to this many threads, each taking at least
+ * FAMFS_FSCK_THREAD_ENTRIES entries
+ */
+#define FAMFS_FSCK_DEFAULT_THREADS 4
+#define FAMFS_FSCK_THREAD_ENTRIES  256
+
+/* Threads that create files (and issue their map ioctls) during logplay */
+#define FAMFS_LOGPLAY_DEFAULT_THREADS 4
+
+/* logplay --follow polls the log header at intervals between these (backing off when idle) */
+#define FAMFS_FOLLOW_MIN_POLL_US   50
+#define FAMFS_FOLLOW_MAX_POLL_US   (100 * 1000)
+extern volatile sig_atomic_t famfs_follow_stop;
+extern volatile sig_atomic_t famfs_follow_report;
+
+/* Log readers: tries at a consistent snapshot of the log cursor (it's only inconsistent
+ * while a commit is updating it), and re-reads of a record that fails its crc
+ */
+#define FAMFS_LOG_CURSOR_TRIES     1000
+#define FAMFS_LOG_REC_TRIES        3
+
+int famfs_alloc_policy_from_name(const char *name);
+const char *famfs_alloc_policy_name(enum famfs_alloc_policy policy);
+
 int famfs_module_loaded(int verbose);
+
+/*
+ * Mapping options (see famfs_mmap_fd()). famfs extents are allocated in 2MiB units, so
+ * a mapping whose virtual address is aligned like the extents can be faulted with PMD
+ * (2MiB) or PUD (1GiB) pages, rather than spending a TLB entry per 4KiB.
+ */
+#define FAMFS_MMAP_ALIGN_AUTO 0     /* Largest page size the file's extents allow */
+#define FAMFS_MMAP_ALIGN_NONE 4096
+#define FAMFS_PMD_SIZE        (2UL * 1024 * 1024)
+#define FAMFS_PUD_SIZE        (1024UL * 1024 * 1024)
+#define FAMFS_MMAP_NO_ADVICE  (-1)
+
+struct famfs_mmap_opts {
+	size_t align;      /* FAMFS_MMAP_ALIGN_*, FAMFS_PMD_SIZE or FAMFS_PUD_SIZE */
+	int    populate;   /* Prefault the page tables (MAP_POPULATE) */
+	int    advice;     /* madvise() advice, or FAMFS_MMAP_NO_ADVICE */
+	int    numa_node;  /* Preferred node for page cache backed files, or -1 */
+	int    verbose;    /* Print the alignment and page size that were achieved */
+	size_t align_out;  /* Out: the alignment the mapping got */
+	size_t pagesize;   /* Out: the largest page size seen in the mapping (0 if unknown) */
+};
+
+void famfs_mmap_opts_init(struct famfs_mmap_opts *opts);
+int famfs_mmap_opts_parse(struct famfs_mmap_opts *opts, const char *spec);
+size_t famfs_mmap_pagesize(const void *addr);
+void *famfs_mmap_fd(int fd, size_t size, int read_only, struct famfs_mmap_opts *opts);
+void *famfs_mmap_file(const char *fname, int read_only, size_t *sizep,
+		      struct famfs_mmap_opts *opts);
 void *famfs_mmap_whole_file(const char *fname, int read_only, size_t *sizep);
 
 extern int famfs_get_device_size(const char *fname, size_t *size, enum famfs_extent_type *type);
 int famfs_check_super(const struct famfs_superblock *sb);
-int famfs_fsck(const char *devname, int use_mmap, int human, int verbose);
+int famfs_fsck(const char *devname, int use_mmap, int human, int nthreads, int verbose);
 
 void famfs_uuidgen(uuid_le *uuid);
 int famfs_get_system_uuid(uuid_le *uuid_out);
 int famfs_mkmeta(const char *devname);
 u64 famfs_alloc(const char *devname, u64 size);
-int famfs_logplay(const char *mpt, int use_mmap,
-		  int dry_run, int client_mode, int verbose);
+int famfs_logplay(const char *mpt, int use_mmap, int dry_run, int client_mode, int full,
+		  int nthreads, int follow, int verbose);
+int famfs_compact(const char *fspath, int verbose);
 
-int famfs_mkfile(const char *filename, mode_t mode, uid_t uid, gid_t gid, size_t size, int verbose);
+int famfs_mkfile(const char *filename, mode_t mode, uid_t uid, gid_t gid, size_t size,
+		 enum famfs_alloc_policy policy, int verbose);
 
 int famfs_cp_multi(int argc, char *argv[],
-		   mode_t mode, uid_t uid, gid_t gid, int recursive, int verbose);
+		   mode_t mode, uid_t uid, gid_t gid, int recursive,
+		   enum famfs_alloc_policy policy, int nthreads, size_t chunksize,
+		   int direct, struct famfs_mmap_opts *mmap_opts, int verbose);
 int famfs_clone(const char *srcfile, const char *destfile, int verbose);
 
 int famfs_mkdir(const char *dirpath, mode_t mode, uid_t uid, gid_t gid, int verbose);
 int famfs_mkdir_parents(const char *dirpath, mode_t mode, uid_t uid, gid_t gid, int verbose);
 int famfs_mkfs(const char *daxdev, int kill, int force);
-int famfs_check(const char *path, int verbose);
+int famfs_check(const char *path, int nthreads, int use_log, int verbose);
 
 void famfs_dump_log(struct famfs_log *logp);
 void famfs_dump_super(struct famfs_superblock *sb);
 int famfs_flush_file(const char *filename, int verbose);
 
+/*
+ * Library context: a handle on a mounted famfs file system, for applications that
+ * create files or play the log without running the famfs cli. The superblock is
+ * validated and the log mapped once, at open; the allocation bitmap and directory index
+ * are kept between calls. Calls on a context are serialized, so threads can share one.
+ *
+ * On the master, each call that logs takes the log lock only for its duration, so other
+ * processes can log in between, and the next call catches up with just the entries they
+ * added. On a client, only famfs_ctx_logplay() is allowed (the others return -EROFS).
+ */
+struct famfs_ctx;
+struct famfs_ctx *famfs_ctx_open(const char *mpt, enum famfs_alloc_policy policy,
+				 int verbose);
+int famfs_ctx_close(struct famfs_ctx *ctx);
+int famfs_ctx_mkfile(struct famfs_ctx *ctx, const char *filename, mode_t mode, uid_t uid,
+		     gid_t gid, size_t size);
+int famfs_ctx_mkdir(struct famfs_ctx *ctx, const char *dirpath, mode_t mode, uid_t uid,
+		    gid_t gid);
+int famfs_ctx_cp(struct famfs_ctx *ctx, const char *srcfile, const char *destfile,
+		 mode_t mode, uid_t uid, gid_t gid);
+int famfs_ctx_logplay(struct famfs_ctx *ctx, int nthreads);
+
+struct famfs_flush;
+struct famfs_flush *famfs_flush_start(int nthreads, int verbose);
+int famfs_flush_range(struct famfs_flush *fl, const char *filename, u64 offset, u64 len);
+int famfs_flush_path(struct famfs_flush *fl, const char *path, u64 offset, u64 len,
+		     int recursive);
+u64 famfs_flush_finish(struct famfs_flush *fl);
+
 #endif /* _H_FAMFS_LIB */
@@ -6,7 +6,10 @@
 #ifndef _H_FAMFS_LIB_INTERNAL
 #define _H_FAMFS_LIB_INTERNAL
 
+#include <time.h>
+
 #include "famfs_meta.h"
+#include "mu_crc.h"
 
 enum lock_opt {
 	NO_LOCK = 0,
@@ -14,18 +17,96 @@ enum lock_opt {
 	NON_BLOCKING_LOCK,
 };
 
+struct famfs_dir_index;
+
 struct famfs_locked_log {
 	s64               devsize;
 	struct famfs_log *logp;
+	size_t            log_size; /* Length of the mapping of the log */
 	int               lfd;
 	u64               nbits;
 	u8               *bitmap;
+	uuid_le           fs_uuid;
+	int               policy;   /* enum famfs_alloc_policy */
+	u64               next_fit; /* Bit after the last allocation, for FAMFS_ALLOC_NEXT_FIT */
+	int               txn_open;    /* famfs_log_txn_begin() was called */
+	u64               txn_nstaged; /* Entries written past next_index but not published */
+	u64               txn_nbytes;  /* Bytes of the staged records */
+	u64               txn_last;    /* Offset of the last record staged */
+	struct famfs_dir_index *dirs;  /* Directory records found or logged, by path */
+	struct thpool    *cp_pool;      /* Data copy workers, or NULL to copy inline */
+	size_t            cp_chunksize; /* Per-worker unit of a file copy */
+	int               cp_direct;    /* O_DIRECT reads + non-temporal stores */
+	struct famfs_mmap_opts *cp_mmap; /* Destination mapping options, or NULL */
+	u64               cp_files;     /* Copy stats; workers update these atomically */
+	u64               cp_bytes;
+	u64               cp_errors;
+	struct timespec   cp_start;
 	char              mpt[PATH_MAX];
 };
 
 
+/* A position in the log: the index and offset of a record */
+struct famfs_log_pos {
+	u64 index;
+	u64 offset;
+};
+
+/* A consistent copy of the cursor block of a log header (see famfs_log_read_cursor()) */
+struct famfs_log_cursor {
+	u64 next_seqnum;
+	u64 next_index;
+	u64 next_offset;
+	u64 last_offset;
+	u64 epoch;
+	u64 gen;
+};
+
+/* famfs_log_iter_init() flags */
+#define FAMFS_LOG_ITER_VALIDATE 0x1 /* check each record's crc */
+#define FAMFS_LOG_ITER_NOPATHS  0x2 /* return just the name (see famfs_log_iter_path()) */
+
+/*
+ * Iterator over the file and directory creations in a log, decoding each record into a
+ * log entry. The records of a checkpoint are returned like any others (with in_ckpt set);
+ * the checkpoint record itself is not.
+ */
+struct famfs_log_iter {
+	const struct famfs_log     *logp;
+	struct famfs_log_pos        pos;      /* next record */
+	struct famfs_log_pos        end;      /* end of the log when iteration began */
+	u64                         epoch;    /* cursor that end came from */
+	u64                         gen;
+	u64                         cur;      /* offset of the last record returned */
+	u64                         parent;   /* offset of its parent, or FAMFS_LOG_NO_PARENT */
+	u64                         prev_len; /* length of the record before pos */
+	int                         flags;
+	int                         err;      /* set if iteration stopped on an error */
+	int                         in_ckpt;  /* last record is part of the checkpoint */
+	int                         have_ck;  /* a checkpoint was found */
+	struct famfs_log_checkpoint ck;
+	u64                         ck_left;  /* checkpoint records still to come */
+	u64                         ck_bytes; /* bytes used by the checkpoint and its records */
+	u64                         dir_offset; /* path cache: one directory record */
+	char                        dir_path[FAMFS_MAX_PATHLEN];
+	struct famfs_log_entry      le;       /* the decoded record */
+};
+
+#define FAMFS_LOG_NO_PARENT (~0ULL)
+
+/* The checksum of a log's header and records */
+static inline enum mu_crc_alg
+famfs_log_crc_alg(const struct famfs_log *logp)
+{
+	return (logp->famfs_log_flags & FAMFS_LOG_CRC32C) ? MU_CRC_CRC32C : MU_CRC_ZLIB;
+}
+
+
 /* Only exported for unit tests */
+extern u64 famfs_log_flush_bytes;
+extern u64 famfs_log_flush_bytes_total;
 int famfs_validate_log_header(const struct famfs_log *logp);
+int famfs_log_read_cursor(const struct famfs_log *logp, struct famfs_log_cursor *c);
 int __file_not_famfs(int fd);
 int file_not_famfs(const char *fname);
 unsigned long famfs_gen_superblock_crc(const struct famfs_superblock *sb);
@@ -44,10 +125,40 @@ int __famfs_mkdir(struct famfs_locked_log *lp, const char *dirpath, mode_t mode,
 		  uid_t uid, gid_t gid, int verbose);
 int famfs_init_locked_log(struct famfs_locked_log *lp, const char *fspath, int verbose);
 int famfs_release_locked_log(struct famfs_locked_log *lp);
+int famfs_log_dir_creation(struct famfs_locked_log *lp, const char *relpath, mode_t mode,
+			   uid_t uid, gid_t gid);
+int famfs_log_txn_begin(struct famfs_locked_log *lp);
+int famfs_log_txn_commit(struct famfs_locked_log *lp);
+int famfs_cp_data(struct famfs_locked_log *lp, int srcfd, int destfd, char *destp,
+		  size_t size, int verbose);
+int famfs_cp_pool_start(struct famfs_locked_log *lp, int nthreads, size_t chunksize,
+			int direct);
+u64 famfs_cp_pool_finish(struct famfs_locked_log *lp, int verbose);
 int __famfs_logplay(const struct famfs_log *logp, const char *mpt, int dry_run,
-		    int client_mode, int verbose);
+		    int client_mode, int incremental, int nthreads, int verbose);
+struct mu_histogram;
+int __famfs_logfollow(const struct famfs_log *logp, const char *mpt, int client_mode,
+		      int nthreads, struct mu_histogram *hist, int verbose);
+void famfs_log_iter_init(struct famfs_log_iter *it, const struct famfs_log *logp,
+			 const struct famfs_log_pos *first, int flags);
+const struct famfs_log_entry *famfs_log_iter_next(struct famfs_log_iter *it);
+int famfs_log_iter_refresh(struct famfs_log_iter *it);
+int famfs_log_iter_path(struct famfs_log_iter *it);
+int famfs_log_rec_encode(u8 *buf, const struct famfs_log_entry *le, u64 prev, u64 parent,
+			 const char *name, enum mu_crc_alg alg);
+int famfs_log_rec_decode(const u8 *buf, size_t avail, struct famfs_log_entry *le,
+			 u64 *parent, int check_crc, enum mu_crc_alg alg);
+int famfs_log_compact(struct famfs_locked_log *lp, int verbose);
 int famfs_fsck_scan(const struct famfs_superblock *sb, const struct famfs_log *logp,
-		    int human, int verbose);
+		    int human, int nthreads, int verbose);
+int __famfs_check(const char *mpt, const struct famfs_log *logp, int nthreads, u64 *stats,
+		  int verbose);
+struct famfs_log_stats;
+u8 *famfs_build_bitmap(const struct famfs_log *logp, u64 dev_size_in, u64 *bitmap_nbits_out,
+		       u64 *alloc_errors_out, u64 *size_total_out, u64 *alloc_total_out,
+		       struct famfs_log_stats *log_stats_out, int verbose);
+int bitmap_alloc_extents(u8 *bitmap, u64 nbits, u64 alloc_bits, enum famfs_alloc_policy policy,
+			 u64 *cursor, int max_extents, u64 *ext_start, u64 *ext_len);
 int famfs_create_sys_uuid_file(char *sys_uuid_file);
 int famfs_get_system_uuid(uuid_le *uuid_out);
 
@@ -21,7 +21,7 @@
 #include "famfs.h"
 
 #define FAMFS_SUPER_MAGIC      0x87b282ff
-#define FAMFS_CURRENT_VERSION  46
+#define FAMFS_CURRENT_VERSION  49
 #define FAMFS_MAX_DAXDEVS      64
 
 #define FAMFS_LOG_OFFSET    0x200000 /* 2MiB */
@@ -103,9 +103,10 @@ enum famfs_log_entry_type {
 	FAMFS_LOG_FILE,    /* This type of log entry creates a file */
 	FAMFS_LOG_MKDIR,
 	FAMFS_LOG_ACCESS,  /* This type of log entry gives a host access to a file */
+	FAMFS_LOG_CHECKPOINT, /* Start of a compacted log (famfs compact) */
 };
 
-#define FAMFS_MAX_PATHLEN 80
+#define FAMFS_MAX_PATHLEN 256 /* including the terminating nul */
 #define FAMFS_MAX_HOSTNAME_LEN 32
 
 /* famfs_fc_flags */
@@ -115,6 +116,20 @@ enum famfs_log_entry_type {
 /* Maximum number of extents in a FC extent list */
 #define FAMFS_FC_MAX_EXTENTS 8
 
+/* Maximum number of extents the allocator will split a file into: limited by both the
+ * log entry and the kernel map (FAMFS_MAX_EXTENTS)
+ */
+#define FAMFS_ALLOC_MAX_EXTENTS \
+	((FAMFS_FC_MAX_EXTENTS < FAMFS_MAX_EXTENTS) ? FAMFS_FC_MAX_EXTENTS : FAMFS_MAX_EXTENTS)
+
+/*
+ * Decoded log entries
+ *
+ * These are the in-memory form of the log records (see struct famfs_log_rec below);
+ * they are not stored in the log. The path always comes last, so a copy that doesn't
+ * need the path can stop short of it.
+ */
+
 /* This log entry creates a directory */
 struct famfs_mkdir {
 	/* TODO: consistent field naming */
@@ -136,8 +151,8 @@ struct famfs_file_creation {
 	gid_t   fc_gid;
 	mode_t  fc_mode;
 
-	u8      famfs_relpath[FAMFS_MAX_PATHLEN];
 	struct  famfs_log_extent famfs_ext_list[FAMFS_FC_MAX_EXTENTS];
+	u8      famfs_relpath[FAMFS_MAX_PATHLEN];
 };
 
 /* A log entry of type FAMFS_LOG_ACCESS contains a struct famfs_file_access entry.
@@ -151,45 +166,137 @@ struct famfs_file_access {
 	u8      fa_other_perm;
 };
 
+/* A log entry of type FAMFS_LOG_CHECKPOINT marks the start of a compacted log: it is
+ * always the first record, and the ck_nrecords records that follow it are a rewrite of
+ * the files and directories created by the ck_nentries entries that were compacted.
+ * The log continues after them as usual.
+ */
+struct famfs_log_checkpoint {
+	u64     ck_nrecords;
+	u64     ck_nentries;  /* log entries replaced by the checkpoint */
+};
+
 struct famfs_log_entry {
 	u64     famfs_log_entry_seqnum;
 	u32     famfs_log_entry_type; /* FAMFS_LOG_FILE_CREATION or FAMFS_LOG_ACCESS */
 	union {
-		struct famfs_file_creation famfs_fc;
-		struct famfs_mkdir         famfs_md;
-		struct famfs_file_access   famfs_fa;
+		struct famfs_file_creation  famfs_fc;
+		struct famfs_mkdir          famfs_md;
+		struct famfs_file_access    famfs_fa;
+		struct famfs_log_checkpoint famfs_ck;
 	};
-	unsigned long famfs_log_entry_crc;
+	unsigned long famfs_log_entry_crc;    /* lr_crc of the record */
+};
+
+/*
+ * Log records
+ *
+ * The log is a sequence of variable-length records, each starting on an 8-byte boundary.
+ * The lr_len bytes of a record include its padding, which is zero. Record N has seqnum N.
+ * lr_prev links each record back to the one before, so the tail of the log can also be
+ * scanned backwards.
+ *
+ * The payload is a sequence of unsigned LEB128 varints (7 bits per byte, low bits first,
+ * the top bit set on all but the last byte), by record type:
+ *
+ * FAMFS_LOG_FILE:  parent, mode, uid, gid, size, flags, nextents,
+ *                  nextents x (offset delta, len), namelen, name
+ * FAMFS_LOG_MKDIR: parent, mode, uid, gid, namelen, name
+ * FAMFS_LOG_CHECKPOINT: nrecords, nentries
+ *
+ * parent is the distance in bytes back to the MKDIR record of the directory that holds
+ * this file or directory, and name is relative to it. If parent is 0, name is relative
+ * to the mount point (and may contain '/'). The full relative path must fit in
+ * FAMFS_MAX_PATHLEN.
+ *
+ * Each extent offset is stored as the zigzag-encoded (signed) difference from the end of
+ * the previous extent (or from 0); with FAMFS_LR_EXT_UNITS, offsets and lengths are in
+ * FAMFS_ALLOC_UNITs rather than bytes.
+ */
+struct famfs_log_rec {
+	u32     lr_crc;     /* crc of bytes [4, lr_len) (see FAMFS_LOG_CRC32C) */
+	u16     lr_len;
+	u16     lr_prev;    /* lr_len of the previous record (0 for the first) */
+	u8      lr_type;    /* enum famfs_log_entry_type */
+	u8      lr_flags;
+	u16     lr_rsvd;
+	u32     lr_seqnum;
+	u8      lr_data[];
 };
 
+/* lr_flags */
+#define FAMFS_LR_EXT_UNITS (1 << 0)
+
+#define FAMFS_LOG_REC_ALIGN 8
+#define FAMFS_LOG_REC_MAX   512 /* Largest possible record */
+
 #define FAMFS_LOG_MAGIC 0xbadcafef00d
 
+/* famfs_log_flags */
+#define FAMFS_LOG_CRC32C (1 << 0) /* header and record crcs are crc32c, not zlib crc32 */
+#define FAMFS_LOG_FLAGS_KNOWN (FAMFS_LOG_CRC32C)
+
+/* The log header is two blocks of FAMFS_LOG_HDR_BLOCK bytes: the fields that are fixed
+ * when the log is created, and the cursor that every commit moves. A block is two cache
+ * lines because adjacent-line prefetchers move lines in pairs; a smaller split would still
+ * drag the immutable fields along with each cursor update.
+ */
+#define FAMFS_LOG_HDR_BLOCK 128
+
 /**
  * @famfs_log - the structure of the famfs log
  *
  * @famfs_log_magic: magic number
  * @famfs_log_len: total size of the log, including header and all valid entries
- * @famfs_log_last_index:  The last valid index (i.e. inclusive)
+ * @famfs_log_data_len: size of @famfs_log_data
+ * @famfs_log_flags: format flags (FAMFS_LOG_*)
  * @famfs_log_crc: crc which covers the preceeding fields, which don't change
  * @famfs_log_next_seqnum: sequence number for the next log entry
  * @famfs_log_next_index: Index of the next (not yet inserted) log entry
- * @entries: Array of log entries. sizeof famfs_log, including all entries, must be
- *           <= @famfs_log_len
+ * @famfs_log_next_offset: offset in @famfs_log_data of the next record
+ * @famfs_log_last_offset: offset of the last record (if @famfs_log_next_index > 0)
+ * @famfs_log_epoch: incremented each time the log is rewritten (by compaction), so
+ *           a saved log position from before the rewrite can be recognized
+ * @famfs_log_gen: seqlock generation of the cursor; odd while the master is updating it
+ * @famfs_log_data: the records
+ *
+ * The immutable fields (magic through crc) and the cursor fields (next_seqnum through
+ * gen) each have a FAMFS_LOG_HDR_BLOCK to themselves. The master only writes the cursor
+ * block while the log is live, so a client that has validated the immutable block once
+ * can keep it cached and poll just the cursor.
+ *
+ * Readers don't take the log lock. The master makes @famfs_log_gen odd before it touches
+ * the other cursor fields and even again after, so a reader that sees the same even
+ * generation before and after copying the cursor has a consistent one (see
+ * famfs_log_read_cursor()). Records are only ever appended below the cursor, so a reader
+ * that snapshotted an older cursor still has a valid (shorter) log.
  */
 struct famfs_log {
 	u64     famfs_log_magic;
 	u64     famfs_log_len;
-	u64     famfs_log_last_index;
+	u64     famfs_log_data_len;
+	u64     famfs_log_flags;
 	unsigned long famfs_log_crc;
+	u8      famfs_log_pad0[FAMFS_LOG_HDR_BLOCK - 40];
+
 	u64     famfs_log_next_seqnum;
 	u64     famfs_log_next_index;
-	struct famfs_log_entry entries[];
+	u64     famfs_log_next_offset;
+	u64     famfs_log_last_offset;
+	u64     famfs_log_epoch;
+	u64     famfs_log_gen;
+	u8      famfs_log_pad1[FAMFS_LOG_HDR_BLOCK - 48];
+
+	u8      famfs_log_data[];
 };
 
+/* The number of records that certainly still fit in the log (most records are much
+ * smaller than FAMFS_LOG_REC_MAX, so usually many more do)
+ */
 static inline s64
 log_slots_available(struct famfs_log *logp)
 {
-	s64 navail = logp->famfs_log_last_index - logp->famfs_log_next_index + 1;
+	s64 navail = (logp->famfs_log_data_len - logp->famfs_log_next_offset) / FAMFS_LOG_REC_MAX;
 	assert(navail >= 0);
 	return navail;
 }
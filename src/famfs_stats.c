@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (C) 2024 Micron Technology, Inc.  All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "famfs_stats.h"
+
+struct famfs_stats famfs_stats;
+
+enum famfs_stat_kind {
+	FAMFS_STAT_COUNTER,
+	FAMFS_STAT_TIMER,
+};
+
+struct famfs_stat_desc {
+	const char           *name;
+	enum famfs_stat_kind  kind;
+	size_t                offset;
+	const char           *help;
+};
+
+#define FAMFS_COUNTER(field, help) \
+	{ #field, FAMFS_STAT_COUNTER, offsetof(struct famfs_stats, field), help }
+#define FAMFS_TIMER(field, help) \
+	{ #field, FAMFS_STAT_TIMER, offsetof(struct famfs_stats, field), help }
+
+static const struct famfs_stat_desc famfs_stat_descs[] = {
+	FAMFS_TIMER(log_lock, "Waits for the famfs log lock"),
+	FAMFS_TIMER(log_commit, "Log commits (record and header flushes)"),
+	FAMFS_COUNTER(log_commit_entries, "Log entries committed"),
+	FAMFS_TIMER(bitmap_build, "Allocation bitmap builds from the log"),
+	FAMFS_TIMER(alloc, "Allocations"),
+	FAMFS_COUNTER(alloc_search_runs, "Free runs examined by the allocator"),
+	FAMFS_COUNTER(alloc_failures, "Allocations that found no space"),
+	FAMFS_COUNTER(flush_bytes, "Bytes flushed from the processor cache"),
+	FAMFS_COUNTER(writeback_bytes, "Bytes written back from the processor cache"),
+	FAMFS_COUNTER(invalidate_bytes, "Bytes invalidated in the processor cache"),
+	FAMFS_TIMER(logplay, "Log plays"),
+	FAMFS_COUNTER(logplay_entries, "Log entries processed by log plays"),
+	FAMFS_COUNTER(pcq_put_msgs, "pcq messages put"),
+	FAMFS_COUNTER(pcq_get_msgs, "pcq messages gotten"),
+	FAMFS_COUNTER(pcq_retries, "pcq buckets re-read after a bad crc"),
+	FAMFS_COUNTER(pcq_crc_errors, "pcq buckets still bad after the re-reads"),
+};
+
+#define FAMFS_NSTATS (sizeof(famfs_stat_descs) / sizeof(famfs_stat_descs[0]))
+
+static uint64_t
+famfs_stat_load(const struct famfs_stat_desc *d, size_t sub)
+{
+	const uint64_t *p = (const uint64_t *)((const char *)&famfs_stats + d->offset) + sub;
+
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/**
+ * famfs_stats_format_from_name()
+ *
+ * Return value: an enum famfs_stats_format ("json" or "prom"), or -1
+ */
+int
+famfs_stats_format_from_name(const char *name)
+{
+	if (!strcmp(name, "json"))
+		return FAMFS_STATS_JSON;
+	if (!strcmp(name, "prom") || !strcmp(name, "prometheus"))
+		return FAMFS_STATS_PROM;
+	return -1;
+}
+
+/**
+ * famfs_stats_print()
+ *
+ * Print the counters, as one line of JSON or as Prometheus text. Timers have a count,
+ * a total and a maximum (in ns).
+ */
+void
+famfs_stats_print(FILE *fp, enum famfs_stats_format fmt)
+{
+	const struct famfs_stat_desc *d;
+	size_t i;
+
+	if (fmt == FAMFS_STATS_JSON) {
+		fprintf(fp, "{");
+		for (i = 0; i < FAMFS_NSTATS; i++) {
+			d = &famfs_stat_descs[i];
+			fprintf(fp, "%s\"%s\":", (i) ? "," : "", d->name);
+			if (d->kind == FAMFS_STAT_COUNTER)
+				fprintf(fp, "%lu", (unsigned long)famfs_stat_load(d, 0));
+			else
+				fprintf(fp, "{\"count\":%lu,\"ns\":%lu,\"max_ns\":%lu}",
+					(unsigned long)famfs_stat_load(d, 0),
+					(unsigned long)famfs_stat_load(d, 1),
+					(unsigned long)famfs_stat_load(d, 2));
+		}
+		fprintf(fp, "}\n");
+	} else if (fmt == FAMFS_STATS_PROM) {
+		for (i = 0; i < FAMFS_NSTATS; i++) {
+			d = &famfs_stat_descs[i];
+			if (d->kind == FAMFS_STAT_COUNTER) {
+				fprintf(fp, "# HELP famfs_%s_total %s\n", d->name, d->help);
+				fprintf(fp, "# TYPE famfs_%s_total counter\n", d->name);
+				fprintf(fp, "famfs_%s_total %lu\n", d->name,
+					(unsigned long)famfs_stat_load(d, 0));
+				continue;
+			}
+			fprintf(fp, "# HELP famfs_%s_count %s\n", d->name, d->help);
+			fprintf(fp, "# TYPE famfs_%s_count counter\n", d->name);
+			fprintf(fp, "famfs_%s_count %lu\n", d->name,
+				(unsigned long)famfs_stat_load(d, 0));
+			fprintf(fp, "# HELP famfs_%s_ns_total %s: total time (ns)\n",
+				d->name, d->help);
+			fprintf(fp, "# TYPE famfs_%s_ns_total counter\n", d->name);
+			fprintf(fp, "famfs_%s_ns_total %lu\n", d->name,
+				(unsigned long)famfs_stat_load(d, 1));
+			fprintf(fp, "# HELP famfs_%s_ns_max %s: longest (ns)\n", d->name, d->help);
+			fprintf(fp, "# TYPE famfs_%s_ns_max gauge\n", d->name);
+			fprintf(fp, "famfs_%s_ns_max %lu\n", d->name,
+				(unsigned long)famfs_stat_load(d, 2));
+		}
+	}
+	fflush(fp);
+}
+
+void
+famfs_stats_reset(void)
+{
+	memset(&famfs_stats, 0, sizeof(famfs_stats));
+}
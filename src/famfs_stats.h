@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (C) 2024 Micron Technology, Inc.  All rights reserved.
+ */
+#ifndef H_FAMFS_STATS
+#define H_FAMFS_STATS
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Hot-path counters and timers
+ *
+ * Built in when FAMFS_STATS is defined (cmake -DFAMFS_STATS=OFF compiles them out, and
+ * then every FAMFS_STAT_*() is a no-op). An update is a relaxed atomic add to a
+ * process-global counter, and a timer is two clock reads, so they're cheap enough to
+ * leave on; unlike verbose printfs, they don't change the timing they measure.
+ *
+ * The counters are per process: "famfs stats <command>" runs a famfs command and
+ * exports what it counted, and pcq's status worker exports them periodically.
+ */
+struct famfs_stat_timer {
+	uint64_t count;
+	uint64_t ns;     /* Total */
+	uint64_t max_ns;
+};
+
+struct famfs_stats {
+	struct famfs_stat_timer log_lock;     /* Waiting for the log lock (flock) */
+	struct famfs_stat_timer log_commit;   /* famfs_log_publish() */
+	uint64_t log_commit_entries;
+	struct famfs_stat_timer bitmap_build; /* famfs_build_bitmap() */
+	struct famfs_stat_timer alloc;        /* bitmap_alloc_extents() */
+	uint64_t alloc_search_runs;           /* Free runs examined by the allocator */
+	uint64_t alloc_failures;
+	uint64_t flush_bytes;                 /* flush_processor_cache() */
+	uint64_t writeback_bytes;             /* writeback_processor_cache() */
+	uint64_t invalidate_bytes;            /* invalidate_processor_cache() */
+	struct famfs_stat_timer logplay;      /* A whole log play */
+	uint64_t logplay_entries;             /* Entries processed by those plays */
+	uint64_t pcq_put_msgs;
+	uint64_t pcq_get_msgs;
+	uint64_t pcq_retries;                 /* Buckets re-read because of a bad crc */
+	uint64_t pcq_crc_errors;              /* Buckets whose crc was still bad after that */
+};
+
+extern struct famfs_stats famfs_stats;
+
+enum famfs_stats_format {
+	FAMFS_STATS_NONE = 0,
+	FAMFS_STATS_JSON,
+	FAMFS_STATS_PROM, /* Prometheus text exposition format */
+};
+
+int famfs_stats_format_from_name(const char *name);
+void famfs_stats_print(FILE *fp, enum famfs_stats_format fmt);
+void famfs_stats_reset(void);
+
+static inline uint64_t
+famfs_stat_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+famfs_stat_time(struct famfs_stat_timer *t, uint64_t ns)
+{
+	uint64_t max = __atomic_load_n(&t->max_ns, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&t->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->ns, ns, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&t->max_ns, &max, ns, 1, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+#ifdef FAMFS_STATS
+#define FAMFS_STAT_ADD(field, n) \
+	__atomic_add_fetch(&famfs_stats.field, (n), __ATOMIC_RELAXED)
+#define FAMFS_STAT_NOW() famfs_stat_now_ns()
+#define FAMFS_STAT_TIME(field, start) \
+	famfs_stat_time(&famfs_stats.field, famfs_stat_now_ns() - (start))
+#else
+#define FAMFS_STAT_ADD(field, n) do { } while (0)
+#define FAMFS_STAT_NOW() 0
+#define FAMFS_STAT_TIME(field, start) ((void)(start))
+#endif
+
+#endif /* H_FAMFS_STATS */
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (C) 2024 Micron Technology, Inc.  All rights reserved.
+ */
+#ifndef H_MU_CRC
+#define H_MU_CRC
+
+#include <stdint.h>
+#include <string.h>
+#include <cpuid.h>
+#include <zlib.h>
+
+/*
+ * Checksums for shared-memory structures. Structures record which algorithm they were
+ * written with, so images written with zlib crc32 stay readable.
+ *
+ * CRC32C (Castagnoli) has a dedicated instruction on x86 (SSE4.2), which is several
+ * times faster than zlib's crc32 (and much faster on small buffers). Without it we fall
+ * back to a slicing-by-8 table, which is slower than a recent zlib on large buffers but
+ * keeps CRC32C structures readable everywhere.
+ */
+enum mu_crc_alg {
+	MU_CRC_ZLIB = 0,   /* zlib crc32() */
+	MU_CRC_CRC32C = 1,
+};
+
+#define MU_CRC32C_POLY  0x82f63b78 /* reflected */
+#define MU_CRC32C_BLOCK 512        /* bytes per stream in the interleaved hw loop */
+
+struct mu_crc32c_tables {
+	int      ready;
+	uint32_t k1;       /* x^(8 * MU_CRC32C_BLOCK) mod P */
+	uint32_t k2;       /* x^(16 * MU_CRC32C_BLOCK) mod P */
+	uint32_t t[8][256];
+};
+
+/**
+ * mu_cpu_has_sse42()
+ *
+ * Probe cpuid once per translation unit (racing probes store the same value)
+ */
+static inline int
+mu_cpu_has_sse42(void)
+{
+	static int has = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (has < 0)
+		has = (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) ? 1 : 0;
+	return has;
+}
+
+/* x^(8 * nbytes) mod P: the crc register after nbytes of zeroes, from x^0 */
+static inline uint32_t
+__mu_crc32c_xpow8n(size_t nbytes)
+{
+	uint32_t c = 0x80000000;
+	size_t i;
+
+	for (i = 0; i < 8 * nbytes; i++)
+		c = (c & 1) ? (c >> 1) ^ MU_CRC32C_POLY : c >> 1;
+	return c;
+}
+
+static inline const struct mu_crc32c_tables *
+__mu_crc32c_tables(void)
+{
+	static struct mu_crc32c_tables tab;
+	uint32_t c;
+	int i, k;
+
+	if (__atomic_load_n(&tab.ready, __ATOMIC_ACQUIRE))
+		return &tab;
+
+	/* Racing initializers compute the same values */
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ MU_CRC32C_POLY : c >> 1;
+		tab.t[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (k = 1; k < 8; k++)
+			tab.t[k][i] = (tab.t[k - 1][i] >> 8) ^ tab.t[0][tab.t[k - 1][i] & 0xff];
+	tab.k1 = __mu_crc32c_xpow8n(MU_CRC32C_BLOCK);
+	tab.k2 = __mu_crc32c_xpow8n(2 * MU_CRC32C_BLOCK);
+	__atomic_store_n(&tab.ready, 1, __ATOMIC_RELEASE);
+	return &tab;
+}
+
+/* a * b mod P (reflected; @a must be nonzero) */
+static inline uint32_t
+__mu_crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 0x80000000;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ MU_CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/*
+ * The kernels work on the raw crc register (no pre/post inversion)
+ */
+static inline uint32_t
+__mu_crc32c_sw(uint32_t c, const unsigned char *p, size_t len)
+{
+	const struct mu_crc32c_tables *tab = __mu_crc32c_tables();
+	uint64_t v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = tab->t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		v ^= c;
+		c = tab->t[7][v & 0xff] ^ tab->t[6][(v >> 8) & 0xff] ^
+			tab->t[5][(v >> 16) & 0xff] ^ tab->t[4][(v >> 24) & 0xff] ^
+			tab->t[3][(v >> 32) & 0xff] ^ tab->t[2][(v >> 40) & 0xff] ^
+			tab->t[1][(v >> 48) & 0xff] ^ tab->t[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = tab->t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c;
+}
+
+/*
+ * The crc32 instruction has a latency of 3 cycles but a throughput of 1, so big
+ * buffers are done as three independent streams, which are combined by shifting the
+ * first two over the bytes that follow them (crc(A|B) = crc(A) * x^(8|B|) ^ crc(0, B)).
+ */
+__attribute__((target("sse4.2")))
+static inline uint32_t
+__mu_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc;
+	uint64_t v0, v1, v2;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+		len--;
+	}
+
+	if (len >= 3 * MU_CRC32C_BLOCK) {
+		const struct mu_crc32c_tables *tab = __mu_crc32c_tables();
+
+		do {
+			const unsigned char *end = p + MU_CRC32C_BLOCK;
+			uint64_t c1 = 0;
+			uint64_t c2 = 0;
+
+			do {
+				memcpy(&v0, p, 8);
+				memcpy(&v1, p + MU_CRC32C_BLOCK, 8);
+				memcpy(&v2, p + 2 * MU_CRC32C_BLOCK, 8);
+				c = __builtin_ia32_crc32di(c, v0);
+				c1 = __builtin_ia32_crc32di(c1, v1);
+				c2 = __builtin_ia32_crc32di(c2, v2);
+				p += 8;
+			} while (p < end);
+
+			c = __mu_crc32c_multmodp(tab->k2, (uint32_t)c) ^
+				__mu_crc32c_multmodp(tab->k1, (uint32_t)c1) ^ c2;
+			p += 2 * MU_CRC32C_BLOCK;
+			len -= 3 * MU_CRC32C_BLOCK;
+		} while (len >= 3 * MU_CRC32C_BLOCK);
+	}
+
+	while (len >= 8) {
+		memcpy(&v0, p, 8);
+		c = __builtin_ia32_crc32di(c, v0);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+	return (uint32_t)c;
+}
+
+/**
+ * mu_crc32c_sw(), mu_crc32c_hw()
+ *
+ * A specific implementation (mu_crc32c_hw() requires SSE4.2). Like zlib's crc32(), a
+ * crc of 0 starts a new checksum, and a previous result continues it.
+ */
+static inline uint32_t
+mu_crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	return ~__mu_crc32c_sw(~crc, (const unsigned char *)buf, len);
+}
+
+static inline uint32_t
+mu_crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	return ~__mu_crc32c_hw(~crc, (const unsigned char *)buf, len);
+}
+
+/**
+ * mu_crc32c()
+ *
+ * CRC32C with the fastest implementation this cpu has
+ */
+static inline uint32_t
+mu_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	if (mu_cpu_has_sse42())
+		return mu_crc32c_hw(crc, buf, len);
+	return mu_crc32c_sw(crc, buf, len);
+}
+
+/**
+ * mu_crc()
+ *
+ * Checksum with @alg; 0 starts a checksum, a previous result continues it
+ */
+static inline uint32_t
+mu_crc(enum mu_crc_alg alg, uint32_t crc, const void *buf, size_t len)
+{
+	if (alg == MU_CRC_CRC32C)
+		return mu_crc32c(crc, buf, len);
+	return (uint32_t)crc32(crc, (const unsigned char *)buf, len);
+}
+
+static inline const char *
+mu_crc_alg_name(enum mu_crc_alg alg)
+{
+	switch (alg) {
+	case MU_CRC_ZLIB:
+		return "crc32 (zlib)";
+	case MU_CRC_CRC32C:
+		return (mu_cpu_has_sse42()) ? "crc32c (sse4.2)" : "crc32c (table)";
+	}
+	return "unknown";
+}
+
+#endif /* H_MU_CRC */
@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (C) 2024 Micron Technology, Inc.  All rights reserved.
+ */
+#ifndef H_MU_HISTOGRAM
+#define H_MU_HISTOGRAM
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log2 histogram. Bucket 0 counts zeroes; bucket i (i > 0) counts values in
+ * [2^(i-1), 2^i). Recording is a few instructions, so it's cheap enough for hot paths;
+ * percentiles are reported as the upper bound of the bucket they fall in.
+ */
+#define MU_HIST_BUCKETS 65
+
+struct mu_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[MU_HIST_BUCKETS];
+};
+
+static inline void
+mu_hist_init(struct mu_histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+static inline unsigned int
+mu_hist_bucket(uint64_t val)
+{
+	return (val) ? 64 - __builtin_clzll(val) : 0;
+}
+
+static inline void
+mu_hist_record(struct mu_histogram *h, uint64_t val)
+{
+	h->buckets[mu_hist_bucket(val)]++;
+	h->count++;
+	h->sum += val;
+	if (val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+}
+
+/**
+ * mu_hist_percentile()
+ *
+ * @pct - 0 to 100
+ *
+ * Return value: an upper bound for the @pct'th percentile (clamped to the max recorded
+ * value), or 0 if the histogram is empty
+ */
+static inline uint64_t
+mu_hist_percentile(const struct mu_histogram *h, double pct)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	target = (uint64_t)((pct / 100.0) * (double)h->count + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < MU_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) {
+			uint64_t upper = (i == 0) ? 0 :
+				(i == 64) ? UINT64_MAX : (1ULL << i) - 1;
+
+			return (upper < h->max) ? upper : h->max;
+		}
+	}
+	return h->max;
+}
+
+/* Add @src into @dst (e.g. to combine per-thread histograms) */
+static inline void
+mu_hist_merge(struct mu_histogram *dst, const struct mu_histogram *src)
+{
+	unsigned int i;
+
+	if (!src->count)
+		return;
+	for (i = 0; i < MU_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/**
+ * mu_hist_print()
+ *
+ * Print a summary line and the non-empty buckets
+ *
+ * @unit - label for the values (e.g. "us")
+ */
+static inline void
+mu_hist_print(const struct mu_histogram *h, FILE *fp, const char *name, const char *unit)
+{
+	unsigned int i;
+
+	if (!h->count) {
+		fprintf(fp, "%s: no samples\n", name);
+		return;
+	}
+
+	fprintf(fp, "%s: %llu samples; min %llu avg %llu max %llu %s; "
+		"p50 %llu p90 %llu p99 %llu %s\n", name,
+		(unsigned long long)h->count, (unsigned long long)h->min,
+		(unsigned long long)(h->sum / h->count), (unsigned long long)h->max, unit,
+		(unsigned long long)mu_hist_percentile(h, 50),
+		(unsigned long long)mu_hist_percentile(h, 90),
+		(unsigned long long)mu_hist_percentile(h, 99), unit);
+
+	for (i = 0; i < MU_HIST_BUCKETS; i++) {
+		if (!h->buckets[i])
+			continue;
+		fprintf(fp, "\t< %-12llu %s: %llu\n",
+			(i == 64) ? (unsigned long long)UINT64_MAX : (unsigned long long)(1ULL << i),
+			unit, (unsigned long long)h->buckets[i]);
+	}
+}
+
+/*
+ * HDR-style histogram: like the log2 histogram, but each power of 2 is split into
+ * MU_HDR_SUB linear sub-buckets, so a recorded value is known to within 1/MU_HDR_SUB
+ * (~3%) - enough resolution for tail percentiles. Values below MU_HDR_SUB are exact.
+ * It's ~15KiB, so allocate it rather than putting it on a small stack.
+ */
+#define MU_HDR_SUB_BITS 5
+#define MU_HDR_SUB      (1 << MU_HDR_SUB_BITS)
+#define MU_HDR_BUCKETS  ((64 - MU_HDR_SUB_BITS + 1) * MU_HDR_SUB)
+
+struct mu_hdr_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[MU_HDR_BUCKETS];
+};
+
+static inline void
+mu_hdr_init(struct mu_hdr_histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+static inline unsigned int
+mu_hdr_bucket(uint64_t val)
+{
+	unsigned int e;
+
+	if (val < MU_HDR_SUB)
+		return (unsigned int)val;
+
+	/* e >= MU_HDR_SUB_BITS; the top MU_HDR_SUB_BITS + 1 bits pick the sub-bucket */
+	e = 63 - __builtin_clzll(val);
+	return ((e - MU_HDR_SUB_BITS + 1) * MU_HDR_SUB) +
+		(unsigned int)((val >> (e - MU_HDR_SUB_BITS)) - MU_HDR_SUB);
+}
+
+/* The largest value that lands in bucket @i */
+static inline uint64_t
+mu_hdr_bucket_max(unsigned int i)
+{
+	unsigned int g = i / MU_HDR_SUB;
+	uint64_t sub = i % MU_HDR_SUB;
+
+	if (g == 0)
+		return sub;
+	/* (Wraps to UINT64_MAX for the last bucket) */
+	return (((uint64_t)MU_HDR_SUB + sub + 1) << (g - 1)) - 1;
+}
+
+static inline void
+mu_hdr_record(struct mu_hdr_histogram *h, uint64_t val)
+{
+	h->buckets[mu_hdr_bucket(val)]++;
+	h->count++;
+	h->sum += val;
+	if (val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+}
+
+/* Add @src into @dst (e.g. to combine per-thread histograms) */
+static inline void
+mu_hdr_merge(struct mu_hdr_histogram *dst, const struct mu_hdr_histogram *src)
+{
+	unsigned int i;
+
+	if (!src->count)
+		return;
+	for (i = 0; i < MU_HDR_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/**
+ * mu_hdr_percentile()
+ *
+ * @pct - 0 to 100 (e.g. 99.9)
+ *
+ * Return value: an upper bound for the @pct'th percentile (clamped to the max recorded
+ * value), or 0 if the histogram is empty
+ */
+static inline uint64_t
+mu_hdr_percentile(const struct mu_hdr_histogram *h, double pct)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	target = (uint64_t)((pct / 100.0) * (double)h->count + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < MU_HDR_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) {
+			uint64_t upper = mu_hdr_bucket_max(i);
+
+			return (upper < h->max) ? upper : h->max;
+		}
+	}
+	return h->max;
+}
+
+static inline void
+mu_hdr_print(const struct mu_hdr_histogram *h, FILE *fp, const char *name, const char *unit)
+{
+	if (!h->count) {
+		fprintf(fp, "%s: no samples\n", name);
+		return;
+	}
+
+	fprintf(fp, "%s: %llu samples; min %llu avg %llu max %llu %s; "
+		"p50 %llu p99 %llu p99.9 %llu %s\n", name,
+		(unsigned long long)h->count, (unsigned long long)h->min,
+		(unsigned long long)(h->sum / h->count), (unsigned long long)h->max, unit,
+		(unsigned long long)mu_hdr_percentile(h, 50),
+		(unsigned long long)mu_hdr_percentile(h, 99),
+		(unsigned long long)mu_hdr_percentile(h, 99.9), unit);
+}
+
+#endif /* H_MU_HISTOGRAM */
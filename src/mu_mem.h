@@ -6,28 +6,143 @@
 #define H_MU_MEM
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <cpuid.h>
+#include <emmintrin.h> /* SSE2 streaming stores */
 #include <sys/types.h>
 #include <sys/user.h>
 #include <sys/param.h>
 
+#include "famfs_stats.h"
+
 extern int mock_flush;
 
 #define CL_SIZE 64
 #define CL_SHIFT 6
 
+/* Cache line flush instructions supported by this cpu (see mu_cpu_flush_features()) */
+#define MU_CPU_CLFLUSHOPT  0x1
+#define MU_CPU_CLWB        0x2
+#define MU_CPU_PROBED      0x80000000
+
+/**
+ * mu_cpu_flush_features()
+ *
+ * Probe cpuid (leaf 7) for clflushopt and clwb, once per translation unit. The race
+ * between threads probing at the same time is harmless; they store the same value.
+ */
+static inline unsigned int
+mu_cpu_flush_features(void)
+{
+	static unsigned int features;
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int f = MU_CPU_PROBED;
+
+	if (features)
+		return features;
+
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		if (ebx & bit_CLFLUSHOPT)
+			f |= MU_CPU_CLFLUSHOPT;
+		if (ebx & bit_CLWB)
+			f |= MU_CPU_CLWB;
+	}
+	features = f;
+	return f;
+}
+
+/**
+ * mu_cl_span()
+ *
+ * Return value: the number of bytes in the cache lines touched by [@addr, @addr + @len)
+ */
+static inline size_t
+mu_cl_span(const void *addr, size_t len)
+{
+	uintptr_t start = (uintptr_t)addr & ~((uintptr_t)CL_SIZE - 1);
+	uintptr_t end = ((uintptr_t)addr + len + CL_SIZE - 1) & ~((uintptr_t)CL_SIZE - 1);
+
+	return (len) ? end - start : 0;
+}
+
+/*
+ * Flush kernels. These don't fence; the callers below issue one fence per range.
+ * Each starts at the cache line that holds addr, so an unaligned range doesn't leave
+ * its last line behind.
+ *
+ * clflush is serializing with respect to other clflushes; clflushopt and clwb are not,
+ * so they can have many lines in flight (and need a trailing sfence to be ordered).
+ */
+static inline void
+__mu_clflush_range(const char *buffer, size_t span)
+{
+	size_t i;
+
+	for (i = 0; i < span; i += CL_SIZE)
+		__builtin_ia32_clflush(&buffer[i]);
+}
+
+__attribute__((target("clflushopt")))
+static inline void
+__mu_clflushopt_range(const char *buffer, size_t span)
+{
+	size_t i;
+
+	for (i = 0; i < span; i += CL_SIZE)
+		__builtin_ia32_clflushopt((void *)&buffer[i]);
+}
+
+__attribute__((target("clwb")))
+static inline void
+__mu_clwb_range(const char *buffer, size_t span)
+{
+	size_t i;
+
+	for (i = 0; i < span; i += CL_SIZE)
+		__builtin_ia32_clwb(&buffer[i]);
+}
+
+/**
+ * __flush_processor_cache()
+ *
+ * Write back and evict the cache lines of a range, with the fastest instruction the
+ * cpu has. No fences.
+ */
 static inline void
 __flush_processor_cache(const void *addr, size_t len)
 {
-	int64_t i;
-	const char *buffer = (const char *)addr;
+	const char *buffer = (const char *)((uintptr_t)addr & ~((uintptr_t)CL_SIZE - 1));
+	size_t span = mu_cl_span(addr, len);
 
 	if (mock_flush)
 		return;
 
-	/* Flush the processor cache for the target range */
-	for (i=0; i<len; i+=CL_SIZE)
-		__builtin_ia32_clflush(&buffer[i]);
+	if (mu_cpu_flush_features() & MU_CPU_CLFLUSHOPT)
+		__mu_clflushopt_range(buffer, span);
+	else
+		__mu_clflush_range(buffer, span);
+}
+
+/**
+ * __writeback_processor_cache()
+ *
+ * Write back the dirty cache lines of a range, leaving them valid in the cache if the
+ * cpu has clwb (otherwise this is the same as __flush_processor_cache()). No fences.
+ */
+static inline void
+__writeback_processor_cache(const void *addr, size_t len)
+{
+	const char *buffer = (const char *)((uintptr_t)addr & ~((uintptr_t)CL_SIZE - 1));
+	size_t span = mu_cl_span(addr, len);
+
+	if (mock_flush)
+		return;
 
+	if (mu_cpu_flush_features() & MU_CPU_CLWB)
+		__mu_clwb_range(buffer, span);
+	else
+		__flush_processor_cache(addr, len);
 }
 
 /**
@@ -40,13 +155,17 @@ hard_flush_processor_cache(const void *addr, size_t len)
 	if (mock_flush)
 		return;
 
-	__sync_synchronize();
+	__builtin_ia32_mfence();
 	__flush_processor_cache(addr, len);
-	__sync_synchronize();
+	__builtin_ia32_mfence();
 }
 
 /**
  * flush_processor_cache() - flush data that this host has written to memory
+ *
+ * The lines are evicted. Older stores to a line are ordered before its flush by the
+ * cpu; the trailing sfence orders the flushes before any subsequent stores (e.g. the
+ * store that publishes the data).
  */
 static inline void
 flush_processor_cache(const void *addr, size_t len)
@@ -54,9 +173,25 @@ flush_processor_cache(const void *addr, size_t len)
 	if (mock_flush)
 		return;
 
-	/* Barier before clflush to guaranntee all prior memory mutations are flushed */
-	__sync_synchronize();
+	FAMFS_STAT_ADD(flush_bytes, len);
 	__flush_processor_cache(addr, len);
+	__builtin_ia32_sfence();
+}
+
+/**
+ * writeback_processor_cache() - flush data that this host has written, and keep it cached
+ *
+ * For data this host will keep using (it's still coherent for the writer)
+ */
+static inline void
+writeback_processor_cache(const void *addr, size_t len)
+{
+	if (mock_flush)
+		return;
+
+	FAMFS_STAT_ADD(writeback_bytes, len);
+	__writeback_processor_cache(addr, len);
+	__builtin_ia32_sfence();
 }
 
 /**
@@ -68,11 +203,71 @@ invalidate_processor_cache(const void *addr, size_t len)
 	if (mock_flush)
 		return;
 
+	FAMFS_STAT_ADD(invalidate_bytes, len);
 	__flush_processor_cache(addr, len);
-	__sync_synchronize();
+	__builtin_ia32_mfence();
 	/* Barrier after the flush to guarantee all subsequent memory accesses happen
 	 * after the cache is invalidated
 	 */
 }
 
+/**
+ * mu_memcpy_nt()
+ *
+ * Copy into memory that other hosts will read (e.g. a DAX mapping) with non-temporal
+ * stores, which bypass the cache - so there is no need to flush afterwards, and the copy
+ * doesn't evict anyone's working set. The unaligned head and tail (if any) are copied
+ * normally and flushed. Ends with an sfence, so the data is globally visible on return.
+ */
+static inline void
+mu_memcpy_nt(void *dst, const void *src, size_t len)
+{
+	char *d = (char *)dst;
+	const char *s = (const char *)src;
+	size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+	size_t i;
+
+	if (head > len)
+		head = len;
+	if (head) {
+		memcpy(d, s, head);
+		__flush_processor_cache(d, head);
+		d += head;
+		s += head;
+		len -= head;
+	}
+
+	if (((uintptr_t)s & 15) == 0) {
+		for (i = 0; i + 64 <= len; i += 64) {
+			__m128i a = _mm_load_si128((const __m128i *)&s[i]);
+			__m128i b = _mm_load_si128((const __m128i *)&s[i + 16]);
+			__m128i c = _mm_load_si128((const __m128i *)&s[i + 32]);
+			__m128i e = _mm_load_si128((const __m128i *)&s[i + 48]);
+
+			_mm_stream_si128((__m128i *)&d[i], a);
+			_mm_stream_si128((__m128i *)&d[i + 16], b);
+			_mm_stream_si128((__m128i *)&d[i + 32], c);
+			_mm_stream_si128((__m128i *)&d[i + 48], e);
+		}
+	} else {
+		for (i = 0; i + 64 <= len; i += 64) {
+			__m128i a = _mm_loadu_si128((const __m128i *)&s[i]);
+			__m128i b = _mm_loadu_si128((const __m128i *)&s[i + 16]);
+			__m128i c = _mm_loadu_si128((const __m128i *)&s[i + 32]);
+			__m128i e = _mm_loadu_si128((const __m128i *)&s[i + 48]);
+
+			_mm_stream_si128((__m128i *)&d[i], a);
+			_mm_stream_si128((__m128i *)&d[i + 16], b);
+			_mm_stream_si128((__m128i *)&d[i + 32], c);
+			_mm_stream_si128((__m128i *)&d[i + 48], e);
+		}
+	}
+
+	if (i < len) {
+		memcpy(&d[i], &s[i], len - i);
+		__flush_processor_cache(&d[i], len - i);
+	}
+	_mm_sfence();
+}
+
 #endif
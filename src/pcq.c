@@ -32,15 +32,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "famfs_lib.h"
 #include "mu_mem.h"
+#include "mu_histogram.h"
 #include "random_buffer.h"
 #include "famfs.h"
 #include "pcq.h"
+#include "famfs_stats.h"
 
 extern int mock_flush;
 
+#define PCQ_BENCH_NMESSAGES_DEFAULT 100000
+
 /* XXX Move this to famfs_lib_util.c or some such - it is now shared with the cli */
 static s64 get_multiplier(const char *endptr)
 {
@@ -110,6 +115,11 @@ pcq_usage(int   argc,
 	       "Check the state of a producer/consumer queue (maps both fies read-only:\n"
 	       "    %s --info [Args] /mnt/famfs/<queuename>\n"
 	       "\n"
+	       "Measure throughput and latency over a range of bucket sizes, bucket counts\n"
+	       "and batch sizes (this reformats the queue for each combination):\n"
+	       "    %s --bench --bsize 256,1K,4K --nbuckets 64,1K --batch 1,16 \\\n"
+	       "        --output csv /mnt/famfs/<queuename>\n"
+	       "\n"
 	       "Arguments:\n"
 	       "\n"
 	       "Queue Creation:\n"
@@ -118,6 +128,11 @@ pcq_usage(int   argc,
 	       "                                and crc (ignored if queue already exists)\n"
 	       "    -n|--nbuckets <nnbuckets> - Number of buckets in the queue\n"
 	       "                                (ignored if queue already exists)\n"
+	       "    -a|--crc <crc32c|crc32>   - Bucket checksum (default crc32c, which is\n"
+	       "                                hardware-accelerated on most cpus; crc32 is\n"
+	       "                                the original zlib checksum)\n"
+	       "    -L|--lanes <n>            - Split the queue into n independent lanes\n"
+	       "                                (each with nbuckets buckets; default 1)\n"
 	       "\n"
 	       "Queue permissions:\n"
 	       "    -P|--setperm <p|c|b|n>    - Set permissions on a queue for (p)roducer or\n"
@@ -128,9 +143,46 @@ pcq_usage(int   argc,
 	       "    -N|--nmessages <n>        - Number of messages to send and/or receive\n"
 	       "    -t|--time <seconds>       - Run for the specified duration\n"
 	       "    -S|--seed <seed>          - Use seed to generate payload\n"
+	       "    -B|--batch <n>            - Put/get up to n messages at a time, with one\n"
+	       "                                cache flush and index update per batch\n"
+	       "                                (default 1)\n"
+	       "    -Z|--zerocopy             - Write and validate messages in place in the\n"
+	       "                                queue buckets, rather than copying them\n"
+	       "                                (single lane and thread only)\n"
+	       "    -T|--threads <n>          - Run n producer and/or consumer threads, which\n"
+	       "                                share all the lanes (default 1)\n"
+	       "    -H|--hash                 - Producer threads each put to one lane, picked\n"
+	       "                                by hashing the thread number (default is\n"
+	       "                                round-robin across the lanes)\n"
+	       "    -W|--wait <policy>        - How to wait while the queue is full/empty:\n"
+	       "                                yield (default) - sched_yield() and recheck\n"
+	       "                                adaptive[:<spins>[:<max_sleep_us>]] - spin,\n"
+	       "                                then back off, then sleep (default %d spins,\n"
+	       "                                %dus max sleep)\n"
+	       "    -l|--lane <n>             - Only use lane n (e.g. when other lanes are\n"
+	       "                                driven by other hosts). Without this, all\n"
+	       "                                lanes are used\n"
 	       "    -p|--producer             - Run the producer\n"
 	       "    -c|--consumer             - Run the consumer\n"
 	       "    -s|--status <interval>    - Print status at the specified interval\n"
+	       "    -E|--stats <json|prom>    - With --status, also print the famfs stats\n"
+	       "                                counters (flushes, pcq retries and crc\n"
+	       "                                errors...) at each interval\n"
+	       "\n"
+	       "Benchmarking:\n"
+	       "    -m|--bench                - Stamp each message with its send time, and\n"
+	       "                                report msgs/s, GB/s (of payload) and one-way\n"
+	       "                                latency percentiles. Runs the producer and\n"
+	       "                                consumer unless one of them is given (latency\n"
+	       "                                across hosts needs synchronized clocks).\n"
+	       "                                --nmessages defaults to %d\n"
+	       "                                --bsize, --nbuckets and --batch take comma-\n"
+	       "                                separated lists, and each combination is run.\n"
+	       "                                With both sides in one process, the queue is\n"
+	       "                                reformatted (emptied) before each run; a\n"
+	       "                                --bsize or --nbuckets sweep requires that.\n"
+	       "                                Omitted, the queue's own geometry is used\n"
+	       "    -o|--output <text|csv|json> - Format of the --bench results\n"
 	       "\n"
 	       "Special options:\n"
 	       "    -i|--info                 - Dump the state of a queue\n"
@@ -141,29 +193,512 @@ pcq_usage(int   argc,
 	       "                                invalidates\n"
 	       "    -f|--statusfile           - Write exit status to file (for testing)\n"
 	       "    -?                        - Print this message\n"
-	       "\n", progname, progname, progname, progname, progname, progname);
+	       "\n", progname, progname, progname, progname, progname, progname, progname,
+	       PCQ_WAIT_SPINS_DEFAULT, PCQ_WAIT_MAX_US_DEFAULT, PCQ_BENCH_NMESSAGES_DEFAULT);
+}
+
+/*
+ * Open the MPMC front-end if the threads will drive all the lanes of the queue: when no
+ * --lane was given, and there are several lanes or several threads. *mqp is NULL if
+ * the single-lane path will be used.
+ */
+static int
+pcq_open_lanes(
+	const char *fname,
+	enum pcq_role role,
+	s64 lane,
+	u64 nthreads,
+	struct pcq_mpmc **mqp,
+	int verbose)
+{
+	struct pcq_mpmc *mq;
+
+	*mqp = NULL;
+	if (lane >= 0)
+		return 0;
+
+	mq = pcq_mpmc_open(fname, role, verbose);
+	if (!mq)
+		return -1;
+	if (mq->nlanes == 1 && nthreads == 1) {
+		pcq_mpmc_close(mq);
+		return 0;
+	}
+	*mqp = mq;
+	return 0;
+}
+
+/*
+ * Parse "yield" or "adaptive[:<spins>[:<max_sleep_us>]]"
+ */
+static int
+pcq_parse_wait_policy(
+	const char *arg,
+	enum pcq_wait_policy *policy,
+	u64 *spins,
+	u64 *max_us)
+{
+	char *endptr;
+
+	*spins = 0;
+	*max_us = 0;
+	if (strcmp(arg, "yield") == 0) {
+		*policy = PCQ_WAIT_YIELD;
+		return 0;
+	}
+	if (strncmp(arg, "adaptive", strlen("adaptive")) != 0)
+		return -1;
+
+	*policy = PCQ_WAIT_ADAPTIVE;
+	arg += strlen("adaptive");
+	if (*arg == 0)
+		return 0;
+	if (*arg++ != ':')
+		return -1;
+	*spins = strtoull(arg, &endptr, 0);
+	if (endptr == arg)
+		return -1;
+	if (*endptr == 0)
+		return 0;
+	if (*endptr++ != ':')
+		return -1;
+	arg = endptr;
+	*max_us = strtoull(arg, &endptr, 0);
+	if (endptr == arg || *endptr || *max_us == 0)
+		return -1;
+	return 0;
+}
+
+static void
+pcq_sum_args(struct pcq_thread_arg *sum, const struct pcq_thread_arg *a, u64 n)
+{
+	u64 i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < n; i++) {
+		sum->nsent += a[i].nsent;
+		sum->nreceived += a[i].nreceived;
+		sum->nerrors += a[i].nerrors;
+		sum->nfull += a[i].nfull;
+		sum->nempty += a[i].nempty;
+		sum->full_ns += a[i].full_ns;
+		sum->empty_ns += a[i].empty_ns;
+		sum->retries += a[i].retries;
+		sum->nbatches += a[i].nbatches;
+		sum->result += a[i].result;
+	}
+}
+
+static inline u64
+pcq_elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return ((end->tv_sec - start->tv_sec) * 1000000000ULL) + end->tv_nsec - start->tv_nsec;
+}
+
+/*
+ * One run of producer and/or consumer threads. main() does one; --bench does one per
+ * point in its sweep.
+ */
+struct pcq_run {
+	struct pcq_thread_arg tmpl;  /* Settings the threads share */
+	bool producer;
+	bool consumer;
+	bool hash;
+	s64 lane;
+	u64 nthreads;
+	u64 status_interval;
+	int stats_fmt;
+
+	/* Results */
+	struct pcq_thread_arg prod;  /* Summed over the producer threads */
+	struct pcq_thread_arg cons;  /* Summed over the consumer threads */
+	struct mu_hdr_histogram lat; /* --bench: latencies from all the consumers (ns) */
+	u64 elapsed_ns;              /* From starting the threads until they all exit */
+};
+
+static int
+pcq_run(char *filename, struct pcq_run *r)
+{
+	pthread_t *producer_threads = NULL, *consumer_threads = NULL, status_thread;
+	struct pcq_thread_arg *prods = NULL, *conss = NULL;
+	struct pcq_mpmc *prod_mq = NULL, *cons_mq = NULL;
+	struct pcq_status_thread_arg status = { 0 };
+	struct mu_hdr_histogram *lats = NULL;
+	u64 nthreads = r->nthreads;
+	struct timespec start, end;
+	u64 i;
+	int rc;
+
+	/*
+	 * Several threads, or all the lanes of a multi-lane queue, go through the
+	 * MPMC front-end
+	 */
+	if (r->producer &&
+	    pcq_open_lanes(filename, PRODUCER, r->lane, nthreads, &prod_mq, r->tmpl.verbose))
+		return -1;
+	if (r->consumer &&
+	    pcq_open_lanes(filename, CONSUMER, r->lane, nthreads, &cons_mq, r->tmpl.verbose)) {
+		if (prod_mq)
+			pcq_mpmc_close(prod_mq);
+		return -1;
+	}
+	if (r->tmpl.zerocopy && (prod_mq || cons_mq)) {
+		fprintf(stderr, "%s: --zerocopy needs a single lane and thread (see --lane)\n",
+			__func__);
+		if (prod_mq)
+			pcq_mpmc_close(prod_mq);
+		if (cons_mq)
+			pcq_mpmc_close(cons_mq);
+		return -1;
+	}
+
+	prods = calloc(nthreads, sizeof(*prods));
+	conss = calloc(nthreads, sizeof(*conss));
+	producer_threads = calloc(nthreads, sizeof(*producer_threads));
+	consumer_threads = calloc(nthreads, sizeof(*consumer_threads));
+	assert(prods && conss && producer_threads && consumer_threads);
+	if (r->tmpl.bench) {
+		lats = malloc(nthreads * sizeof(*lats));
+		assert(lats);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/*
+	 * Start the producer threads if needed
+	 */
+	for (i = 0; r->producer && i < nthreads; i++) {
+		struct pcq_thread_arg *p = &prods[i];
+
+		*p = r->tmpl;
+		p->role = PRODUCER;
+		p->stop_mode = (p->runtime) ? STOP_FLAG : NMESSAGES;
+		/* The producers split the messages */
+		p->nmessages = (r->tmpl.nmessages / nthreads) +
+			((i < r->tmpl.nmessages % nthreads) ? 1 : 0);
+		p->lane = MAX(r->lane, 0);
+		p->mq = prod_mq;
+		p->key = (r->hash) ? i : PCQ_LANE_ANY;
+		rc = pthread_create(&producer_threads[i], NULL, pcq_worker, (void *)p);
+		if (rc) {
+			fprintf(stderr, "%s: failed to start producer thread\n", __func__);
+		}
+	}
+
+	/*
+	 * Start the consumer threads
+	 */
+	for (i = 0; r->consumer && i < nthreads; i++) {
+		struct pcq_thread_arg *cn = &conss[i];
+
+		*cn = r->tmpl;
+		cn->role = CONSUMER;
+		cn->stop_mode = (cn->runtime) ? STOP_FLAG : NMESSAGES;
+		/* The consumers stop when they have all the messages between them */
+		cn->lane = MAX(r->lane, 0);
+		cn->mq = cons_mq;
+		if (lats) {
+			mu_hdr_init(&lats[i]);
+			cn->lat = &lats[i];
+		}
+		rc = pthread_create(&consumer_threads[i], NULL, pcq_worker, (void *)cn);
+		if (rc) {
+			fprintf(stderr, "%s: failed to start consumer thread\n", __func__);
+		}
+	}
+
+	if (r->status_interval) {
+		status.p = prods;
+		status.c = conss;
+		status.nthreads = nthreads;
+		status.basename = filename;
+		status.interval = r->status_interval;
+		status.stats_fmt = r->stats_fmt;
+		status.stop_now = 0;
+
+		rc = pthread_create(&status_thread, NULL, status_worker, (void *)&status);
+		if (rc) {
+			fprintf(stderr, "%s: failed to start consumer thread\n", __func__);
+		}
+	}
+
+	if (r->tmpl.runtime) {
+		sleep(r->tmpl.runtime);
+		for (i = 0; i < nthreads; i++) {
+			prods[i].stop_now = 1;
+			conss[i].stop_now = 1;
+		}
+		status.stop_now = 1;
+	}
+
+	for (i = 0; r->producer && i < nthreads; i++) {
+		rc = pthread_join(producer_threads[i], NULL);
+		if (rc)
+			fprintf(stderr, "%s: failed to join producer thread\n", __func__);
+	}
+	for (i = 0; r->consumer && i < nthreads; i++) {
+		rc = pthread_join(consumer_threads[i], NULL);
+		if (rc)
+			fprintf(stderr, "%s: failed to join consumer thread\n", __func__);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (r->status_interval) {
+		status.stop_now = 1;
+		rc = pthread_join(status_thread, NULL);
+		if (rc)
+			fprintf(stderr, "%s: failed to join consumer thread\n", __func__);
+	}
+
+	r->elapsed_ns = pcq_elapsed_ns(&start, &end);
+	pcq_sum_args(&r->prod, prods, nthreads);
+	pcq_sum_args(&r->cons, conss, nthreads);
+	mu_hdr_init(&r->lat);
+	for (i = 0; lats && r->consumer && i < nthreads; i++)
+		mu_hdr_merge(&r->lat, &lats[i]);
+
+	if (prod_mq)
+		pcq_mpmc_close(prod_mq);
+	if (cons_mq)
+		pcq_mpmc_close(cons_mq);
+	free(producer_threads);
+	free(consumer_threads);
+	free(prods);
+	free(conss);
+	free(lats);
+	return 0;
+}
+
+/*
+ * --bench
+ */
+#define PCQ_SWEEP_MAX 16
+
+/* The values to sweep; an empty list means "what the queue already has" */
+struct pcq_sweep {
+	u64 bsize[PCQ_SWEEP_MAX];
+	u64 nbuckets[PCQ_SWEEP_MAX];
+	u64 batch[PCQ_SWEEP_MAX];
+	int nbsize;
+	int nnbuckets;
+	int nbatch;
+};
+
+enum pcq_output {
+	PCQ_OUTPUT_TEXT,
+	PCQ_OUTPUT_CSV,
+	PCQ_OUTPUT_JSON,
+};
+
+/*
+ * Parse a number (with an optional k/m/g multiplier), or a comma-separated list of them
+ *
+ * Return value: the number of values, or -1 if @arg is invalid
+ */
+static int
+pcq_parse_list(const char *arg, u64 *vals, int max)
+{
+	char *str = strdup(arg);
+	char *tok, *saveptr;
+	char *endptr;
+	s64 mult;
+	int n = 0;
+
+	assert(str);
+	for (tok = strtok_r(str, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		if (n == max)
+			goto err;
+		vals[n] = strtoull(tok, &endptr, 0);
+		if (endptr == tok)
+			goto err;
+		mult = get_multiplier(endptr);
+		if (mult < 0)
+			goto err;
+		vals[n++] *= mult;
+	}
+	free(str);
+	return (n) ? n : -1;
+err:
+	free(str);
+	return -1;
+}
+
+static void
+pcq_bench_report(
+	enum pcq_output output,
+	int point,
+	const struct pcq_run *r,
+	u64 bsize,
+	u64 nbuckets,
+	u64 batch,
+	u64 nlanes,
+	u64 payload_size)
+{
+	const struct mu_hdr_histogram *h = &r->lat;
+	u64 nmsgs = (r->consumer) ? r->cons.nreceived : r->prod.nsent;
+	double secs = (double)r->elapsed_ns / 1e9;
+	double msgs_per_sec = (secs > 0) ? (double)nmsgs / secs : 0;
+	double gb_per_sec = msgs_per_sec * (double)payload_size / 1e9;
+	u64 min = (h->count) ? h->min : 0;
+	u64 avg = (h->count) ? h->sum / h->count : 0;
+
+	switch (output) {
+	case PCQ_OUTPUT_TEXT:
+		printf("pcq bench: bsize=%lld nbuckets=%lld batch=%lld nlanes=%lld "
+		       "threads=%lld: %lld msgs in %.3fs; %.0f msgs/s, %.3f GB/s\n",
+		       bsize, nbuckets, batch, nlanes, r->nthreads, nmsgs, secs,
+		       msgs_per_sec, gb_per_sec);
+		if (r->consumer)
+			mu_hdr_print(h, stdout, "pcq bench: latency", "ns");
+		break;
+
+	case PCQ_OUTPUT_CSV:
+		if (point == 0)
+			printf("bsize,nbuckets,batch,nlanes,threads,messages,seconds,"
+			       "msgs_per_sec,gb_per_sec,lat_min_ns,lat_avg_ns,lat_p50_ns,"
+			       "lat_p99_ns,lat_p999_ns,lat_max_ns\n");
+		printf("%lld,%lld,%lld,%lld,%lld,%lld,%.6f,%.0f,%.6f,"
+		       "%lld,%lld,%lld,%lld,%lld,%lld\n",
+		       bsize, nbuckets, batch, nlanes, r->nthreads, nmsgs, secs,
+		       msgs_per_sec, gb_per_sec, min, avg,
+		       (u64)mu_hdr_percentile(h, 50), (u64)mu_hdr_percentile(h, 99),
+		       (u64)mu_hdr_percentile(h, 99.9), (u64)h->max);
+		break;
+
+	case PCQ_OUTPUT_JSON:
+		/* One object per point, in an array that pcq_bench() closes */
+		printf("%s\n  {\"bsize\": %lld, \"nbuckets\": %lld, \"batch\": %lld, "
+		       "\"nlanes\": %lld, \"threads\": %lld, \"messages\": %lld, "
+		       "\"seconds\": %.6f, \"msgs_per_sec\": %.0f, \"gb_per_sec\": %.6f, "
+		       "\"lat_min_ns\": %lld, \"lat_avg_ns\": %lld, \"lat_p50_ns\": %lld, "
+		       "\"lat_p99_ns\": %lld, \"lat_p999_ns\": %lld, \"lat_max_ns\": %lld}",
+		       (point == 0) ? "[" : ",",
+		       bsize, nbuckets, batch, nlanes, r->nthreads, nmsgs, secs,
+		       msgs_per_sec, gb_per_sec, min, avg,
+		       (u64)mu_hdr_percentile(h, 50), (u64)mu_hdr_percentile(h, 99),
+		       (u64)mu_hdr_percentile(h, 99.9), (u64)h->max);
+		break;
+	}
+	fflush(stdout);
+}
+
+/*
+ * Run the producers and/or consumers once for each combination of bucket size, bucket
+ * count and batch size. If this process runs both sides, the queue is reformatted to
+ * each geometry (which also clears out anything left from the previous point);
+ * otherwise the queue's own geometry is used.
+ *
+ * @total - sums over all the points
+ */
+static int
+pcq_bench(
+	char *filename,
+	struct pcq_run *r,
+	struct pcq_sweep *sw,
+	enum pcq_output output,
+	struct pcq_thread_arg *total_prod,
+	struct pcq_thread_arg *total_cons)
+{
+	bool reformat = r->producer && r->consumer;
+	struct pcq_handle *pcqh;
+	int point = 0;
+	int b, n, k;
+	int rc = 0;
+
+	memset(total_prod, 0, sizeof(*total_prod));
+	memset(total_cons, 0, sizeof(*total_cons));
+
+	if (!reformat && (sw->nbsize || sw->nnbuckets)) {
+		fprintf(stderr, "%s: sweeping --bsize or --nbuckets needs --producer and "
+			"--consumer in this process\n", __func__);
+		return -1;
+	}
+
+	pcqh = pcq_lane_open(filename, READONLY, 0, 0);
+	if (!pcqh)
+		return -1;
+	if (!sw->nbsize)
+		sw->bsize[sw->nbsize++] = pcqh->pcq->bucket_size;
+	if (!sw->nnbuckets)
+		sw->nbuckets[sw->nnbuckets++] = pcqh->pcq->nbuckets;
+	pcq_close(pcqh);
+
+	for (b = 0; b < sw->nbsize; b++) {
+		for (n = 0; n < sw->nnbuckets; n++) {
+			for (k = 0; k < sw->nbatch; k++) {
+				u64 nlanes, payload_size;
+
+				if (reformat && pcq_reformat(filename, sw->nbuckets[n],
+							     sw->bsize[b], r->tmpl.verbose)) {
+					rc = -1;
+					goto out;
+				}
+				pcqh = pcq_lane_open(filename, READONLY, 0, 0);
+				if (!pcqh) {
+					rc = -1;
+					goto out;
+				}
+				nlanes = pcq_nlanes(pcqh->pcq);
+				payload_size = pcq_payload_size(pcqh->pcq);
+				pcq_close(pcqh);
+
+				r->tmpl.batch = sw->batch[k];
+				if (pcq_run(filename, r) || r->prod.result || r->cons.result) {
+					rc = -1;
+					goto out;
+				}
+				pcq_bench_report(output, point++, r, sw->bsize[b],
+						 sw->nbuckets[n], sw->batch[k], nlanes,
+						 payload_size);
+
+				total_prod->nsent += r->prod.nsent;
+				total_prod->nerrors += r->prod.nerrors;
+				total_prod->result += r->prod.result;
+				total_cons->nreceived += r->cons.nreceived;
+				total_cons->nerrors += r->cons.nerrors;
+				total_cons->result += r->cons.result;
+				if (r->prod.nerrors || r->cons.nerrors)
+					goto out;
+			}
+		}
+	}
+out:
+	if (output == PCQ_OUTPUT_JSON && point)
+		printf("\n]\n");
+	return rc;
 }
 
 int
 main(int argc, char **argv)
 {
-	pthread_t producer_thread, consumer_thread, status_thread;
-	struct pcq_status_thread_arg status = { 0 };
-	struct pcq_thread_arg prod = { 0 };
-	struct pcq_thread_arg cons = { 0 };
+	enum pcq_output output = PCQ_OUTPUT_TEXT;
+	enum pcq_wait_policy wait_policy = PCQ_WAIT_YIELD;
+	struct pcq_sweep sweep = { 0 };
+	struct pcq_run r = { 0 };
+	struct pcq_doorbell doorbell = { 0 };
+	struct pcq_thread_arg prod, cons;
+	u64 wait_spins = 0, wait_max_us = 0;
 	enum pcq_perm role = pcq_perm_nop;
 	char *statusfname = NULL;
 	FILE *statusfile = NULL;
 	u64 status_interval = 0;
+	int stats_fmt = FAMFS_STATS_NONE;
 	char *filename = NULL;
 	bool producer = false;
 	bool consumer = false;
 	bool create = false;
+	enum mu_crc_alg crc_alg = MU_CRC_CRC32C;
 	u64 bucket_size = 0;
+	bool zerocopy = false;
+	bool bench = false;
 	bool drain = false;
 	u64 nmessages = 0;
 	bool info = false;
 	u64 nbuckets = 0;
+	u64 nthreads = 1;
+	bool hash = false;
+	u64 nlanes = 1;
+	s64 lane = -1;
+	u64 batch = 1;
 	int wait = true;
 	int runtime = 0;
 	int verbose = 0;
@@ -171,6 +706,7 @@ main(int argc, char **argv)
 	int arg_ct;
 	int c, rc;
 	s64 mult;
+	int i;
 
 	struct option pcq_options[] = {
 		/* These options set a flag. */
@@ -181,7 +717,15 @@ main(int argc, char **argv)
 		{"statusfile",  required_argument,        0,  'f'},
 		{"time",        required_argument,        0,  't'},
 		{"status",      required_argument,        0,  's'},
+		{"stats",       required_argument,        0,  'E'},
 		{"setperm",     required_argument,        0,  'P'},
+		{"crc",         required_argument,        0,  'a'},
+		{"batch",       required_argument,        0,  'B'},
+		{"lanes",       required_argument,        0,  'L'},
+		{"wait",        required_argument,        0,  'W'},
+		{"lane",        required_argument,        0,  'l'},
+		{"threads",     required_argument,        0,  'T'},
+		{"output",      required_argument,        0,  'o'},
 
 		{"create",      no_argument,              0,  'C'},
 		{"producer",    no_argument,              0,  'p'},
@@ -189,6 +733,9 @@ main(int argc, char **argv)
 		{"info",        no_argument,              0,  'i'},
 		{"drain",       no_argument,              0,  'd'},
 		{"dontflush",   no_argument,              0,  'D'},
+		{"zerocopy",    no_argument,              0,  'Z'},
+		{"hash",        no_argument,              0,  'H'},
+		{"bench",       no_argument,              0,  'm'},
 		/* These options don't set a flag.
 		 * We distinguish them by their indices.
 		 */
@@ -200,7 +747,7 @@ main(int argc, char **argv)
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+b:s:S:n:N:f:t:s:CdpcwDih?v",
+	while ((c = getopt_long(argc, argv, "+a:b:B:L:l:T:W:o:s:E:S:n:N:f:t:s:CdpcwDZHmih?v",
 				pcq_options, &optind)) != EOF) {
 		char *endptr;
 
@@ -217,29 +764,108 @@ main(int argc, char **argv)
 			break;
 
 		case 'b':
-			bucket_size = strtoull(optarg, &endptr, 0);
-			mult = get_multiplier(endptr);
-			if (mult > 0)
-				bucket_size *= mult;
-			printf("bucket_size=%lld\n", bucket_size);
+			/* (A list is only valid with --bench, which sweeps it) */
+			sweep.nbsize = pcq_parse_list(optarg, sweep.bsize, PCQ_SWEEP_MAX);
+			if (sweep.nbsize < 0) {
+				fprintf(stderr, "%s: invalid --bsize (%s)\n", __func__, optarg);
+				pcq_usage(argc, argv);
+				return -1;
+			}
+			bucket_size = sweep.bsize[0];
 			break;
 
 		case 'n':
-			nbuckets = strtoull(optarg, &endptr, 0);
-			mult = get_multiplier(endptr);
-			if (mult > 0)
-				nbuckets *= mult;
-			printf("nbuckets=%lld\n", nbuckets);
+			sweep.nnbuckets = pcq_parse_list(optarg, sweep.nbuckets, PCQ_SWEEP_MAX);
+			if (sweep.nnbuckets < 0) {
+				fprintf(stderr, "%s: invalid --nbuckets (%s)\n", __func__, optarg);
+				pcq_usage(argc, argv);
+				return -1;
+			}
+			nbuckets = sweep.nbuckets[0];
+			break;
+
+		case 'a':
+			if (strcmp(optarg, "crc32c") == 0)
+				crc_alg = MU_CRC_CRC32C;
+			else if (strcmp(optarg, "crc32") == 0)
+				crc_alg = MU_CRC_ZLIB;
+			else {
+				fprintf(stderr, "%s: invalid --crc arg (%s)\n",
+					__func__, optarg);
+				pcq_usage(argc, argv);
+				return -1;
+			}
 			break;
 
 		case 'S':
 			seed = strtoull(optarg, 0, 0);
 			break;
 
+		case 'B':
+			sweep.nbatch = pcq_parse_list(optarg, sweep.batch, PCQ_SWEEP_MAX);
+			for (i = 0; i < sweep.nbatch; i++)
+				if (sweep.batch[i] == 0)
+					sweep.nbatch = -1;
+			if (sweep.nbatch < 0) {
+				fprintf(stderr, "%s: --batch must be at least 1\n", __func__);
+				pcq_usage(argc, argv);
+				return -1;
+			}
+			batch = sweep.batch[0];
+			break;
+
+		case 'L':
+			nlanes = strtoull(optarg, 0, 0);
+			if (nlanes < 1 || nlanes > PCQ_MAX_LANES) {
+				fprintf(stderr, "%s: --lanes must be between 1 and %d\n",
+					__func__, PCQ_MAX_LANES);
+				pcq_usage(argc, argv);
+				return -1;
+			}
+			break;
+
+		case 'l':
+			lane = strtoll(optarg, 0, 0);
+			if (lane < 0) {
+				fprintf(stderr, "%s: invalid --lane\n", __func__);
+				pcq_usage(argc, argv);
+				return -1;
+			}
+			break;
+
+		case 'T':
+			nthreads = strtoull(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: --threads must be at least 1\n", __func__);
+				pcq_usage(argc, argv);
+				return -1;
+			}
+			break;
+
+		case 'W':
+			if (pcq_parse_wait_policy(optarg, &wait_policy, &wait_spins,
+						  &wait_max_us)) {
+				fprintf(stderr, "%s: invalid --wait policy (%s)\n",
+					__func__, optarg);
+				pcq_usage(argc, argv);
+				return -1;
+			}
+			break;
+
 		case 's':
 			status_interval = strtoull(optarg, 0, 0);
 			break;
 
+		case 'E':
+			stats_fmt = famfs_stats_format_from_name(optarg);
+			if (stats_fmt < 0) {
+				fprintf(stderr, "%s: invalid --stats format (%s)\n",
+					__func__, optarg);
+				pcq_usage(argc, argv);
+				return -1;
+			}
+			break;
+
 		case 't':
 			runtime = strtoull(optarg, 0, 0);
 			break;
@@ -294,6 +920,33 @@ main(int argc, char **argv)
 			mock_flush = 1;
 			break;
 
+		case 'Z':
+			zerocopy = true;
+			break;
+
+		case 'H':
+			hash = true;
+			break;
+
+		case 'm':
+			bench = true;
+			break;
+
+		case 'o':
+			if (strcmp(optarg, "text") == 0)
+				output = PCQ_OUTPUT_TEXT;
+			else if (strcmp(optarg, "csv") == 0)
+				output = PCQ_OUTPUT_CSV;
+			else if (strcmp(optarg, "json") == 0)
+				output = PCQ_OUTPUT_JSON;
+			else {
+				fprintf(stderr, "%s: invalid --output arg (%s)\n",
+					__func__, optarg);
+				pcq_usage(argc, argv);
+				return -1;
+			}
+			break;
+
 		case 'h':
 		case '?':
 			pcq_usage(argc, argv);
@@ -301,6 +954,26 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (!bench && (sweep.nbsize > 1 || sweep.nnbuckets > 1 || sweep.nbatch > 1)) {
+		fprintf(stderr, "%s: lists of values are only valid with --bench\n\n",
+			__func__);
+		pcq_usage(argc, argv);
+		return -1;
+	}
+	if (bench && (create || info || drain || seed || zerocopy)) {
+		fprintf(stderr, "%s: --bench runs producers and/or consumers, and its "
+			"payloads are timestamps (not compatible with create, info, drain, "
+			"seed or zerocopy)\n\n", __func__);
+		pcq_usage(argc, argv);
+		return -1;
+	}
+	if (!bench) {
+		if (bucket_size)
+			printf("bucket_size=%lld\n", bucket_size);
+		if (nbuckets)
+			printf("nbuckets=%lld\n", nbuckets);
+	}
+
 	if (info && (create || producer || consumer || drain)) {
 		fprintf(stderr, "%s: info not compatible with operating on a pcq\n\n",
 			argv[0]);
@@ -319,6 +992,18 @@ main(int argc, char **argv)
 		pcq_usage(argc, argv);
 		return -1;
 	}
+	if (lane >= 0 && nthreads > 1) {
+		fprintf(stderr,
+			"%s: --lane runs one producer and/or consumer on that lane\n\n",
+			__func__);
+		pcq_usage(argc, argv);
+		return -1;
+	}
+	if (drain && nthreads > 1) {
+		fprintf(stderr, "%s: drain runs a single consumer\n\n", __func__);
+		pcq_usage(argc, argv);
+		return -1;
+	}
 	if (runtime && nmessages) {
 		fprintf(stderr,
 			"%s: the --nmessages and --time args cannot be used together\n\n",
@@ -348,7 +1033,7 @@ main(int argc, char **argv)
 		return pcq_set_perm(filename, role);
 
 	if (create)
-		return pcq_create(filename, nbuckets, bucket_size, verbose);
+		return pcq_create(filename, nbuckets, bucket_size, nlanes, crc_alg, verbose);
 
 	if (info)
 		return get_queue_info(filename, statusfile, verbose);
@@ -358,10 +1043,24 @@ main(int argc, char **argv)
 		ta.role = CONSUMER;
 		ta.stop_mode = EMPTY;
 		ta.basename = filename;
+		ta.batch = batch;
+		ta.lane = MAX(lane, 0);
 		ta.verbose = verbose;
 
+		ta.zerocopy = zerocopy;
+		if (pcq_open_lanes(filename, CONSUMER, lane, 1, &ta.mq, verbose))
+			return -1;
+		if (zerocopy && ta.mq) {
+			fprintf(stderr, "%s: --zerocopy needs a single lane (see --lane)\n",
+				__func__);
+			pcq_mpmc_close(ta.mq);
+			return -1;
+		}
+
 		printf("pcq:    %s\n", filename);
 		rc = run_consumer(&ta);
+		if (ta.mq)
+			pcq_mpmc_close(ta.mq);
 		printf("pcq drain: nreceived=%lld nerrors=%lld nempty=%lld retries=%lld\n",
 		       ta.nreceived, ta.nerrors, ta.nempty, ta.retries);
 		if (ta.nerrors) {
@@ -381,85 +1080,54 @@ main(int argc, char **argv)
 		return rc;
 	}
 
-	/*
-	 * Start the producer thread if needed
-	 */
 	assert(wait);
-	if (producer) {
-		prod.role = PRODUCER;
-		prod.stop_mode = (runtime) ? STOP_FLAG : NMESSAGES;
-		prod.nmessages = nmessages;
-		prod.runtime = runtime;
-		prod.basename = filename;
-		prod.seed = seed;
-		prod.wait = wait;
-		prod.verbose = verbose;
-		rc = pthread_create(&producer_thread, NULL, pcq_worker, (void *)&prod);
-		if (rc) {
-			fprintf(stderr, "%s: failed to start producer thread\n", __func__);
-		}
-	}
-
-	/*
-	 * Start the consumer thread
-	 */
-	if (consumer) {
-		cons.role = CONSUMER;
-		cons.stop_mode = (runtime) ? STOP_FLAG : NMESSAGES;
-		cons.nmessages = nmessages;
-		prod.runtime = runtime;
-		cons.basename = filename;
-		cons.seed = seed;
-		cons.wait = wait;
-		cons.verbose = verbose;
-		rc = pthread_create(&consumer_thread, NULL, pcq_worker, (void *)&cons);
-		if (rc) {
-			fprintf(stderr, "%s: failed to start consumer thread\n", __func__);
-		}
-	}
-
-	if (status_interval) {
-		status.p = &prod;
-		status.c = &cons;
-		status.basename = filename;
-		status.interval = status_interval;
-		status.stop_now = 0;
-		
-		rc = pthread_create(&status_thread, NULL, status_worker, (void *)&status);
-		if (rc) {
-			fprintf(stderr, "%s: failed to start consumer thread\n", __func__);
-		}
-	}
+	r.producer = producer;
+	r.consumer = consumer;
+	r.hash = hash;
+	r.lane = lane;
+	r.nthreads = nthreads;
+	r.status_interval = status_interval;
+	r.stats_fmt = stats_fmt;
+	r.tmpl.nmessages = nmessages;
+	r.tmpl.runtime = runtime;
+	r.tmpl.basename = filename;
+	r.tmpl.seed = seed;
+	r.tmpl.batch = batch;
+	r.tmpl.zerocopy = zerocopy;
+	r.tmpl.bench = bench;
+	r.tmpl.wait_policy = wait_policy;
+	r.tmpl.wait_spins = wait_spins;
+	r.tmpl.wait_max_us = wait_max_us;
+	r.tmpl.doorbell = &doorbell;
+	r.tmpl.wait = wait;
+	r.tmpl.verbose = verbose;
 
-	if (runtime) {
-		sleep(runtime);
-		prod.stop_now = 1;
-		cons.stop_now = 1;
-		status.stop_now = 1;
-	}
+	if (bench) {
+		if (!producer && !consumer)
+			r.producer = r.consumer = true;
+		if (!nmessages && !runtime)
+			r.tmpl.nmessages = PCQ_BENCH_NMESSAGES_DEFAULT;
+		if (!sweep.nbatch)
+			sweep.batch[sweep.nbatch++] = batch;
 
-	if (producer) {
-		rc = pthread_join(producer_thread, NULL);
-		if (rc)
-			fprintf(stderr, "%s: failed to join producer thread\n", __func__);
-	}
-	if (consumer) {
-		rc = pthread_join(consumer_thread, NULL);
-		if (rc)
-			fprintf(stderr, "%s: failed to join consumer thread\n", __func__);
-	}
-	if (status_interval) {
-		status.stop_now = 1;
-		rc = pthread_join(status_thread, NULL);
+		rc = pcq_bench(filename, &r, &sweep, output, &prod, &cons);
 		if (rc)
-			fprintf(stderr, "%s: failed to join consumer thread\n", __func__);
-	}
+			return -1;
+	} else {
+		if (pcq_run(filename, &r))
+			return -1;
+		prod = r.prod;
+		cons = r.cons;
 
-	printf("pcq:    %s\n", filename);
-	printf("pcq producer: nsent=%lld nerrors=%lld nfull=%lld\n",
-	       prod.nsent, prod.nerrors, prod.nfull);
-	printf("pcq consumer: nreceived=%lld nerrors=%lld nempty=%lld retries=%lld\n",
-	       cons.nreceived, cons.nerrors, cons.nempty, cons.retries);
+		printf("pcq:    %s\n", filename);
+		printf("pcq producer: nsent=%lld nerrors=%lld nfull=%lld nbatches=%lld "
+		       "full_us=%lld\n",
+		       prod.nsent, prod.nerrors, prod.nfull, prod.nbatches, prod.full_ns / 1000);
+		printf("pcq consumer: nreceived=%lld nerrors=%lld nempty=%lld retries=%lld "
+		       "nbatches=%lld empty_us=%lld\n",
+		       cons.nreceived, cons.nerrors, cons.nempty, cons.retries, cons.nbatches,
+		       cons.empty_ns / 1000);
+	}
 
 	if (prod.nerrors || cons.nerrors) {
 		if (statusfile) {
@@ -6,9 +6,27 @@
 #ifndef _LINUX_PCQ_H
 #define _LINUX_PCQ_H
 
-#define PCQ_MAGIC 0xBEEBEE3
+#include <pthread.h>
+
+#include "mu_crc.h"
+
+#define PCQ_MAGIC 0xBEEBEE3    /* Original format: buckets are checksummed with zlib crc32 */
+#define PCQ_MAGIC_V2 0xBEEBEE5 /* @crc_alg says how buckets are checksummed */
+#define PCQ_MAGIC_V3 0xBEEBEE6 /* V2, plus @nlanes lanes @lane_size apart */
 #define PCQ_CONSUMER_MAGIC 0xBEEBEE4
 
+/*
+ * A queue can be split into lanes, each of which is an independent single-producer /
+ * single-consumer ring. Lane i has its own struct pcq (and buckets) at i * lane_size in
+ * the producer file, and its own struct pcq_consumer at i * PCQ_CONSUMER_LANE_SIZE in the
+ * consumer file - so each lane's indices are on their own cache lines (and pages), and
+ * a lane looks exactly like a single-lane queue. Different lanes can be driven by
+ * different threads or hosts.
+ */
+#define PCQ_HDR_SIZE           (2 * 1024 * 1024)
+#define PCQ_CONSUMER_LANE_SIZE (2 * 1024 * 1024)
+#define PCQ_MAX_LANES          256
+
 /**
  * struct @pcq
  *
@@ -18,6 +36,13 @@
  * @bucket_array_offset - offset within this file of the first bucket
  * @producer_index      - index of the last valid entry; empty if == consumer_index
  * @next_seq            - next seq number (not in same cacche line as producer_index)
+ * @pcq_size
+ * @crc_alg             - enum mu_crc_alg of the bucket crcs (PCQ_MAGIC_V2 and up)
+ * @nlanes              - number of lanes (PCQ_MAGIC_V3 only)
+ * @lane_size           - offset between the lanes in the producer file (ditto)
+ *
+ * Every lane's struct pcq has the same @nlanes, @lane_size and @pcq_size (the size of
+ * the whole file).
  */
 struct pcq {
 	u64 pcq_magic;
@@ -28,6 +53,9 @@ struct pcq {
 	char pad[1024];
 	u64 next_seq;
 	u64 pcq_size;
+	u64 crc_alg;
+	u64 nlanes;
+	u64 lane_size;
 };
 
 /**
@@ -49,14 +77,38 @@ struct pcq_consumer {
 };
 
 struct pcq_handle {
-	struct pcq *pcq;
-	struct pcq_consumer *pcqc;
+	struct pcq *pcq;           /* This lane's struct pcq */
+	struct pcq_consumer *pcqc; /* This lane's struct pcq_consumer */
+	u64 lane;
+	size_t psz;                /* Sizes of the mappings of the whole files */
+	size_t csz;
+	u64 nreserved; /* Buckets handed out by pcq_reserve(), not yet committed */
+	u64 npeeked;   /* Buckets handed out by pcq_peek(), not yet released */
 };
 
+static inline bool
+pcq_magic_valid(const struct pcq *pcq)
+{
+	return (pcq->pcq_magic == PCQ_MAGIC || pcq->pcq_magic == PCQ_MAGIC_V2 ||
+		pcq->pcq_magic == PCQ_MAGIC_V3);
+}
+
+static inline enum mu_crc_alg
+pcq_crc_alg(const struct pcq *pcq)
+{
+	return (pcq->pcq_magic == PCQ_MAGIC) ? MU_CRC_ZLIB : (enum mu_crc_alg)pcq->crc_alg;
+}
+
+static inline u64
+pcq_nlanes(const struct pcq *pcq)
+{
+	return (pcq->pcq_magic == PCQ_MAGIC_V3) ? pcq->nlanes : 1;
+}
+
 static inline int64_t
 pcq_payload_size(struct pcq *pcq)
 {
-	assert(pcq->pcq_magic == PCQ_MAGIC);
+	assert(pcq_magic_valid(pcq));
 	return pcq->bucket_size - sizeof(unsigned long) - sizeof(u64);
 }
 
@@ -78,6 +130,53 @@ enum stop_mode {
 	STOP_FLAG,
 };
 
+/**
+ * struct @pcq_mpmc - all the lanes of a queue, for any number of producer and consumer
+ * threads
+ *
+ * Each lane is still single-producer/single-consumer: a thread holds a lane's lock for
+ * the duration of a put or get (see pcq_mpmc_put_batch() and pcq_mpmc_get_batch()).
+ * The lanes share one mapping of each file.
+ */
+struct pcq_mpmc_lane {
+	struct pcq_handle pcqh;
+	pthread_mutex_t lock;
+} __attribute__((aligned(64)));
+
+struct pcq_mpmc {
+	u64 nlanes;
+	u64 cursor;    /* Where the next round-robin put or get starts (atomic) */
+	u64 nreceived; /* Messages gotten by all consumers (atomic) */
+	struct pcq_mpmc_lane *lanes;
+};
+
+#define PCQ_LANE_ANY ((u64)-1) /* pcq_mpmc_put_batch() key for round-robin */
+
+/*
+ * What a producer (or consumer) does while the queue is full (or empty)
+ *
+ * PCQ_WAIT_ADAPTIVE spins (with pause) for @wait_spins checks, then backs off with
+ * exponentially longer bursts of pause, then sleeps for exponentially longer times up to
+ * @wait_max_us between checks. A sleeping waiter can be woken early through a doorbell
+ * that the other side rings when it publishes its index - but only when both sides are
+ * in the same process (the other side may be on another host, so the sleeps are always
+ * bounded).
+ */
+enum pcq_wait_policy {
+	PCQ_WAIT_YIELD = 0, /* sched_yield() between checks */
+	PCQ_WAIT_ADAPTIVE,
+};
+
+#define PCQ_WAIT_SPINS_DEFAULT  1000
+#define PCQ_WAIT_MAX_US_DEFAULT 100
+
+struct pcq_doorbell {
+	u32 seq;      /* Bumped (and futex-woken) by a publish, if anybody is sleeping */
+	u32 nsleepers;
+};
+
+struct mu_hdr_histogram;
+
 struct pcq_thread_arg {
 	enum pcq_role role;
 	int verbose;
@@ -85,8 +184,19 @@ struct pcq_thread_arg {
 	u64 nmessages;
 	u64 runtime;
 	u64 seed;
+	u64 batch;  /* Messages per put/get (0 or 1 for one at a time) */
 	bool wait;
+	bool zerocopy; /* Fill/validate messages in the buckets (reserve/commit, peek/release) */
 	char *basename;
+	u64 lane;            /* The lane to drive, if no @mq */
+	struct pcq_mpmc *mq; /* Drive all lanes through the MPMC front-end (may be shared) */
+	u64 key;             /* Producer lane key with @mq (PCQ_LANE_ANY for round-robin) */
+	enum pcq_wait_policy wait_policy;
+	u64 wait_spins;      /* PCQ_WAIT_ADAPTIVE; 0 for PCQ_WAIT_SPINS_DEFAULT */
+	u64 wait_max_us;     /* PCQ_WAIT_ADAPTIVE; 0 for PCQ_WAIT_MAX_US_DEFAULT */
+	struct pcq_doorbell *doorbell; /* Optional; shared with the other side */
+	bool bench;          /* Stamp messages with their send time (no seed payload) */
+	struct mu_hdr_histogram *lat; /* With @bench: consumer records one-way latency (ns) */
 	int stop_now;
 
 	/* Outputs */
@@ -95,15 +205,20 @@ struct pcq_thread_arg {
 	u64 nerrors;
 	u64 nfull;  /* # of times full (producer) */
 	u64 nempty; /* # of times empty (consumer) */
+	u64 full_ns;  /* Time spent waiting while full */
+	u64 empty_ns; /* Time spent waiting while empty */
 	u64 retries;
+	u64 nbatches; /* # of index updates published */
 	int result;
 };
 
 struct pcq_status_thread_arg {
-	struct pcq_thread_arg *p; /* producer */
-	struct pcq_thread_arg *c; /* consumer */
+	struct pcq_thread_arg *p; /* producers */
+	struct pcq_thread_arg *c; /* consumers */
+	u64 nthreads;             /* of each */
 	char *basename;
 	u64 interval;
+	int stats_fmt;            /* enum famfs_stats_format; FAMFS_STATS_NONE for none */
 	int stop_now;
 };
 
@@ -115,8 +230,54 @@ enum pcq_perm {
 	pcq_perm_consumer,
 };
 
+enum pcq_producer_status {
+	PCQ_PUT_GOOD,
+	PCQ_PUT_FULL_NOWAIT,
+	PCQ_PUT_STOPPED,
+};
+
+enum pcq_consumer_status {
+	PCQ_GET_GOOD,
+	PCQ_GET_EMPTY,
+	PCQ_GET_STOPPED,
+	PCQ_GET_BAD_MSG, /* Failed its crc or sequence check; it stays in the queue */
+};
+
+/*
+ * Library API: open a queue once with pcq_producer_open() or pcq_consumer_open() (one
+ * lane with pcq_lane_open(), or all of them with pcq_mpmc_open()), and put or get batches
+ * of entries through the handle. The thread arg of the put/get calls is optional: with
+ * NULL, a call returns PCQ_PUT_FULL_NOWAIT (or PCQ_GET_EMPTY) rather than waiting, and
+ * keeps no counters.
+ */
+struct pcq_handle *pcq_lane_open(const char *fname, enum pcq_role role, u64 lane,
+				 int verbose);
+struct pcq_handle *pcq_producer_open(const char *fname, int verbose);
+struct pcq_handle *pcq_consumer_open(const char *fname, int verbose);
+void pcq_close(struct pcq_handle *pcqh);
+void *pcq_alloc_entries(struct pcq_handle *pcqh, u64 n);
+void *pcq_alloc_entry(struct pcq_handle *pcqh);
+u64 pcq_entry_seq(struct pcq_handle *pcqh, const void *entry);
+enum pcq_producer_status pcq_put_batch(struct pcq_handle *pcqh, void *entries, u64 n,
+				       u64 *nput, struct pcq_thread_arg *a);
+enum pcq_consumer_status pcq_get_batch(struct pcq_handle *pcqh, void *entries_out, u64 max,
+				       u64 *nget, struct pcq_thread_arg *a);
+enum pcq_producer_status pcq_reserve(struct pcq_handle *pcqh, u64 n, void **bucketp,
+				     u64 *nreserved, struct pcq_thread_arg *a);
+void pcq_commit(struct pcq_handle *pcqh, u64 n, struct pcq_thread_arg *a);
+enum pcq_consumer_status pcq_peek(struct pcq_handle *pcqh, u64 max, const void **bucketp,
+				  u64 *navail, struct pcq_thread_arg *a);
+void pcq_release(struct pcq_handle *pcqh, u64 n, struct pcq_thread_arg *a);
+struct pcq_mpmc *pcq_mpmc_open(const char *fname, enum pcq_role role, int verbose);
+void pcq_mpmc_close(struct pcq_mpmc *mq);
+enum pcq_producer_status pcq_mpmc_put_batch(struct pcq_mpmc *mq, void *entries, u64 n,
+					    u64 key, u64 *nput, struct pcq_thread_arg *a);
+enum pcq_consumer_status pcq_mpmc_get_batch(struct pcq_mpmc *mq, void *entries_out,
+					    u64 max, u64 *nget, struct pcq_thread_arg *a);
 int pcq_set_perm(const char *filename, enum pcq_perm role);
-int pcq_create(char *fname, u64 nbuckets, u64 bucket_size, int verbose);
+int pcq_create(char *fname, u64 nbuckets, u64 bucket_size, u64 nlanes,
+	       enum mu_crc_alg crc_alg, int verbose);
+int pcq_reformat(const char *fname, u64 nbuckets, u64 bucket_size, int verbose);
 int get_queue_info(const char *fname, FILE *statusfile, int verbose);
 int run_producer(struct pcq_thread_arg *a);
 void *pcq_worker(void *arg);
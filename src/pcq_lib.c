@@ -32,9 +32,14 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "famfs_lib.h"
 #include "mu_mem.h"
+#include "mu_histogram.h"
+#include "famfs_stats.h"
 #include "random_buffer.h"
 #include "famfs.h"
 #include "pcq.h"
@@ -59,11 +64,16 @@ pcq_valid(struct pcq_handle *pcqh, int verbose)
 			fprintf(stderr, "pcqc null\n");
 		return false;
 	}
-	if (pcqh->pcq->pcq_magic != PCQ_MAGIC) {
+	if (!pcq_magic_valid(pcqh->pcq)) {
 		if (verbose)
 			fprintf(stderr, "pcq bad magic\n");
 		return false;
 	}
+	if (pcq_crc_alg(pcqh->pcq) != MU_CRC_ZLIB && pcq_crc_alg(pcqh->pcq) != MU_CRC_CRC32C) {
+		if (verbose)
+			fprintf(stderr, "pcq unknown crc algorithm %lld\n", pcqh->pcq->crc_alg);
+		return false;
+	}
 	if (pcqh->pcqc->pcq_consumer_magic != PCQ_CONSUMER_MAGIC) {
 		if (verbose)
 			fprintf(stderr, "pcqc bad magic\n");
@@ -121,13 +131,65 @@ pcq_seq_offset(struct pcq *pcq)
 	return pcq_crc_offset(pcq) - sizeof(u64);
 }
 
-void *
-pcq_alloc_entry(struct pcq_handle *pcqh)
+/* Lanes start on 2MiB boundaries; the last one isn't padded */
+static inline u64
+pcq_lane_size(u64 nbuckets, u64 bucket_size)
 {
-	assert(pcqh);
-	assert(pcqh->pcq);
-	assert(pcqh->pcq->pcq_magic == PCQ_MAGIC);
-	return calloc(1, pcqh->pcq->bucket_size);
+	return roundup(PCQ_HDR_SIZE + (nbuckets * bucket_size), PCQ_HDR_SIZE);
+}
+
+static inline u64
+pcq_file_size(u64 nlanes, u64 nbuckets, u64 bucket_size)
+{
+	return ((nlanes - 1) * pcq_lane_size(nbuckets, bucket_size)) + PCQ_HDR_SIZE +
+		(nbuckets * bucket_size);
+}
+
+/* Initialize (or reset) the lane headers in a mapped consumer file */
+static void
+pcq_init_consumer_lanes(struct pcq_consumer *pcqc, size_t csz, u64 nlanes)
+{
+	u64 i;
+
+	for (i = 0; i < nlanes; i++) {
+		struct pcq_consumer *lc = (void *)((u64)pcqc + (i * PCQ_CONSUMER_LANE_SIZE));
+
+		lc->pcq_consumer_magic = PCQ_CONSUMER_MAGIC;
+		lc->consumer_index = 0;
+		lc->next_seq = 0;
+		lc->pcqc_size = csz;
+		flush_processor_cache(lc, sizeof(*lc));
+	}
+}
+
+/* Initialize (or reset) the lane headers in a mapped producer file */
+static void
+pcq_init_producer_lanes(
+	struct pcq *pcq,
+	size_t psz,
+	u64 nlanes,
+	u64 nbuckets,
+	u64 bucket_size,
+	enum mu_crc_alg crc_alg)
+{
+	u64 lane_size = pcq_lane_size(nbuckets, bucket_size);
+	u64 i;
+
+	for (i = 0; i < nlanes; i++) {
+		struct pcq *lp = (void *)((u64)pcq + (i * lane_size));
+
+		lp->pcq_magic = PCQ_MAGIC_V3;
+		lp->crc_alg = crc_alg;
+		lp->nlanes = nlanes;
+		lp->lane_size = lane_size;
+		lp->nbuckets = nbuckets;
+		lp->bucket_size = bucket_size;
+		lp->bucket_array_offset = PCQ_HDR_SIZE;
+		lp->producer_index = 0ULL;
+		lp->next_seq = 0;
+		lp->pcq_size = psz;
+		flush_processor_cache(lp, sizeof(*lp));
+	}
 }
 
 int
@@ -135,16 +197,17 @@ pcq_create(
 	char *fname,
 	u64 nbuckets,
 	u64 bucket_size,
+	u64 nlanes,
+	enum mu_crc_alg crc_alg,
 	int verbose)
 {
-	int two_mb = 2 * 1024 * 1024;
 	struct pcq_consumer *pcqc;
 	char *consumer_fname;
 	size_t psz, csz;
 	struct pcq *pcq;
 	struct stat st;
-	int rc, rc2;
 	u64 size;
+	int rc, rc2;
 	int fd;
 
 	if (bucket_size & (bucket_size - 1)) {
@@ -152,8 +215,13 @@ pcq_create(
 			__func__, bucket_size);
 		return -1;
 	}
+	if (nlanes < 1 || nlanes > PCQ_MAX_LANES) {
+		fprintf(stderr, "%s: nlanes %lld must be between 1 and %d\n",
+			__func__, nlanes, PCQ_MAX_LANES);
+		return -1;
+	}
 
-	size = two_mb + (nbuckets * bucket_size);
+	size = pcq_file_size(nlanes, nbuckets, bucket_size);
 
 	consumer_fname = pcq_consumer_fname(fname);
 	assert(consumer_fname);
@@ -176,7 +244,8 @@ pcq_create(
 	/*
 	 * Create the consumer file
 	 */
-	fd = famfs_mkfile(consumer_fname, 0644, 0, 0, two_mb, 1);
+	fd = famfs_mkfile(consumer_fname, 0644, 0, 0, nlanes * PCQ_CONSUMER_LANE_SIZE,
+			  FAMFS_ALLOC_FIRST_FIT, 1);
 	if (fd < 0) {
 		fprintf(stderr, "%s: failed to create consumer file\n", __func__);
 		rc = -1;
@@ -188,22 +257,17 @@ pcq_create(
 	pcqc = famfs_mmap_whole_file(consumer_fname, 0 /* writable */, &csz);
 	if (!pcqc) {
 		fprintf(stderr, "%s: failed to create consumer file\n", __func__);
-		free(consumer_fname);
 		rc = -1;
 		goto out;
 	}
 
-	pcqc->pcq_consumer_magic = PCQ_CONSUMER_MAGIC;
-	pcqc->consumer_index = 0;
-	pcqc->next_seq = 0;
-	pcqc->pcqc_size = csz;
-	flush_processor_cache(pcqc, sizeof(*pcqc));
+	pcq_init_consumer_lanes(pcqc, csz, nlanes);
 	munmap(pcqc, csz); /* We're the producer; will remap read-only */
 
 	/*
 	 * Create the producer file
 	 */
-	fd = famfs_mkfile(fname, 0644, 0, 0, size, 1);
+	fd = famfs_mkfile(fname, 0644, 0, 0, size, FAMFS_ALLOC_FIRST_FIT, 1);
 	if (fd < 0) {
 		fprintf(stderr, "%s: failed to create producer file\n", __func__);
 		rc = -1;
@@ -217,42 +281,107 @@ pcq_create(
 		goto out;
 	}
 
-	pcq->pcq_magic = PCQ_MAGIC;
-	pcq->nbuckets = nbuckets;
-	pcq->bucket_size = bucket_size;
-	pcq->bucket_array_offset = two_mb;
-	pcq->producer_index = 0ULL;
-	pcq->next_seq = 0;
-	pcq->pcq_size = psz;
-	flush_processor_cache(pcq, sizeof(*pcq));
+	pcq_init_producer_lanes(pcq, psz, nlanes, nbuckets, bucket_size, crc_alg);
 
 	if (verbose) {
 		printf("%s: sizeof(crc)=%ld\n", __func__, sizeof(unsigned long));
 		printf("%s: bucket_size=%lld\n", __func__, pcq->bucket_size);
 		printf("%s: payload_size=%ld\n", __func__, pcq_payload_size(pcq));
+		printf("%s: crc=%s\n", __func__, mu_crc_alg_name(crc_alg));
+		printf("%s: nlanes=%lld lane_size=%lld\n", __func__, nlanes, pcq->lane_size);
 	}
 	munmap(pcq, psz);
-	munmap(pcqc, csz);
 	printf("%s: Created queue %s\n", __func__, fname);
 out:
 	free(consumer_fname);
 	return 0;
 }
 
-
-struct pcq_handle *
-pcq_open(
+/**
+ * pcq_reformat() - change the bucket size and count of an existing queue, in place
+ *
+ * The queue keeps its files, lanes and crc algorithm. Its indices and sequence numbers
+ * are reset, so the queue must be idle, and any messages in it are lost. Like
+ * pcq_create(), this needs both files to be writable. (This lets a benchmark try
+ * different geometries without creating more files, which famfs can't delete.)
+ */
+int
+pcq_reformat(
 	const char *fname,
-	enum pcq_role role,
+	u64 nbuckets,
+	u64 bucket_size,
 	int verbose)
 {
-	int rc;
+	struct pcq_consumer *pcqc = NULL;
+	struct pcq *pcq = NULL;
+	char *consumer_fname;
+	enum mu_crc_alg alg;
 	size_t psz, csz;
-	struct pcq *pcq;
+	u64 nlanes;
+	int rc = -1;
+
+	if (bucket_size & (bucket_size - 1) ||
+	    bucket_size <= sizeof(u64) + sizeof(unsigned long) || nbuckets < 2) {
+		fprintf(stderr, "%s: bucket_size %lld must be a power of 2 with room for a "
+			"payload, and nbuckets (%lld) at least 2\n",
+			__func__, bucket_size, nbuckets);
+		return -1;
+	}
+
+	consumer_fname = pcq_consumer_fname(fname);
+	assert(consumer_fname);
+
+	pcq = famfs_mmap_whole_file(fname, 0 /* writable */, &psz);
+	if (!pcq)
+		goto out;
+	pcqc = famfs_mmap_whole_file(consumer_fname, 0 /* writable */, &csz);
+	if (!pcqc)
+		goto out;
+
+	if (!pcq_magic_valid(pcq) || pcqc->pcq_consumer_magic != PCQ_CONSUMER_MAGIC) {
+		fprintf(stderr, "%s: %s is not a pcq\n", __func__, fname);
+		goto out;
+	}
+
+	nlanes = pcq_nlanes(pcq);
+	alg = pcq_crc_alg(pcq);
+	if (pcq_file_size(nlanes, nbuckets, bucket_size) > psz) {
+		fprintf(stderr, "%s: %lld lanes of %lld x %lld buckets don't fit in %s\n",
+			__func__, nlanes, nbuckets, bucket_size, fname);
+		goto out;
+	}
+
+	pcq_init_consumer_lanes(pcqc, csz, nlanes);
+	pcq_init_producer_lanes(pcq, psz, nlanes, nbuckets, bucket_size, alg);
+	if (verbose)
+		printf("%s: %s: nlanes=%lld nbuckets=%lld bucket_size=%lld\n",
+		       __func__, fname, nlanes, nbuckets, bucket_size);
+	rc = 0;
+out:
+	if (pcq)
+		munmap(pcq, psz);
+	if (pcqc)
+		munmap(pcqc, csz);
+	free(consumer_fname);
+	return rc;
+}
+
+/*
+ * Map both files of a queue (whole), and check that all of its lanes fit in them
+ */
+static int
+pcq_map(
+	const char *fname,
+	enum pcq_role role,
+	struct pcq_handle *pcqh)
+{
 	struct pcq_consumer *pcqc;
-	struct pcq_handle *pcqh;
 	char *consumer_fname;
+	size_t psz, csz;
+	struct pcq *pcq;
 	struct stat st;
+	u64 nlanes;
+	int rc;
 
 	consumer_fname = pcq_consumer_fname(fname);
 
@@ -260,13 +389,13 @@ pcq_open(
 	if (rc) {
 		fprintf(stderr, "%s: pcq files not found for queue %s\n", __func__, fname);
 		free(consumer_fname);
-		return NULL;
+		return -1;
 	}
 
 	pcq = famfs_mmap_whole_file(fname, (role == PRODUCER) ? 0:1, &psz);
 	if (!pcq) {
 		free(consumer_fname);
-		return NULL;
+		return -1;
 	}
 
 	pcqc = famfs_mmap_whole_file(consumer_fname, (role == CONSUMER) ? 0:1, &csz);
@@ -274,23 +403,109 @@ pcq_open(
 		munmap(pcq, psz);
 		fprintf(stderr, "%s: failed to create consumer file\n", __func__);
 		free(consumer_fname);
-		return NULL;
+		return -1;
+	}
+	free(consumer_fname);
+
+	nlanes = pcq_nlanes(pcq);
+	if (pcq->pcq_magic == PCQ_MAGIC_V3 &&
+	    (nlanes < 1 || nlanes > PCQ_MAX_LANES ||
+	     ((nlanes - 1) * pcq->lane_size) + pcq->bucket_array_offset +
+	     (pcq->nbuckets * pcq->bucket_size) > psz ||
+	     nlanes * PCQ_CONSUMER_LANE_SIZE > csz)) {
+		fprintf(stderr, "%s: queue %s has a bad lane layout (nlanes=%lld)\n",
+			__func__, fname, nlanes);
+		munmap(pcq, psz);
+		munmap(pcqc, csz);
+		return -1;
 	}
 
-	pcqh = calloc(1, sizeof(*pcqh));
 	pcqh->pcq = pcq;
 	pcqh->pcqc = pcqc;
+	pcqh->psz = psz;
+	pcqh->csz = csz;
+	pcqh->lane = 0;
+	return 0;
+}
+
+/* Point a handle from pcq_map() (@pcqh, which is not modified) at @lane */
+static void
+pcq_lane_init(
+	struct pcq_handle *lane_pcqh,
+	const struct pcq_handle *pcqh,
+	u64 lane)
+{
+	*lane_pcqh = *pcqh;
+	lane_pcqh->pcq = (struct pcq *)((u64)pcqh->pcq + (lane * pcqh->pcq->lane_size));
+	lane_pcqh->pcqc = (struct pcq_consumer *)((u64)pcqh->pcqc +
+						  (lane * PCQ_CONSUMER_LANE_SIZE));
+	lane_pcqh->lane = lane;
+}
+
+/* Unmap the files that a handle (on any lane) points into */
+static void
+pcq_unmap(struct pcq_handle *pcqh)
+{
+	munmap((void *)((u64)pcqh->pcq - (pcqh->lane * pcqh->pcq->lane_size)), pcqh->psz);
+	munmap((void *)((u64)pcqh->pcqc - (pcqh->lane * PCQ_CONSUMER_LANE_SIZE)), pcqh->csz);
+}
+
+/**
+ * pcq_lane_open() - open one lane of a pcq, for single-producer/single-consumer use
+ */
+struct pcq_handle *
+pcq_lane_open(
+	const char *fname,
+	enum pcq_role role,
+	u64 lane,
+	int verbose)
+{
+	struct pcq_handle *pcqh;
+	struct pcq_handle files;
+	struct pcq *pcq;
+
+	memset(&files, 0, sizeof(files));
+	if (pcq_map(fname, role, &files))
+		return NULL;
+
+	pcq = files.pcq;
+	if (lane >= pcq_nlanes(pcq)) {
+		fprintf(stderr, "%s: queue %s has no lane %lld (nlanes=%lld)\n",
+			__func__, fname, lane, pcq_nlanes(pcq));
+		pcq_unmap(&files);
+		return NULL;
+	}
+
+	pcqh = calloc(1, sizeof(*pcqh));
+	pcq_lane_init(pcqh, &files, lane);
 
 	if (verbose) {
 		printf("%s: sizeof(crc)=%ld\n", __func__, sizeof(unsigned long));
 		printf("%s: bucket_size=%lld\n", __func__, pcq->bucket_size);
 		printf("%s: payload_size=%ld\n", __func__, pcq_payload_size(pcq));
+		printf("%s: crc=%s\n", __func__, mu_crc_alg_name(pcq_crc_alg(pcq)));
+		printf("%s: lane %lld of %lld\n", __func__, lane, pcq_nlanes(pcq));
 	}
 
-	free(consumer_fname);
 	return pcqh;
 }
 
+struct pcq_handle *
+pcq_open(
+	const char *fname,
+	enum pcq_role role,
+	int verbose)
+{
+	return pcq_lane_open(fname, role, 0, verbose);
+}
+
+void
+pcq_close(struct pcq_handle *pcqh)
+{
+	pcq_unmap(pcqh);
+	free(pcqh);
+}
+
 struct pcq_handle *
 pcq_producer_open(const char *fname, int verbose)
 {
@@ -303,201 +518,465 @@ pcq_consumer_open(const char *fname, int verbose)
 	return pcq_open(fname, CONSUMER, verbose);
 }
 
-enum pcq_producer_status {
-	PCQ_PUT_GOOD,
-	PCQ_PUT_FULL_NOWAIT,
-	PCQ_PUT_STOPPED,
+static inline void *
+pcq_bucket(struct pcq *pcq, u64 index)
+{
+	return (void *)((u64)pcq + pcq->bucket_array_offset + (index * pcq->bucket_size));
+}
+
+static inline void *
+pcq_entry(struct pcq *pcq, const void *entries, u64 i)
+{
+	return (void *)((u64)entries + (i * pcq->bucket_size));
+}
+
+void *
+pcq_alloc_entries(struct pcq_handle *pcqh, u64 n)
+{
+	assert(pcqh);
+	assert(pcqh->pcq);
+	assert(pcq_magic_valid(pcqh->pcq));
+	return calloc(n, pcqh->pcq->bucket_size);
+}
+
+void *
+pcq_alloc_entry(struct pcq_handle *pcqh)
+{
+	return pcq_alloc_entries(pcqh, 1);
+}
+
+/* The sequence number of an entry or a bucket */
+u64
+pcq_entry_seq(struct pcq_handle *pcqh, const void *entry)
+{
+	return *(const u64 *)((u64)entry + pcq_seq_offset(pcqh->pcq));
+}
+
+/*
+ * Waiting while full or empty (see enum pcq_wait_policy). A wait is a loop of
+ * pcq_wait_arm(), a check, and (if the check fails) pcq_backoff(); pcq_wait_done()
+ * ends it.
+ */
+#define PCQ_BACKOFF_MAX_PAUSES 1024
+
+struct pcq_waiter {
+	u64 nchecks;
+	u64 npauses;   /* Length of the next backoff burst */
+	u64 sleep_us;  /* Length of the next sleep */
+	u64 start_ns;  /* When the first check failed */
+	u32 seq;       /* Doorbell seq from before the last check */
+	bool sleeping; /* Counted in doorbell->nsleepers */
 };
 
+static inline u64
+pcq_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/* Snapshot the doorbell before a check, so a publish after the check wakes us up */
+static inline void
+pcq_wait_arm(struct pcq_waiter *w, struct pcq_thread_arg *a)
+{
+	if (w->sleeping)
+		w->seq = __atomic_load_n(&a->doorbell->seq, __ATOMIC_ACQUIRE);
+}
+
+static void
+pcq_backoff(struct pcq_waiter *w, struct pcq_thread_arg *a)
+{
+	u64 spins = (a->wait_spins) ? a->wait_spins : PCQ_WAIT_SPINS_DEFAULT;
+	u64 max_us = (a->wait_max_us) ? a->wait_max_us : PCQ_WAIT_MAX_US_DEFAULT;
+	struct timespec ts;
+	u64 i;
+
+	if (!w->start_ns)
+		w->start_ns = pcq_now_ns();
+	w->nchecks++;
+
+	if (a->wait_policy == PCQ_WAIT_YIELD) {
+		sched_yield();
+		return;
+	}
+
+	/* Spin */
+	if (w->nchecks <= spins) {
+		__builtin_ia32_pause();
+		return;
+	}
+
+	/* Back off */
+	if (w->npauses < PCQ_BACKOFF_MAX_PAUSES) {
+		w->npauses = (w->npauses) ? w->npauses * 2 : 2;
+		for (i = 0; i < w->npauses; i++)
+			__builtin_ia32_pause();
+		return;
+	}
+
+	/* Sleep. Start listening for the doorbell first; the wait is armed next time */
+	if (a->doorbell && !w->sleeping) {
+		w->sleeping = true;
+		__atomic_add_fetch(&a->doorbell->nsleepers, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	w->sleep_us = (w->sleep_us) ? MIN(w->sleep_us * 2, max_us) : 1;
+	ts.tv_sec = w->sleep_us / 1000000;
+	ts.tv_nsec = (w->sleep_us % 1000000) * 1000;
+	if (w->sleeping)
+		syscall(SYS_futex, &a->doorbell->seq, FUTEX_WAIT_PRIVATE, w->seq, &ts, NULL, 0);
+	else
+		nanosleep(&ts, NULL);
+}
+
+static void
+pcq_wait_done(struct pcq_waiter *w, struct pcq_thread_arg *a, u64 *wait_ns)
+{
+	if (w->start_ns)
+		*wait_ns += pcq_now_ns() - w->start_ns;
+	if (w->sleeping)
+		__atomic_sub_fetch(&a->doorbell->nsleepers, 1, __ATOMIC_SEQ_CST);
+	memset(w, 0, sizeof(*w));
+}
+
+/* After publishing an index: wake up anybody sleeping on the other side */
+static inline void
+pcq_ring_doorbell(struct pcq_thread_arg *a)
+{
+	struct pcq_doorbell *db = a->doorbell;
+
+	if (!db)
+		return;
+
+	/* The index store must be ordered before the nsleepers load */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&db->nsleepers, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&db->seq, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &db->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+/*
+ * The put/get calls take an optional thread arg, for wait policies and counters.
+ * Without one (NULL), a call doesn't wait while the queue is full (or empty), and
+ * counts nothing.
+ */
+static inline struct pcq_thread_arg *
+pcq_arg(struct pcq_thread_arg *a, struct pcq_thread_arg *dflt)
+{
+	if (a)
+		return a;
+	memset(dflt, 0, sizeof(*dflt));
+	return dflt;
+}
+
 /**
- * pcq_producer_put() - put an in a pcq
+ * pcq_producer_wait() - wait for (at least one) free bucket
  *
- * NOTE: this function must not be called re-entrantly for the same queue
+ * @nfree - the number of free buckets
  */
 static enum pcq_producer_status
-pcq_producer_put(
+pcq_producer_wait(
 	struct pcq_handle *pcqh,
-	void  *entry,
+	u64 *nfree,
 	struct pcq_thread_arg *a)
 {
-	unsigned long crc = crc32(0L, Z_NULL, 0);
 	struct pcq_consumer *pcqc = pcqh->pcqc;
 	struct pcq *pcq = pcqh->pcq;
-	u64 crc_offset, seq_offset;
-	unsigned long *crcp;
-	void *bucket_addr;
-	u64 put_index;
+	enum pcq_producer_status pstat;
+	struct pcq_waiter w = { 0 };
 	bool full = false;
-	u64 *seqp;
-
-	/* Bucket size is inclusive of sequence number and crc at the end
-	 * Compute pointers to those. We do this in the entry before we memcpy
-	 * it into the queue bucket.
-	 */
-	crc_offset = pcq_crc_offset(pcq);
-	seq_offset = pcq_seq_offset(pcq);
-
-	/* crc and sequence pointers into the entry */
-	crcp = (unsigned long *)((u64)entry + crc_offset);
-	seqp = (u64 *)((u64)entry + seq_offset);
-
-	assert(pcq->pcq_magic == PCQ_MAGIC);
-	assert(pcqc->pcq_consumer_magic == PCQ_CONSUMER_MAGIC);
+	u64 put_index;
 
 	do {
+		pcq_wait_arm(&w, a);
 		put_index = pcq->producer_index;
 
-		if (((put_index + 1) % pcq->nbuckets ) != pcqc->consumer_index)
-			break; /* Not full - proceed */
+		/* One bucket is always left empty, so full != empty */
+		*nfree = (pcqc->consumer_index + pcq->nbuckets - put_index - 1) % pcq->nbuckets;
+		if (*nfree) {
+			pstat = PCQ_PUT_GOOD;
+			break;
+		}
 
 		/* Queue looks full */
-		if (!full) { /* Count full only once per call to this function */
+		if (!full) { /* Count full only once per call */
 			full = true;
 			a->nfull++;
 		}
 		if (a->stop_now) {
-			return PCQ_PUT_STOPPED;
+			pstat = PCQ_PUT_STOPPED;
+			break;
 		}
 		else if (a->wait) {
+			pcq_backoff(&w, a);
 			invalidate_processor_cache(&pcqc->consumer_index,
 						   sizeof(pcqc->consumer_index));
-			sched_yield();
 		} else {
-			fprintf(stderr, "%s: queue full no wait\n", __func__);
-			return PCQ_PUT_FULL_NOWAIT;
+			if (a->verbose > 1)
+				printf("%s: queue full no wait\n", __func__);
+			pstat = PCQ_PUT_FULL_NOWAIT;
+			break;
 		}
 	} while (true);
 
-	/* Set seq and crc in entry before we memcpy it into the bucket */
-	*seqp = pcq->next_seq++;
-	crc = crc32(crc, entry, pcq_payload_size(pcq) + sizeof(*seqp));
-	*crcp = crc;
-
-	if (a->verbose) {
-		printf("%s: put_index=%lld seq=%lld\n", __func__, put_index, *seqp);
-		if (a->verbose > 1) {
-			printf("%s: bucket_size=%lld seq_offset=%lld "
-			       "crc_offset=%lld crc %lx/%lx\n",
-			       __func__, pcq->bucket_size, seq_offset, crc_offset,
-			       crc, *crcp);
-		}
-	}
-
-	/*
-	 * Put entry into the queue
-	 */
-	bucket_addr = (void *)((u64)pcq + pcq->bucket_array_offset +
-			       (put_index * pcq->bucket_size));
-	memcpy(bucket_addr, entry, pcq->bucket_size);
-	flush_processor_cache(bucket_addr, pcq->bucket_size);
-	pcq->producer_index = (put_index + 1) % pcq->nbuckets;
-	flush_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
-
-	a->nsent++;
-	return 0;
+	pcq_wait_done(&w, a, &a->full_ns);
+	return pstat;
 }
 
-enum pcq_consumer_status {
-	PCQ_GET_GOOD,
-	PCQ_GET_EMPTY,
-	PCQ_GET_STOPPED,
-	PCQ_GET_BAD_MSG,
-};
-
-#define CONSUMER_NRETRIES 2
-
 /**
- * pcq_consumer_get() - get an element from a pcq
+ * pcq_reserve() - get free buckets to fill in place
+ *
+ * Waits for at least one free bucket. The buckets are contiguous, so fewer than @n may
+ * be reserved when the free space wraps around the end of the ring. The caller writes
+ * the payloads (pcq_payload_size() bytes at the start of each bucket), then calls
+ * pcq_commit().
+ *
+ * @bucketp   - the first reserved bucket; the rest follow at bucket_size strides
+ * @nreserved - the number of buckets reserved
  *
  * NOTE: this function must not be called re-entrantly for the same queue
  */
-static enum pcq_consumer_status
-pcq_consumer_get(
+enum pcq_producer_status
+pcq_reserve(
 	struct pcq_handle *pcqh,
-	void  *entry_out,
-	u64 *seq_out,
+	u64 n,
+	void **bucketp,
+	u64 *nreserved,
+	struct pcq_thread_arg *a)
+{
+	struct pcq *pcq = pcqh->pcq;
+	enum pcq_producer_status pstat;
+	u64 put_index;
+	u64 nfree;
+	struct pcq_thread_arg dflt;
+
+	a = pcq_arg(a, &dflt);
+	assert(pcq_magic_valid(pcq));
+	assert(pcqh->pcqc->pcq_consumer_magic == PCQ_CONSUMER_MAGIC);
+	assert(n > 0);
+
+	*nreserved = 0;
+	pstat = pcq_producer_wait(pcqh, &nfree, a);
+	if (pstat != PCQ_PUT_GOOD)
+		return pstat;
+
+	put_index = pcq->producer_index;
+	*nreserved = MIN(MIN(n, nfree), pcq->nbuckets - put_index);
+	*bucketp = pcq_bucket(pcq, put_index);
+	pcqh->nreserved = *nreserved;
+	return PCQ_PUT_GOOD;
+}
+
+/**
+ * pcq_commit() - publish the first @n reserved buckets
+ *
+ * Sequence numbers and crcs are set in place; then the buckets are flushed together,
+ * and the producer index is published once.
+ */
+void
+pcq_commit(
+	struct pcq_handle *pcqh,
+	u64 n,
 	struct pcq_thread_arg *a)
 {
-	unsigned long crc;
-	struct pcq_consumer *pcqc = pcqh->pcqc;
-	int retries = CONSUMER_NRETRIES;
 	struct pcq *pcq = pcqh->pcq;
+	enum mu_crc_alg alg = pcq_crc_alg(pcq);
+	u64 put_index = pcq->producer_index;
 	u64 crc_offset, seq_offset;
-	bool retry_counted = false;
-	bool good_crc = true;
 	unsigned long *crcp;
-	void *bucket_addr;
-	u64 seq_expect;
-	u64 get_index;
-	bool empty = false;
-	int errs = 0;
+	void *first;
 	u64 *seqp;
+	u64 i;
+	struct pcq_thread_arg dflt;
 
-	assert(pcq->pcq_magic == PCQ_MAGIC);
-	assert(pcqc->pcq_consumer_magic == PCQ_CONSUMER_MAGIC);
+	a = pcq_arg(a, &dflt);
+	assert(n <= pcqh->nreserved);
+	pcqh->nreserved = 0;
+	if (!n)
+		return;
 
-	/* Wait until there is in a message to consume (breaking out if we get stopped) */
-	do {
-		get_index = pcqc->consumer_index;
+	/* Bucket size is inclusive of sequence number and crc at the end */
+	crc_offset = pcq_crc_offset(pcq);
+	seq_offset = pcq_seq_offset(pcq);
 
-		invalidate_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
-		if (get_index != pcq->producer_index)
-			break;
-		else {
-			/* Queue looks empty */
-			if (!empty) {
-				/* count empty only once per call to this function */
-				empty = true;
-				a->nempty++;
-			}
-			if (a->stop_now)
-				return PCQ_GET_STOPPED;
-			else if (a->wait)
-				sched_yield();
-			else {
-				if (a->verbose > 1)
-					printf("%s: queue empty\n", __func__);
-				return PCQ_GET_EMPTY;
+	first = pcq_bucket(pcq, put_index);
+	for (i = 0; i < n; i++) {
+		void *bucket_addr = pcq_entry(pcq, first, i);
+
+		crcp = (unsigned long *)((u64)bucket_addr + crc_offset);
+		seqp = (u64 *)((u64)bucket_addr + seq_offset);
+		*seqp = pcq->next_seq++;
+		*crcp = mu_crc(alg, 0, bucket_addr, pcq_payload_size(pcq) + sizeof(*seqp));
+
+		if (a->verbose) {
+			printf("%s: put_index=%lld seq=%lld\n", __func__, put_index + i, *seqp);
+			if (a->verbose > 1) {
+				printf("%s: bucket_size=%lld seq_offset=%lld "
+				       "crc_offset=%lld crc %lx\n",
+				       __func__, pcq->bucket_size, seq_offset,
+				       crc_offset, *crcp);
 			}
 		}
-	} while (true);
+	}
 
-	/* Get entry from queue */
-	bucket_addr = (void *)((u64)pcq + pcq->bucket_array_offset +
-			       (get_index * pcq->bucket_size));
-	seq_expect = pcqc->next_seq++;
+	/* One flush of the buckets, ordered before the index that publishes them */
+	flush_processor_cache(first, n * pcq->bucket_size);
+	pcq->producer_index = (put_index + n) % pcq->nbuckets;
+	writeback_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
+	pcq_ring_doorbell(a);
 
+	a->nsent += n;
+	a->nbatches++;
+	FAMFS_STAT_ADD(pcq_put_msgs, n);
+}
 
-	/*
-	 * Although we know there is an entry to retrieve, we might see a cache-incoherent
-	 * entry. If the crc is bad, invalidate the cache for the entry and retry
-	 */
-	while (true) {
-		crc = crc32(0L, Z_NULL, 0);
-		invalidate_processor_cache(bucket_addr, pcq->bucket_size);
-		memcpy(entry_out, bucket_addr, pcq->bucket_size);
+/**
+ * pcq_put_batch() - put entries in a pcq
+ *
+ * The entries are copied into as many free buckets as there are (up to @n), which are
+ * committed together; that repeats as buckets are freed, or when the free space wraps.
+ *
+ * @entries - @n contiguous entries of bucket_size each (see pcq_alloc_entries())
+ * @nput    - the number of entries put; @n unless the return value isn't PCQ_PUT_GOOD
+ *
+ * NOTE: this function must not be called re-entrantly for the same queue
+ */
+enum pcq_producer_status
+pcq_put_batch(
+	struct pcq_handle *pcqh,
+	void *entries,
+	u64 n,
+	u64 *nput,
+	struct pcq_thread_arg *a)
+{
+	struct pcq *pcq = pcqh->pcq;
+	enum pcq_producer_status pstat;
+	void *bucket_addr;
+	u64 k;
+	struct pcq_thread_arg dflt;
+
+	a = pcq_arg(a, &dflt);
+	*nput = 0;
+	while (*nput < n) {
+		pstat = pcq_reserve(pcqh, n - *nput, &bucket_addr, &k, a);
+		if (pstat != PCQ_PUT_GOOD)
+			return pstat;
+
+		memcpy(bucket_addr, pcq_entry(pcq, entries, *nput), k * pcq->bucket_size);
+		pcq_commit(pcqh, k, a);
+		*nput += k;
+	}
+	return PCQ_PUT_GOOD;
+}
 
-		/* Check crc and seq number */
-		crc_offset = pcq_crc_offset(pcq);
-		seq_offset = pcq_seq_offset(pcq);
-		crcp = (unsigned long *)((u64)entry_out + crc_offset);
-		seqp = (u64 *)((u64)entry_out + seq_offset);
+#define CONSUMER_NRETRIES 2
 
-		crc = crc32(crc, entry_out, pcq_payload_size(pcq) + sizeof(*seqp));
+/**
+ * pcq_consumer_wait() - wait for (at least one) message
+ *
+ * @navail - the number of messages in the queue
+ */
+static enum pcq_consumer_status
+pcq_consumer_wait(
+	struct pcq_handle *pcqh,
+	u64 *navail,
+	struct pcq_thread_arg *a)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	enum pcq_consumer_status cstat;
+	struct pcq_waiter w = { 0 };
+	struct pcq *pcq = pcqh->pcq;
+	bool empty = false;
+	u64 get_index;
 
+	do {
+		pcq_wait_arm(&w, a);
+		get_index = pcqc->consumer_index;
+
+		invalidate_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
+		*navail = (pcq->producer_index + pcq->nbuckets - get_index) % pcq->nbuckets;
+		if (*navail) {
+			cstat = PCQ_GET_GOOD;
+			break;
+		}
+
+		/* Queue looks empty */
+		if (!empty) {
+			/* count empty only once per call */
+			empty = true;
+			a->nempty++;
+		}
+		if (a->stop_now) {
+			cstat = PCQ_GET_STOPPED;
+			break;
+		} else if (a->wait) {
+			pcq_backoff(&w, a);
+		} else {
+			if (a->verbose > 1)
+				printf("%s: queue empty\n", __func__);
+			cstat = PCQ_GET_EMPTY;
+			break;
+		}
+	} while (true);
+
+	pcq_wait_done(&w, a, &a->empty_ns);
+	return cstat;
+}
+
+/**
+ * pcq_check_bucket() - check the crc and sequence number of a bucket, in place
+ *
+ * Although we know there is an entry to retrieve, we might see a cache-incoherent
+ * entry. If the crc is bad, invalidate the cache for just this bucket and retry.
+ *
+ * Return value: PCQ_GET_GOOD, or PCQ_GET_BAD_MSG if the crc is still bad after the
+ *               retries, or the sequence number isn't the next one (pcqc->next_seq is
+ *               left as it was, so the bucket is checked again next time)
+ */
+static enum pcq_consumer_status
+pcq_check_bucket(
+	struct pcq_handle *pcqh,
+	u64 get_index,
+	struct pcq_thread_arg *a)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	int retries = CONSUMER_NRETRIES;
+	struct pcq *pcq = pcqh->pcq;
+	enum mu_crc_alg alg = pcq_crc_alg(pcq);
+	void *bucket_addr = pcq_bucket(pcq, get_index);
+	const unsigned long *crcp;
+	u64 seq_expect = pcqc->next_seq++;
+	bool retry_counted = false;
+	bool good_crc = true;
+	const u64 *seqp;
+	unsigned long crc;
+	int errs = 0;
+
+	crcp = (const unsigned long *)((u64)bucket_addr + pcq_crc_offset(pcq));
+	seqp = (const u64 *)((u64)bucket_addr + pcq_seq_offset(pcq));
+
+	while (true) {
+		crc = mu_crc(alg, 0, bucket_addr, pcq_payload_size(pcq) + sizeof(*seqp));
 		if (crc == *crcp) /* Good crc, good entry */
 			break;
 
 		if (!retry_counted) {
-			/* count only one retry each time per call to this func */
+			/* count only one retry per bucket */
 			retry_counted = true;
 			a->retries++;
+			FAMFS_STAT_ADD(pcq_retries, 1);
 		}
 		if (!retries--) {
 			/* Out of retries; continue with bad crc */
+			FAMFS_STAT_ADD(pcq_crc_errors, 1);
 			good_crc = false;
 			break;
 		}
+		invalidate_processor_cache(bucket_addr, pcq->bucket_size);
 	}
 
 	/* Only look at seq if crc is good */
@@ -507,50 +986,527 @@ pcq_consumer_get(
 		errs++;
 	}
 
+	if (!good_crc)
+		errs++;
+
 	if (errs) {
-		/* This is fatal */
 		fprintf(stderr, "%s: bad msg after %d retries. cache coherency suspicious\n",
 			__func__, CONSUMER_NRETRIES);
 		fprintf(stderr, "%s: seq=%lld\n", __func__, seq_expect);
-		a->stop_now = true;
 		a->nerrors++;
-		exit(-1); /* force a hard exit so we can investigate */
+		pcqc->next_seq--;
 		return PCQ_GET_BAD_MSG;
 	}
 
-	if (a->verbose) {
+	if (a->verbose)
 		printf("%s: bucket=%lld seq=%lld\n", __func__, get_index, *seqp);
+	return PCQ_GET_GOOD;
+}
+
+/**
+ * pcq_peek() - get messages to read in place
+ *
+ * Waits for at least one message, then takes every message up to the observed producer
+ * index (at most @max, and not past the end of the ring). Their buckets are invalidated
+ * together and checked in place. The caller reads the payloads, then calls
+ * pcq_release().
+ *
+ * @bucketp - the first bucket; the rest follow at bucket_size strides
+ * @navail  - the number of buckets
+ *
+ * If a bucket fails its check, just the buckets before it are returned. If it's the
+ * first, the return value is PCQ_GET_BAD_MSG, and it stays in the queue.
+ *
+ * NOTE: this function must not be called re-entrantly for the same queue
+ */
+enum pcq_consumer_status
+pcq_peek(
+	struct pcq_handle *pcqh,
+	u64 max,
+	const void **bucketp,
+	u64 *navail,
+	struct pcq_thread_arg *a)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	struct pcq *pcq = pcqh->pcq;
+	enum pcq_consumer_status cstat;
+	u64 get_index;
+	u64 i;
+	struct pcq_thread_arg dflt;
+
+	a = pcq_arg(a, &dflt);
+	assert(pcq_magic_valid(pcq));
+	assert(pcqc->pcq_consumer_magic == PCQ_CONSUMER_MAGIC);
+	assert(max > 0);
+
+	cstat = pcq_consumer_wait(pcqh, navail, a);
+	if (cstat != PCQ_GET_GOOD) {
+		*navail = 0;
+		return cstat;
 	}
 
-	/* Update queue metadata */
-	pcqc->consumer_index = (pcqc->consumer_index + 1) % pcq->nbuckets;
-	flush_processor_cache(&pcqc->consumer_index, sizeof(pcqc->consumer_index));
-	a->nreceived++;
+	get_index = pcqc->consumer_index;
+	*navail = MIN(MIN(max, *navail), pcq->nbuckets - get_index);
+	*bucketp = pcq_bucket(pcq, get_index);
+
+	invalidate_processor_cache(*bucketp, *navail * pcq->bucket_size);
+	for (i = 0; i < *navail; i++) {
+		if (pcq_check_bucket(pcqh, get_index + i, a) != PCQ_GET_GOOD)
+			break;
+	}
+	*navail = i;
+	if (!i)
+		return PCQ_GET_BAD_MSG;
+
+	pcqh->npeeked = *navail;
+	return PCQ_GET_GOOD;
+}
+
+/**
+ * pcq_release() - free the first @n peeked buckets for the producer
+ */
+void
+pcq_release(
+	struct pcq_handle *pcqh,
+	u64 n,
+	struct pcq_thread_arg *a)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	struct pcq *pcq = pcqh->pcq;
+	struct pcq_thread_arg dflt;
+
+	a = pcq_arg(a, &dflt);
+	assert(n <= pcqh->npeeked);
+	if (n < pcqh->npeeked)
+		pcqc->next_seq -= pcqh->npeeked - n; /* They'll be checked again */
+	pcqh->npeeked = 0;
+	if (!n)
+		return;
+
+	pcqc->consumer_index = (pcqc->consumer_index + n) % pcq->nbuckets;
+	writeback_processor_cache(&pcqc->consumer_index, sizeof(pcqc->consumer_index));
+	pcq_ring_doorbell(a);
+	a->nreceived += n;
+	a->nbatches++;
+	FAMFS_STAT_ADD(pcq_get_msgs, n);
+}
 
-	*seq_out = *seqp;
+/**
+ * pcq_get_batch() - get entries from a pcq
+ *
+ * Copies out every message up to the observed producer index (at most @max), and
+ * publishes the consumer index once (twice if the messages wrap around the ring). A bad
+ * message ends the batch; if it's the first, the return value is PCQ_GET_BAD_MSG (see
+ * pcq_peek()).
+ *
+ * @entries_out - room for @max contiguous entries (see pcq_alloc_entries())
+ * @nget        - the number of entries gotten
+ *
+ * NOTE: this function must not be called re-entrantly for the same queue
+ */
+enum pcq_consumer_status
+pcq_get_batch(
+	struct pcq_handle *pcqh,
+	void *entries_out,
+	u64 max,
+	u64 *nget,
+	struct pcq_thread_arg *a)
+{
+	struct pcq *pcq = pcqh->pcq;
+	enum pcq_consumer_status cstat;
+	const void *bucket_addr;
+	u64 k;
+	struct pcq_thread_arg dflt;
+
+	a = pcq_arg(a, &dflt);
+	*nget = 0;
+	cstat = pcq_peek(pcqh, max, &bucket_addr, &k, a);
+	if (cstat != PCQ_GET_GOOD)
+		return cstat;
+
+	for (;;) {
+		memcpy(pcq_entry(pcq, entries_out, *nget), bucket_addr, k * pcq->bucket_size);
+		pcq_release(pcqh, k, a);
+		*nget += k;
+
+		/* Wrapped: take the rest without waiting */
+		if (*nget == max || pcqh->pcqc->consumer_index != 0 ||
+		    pcq->producer_index == 0)
+			break;
+		/* A bad message here is reported by the next call */
+		cstat = pcq_peek(pcqh, max - *nget, &bucket_addr, &k, a);
+		if (cstat != PCQ_GET_GOOD)
+			break;
+	}
 	return PCQ_GET_GOOD;
 }
 
+/**
+ * pcq_mpmc_open() - open all the lanes of a pcq, for multiple producers and consumers
+ *
+ * The lanes share one mapping of each file. A single-lane queue works too, with
+ * producers (and consumers) taking turns.
+ */
+struct pcq_mpmc *
+pcq_mpmc_open(
+	const char *fname,
+	enum pcq_role role,
+	int verbose)
+{
+	struct pcq_handle files;
+	struct pcq_mpmc *mq;
+	u64 i;
+
+	memset(&files, 0, sizeof(files));
+	if (pcq_map(fname, role, &files))
+		return NULL;
+
+	mq = calloc(1, sizeof(*mq));
+	assert(mq);
+	mq->nlanes = pcq_nlanes(files.pcq);
+	mq->lanes = aligned_alloc(__alignof__(*mq->lanes), mq->nlanes * sizeof(*mq->lanes));
+	assert(mq->lanes);
+	memset(mq->lanes, 0, mq->nlanes * sizeof(*mq->lanes));
+
+	for (i = 0; i < mq->nlanes; i++) {
+		pcq_lane_init(&mq->lanes[i].pcqh, &files, i);
+		pthread_mutex_init(&mq->lanes[i].lock, NULL);
+	}
+
+	if (verbose)
+		printf("%s: %s nlanes=%lld\n", __func__, fname, mq->nlanes);
+	return mq;
+}
+
+void
+pcq_mpmc_close(struct pcq_mpmc *mq)
+{
+	u64 i;
+
+	for (i = 0; i < mq->nlanes; i++)
+		pthread_mutex_destroy(&mq->lanes[i].lock);
+	pcq_unmap(&mq->lanes[0].pcqh);
+	free(mq->lanes);
+	free(mq);
+}
+
+/* Free buckets in a lane, from a fresh look at the consumer index (doesn't wait) */
+static u64
+pcq_nfree(struct pcq_handle *pcqh)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	struct pcq *pcq = pcqh->pcq;
+
+	invalidate_processor_cache(&pcqc->consumer_index, sizeof(pcqc->consumer_index));
+	return (pcqc->consumer_index + pcq->nbuckets - pcq->producer_index - 1) % pcq->nbuckets;
+}
+
+/* Messages in a lane, from a fresh look at the producer index (doesn't wait) */
+static u64
+pcq_navail(struct pcq_handle *pcqh)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	struct pcq *pcq = pcqh->pcq;
+
+	invalidate_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
+	return (pcq->producer_index + pcq->nbuckets - pcqc->consumer_index) % pcq->nbuckets;
+}
+
+static inline u64
+pcq_lane_hash(u64 key, u64 nlanes)
+{
+	return ((key * 0x9e3779b97f4a7c15ULL) >> 32) % nlanes;
+}
+
+/**
+ * pcq_mpmc_put_batch() - put entries in one lane of a pcq
+ *
+ * With @key == PCQ_LANE_ANY, the lanes are tried round-robin, and the entries go into
+ * the first lane that has room and isn't in use by another producer - as many of them
+ * as fit, so @nput may be less than @n. Otherwise the lane is picked by hashing @key
+ * (so entries with the same key stay in order), and all @n are put, waiting for room
+ * as needed.
+ *
+ * Any number of threads can call this on the same @mq
+ */
+enum pcq_producer_status
+pcq_mpmc_put_batch(
+	struct pcq_mpmc *mq,
+	void *entries,
+	u64 n,
+	u64 key,
+	u64 *nput,
+	struct pcq_thread_arg *a)
+{
+	enum pcq_producer_status pstat = PCQ_PUT_GOOD;
+	struct pcq_waiter w = { 0 };
+	struct pcq_mpmc_lane *lane;
+	bool full = false;
+	struct pcq_thread_arg dflt;
+	u64 start, i, nfree;
+	bool busy;
+
+	a = pcq_arg(a, &dflt);
+	*nput = 0;
+	if (n == 0)
+		return PCQ_PUT_GOOD;
+
+	if (key != PCQ_LANE_ANY) {
+		lane = &mq->lanes[pcq_lane_hash(key, mq->nlanes)];
+		pthread_mutex_lock(&lane->lock);
+		pstat = pcq_put_batch(&lane->pcqh, entries, n, nput, a);
+		pthread_mutex_unlock(&lane->lock);
+		return pstat;
+	}
+
+	start = __atomic_fetch_add(&mq->cursor, 1, __ATOMIC_RELAXED);
+	while (true) {
+		pcq_wait_arm(&w, a);
+		busy = false;
+		for (i = 0; i < mq->nlanes; i++) {
+			lane = &mq->lanes[(start + i) % mq->nlanes];
+			if (pthread_mutex_trylock(&lane->lock)) {
+				busy = true;
+				continue;
+			}
+			nfree = pcq_nfree(&lane->pcqh);
+			if (nfree)
+				pstat = pcq_put_batch(&lane->pcqh, entries, MIN(n, nfree), nput, a);
+			pthread_mutex_unlock(&lane->lock);
+			if (nfree)
+				goto out;
+		}
+
+		/* Lanes that are in use by other producers don't make the queue full */
+		if (!busy) {
+			if (!full) {
+				full = true;
+				a->nfull++;
+			}
+			if (!a->wait) {
+				if (a->verbose > 1)
+					printf("%s: queue full no wait\n", __func__);
+				pstat = PCQ_PUT_FULL_NOWAIT;
+				goto out;
+			}
+		}
+		if (a->stop_now) {
+			pstat = PCQ_PUT_STOPPED;
+			goto out;
+		}
+		if (busy)
+			sched_yield(); /* Let the lane holder run */
+		else
+			pcq_backoff(&w, a);
+	}
+out:
+	pcq_wait_done(&w, a, &a->full_ns);
+	return pstat;
+}
+
+/**
+ * pcq_mpmc_get_batch() - get entries from one lane of a pcq
+ *
+ * The lanes are tried round-robin; the entries (up to @max) come from the first lane
+ * that has messages and isn't in use by another consumer. If that lane's next message is
+ * bad, the return value is PCQ_GET_BAD_MSG (see pcq_get_batch()).
+ *
+ * With a->stop_mode == NMESSAGES, the consumers sharing @mq stop (PCQ_GET_STOPPED)
+ * once they have gotten a->nmessages between them.
+ *
+ * Any number of threads can call this on the same @mq
+ */
+enum pcq_consumer_status
+pcq_mpmc_get_batch(
+	struct pcq_mpmc *mq,
+	void *entries_out,
+	u64 max,
+	u64 *nget,
+	struct pcq_thread_arg *a)
+{
+	enum pcq_consumer_status cstat = PCQ_GET_GOOD;
+	struct pcq_waiter w = { 0 };
+	struct pcq_mpmc_lane *lane;
+	bool empty = false;
+	struct pcq_thread_arg dflt;
+	u64 start, i, navail;
+	bool busy;
+
+	a = pcq_arg(a, &dflt);
+	*nget = 0;
+	assert(max > 0);
+
+	start = __atomic_fetch_add(&mq->cursor, 1, __ATOMIC_RELAXED);
+	while (true) {
+		pcq_wait_arm(&w, a);
+		busy = false;
+		for (i = 0; i < mq->nlanes; i++) {
+			lane = &mq->lanes[(start + i) % mq->nlanes];
+			if (pthread_mutex_trylock(&lane->lock)) {
+				busy = true;
+				continue;
+			}
+			navail = pcq_navail(&lane->pcqh);
+			if (navail)
+				cstat = pcq_get_batch(&lane->pcqh, entries_out, max, nget, a);
+			pthread_mutex_unlock(&lane->lock);
+			if (navail) {
+				__atomic_add_fetch(&mq->nreceived, *nget, __ATOMIC_RELAXED);
+				goto out;
+			}
+		}
+
+		/* Lanes that are in use by other consumers don't make the queue empty */
+		if (!busy) {
+			if (!empty) {
+				empty = true;
+				a->nempty++;
+			}
+			if (!a->wait) {
+				if (a->verbose > 1)
+					printf("%s: queue empty\n", __func__);
+				cstat = PCQ_GET_EMPTY;
+				goto out;
+			}
+		}
+		if (a->stop_now ||
+		    (a->stop_mode == NMESSAGES &&
+		     __atomic_load_n(&mq->nreceived, __ATOMIC_RELAXED) >= a->nmessages)) {
+			cstat = PCQ_GET_STOPPED;
+			goto out;
+		}
+		if (busy)
+			sched_yield(); /* Let the lane holder run */
+		else
+			pcq_backoff(&w, a);
+	}
+out:
+	pcq_wait_done(&w, a, &a->empty_ns);
+	return cstat;
+}
+
+/*
+ * --bench: the first 8 bytes of a payload are its send time. It's CLOCK_REALTIME so a
+ * consumer on another host can compare it to its own clock; cross-host latencies are
+ * only as good as the hosts' clock sync.
+ */
+static inline u64
+pcq_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void
+pcq_bench_stamp(struct pcq *pcq, void *entries, u64 n)
+{
+	u64 now = pcq_bench_now();
+	u64 i;
+
+	for (i = 0; i < n; i++)
+		memcpy(pcq_entry(pcq, entries, i), &now, sizeof(now));
+}
+
+static void
+pcq_bench_record(struct pcq *pcq, const void *entries, u64 n, struct pcq_thread_arg *a)
+{
+	u64 now, stamp;
+	u64 i;
+
+	if (!n || !a->lat)
+		return;
+
+	now = pcq_bench_now();
+	for (i = 0; i < n; i++) {
+		memcpy(&stamp, pcq_entry(pcq, entries, i), sizeof(stamp));
+		mu_hdr_record(a->lat, (now > stamp) ? now - stamp : 0);
+	}
+}
+
+static int
+pcq_bench_check(struct pcq_handle *pcqh, struct pcq_thread_arg *a)
+{
+	if (a->bench && pcq_payload_size(pcqh->pcq) < sizeof(u64)) {
+		fprintf(stderr, "%s: --bench needs a payload of at least %ld bytes\n",
+			__func__, sizeof(u64));
+		return -1;
+	}
+	return 0;
+}
+
+/* Messages received by this consumer, or by all consumers sharing its front-end */
+static u64
+pcq_total_received(struct pcq_thread_arg *a)
+{
+	if (a->mq)
+		return __atomic_load_n(&a->mq->nreceived, __ATOMIC_RELAXED);
+	return a->nreceived;
+}
+
 int
 run_producer(struct pcq_thread_arg *a)
 {
+	u64 batch = MAX(a->batch, 1);
 	enum pcq_producer_status pstat;
 	struct pcq_handle *pcqh;
-	struct pcq_entry *entry;
+	void *entries = NULL;
+	u64 nput;
 	int rc = 0;
+	u64 n, i;
 
-	pcqh = pcq_producer_open(a->basename, a->verbose);
+	assert(!(a->mq && a->zerocopy));
+	if (a->mq)
+		pcqh = &a->mq->lanes[0].pcqh;
+	else
+		pcqh = pcq_lane_open(a->basename, PRODUCER, a->lane, a->verbose);
 
 	if (!pcqh)
 		return -1;
+	if (pcq_bench_check(pcqh, a)) {
+		rc = -1;
+		goto out;
+	}
 
-	entry = pcq_alloc_entry(pcqh);
-	assert(entry);
+	entries = pcq_alloc_entries(pcqh, batch);
+	assert(entries);
 
 	while (true) {
-		if (a->seed)
-			randomize_buffer(entry, pcq_payload_size(pcqh->pcq), a->seed);
-		pstat = pcq_producer_put(pcqh, entry, a);
+		n = batch;
+		if (a->stop_mode == NMESSAGES)
+			n = MIN(n, a->nmessages - a->nsent);
+		if (!n)
+			goto out;
+
+		if (a->mq) {
+			for (i = 0; a->seed && i < n; i++)
+				randomize_buffer(pcq_entry(pcqh->pcq, entries, i),
+						 pcq_payload_size(pcqh->pcq), a->seed);
+			if (a->bench)
+				pcq_bench_stamp(pcqh->pcq, entries, n);
+			pstat = pcq_mpmc_put_batch(a->mq, entries, n, a->key, &nput, a);
+		} else if (a->zerocopy) {
+			void *bucket_addr;
+
+			/* Fill the buckets in place */
+			pstat = pcq_reserve(pcqh, n, &bucket_addr, &nput, a);
+			if (pstat == PCQ_PUT_GOOD) {
+				for (i = 0; a->seed && i < nput; i++)
+					randomize_buffer(pcq_entry(pcqh->pcq, bucket_addr, i),
+							 pcq_payload_size(pcqh->pcq), a->seed);
+				if (a->bench)
+					pcq_bench_stamp(pcqh->pcq, bucket_addr, nput);
+				pcq_commit(pcqh, nput, a);
+			}
+		} else {
+			for (i = 0; a->seed && i < n; i++)
+				randomize_buffer(pcq_entry(pcqh->pcq, entries, i),
+						 pcq_payload_size(pcqh->pcq), a->seed);
+			if (a->bench)
+				pcq_bench_stamp(pcqh->pcq, entries, n);
+			pstat = pcq_put_batch(pcqh, entries, n, &nput, a);
+		}
 		if (pstat == PCQ_PUT_FULL_NOWAIT) {
 			a->nerrors++;
 			rc = -1;
@@ -569,62 +1525,96 @@ run_producer(struct pcq_thread_arg *a)
 			goto out;
 	}
 out:
-	munmap(pcqh->pcq, pcqh->pcq->pcq_size);
-	munmap(pcqh->pcqc, pcqh->pcqc->pcqc_size);
-	free(pcqh);
-	free(entry);
+	if (!a->mq)
+		pcq_close(pcqh);
+	free(entries);
 	return rc;
 }
 
 int
 run_consumer(struct pcq_thread_arg *a)
 {
+	u64 batch = MAX(a->batch, 1);
 	enum pcq_consumer_status cstat;
-	struct pcq_entry *entry_out;
 	struct pcq_handle *pcqh;
+	void *entries_out = NULL;
+	const void *buf;
 	int64_t ofs;
-	u64 seqnum;
+	u64 nget;
 	int rc = 0;
+	u64 n, i;
 
 	if (a->stop_mode == EMPTY)
 		assert(a->wait == 0);
 
-	pcqh = pcq_consumer_open(a->basename, a->verbose);
+	assert(!(a->mq && a->zerocopy));
+	if (a->mq)
+		pcqh = &a->mq->lanes[0].pcqh;
+	else
+		pcqh = pcq_lane_open(a->basename, CONSUMER, a->lane, a->verbose);
 	if (!pcqh)
 		return -1;
+	if (pcq_bench_check(pcqh, a)) {
+		rc = -1;
+		goto out;
+	}
 
-	entry_out = pcq_alloc_entry(pcqh);
+	entries_out = pcq_alloc_entries(pcqh, batch);
+	assert(entries_out);
 
 	while (true) {
-		cstat = pcq_consumer_get(pcqh, entry_out, &seqnum, a);
+		n = batch;
+		if (a->stop_mode == NMESSAGES)
+			n = MIN(n, a->nmessages - MIN(a->nmessages, pcq_total_received(a)));
+		if (!n)
+			goto out;
+
+		if (a->mq) {
+			cstat = pcq_mpmc_get_batch(a->mq, entries_out, n, &nget, a);
+			buf = entries_out;
+		} else if (a->zerocopy) {
+			/* Validate the buckets in place; release them below */
+			cstat = pcq_peek(pcqh, n, &buf, &nget, a);
+		} else {
+			cstat = pcq_get_batch(pcqh, entries_out, n, &nget, a);
+			buf = entries_out;
+		}
 		if (cstat == PCQ_GET_EMPTY && a->stop_mode == EMPTY)
 			goto out;
+		if (cstat == PCQ_GET_BAD_MSG) {
+			/* Stop here, so the queue can be investigated */
+			a->stop_now = true;
+			rc = -1;
+			goto out;
+		}
+
+		if (a->bench)
+			pcq_bench_record(pcqh->pcq, buf, nget, a);
 
-		if (cstat == PCQ_GET_GOOD) {
-			if (a->seed) {
-				ofs = validate_random_buffer(entry_out,
-							     pcq_payload_size(pcqh->pcq),
-							     a->seed);
-				if (ofs != -1) {
-					fprintf(stderr, "%s: miscompare seq=%lld ofs=%ld\n",
-						__func__, seqnum, ofs);
-					a->nerrors++;
-					continue;
-				}
+		for (i = 0; a->seed && i < nget; i++) {
+			void *entry = pcq_entry(pcqh->pcq, buf, i);
+
+			ofs = validate_random_buffer(entry, pcq_payload_size(pcqh->pcq),
+						     a->seed);
+			if (ofs != -1) {
+				fprintf(stderr, "%s: miscompare seq=%lld ofs=%ld\n",
+					__func__, pcq_entry_seq(pcqh, entry), ofs);
+				a->nerrors++;
 			}
 		}
+		if (a->zerocopy && nget)
+			pcq_release(pcqh, nget, a);
 
 		if (a->stop_now)
 			goto out;
-		if (a->stop_mode == NMESSAGES && a->nreceived >= a->nmessages)
+		if (a->stop_mode == NMESSAGES && pcq_total_received(a) >= a->nmessages)
 			goto out;
 
 	}
 out:
-	munmap(pcqh->pcq, pcqh->pcq->pcq_size);
-	munmap(pcqh->pcqc, pcqh->pcqc->pcqc_size);
-	free(pcqh);
-	free(entry_out);
+	if (!a->mq)
+		pcq_close(pcqh);
+	free(entries_out);
 	return rc;
 }
 
@@ -651,7 +1641,7 @@ pcq_worker(void *arg)
 void *status_worker(void *arg)
 {
 	struct pcq_status_thread_arg *a = arg;
-	u64 i;
+	u64 i, t;
 
 	if (!a->interval)
 		return NULL;
@@ -659,6 +1649,7 @@ void *status_worker(void *arg)
 	assert(a->p && a->c);
 
 	for (i = 1; ; i++) {
+		u64 nsent = 0, nfull = 0, nrcvd = 0, nempty = 0, nretries = 0, nerrors = 0;
 		struct tm *local_now;
 		char time_str[80];
 		time_t now;
@@ -669,10 +1660,19 @@ void *status_worker(void *arg)
 		local_now = localtime(&now);
 		strftime(time_str, sizeof(time_str), "%m-%d %H:%M:%S", local_now);
 
+		for (t = 0; t < MAX(a->nthreads, 1); t++) {
+			nsent += a->p[t].nsent;
+			nfull += a->p[t].nfull;
+			nrcvd += a->c[t].nreceived;
+			nempty += a->c[t].nempty;
+			nretries += a->p[t].nerrors + a->c[t].retries;
+			nerrors += a->c[t].nerrors;
+		}
 		printf("%s pcq=%s prod(nsent=%lld nfull=%lld) cons(nrcvd=%lld nempty=%lld "
 		       "nretries= %lld nerrors=%lld)\n", time_str,
-		       a->basename, a->p->nsent, a->p->nfull, a->c->nreceived, a->c->nempty,
-		       a->p->nerrors + a->c->retries, a->c->nerrors);
+		       a->basename, nsent, nfull, nrcvd, nempty, nretries, nerrors);
+		if (a->stats_fmt != FAMFS_STATS_NONE)
+			famfs_stats_print(stdout, a->stats_fmt);
 
 		if (a->stop_now)
 			return NULL;
@@ -683,27 +1683,45 @@ void *status_worker(void *arg)
 int
 get_queue_info(const char *fname, FILE *statusfile, int verbose)
 {
-	struct pcq_handle *pcqh = NULL;
+	struct pcq_mpmc *mq = NULL;
+	struct pcq_handle *pcqh;
 	s64 nmessages = -1;
 	int rc = 0;
+	u64 i, n;
 
-	pcqh = pcq_open(fname, READONLY, verbose);
+	mq = pcq_mpmc_open(fname, READONLY, verbose);
 
-	if (!pcqh)
+	if (!mq)
 		return -1;
 
-
-	if (!pcq_valid(pcqh, verbose)) {
-		rc = -1;
-		goto out;
+	nmessages = 0;
+	for (i = 0; i < mq->nlanes; i++) {
+		pcqh = &mq->lanes[i].pcqh;
+		if (!pcq_valid(pcqh, verbose)) {
+			nmessages = -1;
+			rc = -1;
+			goto out;
+		}
+		n = pcq_nmessages(pcqh);
+		nmessages += n;
+		if (mq->nlanes > 1)
+			printf("%s: lane %lld contains %lld messages p next_seq %lld "
+			       "c next_seq %lld\n", __func__, i, n, pcqh->pcq->next_seq,
+			       pcqh->pcqc->next_seq);
 	}
-	nmessages = pcq_nmessages(pcqh);
-	printf("%s: queue %s contains %lld messages p next_seq %lld c next_seq %lld\n",
-	       __func__, fname, nmessages, pcqh->pcq->next_seq, pcqh->pcqc->next_seq);
+	pcqh = &mq->lanes[0].pcqh;
+	if (mq->nlanes > 1)
+		printf("%s: queue %s contains %lld messages in %lld lanes\n",
+		       __func__, fname, nmessages, mq->nlanes);
+	else
+		printf("%s: queue %s contains %lld messages p next_seq %lld c next_seq %lld\n",
+		       __func__, fname, nmessages, pcqh->pcq->next_seq, pcqh->pcqc->next_seq);
+	if (verbose)
+		printf("%s: crc %s\n", __func__, mu_crc_alg_name(pcq_crc_alg(pcqh->pcq)));
 
 
 out:
-	free(pcqh);
+	pcq_mpmc_close(mq);
 	if (statusfile)
 		fprintf(statusfile, "%lld", nmessages);
 	return rc;
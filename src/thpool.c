@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (C) 2024 Micron Technology, Inc.  All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "thpool.h"
+
+struct thpool_work {
+	thpool_fn           fn;
+	void               *arg;
+	struct thpool_work *next;
+};
+
+struct thpool {
+	pthread_mutex_t     lock;
+	pthread_cond_t      work_cond;  /* signalled when work is queued, or on shutdown */
+	pthread_cond_t      space_cond; /* signalled when the queue has room */
+	pthread_cond_t      idle_cond;  /* signalled when the last busy worker goes idle */
+	struct thpool_work *head;
+	struct thpool_work *tail;
+	int                 nqueued;
+	int                 max_queued;
+	int                 nbusy;
+	int                 shutdown;
+	int                 nthreads;
+	pthread_t          *threads;
+};
+
+static void *
+thpool_worker(void *arg)
+{
+	struct thpool *tp = arg;
+	struct thpool_work *w;
+
+	pthread_mutex_lock(&tp->lock);
+	for (;;) {
+		while (!tp->head && !tp->shutdown)
+			pthread_cond_wait(&tp->work_cond, &tp->lock);
+
+		if (!tp->head) /* shutdown, and the queue is drained */
+			break;
+
+		w = tp->head;
+		tp->head = w->next;
+		if (!tp->head)
+			tp->tail = NULL;
+		tp->nqueued--;
+		tp->nbusy++;
+		pthread_cond_signal(&tp->space_cond);
+		pthread_mutex_unlock(&tp->lock);
+
+		w->fn(w->arg);
+		free(w);
+
+		pthread_mutex_lock(&tp->lock);
+		tp->nbusy--;
+		if (!tp->nbusy && !tp->head)
+			pthread_cond_broadcast(&tp->idle_cond);
+	}
+	pthread_mutex_unlock(&tp->lock);
+	return NULL;
+}
+
+/**
+ * thpool_init()
+ *
+ * @nthreads   - number of worker threads (>= 1)
+ * @max_queued - max work items waiting for a worker; 0 means 4 per thread
+ *
+ * Return value: the pool, or NULL
+ */
+struct thpool *
+thpool_init(int nthreads, int max_queued)
+{
+	struct thpool *tp;
+	int rc;
+	int i;
+
+	if (nthreads < 1) {
+		fprintf(stderr, "%s: invalid thread count %d\n", __func__, nthreads);
+		return NULL;
+	}
+
+	tp = calloc(1, sizeof(*tp));
+	if (!tp)
+		return NULL;
+
+	tp->threads = calloc(nthreads, sizeof(*tp->threads));
+	if (!tp->threads) {
+		free(tp);
+		return NULL;
+	}
+	tp->max_queued = (max_queued > 0) ? max_queued : 4 * nthreads;
+	pthread_mutex_init(&tp->lock, NULL);
+	pthread_cond_init(&tp->work_cond, NULL);
+	pthread_cond_init(&tp->space_cond, NULL);
+	pthread_cond_init(&tp->idle_cond, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		rc = pthread_create(&tp->threads[i], NULL, thpool_worker, tp);
+		if (rc) {
+			fprintf(stderr, "%s: pthread_create failed (%d)\n", __func__, rc);
+			break;
+		}
+		tp->nthreads++;
+	}
+	if (!tp->nthreads) {
+		thpool_destroy(tp);
+		return NULL;
+	}
+	return tp;
+}
+
+/**
+ * thpool_add_work()
+ *
+ * Queue @fn(@arg) to run on a worker. Blocks while the queue is full.
+ *
+ * Return value: 0, or -ENOMEM
+ */
+int
+thpool_add_work(struct thpool *tp, thpool_fn fn, void *arg)
+{
+	struct thpool_work *w = malloc(sizeof(*w));
+
+	assert(tp);
+	if (!w)
+		return -ENOMEM;
+
+	w->fn = fn;
+	w->arg = arg;
+	w->next = NULL;
+
+	pthread_mutex_lock(&tp->lock);
+	while (tp->nqueued >= tp->max_queued)
+		pthread_cond_wait(&tp->space_cond, &tp->lock);
+
+	if (tp->tail)
+		tp->tail->next = w;
+	else
+		tp->head = w;
+	tp->tail = w;
+	tp->nqueued++;
+	pthread_cond_signal(&tp->work_cond);
+	pthread_mutex_unlock(&tp->lock);
+	return 0;
+}
+
+/**
+ * thpool_wait()
+ *
+ * Wait until all queued work has completed
+ */
+void
+thpool_wait(struct thpool *tp)
+{
+	assert(tp);
+
+	pthread_mutex_lock(&tp->lock);
+	while (tp->head || tp->nbusy)
+		pthread_cond_wait(&tp->idle_cond, &tp->lock);
+	pthread_mutex_unlock(&tp->lock);
+}
+
+/**
+ * thpool_destroy()
+ *
+ * Run any remaining work, then stop the workers and free the pool
+ */
+void
+thpool_destroy(struct thpool *tp)
+{
+	int i;
+
+	if (!tp)
+		return;
+
+	pthread_mutex_lock(&tp->lock);
+	tp->shutdown = 1;
+	pthread_cond_broadcast(&tp->work_cond);
+	pthread_mutex_unlock(&tp->lock);
+
+	for (i = 0; i < tp->nthreads; i++)
+		pthread_join(tp->threads[i], NULL);
+
+	pthread_mutex_destroy(&tp->lock);
+	pthread_cond_destroy(&tp->work_cond);
+	pthread_cond_destroy(&tp->space_cond);
+	pthread_cond_destroy(&tp->idle_cond);
+	free(tp->threads);
+	free(tp);
+}
+
+int
+thpool_nthreads(const struct thpool *tp)
+{
+	return tp->nthreads;
+}
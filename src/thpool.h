@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (C) 2024 Micron Technology, Inc.  All rights reserved.
+ */
+#ifndef _H_THPOOL
+#define _H_THPOOL
+
+/*
+ * Minimal fixed-size thread pool.
+ *
+ * Work items are run in FIFO order by nthreads workers. The queue is bounded, so
+ * thpool_add_work() blocks when it is full; that keeps producers (e.g. a recursive copy
+ * that opens files as it goes) from running arbitrarily far ahead of the workers.
+ */
+
+struct thpool;
+
+typedef void (*thpool_fn)(void *arg);
+
+struct thpool *thpool_init(int nthreads, int max_queued);
+int thpool_add_work(struct thpool *tp, thpool_fn fn, void *arg);
+void thpool_wait(struct thpool *tp);
+void thpool_destroy(struct thpool *tp);
+int thpool_nthreads(const struct thpool *tp);
+
+#endif /* _H_THPOOL */
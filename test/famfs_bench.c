@@ -0,0 +1,885 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * Copyright (C) 2023-2024 Micron Technology, Inc.  All rights reserved.
+ */
+
+/*
+ * famfs_bench - microbenchmarks for the famfs hot paths
+ *
+ * Builds a synthetic famfs image (a mock instance at /tmp/famfs, like the unit tests
+ * use, with mock_kmod and mock_flush set), then times the log, allocator, logplay, copy,
+ * flush and pcq primitives against it. Results go to stdout as a table, or (with -j) as
+ * one JSON object per line so runs can be compared across releases. Whatever the
+ * library prints along the way is discarded unless -v is given.
+ */
+
+#include <unistd.h>
+#include <getopt.h>
+#include <linux/limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h> /* MIN()/MAX() */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "famfs_lib.h"
+#include "famfs_lib_internal.h"
+#include "famfs_meta.h"
+#include "bitmap.h"
+#include "mu_mem.h"
+#include "mu_histogram.h"
+#include "pcq.h"
+#include "xrand.h"
+#include "random_buffer.h"
+#include "famfs_unit.h"
+
+extern int mock_kmod;
+extern int mock_flush;
+
+#define BENCH_MPT        "/tmp/famfs"
+#define BENCH_PCQ        BENCH_MPT "/bench.pcq"
+#define BENCH_PCQ_C      BENCH_MPT "/bench.pcq.consumer"
+#define BENCH_CP_SRC     "/tmp/famfs_bench_cp_src"
+#define BENCH_CP_DEST    "/tmp/famfs_bench_cp_dest"
+#define BENCH_TXN_BATCH  64
+#define BENCH_PCQ_BATCH  64
+#define BENCH_PCQ_BUCKET 64
+#define BENCH_PCQ_NBUCKETS 1024
+
+struct bench_opts {
+	u64   devsize;   /* Size of the mock device */
+	u64   nfiles;    /* Files in the image */
+	u64   ndirs;     /* Directories in the image (the files are spread across them) */
+	u64   file_aus;  /* Allocation units per file */
+	u64   frag_pct;  /* Percent of the space reserved at random while the image is built */
+	u64   nappends;  /* Extra (directory) records appended by the append benchmarks */
+	u64   reps;      /* Repetitions of each whole-log, copy and flush operation */
+	u64   nallocs;   /* Allocations per allocator policy */
+	u64   cp_size;   /* Bytes per copy and flush */
+	u64   nmsgs;     /* pcq messages */
+	int   nthreads;  /* Copy and logplay threads */
+	u64   seed;
+	int   real_flush; /* Flush the image updates too (mock_flush = 0 throughout) */
+	int   verbose;
+	char *only;      /* Comma-separated benchmark names, or NULL for all */
+};
+
+struct bench_result {
+	const char         *name;
+	u64                 ops;
+	u64                 ns;    /* Total time */
+	u64                 bytes; /* Bytes processed, if the op has a throughput */
+	struct mu_histogram lat;   /* ns per op */
+};
+
+static FILE *out;
+static int json;
+
+static u64
+bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static s64 get_multiplier(const char *endptr)
+{
+	size_t multiplier = 1;
+
+	if (!endptr)
+		return 1;
+
+	switch (*endptr) {
+	case 'k':
+	case 'K':
+		multiplier = 1024;
+		break;
+	case 'm':
+	case 'M':
+		multiplier = 1024 * 1024;
+		break;
+	case 'g':
+	case 'G':
+		multiplier = 1024 * 1024 * 1024;
+		break;
+	case 0:
+		return 1;
+	}
+	++endptr;
+	if (*endptr) /* If the unit was not the last char in string, it's an error */
+		return -1;
+	return multiplier;
+}
+
+static int
+bench_parse_size(const char *arg, u64 *val)
+{
+	char *endptr;
+	s64 mult;
+
+	*val = strtoull(arg, &endptr, 0);
+	mult = get_multiplier(endptr);
+	if (mult <= 0)
+		return -1;
+	*val *= mult;
+	return 0;
+}
+
+static bool
+bench_selected(const struct bench_opts *o, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	if (!o->only)
+		return true;
+	for (p = o->only; p; p = strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+		if (!strncmp(p, name, len) && (p[len] == ',' || p[len] == 0))
+			return true;
+	}
+	return false;
+}
+
+static void
+bench_start(struct bench_result *r, const char *name)
+{
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	mu_hist_init(&r->lat);
+}
+
+/* Record @n ops that took @ns between them (a batch is recorded as its mean per op) */
+static void
+bench_ops(struct bench_result *r, u64 n, u64 ns, u64 bytes)
+{
+	u64 i;
+
+	r->ops += n;
+	r->ns += ns;
+	r->bytes += bytes;
+	for (i = 0; i < n; i++)
+		mu_hist_record(&r->lat, ns / n);
+}
+
+static void
+bench_report(const struct bench_result *r)
+{
+	double ns_per_op, ops_per_sec, mb_per_sec;
+
+	if (!r->ops) {
+		fprintf(stderr, "famfs_bench: %s: no operations completed\n", r->name);
+		return;
+	}
+	ns_per_op = (double)r->ns / r->ops;
+	ops_per_sec = (r->ns) ? (double)r->ops * 1e9 / r->ns : 0;
+	mb_per_sec = (r->ns) ? (double)r->bytes * 1e9 / r->ns / (1024 * 1024) : 0;
+
+	if (json) {
+		fprintf(out, "{\"bench\":\"%s\",\"ops\":%llu,\"total_ns\":%llu,"
+			"\"ns_per_op\":%.1f,\"ops_per_sec\":%.1f,\"min_ns\":%llu,"
+			"\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,"
+			"\"bytes\":%llu,\"mb_per_sec\":%.1f}\n",
+			r->name, r->ops, r->ns, ns_per_op, ops_per_sec,
+			(u64)r->lat.min, (u64)mu_hist_percentile(&r->lat, 50),
+			(u64)mu_hist_percentile(&r->lat, 90),
+			(u64)mu_hist_percentile(&r->lat, 99), (u64)r->lat.max,
+			r->bytes, mb_per_sec);
+	} else {
+		fprintf(out, "%-20s %10llu %14.1f %14.1f %12llu %12llu",
+			r->name, r->ops, ns_per_op, ops_per_sec,
+			(u64)mu_hist_percentile(&r->lat, 50),
+			(u64)mu_hist_percentile(&r->lat, 99));
+		if (r->bytes)
+			fprintf(out, " %12.1f", mb_per_sec);
+		fprintf(out, "\n");
+	}
+	fflush(out);
+}
+
+/*
+ * The image
+ */
+
+/**
+ * bench_build_image()
+ *
+ * Make a mock famfs with @o->ndirs directories and up to @o->nfiles files (fewer if the
+ * space or the log runs out), timing the mkdirs and mkfiles as it goes.
+ *
+ * Fragmentation: before any file is allocated, @o->frag_pct percent of the allocation
+ * units (chosen at random) are marked in use in the allocator's bitmap, but never
+ * logged. The files are laid out around them, so files bigger than the holes get split
+ * into several extents; and once the bitmap is rebuilt from the log, that space is free
+ * again, in small runs between the files.
+ */
+static int
+bench_build_image(
+	const struct bench_opts   *o,
+	struct famfs_superblock  **sbp,
+	struct famfs_log         **logpp,
+	struct bench_result       *rdir,
+	struct bench_result       *rfile,
+	u64                       *nfiles_out)
+{
+	struct famfs_locked_log ll;
+	char path[PATH_MAX];
+	struct xrand xr;
+	u64 i, t;
+	int rc;
+
+	rc = create_mock_famfs_instance(BENCH_MPT, o->devsize, sbp, logpp);
+	if (rc) {
+		fprintf(stderr, "%s: failed to create the mock famfs (%d)\n", __func__, rc);
+		return -1;
+	}
+
+	rc = famfs_init_locked_log(&ll, BENCH_MPT, o->verbose);
+	if (rc)
+		return -1;
+
+	if (o->frag_pct) {
+		ll.bitmap = famfs_build_bitmap(*logpp, o->devsize, &ll.nbits,
+					       NULL, NULL, NULL, NULL, 0);
+		if (!ll.bitmap) {
+			famfs_release_locked_log(&ll);
+			return -1;
+		}
+		xrand_init(&xr, o->seed);
+		for (i = 0; i < ll.nbits; i++)
+			if (xrand64(&xr) % 100 < o->frag_pct)
+				mu_bitmap_set(ll.bitmap, i);
+	}
+
+	bench_start(rdir, "mkdir");
+	for (i = 0; i < o->ndirs; i++) {
+		snprintf(path, sizeof(path), "%s/d%05llu", BENCH_MPT, i);
+		t = bench_now_ns();
+		rc = __famfs_mkdir(&ll, path, 0755, 0, 0, 0);
+		bench_ops(rdir, 1, bench_now_ns() - t, 0);
+		if (rc) {
+			fprintf(stderr, "%s: mkdir %s failed (%d)\n", __func__, path, rc);
+			famfs_release_locked_log(&ll);
+			return -1;
+		}
+	}
+
+	bench_start(rfile, "mkfile");
+	for (i = 0; i < o->nfiles; i++) {
+		int fd;
+
+		if (o->ndirs)
+			snprintf(path, sizeof(path), "%s/d%05llu/f%07llu", BENCH_MPT,
+				 i % o->ndirs, i);
+		else
+			snprintf(path, sizeof(path), "%s/f%07llu", BENCH_MPT, i);
+		t = bench_now_ns();
+		fd = __famfs_mkfile(&ll, path, 0644, 0, 0, o->file_aus * FAMFS_ALLOC_UNIT, 0);
+		t = bench_now_ns() - t;
+		if (fd < 0) {
+			fprintf(stderr, "%s: image is full after %llu files\n", __func__, i);
+			break;
+		}
+		close(fd);
+		bench_ops(rfile, 1, t, 0);
+	}
+	*nfiles_out = i;
+
+	famfs_release_locked_log(&ll);
+	return 0;
+}
+
+/* Report the shape of the image (and the run's parameters) */
+static void
+bench_describe_image(const struct bench_opts *o, const struct famfs_log *logp, u64 nfiles)
+{
+	const struct famfs_log_entry *le;
+	struct famfs_log_iter it;
+	u64 nextents = 0;
+	u64 nrecords = 0;
+
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_NOPATHS);
+	while ((le = famfs_log_iter_next(&it)) != NULL) {
+		nrecords++;
+		if (le->famfs_log_entry_type == FAMFS_LOG_FILE)
+			nextents += le->famfs_fc.famfs_nextents;
+	}
+
+	if (json) {
+		fprintf(out, "{\"config\":{\"devsize\":%llu,\"files\":%llu,\"dirs\":%llu,"
+			"\"file_bytes\":%llu,\"frag_pct\":%llu,\"extents\":%llu,"
+			"\"log_records\":%llu,\"log_bytes\":%llu,\"reps\":%llu,"
+			"\"threads\":%d,\"real_flush\":%d,\"seed\":%llu}}\n",
+			o->devsize, nfiles, o->ndirs, o->file_aus * FAMFS_ALLOC_UNIT,
+			o->frag_pct, nextents, nrecords, logp->famfs_log_next_offset,
+			o->reps, o->nthreads, o->real_flush, o->seed);
+	} else {
+		fprintf(out, "famfs_bench: %llu files (%llu extents) in %llu dirs, "
+			"%llu log records (%llu bytes), %llu%% fragmentation\n",
+			nfiles, nextents, o->ndirs, nrecords, logp->famfs_log_next_offset,
+			o->frag_pct);
+		fprintf(out, "%-20s %10s %14s %14s %12s %12s %12s\n", "bench", "ops",
+			"ns/op", "ops/sec", "p50 ns", "p99 ns", "MiB/sec");
+	}
+	fflush(out);
+}
+
+/*
+ * The benchmarks
+ */
+
+/* famfs_append_log(), by way of directory records (which don't allocate) */
+static void
+bench_append(const struct bench_opts *o)
+{
+	struct famfs_locked_log ll;
+	struct bench_result r;
+	char relpath[64];
+	u64 i, n, t;
+	int rc = 0;
+
+	if (famfs_init_locked_log(&ll, BENCH_MPT, o->verbose))
+		return;
+
+	if (bench_selected(o, "append")) {
+		bench_start(&r, "append");
+		for (i = 0; i < o->nappends && !rc; i++) {
+			snprintf(relpath, sizeof(relpath), "a%07llu", i);
+			t = bench_now_ns();
+			rc = famfs_log_dir_creation(&ll, relpath, 0755, 0, 0);
+			bench_ops(&r, 1, bench_now_ns() - t, 0);
+		}
+		bench_report(&r);
+	}
+
+	/* The same, in transactions of BENCH_TXN_BATCH records (one publish each) */
+	if (bench_selected(o, "append_txn")) {
+		bench_start(&r, "append_txn");
+		for (i = 0; i < o->nappends && !rc; i += n) {
+			t = bench_now_ns();
+			famfs_log_txn_begin(&ll);
+			for (n = 0; n < BENCH_TXN_BATCH && i + n < o->nappends && !rc; n++) {
+				snprintf(relpath, sizeof(relpath), "t%07llu", i + n);
+				rc = famfs_log_dir_creation(&ll, relpath, 0755, 0, 0);
+			}
+			famfs_log_txn_commit(&ll);
+			bench_ops(&r, n, bench_now_ns() - t, 0);
+		}
+		bench_report(&r);
+	}
+	if (rc)
+		fprintf(stderr, "%s: log append failed (%d)\n", __func__, rc);
+
+	famfs_release_locked_log(&ll);
+}
+
+/* Decoding and validating every record; then building the allocation bitmap */
+static void
+bench_log_scan(const struct bench_opts *o, const struct famfs_log *logp)
+{
+	u64 log_bytes = logp->famfs_log_next_offset;
+	struct bench_result r;
+	u64 i, t;
+
+	if (bench_selected(o, "log_iter")) {
+		bench_start(&r, "log_iter");
+		for (i = 0; i < o->reps; i++) {
+			struct famfs_log_iter it;
+
+			t = bench_now_ns();
+			famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+			while (famfs_log_iter_next(&it))
+				;
+			bench_ops(&r, 1, bench_now_ns() - t, log_bytes);
+		}
+		bench_report(&r);
+	}
+
+	if (bench_selected(o, "build_bitmap")) {
+		bench_start(&r, "build_bitmap");
+		for (i = 0; i < o->reps; i++) {
+			u64 nbits, errs = 0;
+			u8 *bitmap;
+
+			t = bench_now_ns();
+			bitmap = famfs_build_bitmap(logp, o->devsize, &nbits, &errs,
+						    NULL, NULL, NULL, 0);
+			t = bench_now_ns() - t;
+			if (!bitmap || errs) {
+				fprintf(stderr, "%s: bitmap build failed (%llu errors)\n",
+					__func__, errs);
+				free(bitmap);
+				break;
+			}
+			free(bitmap);
+			bench_ops(&r, 1, t, log_bytes);
+		}
+		bench_report(&r);
+	}
+}
+
+/* bitmap_alloc_extents() with each policy, filling the (fragmented) free space */
+static void
+bench_alloc(const struct bench_opts *o, const struct famfs_log *logp)
+{
+	u64 ext_start[FAMFS_ALLOC_MAX_EXTENTS];
+	u64 ext_len[FAMFS_ALLOC_MAX_EXTENTS];
+	u8 *pristine, *bitmap;
+	u64 nbits, nbytes;
+	char name[32];
+	int policy;
+
+	pristine = famfs_build_bitmap(logp, o->devsize, &nbits, NULL, NULL, NULL, NULL, 0);
+	if (!pristine)
+		return;
+	nbytes = mu_bitmap_size(nbits);
+	bitmap = malloc(nbytes);
+	if (!bitmap) {
+		free(pristine);
+		return;
+	}
+
+	for (policy = 0; policy < FAMFS_ALLOC_NPOLICIES; policy++) {
+		struct bench_result r;
+		u64 cursor = 0;
+		u64 i, t;
+
+		snprintf(name, sizeof(name), "alloc_%s", famfs_alloc_policy_name(policy));
+		if (!bench_selected(o, name) && !bench_selected(o, "alloc"))
+			continue;
+
+		memcpy(bitmap, pristine, nbytes);
+		bench_start(&r, name);
+		for (i = 0; i < o->nallocs; i++) {
+			int n;
+
+			t = bench_now_ns();
+			n = bitmap_alloc_extents(bitmap, nbits, o->file_aus, policy, &cursor,
+						 FAMFS_ALLOC_MAX_EXTENTS, ext_start, ext_len);
+			t = bench_now_ns() - t;
+			if (n < 0)
+				break; /* Full: the ops that fit are what's reported */
+			bench_ops(&r, 1, t, 0);
+		}
+		bench_report(&r);
+	}
+	free(bitmap);
+	free(pristine);
+}
+
+/* __famfs_logplay(): a dry run (log processing only), a full client play, and an
+ * incremental play that a checkpoint has caught up
+ */
+static void
+bench_logplay(const struct bench_opts *o, const struct famfs_log *logp)
+{
+	u64 log_bytes = logp->famfs_log_next_offset;
+	struct bench_result r;
+	u64 i, t;
+	int rc;
+
+	if (bench_selected(o, "logplay_dry")) {
+		bench_start(&r, "logplay_dry");
+		for (i = 0; i < o->reps; i++) {
+			t = bench_now_ns();
+			rc = __famfs_logplay(logp, BENCH_MPT, 1, 0, 0, o->nthreads, 0);
+			bench_ops(&r, 1, bench_now_ns() - t, log_bytes);
+			if (rc)
+				fprintf(stderr, "%s: dry run logplay: %d errors\n", __func__, rc);
+		}
+		bench_report(&r);
+	}
+
+	if (bench_selected(o, "logplay")) {
+		bench_start(&r, "logplay");
+		for (i = 0; i < o->reps; i++) {
+			t = bench_now_ns();
+			rc = __famfs_logplay(logp, BENCH_MPT, 0, 1, 0, o->nthreads, 0);
+			bench_ops(&r, 1, bench_now_ns() - t, log_bytes);
+			if (rc)
+				fprintf(stderr, "%s: logplay: %d errors\n", __func__, rc);
+		}
+		bench_report(&r);
+	}
+
+	if (bench_selected(o, "logplay_incr")) {
+		/* The first play leaves the checkpoint that the timed ones start from */
+		__famfs_logplay(logp, BENCH_MPT, 0, 1, 1, o->nthreads, 0);
+		bench_start(&r, "logplay_incr");
+		for (i = 0; i < o->reps; i++) {
+			t = bench_now_ns();
+			__famfs_logplay(logp, BENCH_MPT, 0, 1, 1, o->nthreads, 0);
+			bench_ops(&r, 1, bench_now_ns() - t, 0);
+		}
+		bench_report(&r);
+	}
+}
+
+/* famfs_cp_data(): the cp data path, inline and on @o->nthreads copy threads. Each rep
+ * copies the source to the (re-mapped) destination, and the reps are timed together, the
+ * way famfs cp queues a set of files and waits for them all.
+ */
+static void
+bench_cp(const struct bench_opts *o)
+{
+	size_t size = o->cp_size & ~3ULL; /* randomize_buffer() wants a multiple of 4 */
+	struct famfs_locked_log ll;
+	struct bench_result r;
+	char *srcbuf, *destp;
+	u64 i, n, t;
+	int sfd, dfd;
+	int j;
+
+	srcbuf = malloc(size);
+	if (!srcbuf)
+		return;
+	randomize_buffer(srcbuf, size, o->seed);
+	sfd = open(BENCH_CP_SRC, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (sfd < 0 || write(sfd, srcbuf, size) != (ssize_t)size) {
+		fprintf(stderr, "%s: failed to write %s\n", __func__, BENCH_CP_SRC);
+		goto out;
+	}
+	close(sfd);
+	dfd = open(BENCH_CP_DEST, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (dfd < 0 || ftruncate(dfd, size)) {
+		fprintf(stderr, "%s: failed to create %s\n", __func__, BENCH_CP_DEST);
+		goto out;
+	}
+	close(dfd);
+
+	for (j = 0; j < 2; j++) {
+		const char *name = (j) ? "cp_mt" : "cp";
+		int threads = (j) ? o->nthreads : 1;
+
+		if (!bench_selected(o, name) || (j && o->nthreads <= 1))
+			continue;
+
+		memset(&ll, 0, sizeof(ll));
+		if (famfs_cp_pool_start(&ll, threads, FAMFS_CP_DEFAULT_CHUNKSIZE, 0))
+			break;
+		bench_start(&r, name);
+		t = bench_now_ns();
+		for (i = n = 0; i < o->reps; i++) {
+			/* famfs_cp_data() owns (and releases) the fds and the mapping */
+			sfd = open(BENCH_CP_SRC, O_RDONLY);
+			dfd = open(BENCH_CP_DEST, O_RDWR);
+			if (sfd < 0 || dfd < 0)
+				break;
+			destp = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, dfd, 0);
+			if (destp == MAP_FAILED) {
+				close(sfd);
+				close(dfd);
+				break;
+			}
+			if (famfs_cp_data(&ll, sfd, dfd, destp, size, 0))
+				break;
+			n++;
+		}
+		if (famfs_cp_pool_finish(&ll, 0)) {
+			fprintf(stderr, "%s: %llu copy errors\n", __func__, ll.cp_errors);
+			n = 0;
+		}
+		if (n)
+			bench_ops(&r, n, bench_now_ns() - t, n * size);
+		bench_report(&r);
+	}
+out:
+	unlink(BENCH_CP_DEST);
+	unlink(BENCH_CP_SRC);
+	free(srcbuf);
+}
+
+/* The mu_mem.h flush primitives over @o->cp_size of dirty lines (always really flushed) */
+static void
+bench_flush(const struct bench_opts *o)
+{
+	const char *names[] = { "flush", "writeback", "invalidate" };
+	size_t size = o->cp_size;
+	int save = mock_flush;
+	struct bench_result r;
+	char *buf;
+	u64 i, t;
+	int j;
+
+	if (posix_memalign((void **)&buf, 4096, size))
+		return;
+
+	mock_flush = 0;
+	for (j = 0; j < 3; j++) {
+		if (!bench_selected(o, names[j]))
+			continue;
+		bench_start(&r, names[j]);
+		for (i = 0; i < o->reps; i++) {
+			memset(buf, (int)i, size);
+			t = bench_now_ns();
+			if (j == 0)
+				flush_processor_cache(buf, size);
+			else if (j == 1)
+				writeback_processor_cache(buf, size);
+			else
+				invalidate_processor_cache(buf, size);
+			bench_ops(&r, 1, bench_now_ns() - t, size);
+		}
+		bench_report(&r);
+	}
+	mock_flush = save;
+	free(buf);
+}
+
+/* pcq_put_batch() / pcq_get_batch() on one lane, alternating batches in this thread */
+static void
+bench_pcq(const struct bench_opts *o)
+{
+	struct pcq_thread_arg pa = { .role = PRODUCER };
+	struct pcq_thread_arg ca = { .role = CONSUMER };
+	struct pcq_handle *p = NULL, *c = NULL;
+	struct bench_result rput, rget;
+	void *entries = NULL, *entries_out = NULL;
+	int save = mock_flush;
+	u64 i, n, t;
+
+	if (!bench_selected(o, "pcq_put") && !bench_selected(o, "pcq_get"))
+		return;
+
+	mock_flush = 0;
+	unlink(BENCH_PCQ);
+	unlink(BENCH_PCQ_C);
+	if (pcq_create(BENCH_PCQ, BENCH_PCQ_NBUCKETS, BENCH_PCQ_BUCKET, 1, MU_CRC_CRC32C,
+		       o->verbose))
+		goto out;
+	p = pcq_producer_open(BENCH_PCQ, o->verbose);
+	c = pcq_consumer_open(BENCH_PCQ, o->verbose);
+	if (!p || !c)
+		goto out;
+	entries = pcq_alloc_entries(p, BENCH_PCQ_BATCH);
+	entries_out = pcq_alloc_entries(c, BENCH_PCQ_BATCH);
+	if (!entries || !entries_out)
+		goto out;
+	memset(entries, 0x5a, BENCH_PCQ_BATCH * BENCH_PCQ_BUCKET);
+
+	bench_start(&rput, "pcq_put");
+	bench_start(&rget, "pcq_get");
+	for (i = 0; i < o->nmsgs; i += n) {
+		u64 nput, nget;
+
+		n = MIN((u64)BENCH_PCQ_BATCH, o->nmsgs - i);
+		t = bench_now_ns();
+		if (pcq_put_batch(p, entries, n, &nput, &pa) != PCQ_PUT_GOOD)
+			break;
+		bench_ops(&rput, nput, bench_now_ns() - t, nput * BENCH_PCQ_BUCKET);
+
+		t = bench_now_ns();
+		if (pcq_get_batch(c, entries_out, n, &nget, &ca) != PCQ_GET_GOOD || nget != n)
+			break;
+		bench_ops(&rget, nget, bench_now_ns() - t, nget * BENCH_PCQ_BUCKET);
+	}
+	if (bench_selected(o, "pcq_put"))
+		bench_report(&rput);
+	if (bench_selected(o, "pcq_get"))
+		bench_report(&rget);
+out:
+	free(entries);
+	free(entries_out);
+	if (p)
+		pcq_close(p);
+	if (c)
+		pcq_close(c);
+	unlink(BENCH_PCQ);
+	unlink(BENCH_PCQ_C);
+	mock_flush = save;
+}
+
+static void
+famfs_bench_usage(const char *prog)
+{
+	printf("\n"
+	       "famfs_bench: time the famfs hot paths against a synthetic (mock) famfs image\n"
+	       "\n"
+	       "The image is built at %s, which is removed first.\n"
+	       "\n"
+	       "    %s [args]\n"
+	       "\n"
+	       "Arguments:\n"
+	       "    -?           - Print this message\n"
+	       "    -s|--devsize <size>  - Size of the mock device (default 64G)\n"
+	       "    -n|--files <n>       - Files in the image (default 4000)\n"
+	       "    -d|--dirs <n>        - Directories the files are spread across (default 100)\n"
+	       "    -S|--filesize <size> - Size of each file, rounded up to allocation units\n"
+	       "                           (default 8M)\n"
+	       "    -F|--frag <pct>      - Percent of the device reserved at random while the\n"
+	       "                           image is built, leaving the files split into extents\n"
+	       "                           and the free space in small runs (default 0)\n"
+	       "    -a|--appends <n>     - Records appended by the append benchmarks (default 2000)\n"
+	       "    -A|--allocs <n>      - Allocations per allocator policy (default 1000)\n"
+	       "    -r|--reps <n>        - Repetitions of each log scan, play, copy and flush\n"
+	       "                           (default 10)\n"
+	       "    -c|--cpsize <size>   - Bytes per copy and flush (default 128M)\n"
+	       "    -m|--msgs <n>        - pcq messages (default 1000000)\n"
+	       "    -t|--threads <n>     - Threads for cp_mt and logplay (default 4)\n"
+	       "    -b|--bench <list>    - Run only these (comma-separated) benchmarks:\n"
+	       "                           mkdir,mkfile,append,append_txn,log_iter,build_bitmap,\n"
+	       "                           alloc (or alloc_<policy>),logplay_dry,logplay,\n"
+	       "                           logplay_incr,cp,cp_mt,flush,writeback,invalidate,\n"
+	       "                           pcq_put,pcq_get\n"
+	       "    -R|--realflush       - Flush the image updates too (mock_flush=0); the\n"
+	       "                           flush and pcq benchmarks always flush\n"
+	       "    -j|--json            - One JSON object per line: the image, then each result\n"
+	       "    -x|--seed <n>        - Seed for the fragmentation and copy data (default 42)\n"
+	       "    -v|--verbose         - Don't discard what the library prints\n"
+	       "\n", BENCH_MPT, prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_opts o = {
+		.devsize  = 64ULL << 30,
+		.nfiles   = 4000,
+		.ndirs    = 100,
+		.file_aus = 4,
+		.nappends = 2000,
+		.reps     = 10,
+		.nallocs  = 1000,
+		.cp_size  = 128 << 20,
+		.nmsgs    = 1000000,
+		.nthreads = 4,
+		.seed     = 42,
+	};
+	struct bench_result rdir, rfile;
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	u64 nfiles, size;
+	int c;
+
+	struct option options[] = {
+		{"devsize",   required_argument, 0, 's'},
+		{"files",     required_argument, 0, 'n'},
+		{"dirs",      required_argument, 0, 'd'},
+		{"filesize",  required_argument, 0, 'S'},
+		{"frag",      required_argument, 0, 'F'},
+		{"appends",   required_argument, 0, 'a'},
+		{"allocs",    required_argument, 0, 'A'},
+		{"reps",      required_argument, 0, 'r'},
+		{"cpsize",    required_argument, 0, 'c'},
+		{"msgs",      required_argument, 0, 'm'},
+		{"threads",   required_argument, 0, 't'},
+		{"bench",     required_argument, 0, 'b'},
+		{"realflush", no_argument,       0, 'R'},
+		{"json",      no_argument,       0, 'j'},
+		{"seed",      required_argument, 0, 'x'},
+		{"verbose",   no_argument,       0, 'v'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "+s:n:d:S:F:a:A:r:c:m:t:b:Rjx:vh?",
+				options, &optind)) != EOF) {
+		switch (c) {
+		case 's':
+			if (bench_parse_size(optarg, &o.devsize))
+				goto badarg;
+			break;
+		case 'n':
+			o.nfiles = strtoull(optarg, 0, 0);
+			break;
+		case 'd':
+			o.ndirs = strtoull(optarg, 0, 0);
+			break;
+		case 'S':
+			if (bench_parse_size(optarg, &size) || size == 0)
+				goto badarg;
+			o.file_aus = (size + FAMFS_ALLOC_UNIT - 1) / FAMFS_ALLOC_UNIT;
+			break;
+		case 'F':
+			o.frag_pct = strtoull(optarg, 0, 0);
+			if (o.frag_pct >= 100)
+				goto badarg;
+			break;
+		case 'a':
+			o.nappends = strtoull(optarg, 0, 0);
+			break;
+		case 'A':
+			o.nallocs = strtoull(optarg, 0, 0);
+			break;
+		case 'r':
+			o.reps = strtoull(optarg, 0, 0);
+			break;
+		case 'c':
+			if (bench_parse_size(optarg, &o.cp_size) || o.cp_size < 4)
+				goto badarg;
+			break;
+		case 'm':
+			o.nmsgs = strtoull(optarg, 0, 0);
+			break;
+		case 't':
+			o.nthreads = atoi(optarg);
+			if (o.nthreads < 1)
+				goto badarg;
+			break;
+		case 'b':
+			o.only = optarg;
+			break;
+		case 'R':
+			o.real_flush = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'x':
+			o.seed = strtoull(optarg, 0, 0);
+			break;
+		case 'v':
+			o.verbose++;
+			break;
+		case 'h':
+		case '?':
+			famfs_bench_usage(argv[0]);
+			return 0;
+		}
+	}
+
+	mock_kmod = 1;
+	mock_flush = !o.real_flush;
+	famfs_alloc_cache_enable = 0; /* The reserved (fragmentation) bits must not persist */
+
+	/* Results go to the real stdout; the library's output goes nowhere */
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out) {
+		perror("famfs_bench: dup stdout");
+		return -1;
+	}
+	if (!o.verbose && !freopen("/dev/null", "w", stdout)) {
+		perror("famfs_bench: /dev/null");
+		return -1;
+	}
+
+	if (bench_build_image(&o, &sb, &logp, &rdir, &rfile, &nfiles))
+		return -1;
+	bench_describe_image(&o, logp, nfiles);
+	if (bench_selected(&o, "mkdir") && o.ndirs)
+		bench_report(&rdir);
+	if (bench_selected(&o, "mkfile"))
+		bench_report(&rfile);
+
+	bench_append(&o);
+	bench_log_scan(&o, logp);
+	bench_alloc(&o, logp);
+	bench_logplay(&o, logp);
+	bench_cp(&o);
+	bench_flush(&o);
+	bench_pcq(&o);
+
+	fclose(out);
+	return 0;
+
+badarg:
+	fprintf(stderr, "famfs_bench: invalid argument: -%c %s\n", c, optarg);
+	famfs_bench_usage(argv[0]);
+	return -1;
+}
@@ -17,9 +17,16 @@ extern "C" {
 #include "famfs_lib.h"
 #include "famfs_lib_internal.h"
 #include "famfs_meta.h"
+#include "bitmap.h"
+#include "mu_mem.h"
+#include "mu_crc.h"
+#include "mu_histogram.h"
+#include "thpool.h"
 #include "xrand.h"
 #include "random_buffer.h"
+#include "pcq.h"
 #include "famfs_unit.h"
+#include "famfs_stats.h"
 }
 
 /****+++++++++++++++++++++++++++++++++++++++++++++
@@ -293,6 +300,75 @@ TEST(famfs, famfs_random_buffer)
 #endif
 }
 
+TEST(famfs, famfs_xrand_jump)
+{
+	u_int64_t ns[] = { 0, 1, 127, 128, 1000, 123457 };
+	struct xrand a, b;
+	u_int64_t i, j;
+
+	for (i = 0; i < sizeof(ns) / sizeof(ns[0]); i++) {
+		xrand_init(&a, 42);
+		xrand_init(&b, 42);
+		for (j = 0; j < ns[i]; j++)
+			xrand64(&a);
+		xrand_jump(&b, ns[i]);
+		ASSERT_EQ(xrand64(&a), xrand64(&b));
+		ASSERT_EQ(xrand64(&a), xrand64(&b));
+	}
+}
+
+TEST(famfs, famfs_random_buffer_at)
+{
+	size_t size = 4 * 1048576 + 7; /* Big enough for the vector path, ragged end */
+	size_t pieces[] = { 0, 4096, 1048576 + 4, 3 * 1048576, size };
+	char *buf = (char *)malloc(size);
+	char *ref = (char *)malloc(size);
+	unsigned int *w = (unsigned int *)ref;
+	u_int64_t val;
+	struct xrand xr;
+	size_t i;
+
+	ASSERT_NE(buf, nullptr);
+	ASSERT_NE(ref, nullptr);
+
+	/* The reference stream: the low 32 bits of each output */
+	xrand_init(&xr, 11);
+	for (i = 0; i < size / 4; i++)
+		w[i] = (unsigned int)xrand64(&xr);
+	val = xrand64(&xr);
+	memcpy(&ref[size & ~3UL], &val, size & 3);
+
+	randomize_buffer(buf, size, 11);
+	ASSERT_EQ(memcmp(buf, ref, size), 0);
+	ASSERT_EQ(validate_random_buffer(buf, size, 11), -1);
+
+	/* In pieces, in reverse order */
+	memset(buf, 0, size);
+	for (i = sizeof(pieces) / sizeof(pieces[0]) - 1; i > 0; i--)
+		randomize_buffer_at(&buf[pieces[i - 1]], pieces[i] - pieces[i - 1], 11,
+				    pieces[i - 1]);
+	ASSERT_EQ(memcmp(buf, ref, size), 0);
+	for (i = 1; i < sizeof(pieces) / sizeof(pieces[0]); i++)
+		ASSERT_EQ(validate_random_buffer_at(&buf[pieces[i - 1]],
+						    pieces[i] - pieces[i - 1], 11,
+						    pieces[i - 1]), -1);
+
+	/* Miscompares report stream offsets, from any quarter of the vector path */
+	ASSERT_EQ(validate_random_buffer(buf, size, 12), 0);
+	buf[3 * 1048576 + 9] ^= 1;
+	ASSERT_EQ(validate_random_buffer(buf, size, 11), 3 * 1048576 + 8);
+	ASSERT_EQ(validate_random_buffer_at(&buf[1048576 + 4], size - 1048576 - 4, 11,
+					    1048576 + 4), 3 * 1048576 + 8);
+	buf[512] ^= 1;
+	ASSERT_EQ(validate_random_buffer(buf, size, 11), 512);
+	buf[size - 1] ^= 1;
+	ASSERT_EQ(validate_random_buffer_at(&buf[3 * 1048576 + 12],
+					    size - 3 * 1048576 - 12, 11,
+					    3 * 1048576 + 12), (int64_t)(size & ~3UL));
+	free(buf);
+	free(ref);
+}
+
 #define booboofile "/tmp/booboo"
 TEST(famfs, famfs_file_not_famfs)
 {
@@ -406,17 +482,17 @@ TEST(famfs, famfs_log)
 		rc = __famfs_mkdir(&ll, dirname, 0, 0, 0, 0);
 		ASSERT_EQ(rc, 0);
 	}
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 3);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 3);
 	ASSERT_EQ(rc, 0);
 
-	rc = famfs_fsck_scan(sb, logp, 1, 3);
+	rc = famfs_fsck_scan(sb, logp, 1, 4, 3);
 	ASSERT_EQ(rc, 0);
 
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 1 /* mmap */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 1 /* mmap */, 1, 4, 1);
 	ASSERT_EQ(rc, 0);
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
 	ASSERT_EQ(rc, 0);
-	rc = famfs_fsck("/tmp/nonexistent-file", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/nonexistent-file", 0 /* read */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
 
 	/* Save good copies of the log and superblock */
@@ -424,38 +500,38 @@ TEST(famfs, famfs_log)
 	system("cp /tmp/famfs/.meta/.superblock /tmp/famfs/.meta/.superblock.save");
 
 	truncate("/tmp/famfs/.meta/.superblock", 8192);
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
 	ASSERT_EQ(rc, 0);
 
 	truncate("/tmp/famfs/.meta/.superblock", 7);
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
 
 	truncate("/tmp/famfs/.meta/.log", 8192);
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
 
 	unlink("/tmp/famfs/.meta/.log");
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 1 /* mmap */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 1 /* mmap */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
 	unlink("/tmp/famfs/.meta/.superblock");
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 1 /* mmap */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 1 /* mmap */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
 
 	system("chmod 200 /tmp/famfs/.meta/.log");
-	rc = famfs_fsck("/tmp/famfs/.meta/.log", 1 /* mmap */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.log", 1 /* mmap */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
-	rc = famfs_fsck("/tmp/famfs/.meta/.log", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.log", 0 /* read */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
 
 	system("chmod 200 /tmp/famfs/.meta/.superblock");
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 1 /* mmap */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 1 /* mmap */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
 	ASSERT_NE(rc, 0);
 
 	system("cp /tmp/famfs/.meta/.log.save /tmp/famfs/.meta/.log");
@@ -497,6 +573,34 @@ TEST(famfs, famfs_log)
 
 }
 
+/*
+ * Records are much smaller than a slot, so it takes tens of thousands of commands
+ * to fill the log. Use up most of it in one locked log, leaving @nslots for the test.
+ */
+static void
+fill_log(struct famfs_log *logp, s64 nslots)
+{
+	struct famfs_locked_log ll;
+	char dirname[FAMFS_MAX_PATHLEN];
+	char pad[200];
+	int rc;
+	int i;
+
+	/* Long names, for big records (and fewer directories) */
+	memset(pad, 'x', sizeof(pad) - 1);
+	pad[sizeof(pad) - 1] = 0;
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 0);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; log_slots_available(logp) > nslots; i++) {
+		sprintf(dirname, "/tmp/famfs/fill%05d%s", i, pad);
+		rc = __famfs_mkdir(&ll, dirname, 0755, 0, 0, 0);
+		ASSERT_EQ(rc, 0);
+	}
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+}
+
 TEST(famfs, famfs_log_overflow_mkdir_p)
 {
 	u64 device_size = 64ULL * 1024ULL * 1024ULL * 1024ULL;
@@ -514,6 +618,7 @@ TEST(famfs, famfs_log_overflow_mkdir_p)
 	/* Prepare a fake famfs (move changes to this block everywhere it is) */
 	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
 	ASSERT_EQ(rc, 0);
+	fill_log(logp, 256);
 
 	/* TODO: nested dirs and files to fill up the log */
 	for (i = 0; ; i++) {
@@ -521,34 +626,34 @@ TEST(famfs, famfs_log_overflow_mkdir_p)
 
 		sprintf(dirname, "/tmp/famfs/dir%04d/a/b/c/d/e/f/g/h/i", i);
 		/* mkdir -p */
-		rc = famfs_mkdir_parents(dirname, 0644, 0, 0, (i < 2500) ? 0:2);
+		rc = famfs_mkdir_parents(dirname, 0644, 0, 0, (nslots < 12) ? 2 : 0);
 
 		if (nslots >= 10) {
 			if (rc != 0)
 				printf("nslots: %lld\n", nslots);
 			ASSERT_EQ(rc, 0);
-		} else {
+		} else if (rc != 0) {
+			/* Records are smaller than a slot, so this takes a few more tries */
 			printf("nslots: %lld\n", nslots);
-			ASSERT_NE(rc, 0);
 			break;
 		}
 	}
 
 	/* Let's check how many log entries are left */
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
 	ASSERT_EQ(rc, 0);
 
 	famfs_dump_log(logp);
 
 	/* Let's check how many log entries are left */
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
 	ASSERT_EQ(rc, 0);
 
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
 	ASSERT_EQ(rc, 0);
 	//famfs_print_log_stats("famfs_log test", )
 
-	rc = famfs_fsck_scan(sb, logp, 1, 0);
+	rc = famfs_fsck_scan(sb, logp, 1, 4, 0);
 	ASSERT_EQ(rc, 0);
 }
 
@@ -570,6 +675,7 @@ TEST(famfs, famfs_log_overflow_files)
 	/* Prepare a fake famfs (move changes to this block everywhere it is) */
 	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
 	ASSERT_EQ(rc, 0);
+	fill_log(logp, 256);
 
 	/* Keep doing "mkdir -p" until the log is almost full.
 	 * Each of these commands will use 10 log entries.
@@ -577,11 +683,11 @@ TEST(famfs, famfs_log_overflow_files)
 	for (i = 0; ; i++) {
 		sprintf(dirname, "/tmp/famfs/dir%04d/a/b/c/d/e/f/g/h/i", i);
 		/* mkdir -p */
-		rc = famfs_mkdir_parents(dirname, 0644, 0, 0, (i < 2500) ? 0:2);
+		rc = famfs_mkdir_parents(dirname, 0644, 0, 0, 0);
 		ASSERT_EQ(rc, 0);
 
 		sprintf(filename, "%s/%04d", dirname, i);
-		fd = famfs_mkfile(filename, 0, 0, 0, 1048576, 0);
+		fd = famfs_mkfile(filename, 0, 0, 0, 1048576, FAMFS_ALLOC_FIRST_FIT, 0);
 		ASSERT_GT(fd, 0);
 
 		close(fd);
@@ -592,32 +698,2693 @@ TEST(famfs, famfs_log_overflow_files)
 	}
 
 	for (i = 0 ; ; i++) {
+		s64 nslots = log_slots_available(logp);
+
 		printf("xyi: %d\n", i);
 		sprintf(filename, "%s/%04d", dirname, i);
-		fd = famfs_mkfile(filename, 0, 0, 0, 1048576, 0);
-		if (log_slots_available(logp) > 0) {
+		fd = famfs_mkfile(filename, 0, 0, 0, 1048576, FAMFS_ALLOC_FIRST_FIT, 0);
+		if (nslots > 0) {
 			ASSERT_GT(fd, 0);
-			close(fd);
-		} else if (log_slots_available(logp) == 0) {
-			fd = famfs_mkfile(filename, 0, 0, 0, 1048576, 0);
-			ASSERT_LT(fd, 0);
+		} else if (fd < 0) {
+			/* Less than a slot left: it's full within a slot's worth of files */
+			ASSERT_LT(i, FAMFS_LOG_REC_MAX);
 			break;
 		}
+		close(fd);
 	}
 
 	/* Let's check how many log entries are left */
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
 	ASSERT_EQ(rc, 0);
 
 	famfs_dump_log(logp);
 
 	/* Let's check how many log entries are left */
-	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
+	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 4, 1);
+	ASSERT_EQ(rc, 0);
+
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_fsck_scan(sb, logp, 1, 4, 3);
+	ASSERT_EQ(rc, 0);
+}
+
+TEST(famfs, famfs_logplay_incremental)
+{
+	u64 device_size = 64ULL * 1024ULL * 1024ULL * 1024ULL;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log_rec *lr;
+	struct famfs_log *logp;
+	char filename[64];
+	extern int mock_kmod;
+	struct stat st;
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+
+	/* Prepare a fake famfs (move changes to this block everywhere it is) */
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+
+	for (i = 0; i < 10; i++) {
+		sprintf(filename, "/tmp/famfs/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+
+	/* Full play checkpoints the log */
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+
+	/* Already-played entries are skipped, so a missing file is not re-created */
+	unlink("/tmp/famfs/0003");
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 1, 1, 1);
+	ASSERT_EQ(rc, 0);
+	rc = stat("/tmp/famfs/0003", &st);
+	ASSERT_NE(rc, 0);
+
+	/* New entries are played */
+	for (i = 10; i < 15; i++) {
+		sprintf(filename, "/tmp/famfs/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	unlink("/tmp/famfs/0012");
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 1, 1, 1);
+	ASSERT_EQ(rc, 0);
+	rc = stat("/tmp/famfs/0012", &st);
+	ASSERT_EQ(rc, 0);
+	rc = stat("/tmp/famfs/0003", &st);
+	ASSERT_NE(rc, 0);
+
+	/* A full play still repairs everything */
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+	rc = stat("/tmp/famfs/0003", &st);
+	ASSERT_EQ(rc, 0);
+
+	/* A new mount instance of the log invalidates the checkpoint */
+	unlink("/tmp/famfs/0005");
+	rc = chmod("/tmp/famfs/.meta/.log", 0644);
+	ASSERT_EQ(rc, 0);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 1, 1, 1);
+	ASSERT_EQ(rc, 0);
+	rc = stat("/tmp/famfs/0005", &st);
+	ASSERT_EQ(rc, 0);
+
+	/* So does a log that no longer matches the last entry we played; the whole
+	 * log gets validated again, and the corrupted entry is detected
+	 */
+	lr = (struct famfs_log_rec *)&logp->famfs_log_data[logp->famfs_log_last_offset];
+	lr->lr_crc ^= 1;
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 1, 1, 1);
+	ASSERT_NE(rc, 0);
+	lr->lr_crc ^= 1;
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 1, 1, 1);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+}
+
+TEST(famfs, famfs_logplay_namespace)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char filename[64];
+	struct stat st;
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+
+	/* Prepare a fake famfs (move changes to this block everywhere it is) */
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/ns", 0755, 0, 0, 0);
+	ASSERT_EQ(rc, 0);
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/ns/a", 0755, 0, 0, 0);
+	ASSERT_EQ(rc, 0);
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/ns/a/b", 0755, 0, 0, 0);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 4; i++) {
+		sprintf(filename, "/tmp/famfs/ns/a/b/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+		sprintf(filename, "/tmp/famfs/ns/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+
+	/* Nothing is missing */
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+
+	/* Missing subtrees are re-created, parents first */
+	system("rm -rf /tmp/famfs/ns/a /tmp/famfs/ns/0002");
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 2);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 4; i++) {
+		sprintf(filename, "/tmp/famfs/ns/a/b/%04d", i);
+		rc = stat(filename, &st);
+		ASSERT_EQ(rc, 0);
+		ASSERT_TRUE(S_ISREG(st.st_mode));
+	}
+	rc = stat("/tmp/famfs/ns/0002", &st);
+	ASSERT_EQ(rc, 0);
+
+	/* Something that isn't a directory where one was logged is an error */
+	system("rm -rf /tmp/famfs/ns/a");
+	fd = open("/tmp/famfs/ns/a", O_CREAT | O_RDWR, 0644);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 6); /* a, b and the 4 files in b */
+	unlink("/tmp/famfs/ns/a");
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+
+	/* Files can be created by a worker pool, once their directories exist */
+	system("rm -rf /tmp/famfs/ns/a /tmp/famfs/ns/000*");
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 4, 0);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 4; i++) {
+		sprintf(filename, "/tmp/famfs/ns/a/b/%04d", i);
+		rc = stat(filename, &st);
+		ASSERT_EQ(rc, 0);
+		ASSERT_TRUE(S_ISREG(st.st_mode));
+		sprintf(filename, "/tmp/famfs/ns/%04d", i);
+		rc = stat(filename, &st);
+		ASSERT_EQ(rc, 0);
+	}
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 4, 0);
 	ASSERT_EQ(rc, 0);
 
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0);
+	/* Log entries can't escape the mount point */
+	rmdir("/tmp/famfs_escape");
+	rc = famfs_log_dir_creation(&ll, "ns/../../famfs_escape", 0755, 0, 0);
 	ASSERT_EQ(rc, 0);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 1);
+	rc = stat("/tmp/famfs_escape", &st);
+	ASSERT_NE(rc, 0);
+
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+}
+
+TEST(famfs, mu_histogram)
+{
+	struct mu_histogram h;
+	int i;
+
+	mu_hist_init(&h);
+	ASSERT_EQ(mu_hist_percentile(&h, 50), 0u);
+
+	mu_hist_record(&h, 0);
+	mu_hist_record(&h, 1);
+	for (i = 0; i < 97; i++)
+		mu_hist_record(&h, 100);
+	mu_hist_record(&h, 5000);
+
+	ASSERT_EQ(h.count, 100u);
+	ASSERT_EQ(h.min, 0u);
+	ASSERT_EQ(h.max, 5000u);
+	ASSERT_EQ(h.buckets[0], 1u);
+	ASSERT_EQ(h.buckets[1], 1u);
+	ASSERT_EQ(h.buckets[mu_hist_bucket(100)], 97u);
+	ASSERT_EQ(mu_hist_bucket(64), 7u);
+	ASSERT_EQ(mu_hist_bucket(127), 7u);
+	ASSERT_EQ(mu_hist_bucket(UINT64_MAX), 64u);
+
+	/* Percentiles are bucket upper bounds */
+	ASSERT_EQ(mu_hist_percentile(&h, 50), 127u);
+	ASSERT_EQ(mu_hist_percentile(&h, 99), 127u);
+	ASSERT_EQ(mu_hist_percentile(&h, 100), 5000u);
+	ASSERT_EQ(mu_hist_percentile(&h, 0), 0u);
+	mu_hist_print(&h, stdout, "mu_histogram test", "us");
+}
+
+TEST(famfs, mu_hdr_histogram)
+{
+	struct mu_hdr_histogram *h = (struct mu_hdr_histogram *)malloc(sizeof(*h));
+	struct mu_hdr_histogram *h2 = (struct mu_hdr_histogram *)malloc(sizeof(*h2));
+	unsigned int b;
+	uint64_t v;
+	int i;
+
+	/* Buckets tile the whole range, and are within 1/MU_HDR_SUB of their values */
+	for (b = 0; b < MU_HDR_BUCKETS; b++) {
+		ASSERT_EQ(mu_hdr_bucket(mu_hdr_bucket_max(b)), b);
+		if (b + 1 < MU_HDR_BUCKETS) {
+			ASSERT_EQ(mu_hdr_bucket(mu_hdr_bucket_max(b) + 1), b + 1);
+		}
+	}
+	ASSERT_EQ(mu_hdr_bucket_max(MU_HDR_BUCKETS - 1), UINT64_MAX);
+	for (v = 1; v < (1ULL << 50); v = (v * 3) + 1) {
+		uint64_t upper = mu_hdr_bucket_max(mu_hdr_bucket(v));
+
+		ASSERT_GE(upper, v);
+		ASSERT_LE(upper - v, v / MU_HDR_SUB);
+	}
+	for (v = 0; v < MU_HDR_SUB; v++)
+		ASSERT_EQ(mu_hdr_bucket_max(mu_hdr_bucket(v)), v);
+
+	mu_hdr_init(h);
+	ASSERT_EQ(mu_hdr_percentile(h, 50), 0u);
+	for (i = 1; i <= 1000; i++)
+		mu_hdr_record(h, i * 1000);
+	ASSERT_EQ(h->count, 1000u);
+	ASSERT_EQ(h->min, 1000u);
+	ASSERT_EQ(h->max, 1000000u);
+
+	/* Sub-bucket resolution: within ~3% rather than a factor of 2 */
+	v = mu_hdr_percentile(h, 50);
+	ASSERT_GE(v, 500000u);
+	ASSERT_LE(v, 500000u + 500000u / MU_HDR_SUB);
+	v = mu_hdr_percentile(h, 99.9);
+	ASSERT_GE(v, 999000u);
+	ASSERT_LE(v, 1000000u);
+	ASSERT_EQ(mu_hdr_percentile(h, 100), 1000000u);
+
+	mu_hdr_init(h2);
+	mu_hdr_record(h2, 3);
+	mu_hdr_merge(h2, h);
+	ASSERT_EQ(h2->count, 1001u);
+	ASSERT_EQ(h2->min, 3u);
+	ASSERT_EQ(h2->max, 1000000u);
+	ASSERT_EQ(mu_hdr_percentile(h2, 0), 3u);
+	mu_hdr_print(h2, stdout, "mu_hdr_histogram test", "ns");
+
+	free(h);
+	free(h2);
+}
+
+struct logfollow_args {
+	const struct famfs_log *logp;
+	struct mu_histogram     hist;
+	int                     rc;
+};
+
+static void *
+logfollow_thread(void *arg)
+{
+	struct logfollow_args *a = (struct logfollow_args *)arg;
+
+	a->rc = __famfs_logfollow(a->logp, "/tmp/famfs", 0, 1, &a->hist, 1);
+	return NULL;
+}
+
+TEST(famfs, famfs_logfollow)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct logfollow_args args;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char filename[64];
+	pthread_t tid;
+	int rc;
+	int fd;
+	int i, j;
+
+	mock_kmod = 1;
+
+	/* The follower polls the cursor block, which shares no cache lines (or adjacent-line
+	 * prefetch pairs) with the immutable fields or the records
+	 */
+	ASSERT_EQ(offsetof(struct famfs_log, famfs_log_next_seqnum), (size_t)FAMFS_LOG_HDR_BLOCK);
+	ASSERT_EQ(offsetof(struct famfs_log, famfs_log_epoch) + sizeof(u64),
+		  FAMFS_LOG_HDR_BLOCK + 40u);
+	ASSERT_EQ(offsetof(struct famfs_log, famfs_log_data), 2u * FAMFS_LOG_HDR_BLOCK);
+	ASSERT_EQ(sizeof(struct famfs_log), 2u * FAMFS_LOG_HDR_BLOCK);
+
+	/* Prepare a fake famfs (move changes to this block everywhere it is) */
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+
+	args.logp = logp;
+	args.rc = -1;
+	mu_hist_init(&args.hist);
+	famfs_follow_stop = 0;
+	rc = pthread_create(&tid, NULL, logfollow_thread, &args);
+	ASSERT_EQ(rc, 0);
+	usleep(200 * 1000); /* Let it catch up with the (empty) log */
+
+	/* Each commit is seen (and timed) by the follower */
+	for (i = 0; i < 3; i++) {
+		sprintf(filename, "/tmp/famfs/follow%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+
+		for (j = 0; j < 5000; j++) {
+			if (__atomic_load_n(&args.hist.count, __ATOMIC_ACQUIRE) > (u64)i)
+				break;
+			usleep(1000);
+		}
+		ASSERT_EQ(__atomic_load_n(&args.hist.count, __ATOMIC_ACQUIRE), (u64)(i + 1));
+	}
+
+	famfs_follow_stop = 1;
+	pthread_join(tid, NULL);
+	famfs_follow_stop = 0;
+	ASSERT_EQ(args.rc, 0);
+	mu_hist_print(&args.hist, stdout, "famfs_logfollow test", "us");
+
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+}
+
+struct log_reader_args {
+	const struct famfs_log *logp;
+	volatile int            stop;
+	u64                     nplays;
+	u64                     nentries;
+	u64                     nerrors;
+};
+
+/* Iterate the log over and over while it's being appended to */
+static void *
+log_reader_thread(void *arg)
+{
+	struct log_reader_args *a = (struct log_reader_args *)arg;
+	struct famfs_log_iter it;
+	u64 last = 0;
+
+	while (!a->stop) {
+		u64 n = 0;
+
+		famfs_log_iter_init(&it, a->logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+		do {
+			while (famfs_log_iter_next(&it))
+				n++;
+		} while (!it.err && famfs_log_iter_refresh(&it) > 0);
+		if (it.err || n < last || n != it.end.index)
+			a->nerrors++;
+		last = n;
+		__atomic_store_n(&a->nentries, n, __ATOMIC_RELEASE);
+		a->nplays++;
+	}
+	return NULL;
+}
+
+TEST(famfs, famfs_log_seqlock)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_log_cursor c, c2;
+	struct log_reader_args args[4];
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log_iter it;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char filename[64];
+	pthread_t tid[4];
+	u64 next_offset;
+	u64 last_offset;
+	u64 gen;
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+
+	/* The generation is part of the cursor block, which the master writes back whole */
+	ASSERT_EQ(offsetof(struct famfs_log, famfs_log_gen) + sizeof(u64),
+		  FAMFS_LOG_HDR_BLOCK + 48u);
+
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_log_read_cursor(logp, &c);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(c.gen % 2, 0u);
+	ASSERT_EQ(c.next_index, 0u);
+	gen = c.gen;
+
+	/* Each commit is one (even to even) generation */
+	for (i = 0; i < 3; i++) {
+		sprintf(filename, "/tmp/famfs/seq%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	rc = famfs_log_read_cursor(logp, &c);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(c.gen, gen + 2 * 3);
+	ASSERT_EQ(c.next_index, 3u);
+	ASSERT_EQ(c.next_seqnum, 3u);
+	ASSERT_EQ(c.next_offset, logp->famfs_log_next_offset);
+	ASSERT_EQ(c.last_offset, logp->famfs_log_last_offset);
+
+	/* An iteration that has reached the end picks up just the new entries */
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+	for (i = 0; famfs_log_iter_next(&it); i++)
+		;
+	ASSERT_EQ(i, 3);
+	ASSERT_EQ(famfs_log_iter_refresh(&it), 0);
+	for (i = 3; i < 5; i++) {
+		sprintf(filename, "/tmp/famfs/seq%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	ASSERT_EQ(famfs_log_iter_refresh(&it), 2);
+	for (i = 0; famfs_log_iter_next(&it); i++)
+		ASSERT_NE(strstr((char *)it.le.famfs_fc.famfs_relpath, "seq000"), nullptr);
+	ASSERT_EQ(i, 2);
+	ASSERT_EQ(it.err, 0);
+
+	/* A rewritten log (new epoch) can't be extended */
+	logp->famfs_log_epoch++;
+	logp->famfs_log_gen += 2;
+	ASSERT_EQ(famfs_log_iter_refresh(&it), -ESTALE);
+	logp->famfs_log_epoch--;
+	logp->famfs_log_gen += 2;
+
+	/* A commit in progress (odd generation): no consistent cursor, but an iteration
+	 * still sees the published index
+	 */
+	logp->famfs_log_gen++;
+	rc = famfs_log_read_cursor(logp, &c2);
+	ASSERT_EQ(rc, -EAGAIN);
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+	for (i = 0; famfs_log_iter_next(&it); i++)
+		;
+	ASSERT_EQ(i, 5);
+	ASSERT_EQ(it.err, 0);
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	/* ...and the next master completes it */
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(logp->famfs_log_gen % 2, 0u);
+	rc = famfs_log_read_cursor(logp, &c2);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(c2.next_index, 5u);
 
-	rc = famfs_fsck_scan(sb, logp, 1, 3);
+	/* A master killed between the cursor stores leaves the offsets new but the index
+	 * and seqnum old; the next master rebuilds the cursor from the records
+	 */
+	rc = famfs_log_txn_begin(&ll);
+	ASSERT_EQ(rc, 0);
+	for (i = 5; i < 7; i++) {
+		sprintf(filename, "/tmp/famfs/seq%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	next_offset = logp->famfs_log_next_offset + ll.txn_nbytes;
+	last_offset = ll.txn_last;
+	logp->famfs_log_gen++;
+	logp->famfs_log_next_offset = next_offset;
+	logp->famfs_log_last_offset = last_offset;
+	ll.txn_open = 0;
+	ll.txn_nstaged = 0;
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_log_read_cursor(logp, &c2);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(c2.next_index, 7u);
+	ASSERT_EQ(c2.next_seqnum, 7u);
+	ASSERT_EQ(c2.next_offset, next_offset);
+	ASSERT_EQ(c2.last_offset, last_offset);
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+	for (i = 0; famfs_log_iter_next(&it); i++)
+		;
+	ASSERT_EQ(i, 7);
+	ASSERT_EQ(it.err, 0);
+
+	/* Readers that share the mapping with the master (and each other) never see a
+	 * partial commit
+	 */
+	for (i = 0; i < 4; i++) {
+		memset(&args[i], 0, sizeof(args[i]));
+		args[i].logp = logp;
+		rc = pthread_create(&tid[i], NULL, log_reader_thread, &args[i]);
+		ASSERT_EQ(rc, 0);
+	}
+	for (i = 7; i < 200; i++) {
+		sprintf(filename, "/tmp/famfs/seq%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 4096, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	for (i = 0; i < 4; i++) {
+		int j;
+
+		for (j = 0; j < 5000; j++) {
+			if (__atomic_load_n(&args[i].nentries, __ATOMIC_ACQUIRE) == 200)
+				break;
+			usleep(1000);
+		}
+		args[i].stop = 1;
+		pthread_join(tid[i], NULL);
+		ASSERT_GT(args[i].nplays, 0u);
+		ASSERT_EQ(args[i].nerrors, 0u);
+		ASSERT_EQ(args[i].nentries, 200u);
+	}
+
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_release_locked_log(&ll);
 	ASSERT_EQ(rc, 0);
+	mock_kmod = 0;
+}
+
+#define LONGDIR "/tmp/famfs/a_directory_with_a_rather_long_name"
+
+TEST(famfs, famfs_log_compact)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	const struct famfs_log_entry *le;
+	struct famfs_log_entry *saved;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log_iter it;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char filename[128];
+	u64 nsaved, nrecs;
+	u64 old_len;
+	struct stat st;
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+
+	/* Prepare a fake famfs (move changes to this block everywhere it is) */
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+
+	/* Files logged long after their directory are logged with their full path... */
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	rc = __famfs_mkdir(&ll, LONGDIR, 0755, 0, 0, 0);
+	ASSERT_EQ(rc, 0);
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/fill", 0755, 0, 0, 0);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 2500; i++) {
+		sprintf(filename, "/tmp/famfs/fill/%04d", i);
+		rc = __famfs_mkdir(&ll, filename, 0755, 0, 0, 0);
+		ASSERT_EQ(rc, 0);
+	}
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 200; i++) {
+		sprintf(filename, LONGDIR "/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 4096, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	nsaved = logp->famfs_log_next_index;
+	ASSERT_EQ(nsaved, 2702u);
+	old_len = logp->famfs_log_next_offset;
+
+	saved = (struct famfs_log_entry *)malloc(nsaved * sizeof(*saved));
+	nrecs = 0;
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+	while ((le = famfs_log_iter_next(&it)) != NULL)
+		memcpy(&saved[nrecs++], le, sizeof(*le));
+	ASSERT_EQ(nrecs, nsaved);
+
+	/* ...so compaction, which can refer to every directory, makes the log smaller */
+	rc = famfs_log_compact(&ll, 1);
+	ASSERT_GT(rc, 0);
+	ASSERT_EQ(logp->famfs_log_next_offset, old_len - rc);
+	ASSERT_EQ(logp->famfs_log_next_index, nsaved + 1);
+	ASSERT_EQ(logp->famfs_log_epoch, 1u);
+
+	/* The iterator gets back the same creations, after the checkpoint record */
+	nrecs = 0;
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+	while ((le = famfs_log_iter_next(&it)) != NULL) {
+		const struct famfs_log_entry *orig = &saved[nrecs];
+
+		ASSERT_TRUE(it.in_ckpt);
+		ASSERT_EQ(le->famfs_log_entry_seqnum, nrecs + 1);
+		ASSERT_EQ(le->famfs_log_entry_type, orig->famfs_log_entry_type);
+		if (le->famfs_log_entry_type == FAMFS_LOG_FILE) {
+			ASSERT_STREQ((char *)le->famfs_fc.famfs_relpath,
+				     (char *)orig->famfs_fc.famfs_relpath);
+			ASSERT_EQ(le->famfs_fc.famfs_fc_size, orig->famfs_fc.famfs_fc_size);
+			ASSERT_EQ(le->famfs_fc.fc_mode, orig->famfs_fc.fc_mode);
+			ASSERT_EQ(le->famfs_fc.famfs_nextents, orig->famfs_fc.famfs_nextents);
+			ASSERT_EQ(le->famfs_fc.famfs_ext_list[0].se.famfs_extent_offset,
+				  orig->famfs_fc.famfs_ext_list[0].se.famfs_extent_offset);
+		} else {
+			ASSERT_STREQ((char *)le->famfs_md.famfs_relpath,
+				     (char *)orig->famfs_md.famfs_relpath);
+		}
+		nrecs++;
+	}
+	ASSERT_EQ(it.err, 0);
+	ASSERT_EQ(nrecs, nsaved);
+	ASSERT_TRUE(it.have_ck);
+	ASSERT_EQ(it.ck.ck_nentries, nsaved);
+	ASSERT_EQ(it.ck.ck_nrecords, nsaved);
+	free(saved);
+
+	/* Nothing more to gain */
+	rc = famfs_log_compact(&ll, 1);
+	ASSERT_EQ(rc, 0);
+
+	/* The log continues after the checkpoint */
+	for (i = 200; i < 210; i++) {
+		sprintf(filename, LONGDIR "/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 4096, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	/* Rebuilding the bitmap from the checkpoint finds every allocation */
+	famfs_alloc_cache_enable = 0;
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/after_compact", 0644, 0, 0, 4096, 0);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	famfs_alloc_cache_enable = 1;
+	rc = famfs_fsck_scan(sb, logp, 1, 4, 0);
+	ASSERT_EQ(rc, 0);
+
+	/* Logplay re-creates files from the checkpoint and the tail */
+	system("rm -rf " LONGDIR " /tmp/famfs/fill /tmp/famfs/after_compact");
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 4, 0);
+	ASSERT_EQ(rc, 0);
+	rc = stat(LONGDIR "/0000", &st);
+	ASSERT_EQ(rc, 0);
+	rc = stat(LONGDIR "/0209", &st);
+	ASSERT_EQ(rc, 0);
+	rc = stat("/tmp/famfs/fill/2499", &st);
+	ASSERT_EQ(rc, 0);
+	rc = stat("/tmp/famfs/after_compact", &st);
+	ASSERT_EQ(rc, 0);
+
+	/* Compacting again folds the old checkpoint and the tail together */
+	rc = famfs_log_compact(&ll, 1);
+	ASSERT_GT(rc, 0);
+	famfs_log_iter_init(&it, logp, NULL, 0);
+	while (famfs_log_iter_next(&it) != NULL)
+		;
+	ASSERT_EQ(it.err, 0);
+	ASSERT_EQ(it.ck.ck_nentries, nsaved + 11);
+	ASSERT_EQ(it.ck.ck_nrecords, nsaved + 11);
+	ASSERT_EQ(logp->famfs_log_epoch, 2u);
+
+	/* A damaged record is detected */
+	((struct famfs_log_rec *)logp->famfs_log_data)->lr_rsvd ^= 1;
+	rc = __famfs_logplay(logp, "/tmp/famfs", 1, 0, 0, 1, 0);
+	ASSERT_LT(rc, 0);
+	((struct famfs_log_rec *)logp->famfs_log_data)->lr_rsvd ^= 1;
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+}
+
+TEST(famfs, famfs_log_rec_encoding)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_log_entry le;
+	struct famfs_log_entry out;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	u8 rec[FAMFS_LOG_REC_MAX];
+	struct famfs_log_iter it;
+	char longpath[FAMFS_MAX_PATHLEN + 16];
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char filename[64];
+	u64 parent;
+	int len;
+	int rc;
+	int fd;
+	int i;
+
+	memset(&le, 0, sizeof(le));
+
+	/* Extents are delta-coded, in allocation units when they're aligned */
+	le.famfs_log_entry_type = FAMFS_LOG_FILE;
+	le.famfs_log_entry_seqnum = 7;
+	le.famfs_fc.famfs_fc_size = 3 * FAMFS_ALLOC_UNIT + 1;
+	le.famfs_fc.famfs_nextents = 3;
+	le.famfs_fc.fc_mode = 0100644;
+	le.famfs_fc.famfs_ext_list[0].se.famfs_extent_offset = 1000ULL * FAMFS_ALLOC_UNIT;
+	le.famfs_fc.famfs_ext_list[0].se.famfs_extent_len = 2 * FAMFS_ALLOC_UNIT;
+	le.famfs_fc.famfs_ext_list[1].se.famfs_extent_offset = 10ULL * FAMFS_ALLOC_UNIT;
+	le.famfs_fc.famfs_ext_list[1].se.famfs_extent_len = FAMFS_ALLOC_UNIT;
+	le.famfs_fc.famfs_ext_list[2].se.famfs_extent_offset = 11ULL * FAMFS_ALLOC_UNIT;
+	le.famfs_fc.famfs_ext_list[2].se.famfs_extent_len = FAMFS_ALLOC_UNIT;
+	len = famfs_log_rec_encode(rec, &le, 0, 64, "file", MU_CRC_CRC32C);
+	ASSERT_GT(len, 0);
+	ASSERT_LE(len, 48);
+	ASSERT_EQ(len % FAMFS_LOG_REC_ALIGN, 0);
+	rc = famfs_log_rec_decode(rec, len, &out, &parent, 1, MU_CRC_CRC32C);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(parent, 64u);
+	ASSERT_EQ(out.famfs_log_entry_seqnum, 7u);
+	ASSERT_STREQ((char *)out.famfs_fc.famfs_relpath, "file");
+	ASSERT_EQ(out.famfs_fc.famfs_fc_size, le.famfs_fc.famfs_fc_size);
+	ASSERT_EQ(out.famfs_fc.fc_mode, le.famfs_fc.fc_mode);
+	for (i = 0; i < 3; i++) {
+		ASSERT_EQ(out.famfs_fc.famfs_ext_list[i].se.famfs_extent_offset,
+			  le.famfs_fc.famfs_ext_list[i].se.famfs_extent_offset);
+		ASSERT_EQ(out.famfs_fc.famfs_ext_list[i].se.famfs_extent_len,
+			  le.famfs_fc.famfs_ext_list[i].se.famfs_extent_len);
+	}
+
+	/* Unaligned extents are kept in bytes */
+	le.famfs_fc.famfs_ext_list[1].se.famfs_extent_len = 4096;
+	len = famfs_log_rec_encode(rec, &le, 0, 0, "file", MU_CRC_CRC32C);
+	ASSERT_GT(len, 0);
+	rc = famfs_log_rec_decode(rec, len, &out, &parent, 1, MU_CRC_CRC32C);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(parent, 0u);
+	ASSERT_EQ(out.famfs_fc.famfs_ext_list[1].se.famfs_extent_len, 4096u);
+	ASSERT_EQ(out.famfs_fc.famfs_ext_list[2].se.famfs_extent_offset,
+		  le.famfs_fc.famfs_ext_list[2].se.famfs_extent_offset);
+
+	/* The crc algorithm has to match the log's */
+	ASSERT_NE(famfs_log_rec_decode(rec, len, &out, &parent, 1, MU_CRC_ZLIB), 0);
+	ASSERT_EQ(famfs_log_rec_decode(rec, len, &out, &parent, 0, MU_CRC_ZLIB), 0);
+	len = famfs_log_rec_encode(rec, &le, 0, 0, "file", MU_CRC_ZLIB);
+	ASSERT_GT(len, 0);
+	ASSERT_EQ(famfs_log_rec_decode(rec, len, &out, &parent, 1, MU_CRC_ZLIB), 0);
+	ASSERT_NE(famfs_log_rec_decode(rec, len, &out, &parent, 1, MU_CRC_CRC32C), 0);
+	len = famfs_log_rec_encode(rec, &le, 0, 0, "file", MU_CRC_CRC32C);
+
+	/* Corruption and truncation are caught */
+	rec[len - 1] ^= 1;
+	ASSERT_NE(famfs_log_rec_decode(rec, len, &out, &parent, 1, MU_CRC_CRC32C), 0);
+	rec[len - 1] ^= 1;
+	ASSERT_NE(famfs_log_rec_decode(rec, len - 8, &out, &parent, 1, MU_CRC_CRC32C), 0);
+
+	/* The largest possible record fits */
+	memset(longpath, 'x', FAMFS_MAX_PATHLEN - 1);
+	longpath[FAMFS_MAX_PATHLEN - 1] = 0;
+	le.famfs_fc.famfs_nextents = FAMFS_FC_MAX_EXTENTS;
+	for (i = 0; i < FAMFS_FC_MAX_EXTENTS; i++) {
+		le.famfs_fc.famfs_ext_list[i].se.famfs_extent_offset = ~0ULL - i;
+		le.famfs_fc.famfs_ext_list[i].se.famfs_extent_len = ~0ULL;
+	}
+	le.famfs_fc.famfs_fc_size = ~0ULL;
+	len = famfs_log_rec_encode(rec, &le, FAMFS_LOG_REC_MAX, ~0ULL, longpath,
+				   MU_CRC_CRC32C);
+	ASSERT_GT(len, 0);
+	ASSERT_LE(len, FAMFS_LOG_REC_MAX);
+	longpath[FAMFS_MAX_PATHLEN - 1] = 'x';
+	longpath[FAMFS_MAX_PATHLEN] = 0;
+	ASSERT_LT(famfs_log_rec_encode(rec, &le, 0, 0, longpath, MU_CRC_CRC32C), 0);
+
+	/* A log holds several times more files than it did with fixed-size entries */
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/dir", 0755, 0, 0, 0);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 100; i++) {
+		sprintf(filename, "/tmp/famfs/dir/file%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 4096, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	ASSERT_LT(logp->famfs_log_next_offset / logp->famfs_log_next_index, 328ULL / 4);
+
+	/* Paths longer than the old 80 byte limit work, and are rejected past the new one */
+	memset(longpath, 0, sizeof(longpath));
+	strcpy(longpath, "/tmp/famfs/dir/");
+	memset(&longpath[strlen(longpath)], 'y', 200);
+	fd = __famfs_mkfile(&ll, longpath, 0644, 0, 0, 4096, 0);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	memset(&longpath[strlen(longpath)], 'z', 60);
+	fd = __famfs_mkfile(&ll, longpath, 0644, 0, 0, 4096, 0);
+	ASSERT_LT(fd, 0);
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_VALIDATE);
+	while (famfs_log_iter_next(&it) != NULL)
+		;
+	ASSERT_EQ(it.err, 0);
+	ASSERT_EQ(it.pos.index, 102u);
+	ASSERT_EQ((size_t)strlen((char *)it.le.famfs_fc.famfs_relpath), strlen("dir/") + 200);
+	ASSERT_EQ(it.parent, FAMFS_LOG_NO_PARENT);
+
+	rc = famfs_fsck_scan(sb, logp, 1, 4, 0);
+	ASSERT_EQ(rc, 0);
+}
+
+TEST(famfs, famfs_bitmap_scan)
+{
+	u64 sizes[] = { 1, 7, 8, 63, 64, 65, 129, 1000, 4099 };
+	struct xrand xr;
+	u64 i, j, k, n;
+
+	xrand_init(&xr, 42);
+	for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		u64 nbits = sizes[k];
+		u8 *bitmap = (u8 *)calloc(1, mu_bitmap_size(nbits));
+
+		ASSERT_NE(bitmap, nullptr);
+
+		/* Empty, then full */
+		ASSERT_EQ(mu_bitmap_find_first_zero(bitmap, nbits), 0u);
+		ASSERT_EQ(mu_bitmap_find_next_set(bitmap, nbits, 0), nbits);
+		ASSERT_EQ(mu_bitmap_zero_run(bitmap, nbits, 0, nbits + 10), nbits);
+		mu_bitmap_set_range(bitmap, 0, nbits);
+		ASSERT_EQ(mu_bitmap_find_first_zero(bitmap, nbits), nbits);
+		ASSERT_EQ(mu_bitmap_count_set(bitmap, nbits), nbits);
+		mu_bitmap_clear_range(bitmap, 0, nbits);
+		ASSERT_EQ(mu_bitmap_count_set(bitmap, nbits), 0u);
+
+		/* Sparse and dense random bitmaps vs. testing one bit at a time */
+		for (n = 2; n < 64; n *= 4) {
+			u64 count = 0;
+
+			memset(bitmap, 0, mu_bitmap_size(nbits));
+			for (i = 0; i < nbits; i++) {
+				if ((xrand64(&xr) % n) == 0) {
+					mu_bitmap_set(bitmap, i);
+					count++;
+				}
+			}
+			ASSERT_EQ(mu_bitmap_count_set(bitmap, nbits), count);
+
+			for (i = 0; i <= nbits; i++) {
+				u64 next_set = nbits, next_zero = nbits;
+
+				for (j = i; j < nbits; j++) {
+					if (mu_bitmap_test(bitmap, j)) {
+						next_set = j;
+						break;
+					}
+				}
+				for (j = i; j < nbits; j++) {
+					if (!mu_bitmap_test(bitmap, j)) {
+						next_zero = j;
+						break;
+					}
+				}
+				ASSERT_EQ(mu_bitmap_find_next_set(bitmap, nbits, i), next_set);
+				ASSERT_EQ(mu_bitmap_find_next_zero(bitmap, nbits, i), next_zero);
+				if (i < nbits) {
+					u64 run = (mu_bitmap_test(bitmap, i)) ? 0 : next_set - i;
+
+					ASSERT_EQ(mu_bitmap_zero_run(bitmap, nbits, i, nbits), run);
+					ASSERT_EQ(mu_bitmap_zero_run(bitmap, nbits, i, 3),
+						  (run < 3) ? run : 3);
+				}
+			}
+		}
+
+		/* Ranges that start and end mid-byte */
+		memset(bitmap, 0, mu_bitmap_size(nbits));
+		if (nbits > 10) {
+			mu_bitmap_set_range(bitmap, 3, nbits - 6);
+			ASSERT_EQ(mu_bitmap_count_set(bitmap, nbits), nbits - 6);
+			ASSERT_EQ(mu_bitmap_find_next_set(bitmap, nbits, 0), 3u);
+			ASSERT_EQ(mu_bitmap_find_next_zero(bitmap, nbits, 3), nbits - 3);
+			mu_bitmap_clear_range(bitmap, 5, nbits - 10);
+			ASSERT_EQ(mu_bitmap_count_set(bitmap, nbits), 4u);
+		}
+		free(bitmap);
+	}
+}
+
+TEST(famfs, famfs_alloc_cache)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char filename[64];
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+
+	/* Prepare a fake famfs (move changes to this block everywhere it is) */
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+
+	/* Each pass allocates with a bitmap handed down from the previous pass */
+	for (i = 0; i < 40; i++) {
+		if (i % 10 == 0) {
+			rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+			ASSERT_EQ(rc, 0);
+		}
+		sprintf(filename, "/tmp/famfs/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 4 * 1048576, 1);
+		ASSERT_GT(fd, 0);
+		close(fd);
+		if (i % 10 != 9)
+			continue;
+
+		rc = famfs_release_locked_log(&ll);
+		ASSERT_EQ(rc, 0);
+
+		/* Entries logged without updating the cache get replayed into it */
+		if (i == 9)
+			famfs_alloc_cache_enable = 0;
+		if (i == 19)
+			famfs_alloc_cache_enable = 1;
+
+		/* A corrupted cache is ignored */
+		if (i == 29)
+			system("for f in /opt/famfs/alloc.*; do "
+			       "dd if=/dev/urandom of=$f bs=64 count=1 conv=notrunc; "
+			       "done 2>/dev/null");
+	}
+
+	/* No collisions, and everything is accounted for */
+	rc = famfs_fsck_scan(sb, logp, 1, 4, 0);
+	ASSERT_EQ(rc, 0);
+
+	/* Fill the rest of the device; what's left over must still be usable by the next
+	 * command, which gets the bitmap from the cache
+	 */
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	for (i = 40; ; i++) {
+		sprintf(filename, "/tmp/famfs/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 6 * 1048576, 0);
+		if (fd < 0)
+			break;
+		close(fd);
+	}
+	ASSERT_GT(i, 40);
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	sprintf(filename, "/tmp/famfs/%04d", i + 1);
+	fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 4 * 1048576, 1);
+	ASSERT_GT(fd, 0); /* a 4MiB file still fits */
+	close(fd);
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_fsck_scan(sb, logp, 1, 4, 0);
+	ASSERT_EQ(rc, 0);
+}
+
+/* Decode the last record in the log */
+static struct famfs_log_entry last_le;
+
+static const struct famfs_file_creation *
+last_fc(const struct famfs_log *logp)
+{
+	u64 parent;
+
+	famfs_log_rec_decode(&logp->famfs_log_data[logp->famfs_log_last_offset],
+			     logp->famfs_log_data_len - logp->famfs_log_last_offset,
+			     &last_le, &parent, 1, famfs_log_crc_alg(logp));
+	return &last_le.famfs_fc;
+}
+
+TEST(famfs, famfs_alloc_policy)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	const struct famfs_file_creation *fc;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	u64 first_free;
+	int rc;
+	int fd;
+
+	mock_kmod = 1;
+	famfs_alloc_cache_enable = 0; /* The fragmented bitmap below is not a real one */
+
+	ASSERT_EQ(famfs_alloc_policy_from_name("first"), FAMFS_ALLOC_FIRST_FIT);
+	ASSERT_EQ(famfs_alloc_policy_from_name("best"), FAMFS_ALLOC_BEST_FIT);
+	ASSERT_EQ(famfs_alloc_policy_from_name("next"), FAMFS_ALLOC_NEXT_FIT);
+	ASSERT_EQ(famfs_alloc_policy_from_name("stripe"), FAMFS_ALLOC_STRIPE);
+	ASSERT_LT(famfs_alloc_policy_from_name("bogus"), 0);
+	ASSERT_STREQ(famfs_alloc_policy_name(FAMFS_ALLOC_BEST_FIT), "best");
+
+	/* Prepare a fake famfs (move changes to this block everywhere it is) */
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/f0", 0644, 0, 0, 2 * 1048576, 1);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	ASSERT_NE(ll.bitmap, nullptr);
+	ASSERT_GT(ll.nbits, 400u);
+
+	/* Fragment the free space: leave only these free runs (in alloc units)
+	 * [100, 105) [150, 153) [200, 201) [250, 251) [300, 302) [350, 354)
+	 */
+	first_free = mu_bitmap_find_first_zero(ll.bitmap, ll.nbits);
+	ASSERT_LT(first_free, 100u);
+	mu_bitmap_set_range(ll.bitmap, first_free, ll.nbits - first_free);
+	mu_bitmap_clear_range(ll.bitmap, 100, 5);
+	mu_bitmap_clear_range(ll.bitmap, 150, 3);
+	mu_bitmap_clear_range(ll.bitmap, 200, 1);
+	mu_bitmap_clear_range(ll.bitmap, 250, 1);
+	mu_bitmap_clear_range(ll.bitmap, 300, 2);
+	mu_bitmap_clear_range(ll.bitmap, 350, 4);
+
+#define LAST_FC last_fc(ll.logp)
+#define EXT_OFS(fc, i) ((fc)->famfs_ext_list[i].se.famfs_extent_offset / FAMFS_ALLOC_UNIT)
+#define EXT_LEN(fc, i) ((fc)->famfs_ext_list[i].se.famfs_extent_len / FAMFS_ALLOC_UNIT)
+
+	/* best-fit takes the smallest run that fits */
+	ll.policy = FAMFS_ALLOC_BEST_FIT;
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/best", 0644, 0, 0, 6 * 1048576, 1);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	fc = LAST_FC;
+	ASSERT_EQ(fc->famfs_nextents, 1u);
+	ASSERT_EQ(EXT_OFS(fc, 0), 150u);
+
+	/* next-fit continues after the previous allocation */
+	ll.policy = FAMFS_ALLOC_NEXT_FIT;
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/next", 0644, 0, 0, 2 * 1048576, 1);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	fc = LAST_FC;
+	ASSERT_EQ(fc->famfs_nextents, 1u);
+	ASSERT_EQ(EXT_OFS(fc, 0), 200u);
+
+	/* first-fit takes the lowest run that fits */
+	ll.policy = FAMFS_ALLOC_FIRST_FIT;
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/first", 0644, 0, 0, 2 * 1048576, 1);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	fc = LAST_FC;
+	ASSERT_EQ(fc->famfs_nextents, 1u);
+	ASSERT_EQ(EXT_OFS(fc, 0), 100u);
+
+	/* No single run holds 6 units, so the file is split across the largest runs */
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/split", 0644, 0, 0, 12 * 1048576, 1);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	fc = LAST_FC;
+	ASSERT_EQ(fc->famfs_nextents, 2u);
+	ASSERT_EQ(EXT_OFS(fc, 0), 101u);
+	ASSERT_EQ(EXT_LEN(fc, 0), 4u);
+	ASSERT_EQ(EXT_OFS(fc, 1), 350u);
+	ASSERT_EQ(EXT_LEN(fc, 1), 2u);
+
+	/* stripe splits into equal extents */
+	ll.policy = FAMFS_ALLOC_STRIPE;
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/stripe", 0644, 0, 0, 8 * 1048576, 1);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	fc = LAST_FC;
+	ASSERT_EQ(fc->famfs_nextents, 2u);
+	ASSERT_EQ(EXT_OFS(fc, 0), 300u);
+	ASSERT_EQ(EXT_LEN(fc, 0), 2u);
+	ASSERT_EQ(EXT_OFS(fc, 1), 352u);
+	ASSERT_EQ(EXT_LEN(fc, 1), 2u);
+
+	/* Only [250, 251) is left; a failed allocation must not leak any of it */
+	ll.policy = FAMFS_ALLOC_FIRST_FIT;
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/nospace", 0644, 0, 0, 4 * 1048576, 1);
+	ASSERT_LT(fd, 0);
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/last", 0644, 0, 0, 2 * 1048576, 1);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	fc = LAST_FC;
+	ASSERT_EQ(EXT_OFS(fc, 0), 250u);
+
+#undef LAST_FC
+#undef EXT_OFS
+#undef EXT_LEN
+
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+	famfs_alloc_cache_enable = 1;
+
+	/* The split files are consistent with the log */
+	rc = famfs_fsck_scan(sb, logp, 1, 4, 0);
+	ASSERT_EQ(rc, 0);
+}
+
+TEST(famfs, famfs_log_commit_flush)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	u64 total;
+	int rc;
+	int fd;
+
+	mock_kmod = 1;
+
+	/* Prepare a fake famfs (move changes to this block everywhere it is) */
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	total = famfs_log_flush_bytes_total;
+
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/f0", 0644, 0, 0, 2 * 1048576, 1);
+	ASSERT_GT(fd, 0);
+	close(fd);
+
+	/* A commit flushes the record (a line or two) plus one header line, not the
+	 * whole log
+	 */
+	ASSERT_LE(famfs_log_flush_bytes, 3ULL * CL_SIZE);
+	ASSERT_GE(famfs_log_flush_bytes, 2ULL * CL_SIZE);
+	ASSERT_EQ(famfs_log_flush_bytes_total - total, famfs_log_flush_bytes);
+
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/d0", 0755, 0, 0, 1);
+	ASSERT_EQ(rc, 0);
+	ASSERT_LT(famfs_log_flush_bytes_total - total, (u64)ll.logp->famfs_log_len / 100);
+
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_fsck_scan(sb, logp, 1, 4, 0);
+	ASSERT_EQ(rc, 0);
+}
+
+TEST(famfs, mu_mem_flush)
+{
+	extern int mock_flush;
+	int save_mock_flush = mock_flush;
+	size_t len = 8 * CL_SIZE + 5;
+	char *buf = (char *)malloc(len + 2 * CL_SIZE);
+	char *p;
+	size_t i;
+
+	ASSERT_NE(buf, nullptr);
+	ASSERT_NE(mu_cpu_flush_features() & MU_CPU_PROBED, 0u);
+
+	/* Unaligned ranges cover every line they touch */
+	p = (char *)(((uintptr_t)buf + CL_SIZE - 1) & ~((uintptr_t)CL_SIZE - 1));
+	ASSERT_EQ(mu_cl_span(p, 0), 0u);
+	ASSERT_EQ(mu_cl_span(p, 1), (u64)CL_SIZE);
+	ASSERT_EQ(mu_cl_span(p, CL_SIZE), (u64)CL_SIZE);
+	ASSERT_EQ(mu_cl_span(p + CL_SIZE - 1, 2), (u64)(2 * CL_SIZE));
+	ASSERT_EQ(mu_cl_span(p + 3, len), (u64)(9 * CL_SIZE));
+
+	/* Really flush (whatever instructions this cpu has); the data must be intact */
+	mock_flush = 0;
+	for (i = 0; i < len; i++)
+		p[3 + i] = (char)i;
+	flush_processor_cache(p + 3, len);
+	writeback_processor_cache(p + 3, len);
+	invalidate_processor_cache(p + 3, len);
+	hard_flush_processor_cache(p + 3, len);
+	for (i = 0; i < len; i++)
+		ASSERT_EQ(p[3 + i], (char)i);
+
+	/* Streaming copies, with unaligned heads and tails on either side */
+	for (i = 0; i < 4; i++) {
+		char *src = (char *)malloc(len + 16);
+		size_t j;
+
+		ASSERT_NE(src, nullptr);
+		for (j = 0; j < len; j++)
+			src[i + j] = (char)(j * 7);
+		memset(buf, 0, len + 2 * CL_SIZE);
+		mu_memcpy_nt(p + i * 5, src + i, len - i);
+		for (j = 0; j < len - i; j++)
+			ASSERT_EQ(p[i * 5 + j], (char)(j * 7));
+		ASSERT_EQ(p[i * 5 + len - i], 0);
+		free(src);
+	}
+	mock_flush = save_mock_flush;
+
+	free(buf);
+}
+
+TEST(famfs, mu_crc32c)
+{
+	size_t sizes[] = { 64, 1024, 65536, 1048576 };
+	const char *check = "123456789";
+	struct famfs_log *logp;
+	size_t len = 8 * 1536 + 77;
+	u8 *buf;
+	size_t i, j;
+	u32 crc;
+
+	/* Standard check values */
+	ASSERT_EQ(mu_crc32c_sw(0, check, 9), 0xe3069283);
+	ASSERT_EQ(mu_crc32c(0, check, 9), 0xe3069283);
+	ASSERT_EQ(mu_crc(MU_CRC_ZLIB, 0, check, 9), 0xcbf43926);
+	ASSERT_EQ(mu_crc32c_sw(0, check, 0), 0u);
+
+	buf = (u8 *)malloc(sizes[3] + 8);
+	ASSERT_NE(buf, nullptr);
+	randomize_buffer(buf, sizes[3], 7);
+
+	/* The implementations agree at any alignment and length, including across the
+	 * interleaved blocks of the hardware loop; and checksums can be continued
+	 */
+	for (i = 0; i < len; i += (i < 64) ? 1 : 61) {
+		for (j = 0; j < 8; j++) {
+			crc = mu_crc32c_sw(0, buf + j, i);
+			if (mu_cpu_has_sse42()) {
+				ASSERT_EQ(mu_crc32c_hw(0, buf + j, i), crc);
+			}
+			ASSERT_EQ(mu_crc32c(mu_crc32c(0, buf + j, i / 3), buf + j + i / 3,
+					    i - i / 3), crc);
+		}
+	}
+
+	/* A log header says which crc it (and its records) use */
+	logp = (struct famfs_log *)calloc(1, sizeof(*logp));
+	ASSERT_NE(logp, nullptr);
+	logp->famfs_log_magic = FAMFS_LOG_MAGIC;
+	logp->famfs_log_len = FAMFS_LOG_LEN;
+	logp->famfs_log_data_len = FAMFS_LOG_LEN - sizeof(*logp);
+	logp->famfs_log_crc = famfs_gen_log_header_crc(logp);
+	ASSERT_EQ(famfs_log_crc_alg(logp), MU_CRC_ZLIB);
+	ASSERT_EQ(famfs_validate_log_header(logp), 0);
+	logp->famfs_log_flags = FAMFS_LOG_CRC32C;
+	ASSERT_NE(famfs_validate_log_header(logp), 0);
+	logp->famfs_log_crc = famfs_gen_log_header_crc(logp);
+	ASSERT_EQ(famfs_log_crc_alg(logp), MU_CRC_CRC32C);
+	ASSERT_EQ(famfs_validate_log_header(logp), 0);
+	logp->famfs_log_flags |= 0x100;
+	logp->famfs_log_crc = famfs_gen_log_header_crc(logp);
+	ASSERT_NE(famfs_validate_log_header(logp), 0);
+	free(logp);
+
+	/* Microbenchmark */
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		const char *names[] = { "zlib", "crc32c sw", "crc32c hw" };
+		u64 reps = (64ULL << 20) / sizes[i];
+
+		for (j = 0; j < 3; j++) {
+			struct timespec start, end;
+			double ns;
+			u64 r;
+
+			if (j == 2 && !mu_cpu_has_sse42())
+				continue;
+			crc = 0;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (r = 0; r < reps; r++) {
+				if (j == 0)
+					crc = mu_crc(MU_CRC_ZLIB, crc, buf, sizes[i]);
+				else if (j == 1)
+					crc = mu_crc32c_sw(crc, buf, sizes[i]);
+				else
+					crc = mu_crc32c_hw(crc, buf, sizes[i]);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+			printf("crc %-10s %8zu bytes: %6.2f GB/s %8.1f ns each (%08x)\n",
+			       names[j], sizes[i], (double)reps * sizes[i] / ns, ns / reps, crc);
+		}
+	}
+	free(buf);
+}
+
+TEST(famfs, famfs_log_txn)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char filename[64];
+	u64 next_index;
+	u64 staged;
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+
+	/* Prepare a fake famfs (move changes to this block everywhere it is) */
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	next_index = ll.logp->famfs_log_next_index;
+
+	rc = famfs_log_txn_begin(&ll);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_log_txn_begin(&ll);
+	ASSERT_EQ(rc, -EBUSY);
+
+	/* Staged entries are not visible in the log header until the commit */
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/txndir", 0755, 0, 0, 1);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 10; i++) {
+		sprintf(filename, "/tmp/famfs/txndir/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	ASSERT_EQ(ll.logp->famfs_log_next_index, next_index);
+	ASSERT_EQ(ll.txn_nstaged, 11u);
+	staged = ll.txn_nbytes;
+
+	/* One flush of the contiguous entries plus the header line */
+	rc = famfs_log_txn_commit(&ll);
+	ASSERT_EQ(rc, 11);
+	ASSERT_EQ(ll.logp->famfs_log_next_index, next_index + 11);
+	ASSERT_EQ(ll.logp->famfs_log_next_seqnum, next_index + 11);
+	ASSERT_LE(famfs_log_flush_bytes, staged + 3 * CL_SIZE);
+
+	/* Outside a transaction, entries are published one at a time */
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/txndir2", 0755, 0, 0, 1);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ll.logp->famfs_log_next_index, next_index + 12);
+
+	/* However long a transaction gets, nothing is published before the commit */
+	rc = famfs_log_txn_begin(&ll);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 300; i++) {
+		sprintf(filename, "/tmp/famfs/txndir2/%04d", i);
+		rc = __famfs_mkdir(&ll, filename, 0755, 0, 0, 0);
+		ASSERT_EQ(rc, 0);
+	}
+	ASSERT_EQ(ll.logp->famfs_log_next_index, next_index + 12);
+	ASSERT_EQ(ll.txn_nstaged, 300u);
+
+	/* Releasing the log commits it */
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(logp->famfs_log_next_index, next_index + 312);
+
+	/* A master that dies in a transaction leaves its records staged, and its files
+	 * created locally; the next master removes them
+	 */
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_log_txn_begin(&ll);
+	ASSERT_EQ(rc, 0);
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/txndir3", 0755, 0, 0, 1);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 3; i++) {
+		sprintf(filename, "/tmp/famfs/txndir3/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/txndir3/sub", 0755, 0, 0, 1);
+	ASSERT_EQ(rc, 0);
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/txndir3/sub/0000", 0644, 0, 0, 1048576, 0);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	ASSERT_EQ(ll.txn_nstaged, 6u);
+	ll.txn_open = 0; /* "crash": drop the lock without committing */
+	ll.txn_nstaged = 0;
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(logp->famfs_log_next_index, next_index + 312);
+	ASSERT_EQ(access("/tmp/famfs/txndir3/0000", F_OK), 0);
+	ASSERT_EQ(access("/tmp/famfs/txndir3/sub/0000", F_OK), 0);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	ASSERT_NE(access("/tmp/famfs/txndir3/sub/0000", F_OK), 0);
+	ASSERT_NE(access("/tmp/famfs/txndir3/0000", F_OK), 0);
+	ASSERT_NE(access("/tmp/famfs/txndir3", F_OK), 0);
+	ASSERT_EQ(access("/tmp/famfs/txndir2/0299", F_OK), 0);
+	ASSERT_EQ(ll.logp->famfs_log_next_index, next_index + 312);
+
+	/* The log continues where the last commit left it */
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/txndir3", 0755, 0, 0, 1);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(logp->famfs_log_next_index, next_index + 313);
+
+	/* Every entry is valid and in sequence */
+	rc = __famfs_logplay(logp, "/tmp/famfs", 1, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_fsck_scan(sb, logp, 1, 4, 0);
+	ASSERT_EQ(rc, 0);
+}
+
+static void
+thpool_test_work(void *arg)
+{
+	__atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+TEST(famfs, thpool)
+{
+	struct thpool *tp;
+	int count = 0;
+	int i;
+
+	ASSERT_EQ(thpool_init(0, 0), nullptr);
+
+	/* A small queue makes the producer block on a full queue */
+	tp = thpool_init(4, 2);
+	ASSERT_NE(tp, nullptr);
+	ASSERT_EQ(thpool_nthreads(tp), 4);
+	for (i = 0; i < 1000; i++)
+		ASSERT_EQ(thpool_add_work(tp, thpool_test_work, &count), 0);
+	thpool_wait(tp);
+	ASSERT_EQ(count, 1000);
+
+	/* Work queued before destroy still runs */
+	for (i = 0; i < 10; i++)
+		ASSERT_EQ(thpool_add_work(tp, thpool_test_work, &count), 0);
+	thpool_destroy(tp);
+	ASSERT_EQ(count, 1010);
+}
+
+TEST(famfs, famfs_cp_data)
+{
+	size_t size = 5 * 1048576 + 124; /* randomize_buffer() wants a multiple of 4 */
+	struct famfs_locked_log ll;
+	char *srcbuf;
+	char *destp;
+	int threads;
+	int direct;
+	int sfd, dfd;
+	int rc;
+
+	srcbuf = (char *)malloc(size);
+	ASSERT_NE(srcbuf, nullptr);
+	randomize_buffer(srcbuf, size, 42);
+	sfd = open("/tmp/famfs_cp_src", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	ASSERT_GT(sfd, 0);
+	ASSERT_EQ(write(sfd, srcbuf, size), (ssize_t)size);
+	close(sfd);
+
+	/* Inline, and split across threads in 1MiB chunks (the last one partial);
+	 * buffered and direct (O_DIRECT if /tmp supports it, non-temporal stores either way)
+	 */
+	for (threads = 1, direct = 0; threads <= 4; threads += 3 * direct, direct = !direct) {
+		memset(&ll, 0, sizeof(ll));
+		rc = famfs_cp_pool_start(&ll, threads, 1048576, direct);
+		ASSERT_EQ(rc, 0);
+		ASSERT_EQ(ll.cp_pool != NULL, threads > 1);
+
+		sfd = -1;
+		if (direct)
+			sfd = open("/tmp/famfs_cp_src", O_RDONLY | O_DIRECT);
+		if (sfd < 0)
+			sfd = open("/tmp/famfs_cp_src", O_RDONLY);
+		ASSERT_GT(sfd, 0);
+		dfd = open("/tmp/famfs_cp_dest", O_RDWR | O_CREAT | O_TRUNC, 0644);
+		ASSERT_GT(dfd, 0);
+		ASSERT_EQ(ftruncate(dfd, size), 0);
+		destp = (char *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, dfd, 0);
+		ASSERT_NE(destp, MAP_FAILED);
+
+		rc = famfs_cp_data(&ll, sfd, dfd, destp, size, 2);
+		ASSERT_EQ(rc, 0);
+		ASSERT_EQ(famfs_cp_pool_finish(&ll, 1), 0u);
+		ASSERT_EQ(ll.cp_pool, nullptr);
+		ASSERT_EQ(ll.cp_files, 1u);
+		ASSERT_EQ(ll.cp_bytes, size);
+
+		destp = (char *)famfs_mmap_whole_file("/tmp/famfs_cp_dest", 1, NULL);
+		ASSERT_NE(destp, nullptr);
+		ASSERT_EQ(memcmp(destp, srcbuf, size), 0);
+		munmap(destp, size);
+	}
+
+	/* A source that is shorter than the destination is a copy error */
+	memset(&ll, 0, sizeof(ll));
+	rc = famfs_cp_pool_start(&ll, 4, 1048576, 0);
+	ASSERT_EQ(rc, 0);
+	sfd = open("/tmp/famfs_cp_src", O_RDWR);
+	ASSERT_GT(sfd, 0);
+	ASSERT_EQ(ftruncate(sfd, size / 2), 0);
+	dfd = open("/tmp/famfs_cp_dest", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	ASSERT_GT(dfd, 0);
+	ASSERT_EQ(ftruncate(dfd, size), 0);
+	destp = (char *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, dfd, 0);
+	ASSERT_NE(destp, MAP_FAILED);
+	rc = famfs_cp_data(&ll, sfd, dfd, destp, size, 0);
+	ASSERT_EQ(rc, 0); /* queued */
+	ASSERT_EQ(famfs_cp_pool_finish(&ll, 0), 1u);
+	ASSERT_EQ(ll.cp_files, 0u);
+
+	unlink("/tmp/famfs_cp_src");
+	unlink("/tmp/famfs_cp_dest");
+	free(srcbuf);
+}
+
+TEST(famfs, famfs_flush_path)
+{
+	struct famfs_flush *fl;
+	char buf[4096];
+	int fd;
+
+	memset(buf, 0x5a, sizeof(buf));
+	unlink("/tmp/famfs_flush_dir/sub/f1");
+	rmdir("/tmp/famfs_flush_dir/sub");
+	unlink("/tmp/famfs_flush_dir/f0");
+	rmdir("/tmp/famfs_flush_dir");
+	ASSERT_EQ(mkdir("/tmp/famfs_flush_dir", 0755), 0);
+	ASSERT_EQ(mkdir("/tmp/famfs_flush_dir/sub", 0755), 0);
+	fd = open("/tmp/famfs_flush_dir/f0", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	ASSERT_GT(fd, 0);
+	ASSERT_EQ(write(fd, buf, sizeof(buf)), (ssize_t)sizeof(buf));
+	close(fd);
+	fd = open("/tmp/famfs_flush_dir/sub/f1", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	ASSERT_GT(fd, 0);
+	ASSERT_EQ(write(fd, buf, sizeof(buf)), (ssize_t)sizeof(buf));
+	close(fd);
+
+	fl = famfs_flush_start(2, 0);
+	ASSERT_NE(fl, nullptr);
+	ASSERT_EQ(famfs_flush_path(fl, "/tmp/famfs_flush_dir/f0", 0, 0, 0), 0);
+	ASSERT_EQ(famfs_flush_path(fl, "/tmp/famfs_flush_dir/f0", 1024, 1024, 0), 0);
+	/* A range past EOF is trimmed to nothing, not an error */
+	ASSERT_EQ(famfs_flush_path(fl, "/tmp/famfs_flush_dir/f0", 1048576, 0, 0), 0);
+	ASSERT_EQ(famfs_flush_path(fl, "/tmp/famfs_flush_dir", 0, 0, 0), 2);
+	ASSERT_EQ(famfs_flush_path(fl, "/tmp/famfs_flush_dir/nope", 0, 0, 0), 3);
+	ASSERT_EQ(famfs_flush_path(fl, "/tmp/famfs_flush_dir", 0, 0, 1), 0);
+	ASSERT_EQ(famfs_flush_finish(fl), 0u);
+
+	ASSERT_EQ(famfs_flush_file("/tmp/famfs_flush_dir/sub/f1", 0), 0);
+	unlink("/tmp/famfs_flush_dir/sub/f1");
+	rmdir("/tmp/famfs_flush_dir/sub");
+	unlink("/tmp/famfs_flush_dir/f0");
+	rmdir("/tmp/famfs_flush_dir");
+}
+
+TEST(famfs, famfs_mmap_opts)
+{
+	size_t size = 6 * 1048576 + 4096;
+	struct famfs_mmap_opts opts;
+	size_t sz;
+	char *addr;
+	int fd;
+
+	famfs_mmap_opts_init(&opts);
+	ASSERT_EQ(opts.align, (size_t)FAMFS_MMAP_ALIGN_AUTO);
+	ASSERT_EQ(famfs_mmap_opts_parse(&opts, "align=1g,populate,advice=hugepage,node=0"), 0);
+	ASSERT_EQ(opts.align, FAMFS_PUD_SIZE);
+	ASSERT_EQ(opts.populate, 1);
+	ASSERT_EQ(opts.advice, MADV_HUGEPAGE);
+	ASSERT_EQ(opts.numa_node, 0);
+	ASSERT_EQ(famfs_mmap_opts_parse(&opts, "align=none"), 0);
+	ASSERT_EQ(opts.align, (size_t)FAMFS_MMAP_ALIGN_NONE);
+	ASSERT_NE(famfs_mmap_opts_parse(&opts, "align=3m"), 0);
+	ASSERT_NE(famfs_mmap_opts_parse(&opts, "advice=bogus"), 0);
+	ASSERT_NE(famfs_mmap_opts_parse(&opts, "node=-1"), 0);
+	ASSERT_NE(famfs_mmap_opts_parse(&opts, "populate=1"), 0);
+	ASSERT_NE(famfs_mmap_opts_parse(&opts, "bogus"), 0);
+
+	fd = open("/tmp/famfs_mmap_opts", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	ASSERT_GT(fd, 0);
+	ASSERT_EQ(ftruncate(fd, size), 0);
+
+	/* Auto: a 2MiB+ file that isn't famfs is aligned by its size */
+	addr = (char *)famfs_mmap_fd(fd, size, 0, NULL);
+	ASSERT_NE(addr, nullptr);
+	ASSERT_EQ((uintptr_t)addr % FAMFS_PMD_SIZE, 0u);
+	addr[size - 1] = 1; /* The whole file is mapped */
+	munmap(addr, size);
+
+	famfs_mmap_opts_init(&opts);
+	ASSERT_EQ(famfs_mmap_opts_parse(&opts, "align=2m,populate,advice=sequential"), 0);
+	addr = (char *)famfs_mmap_fd(fd, size, 1, &opts);
+	ASSERT_NE(addr, nullptr);
+	ASSERT_EQ(opts.align_out, FAMFS_PMD_SIZE);
+	ASSERT_EQ((uintptr_t)addr % FAMFS_PMD_SIZE, 0u);
+	ASSERT_GE(opts.pagesize, 4096u);
+	ASSERT_EQ(famfs_mmap_pagesize(addr), opts.pagesize);
+	ASSERT_EQ(addr[size - 1], 1);
+	munmap(addr, size);
+	ASSERT_EQ(famfs_mmap_pagesize(addr), 0u);
+
+	/* Too small for huge pages */
+	ASSERT_EQ(ftruncate(fd, 4096), 0);
+	famfs_mmap_opts_init(&opts);
+	addr = (char *)famfs_mmap_file("/tmp/famfs_mmap_opts", 1, &sz, &opts);
+	ASSERT_NE(addr, nullptr);
+	ASSERT_EQ(sz, 4096u);
+	ASSERT_EQ(opts.align_out, (size_t)FAMFS_MMAP_ALIGN_NONE);
+	munmap(addr, sz);
+	close(fd);
+	unlink("/tmp/famfs_mmap_opts");
+}
+
+TEST(famfs, famfs_check)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_locked_log ll;
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	u64 stats[3];
+	u64 nfiles;
+	int threads;
+	int rc;
+	int i;
+
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+
+	/* A few levels of directories, with files at each level */
+	for (i = 0; i < 60; i++) {
+		char path[64];
+		int fd;
+
+		if (i < 10)
+			sprintf(path, "/tmp/famfs/d%d", i);
+		else if (i < 30)
+			sprintf(path, "/tmp/famfs/d%d/e%d", i % 10, i);
+		else
+			sprintf(path, "/tmp/famfs/d%d/e%d/f%d", i % 10, 10 + (i % 20), i);
+		rc = __famfs_mkdir(&ll, path, 0755, 0, 0, 0);
+		ASSERT_EQ(rc, 0);
+		strcat(path, "/file");
+		fd = __famfs_mkfile(&ll, path, 0644, 0, 0, 4096, 0);
+		ASSERT_GT(fd, 0);
+		ASSERT_EQ(ftruncate(fd, 4096), 0); /* The kernel would, when it got the map */
+		close(fd);
+	}
+	famfs_release_locked_log(&ll);
+
+	/* The count doesn't depend on the number of threads; .meta isn't logged */
+	rc = __famfs_check("/tmp/famfs", NULL, 1, stats, 0);
+	ASSERT_EQ(rc, 0);
+	nfiles = stats[0];
+	ASSERT_GE(nfiles, 60u);
+	ASSERT_EQ(stats[1], 61u);
+	for (threads = 1; threads <= 8; threads *= 2) {
+		rc = __famfs_check("/tmp/famfs", logp, threads, stats, 0);
+		ASSERT_EQ(rc, 0);
+		ASSERT_EQ(stats[0], nfiles);
+		ASSERT_EQ(stats[1], 61u);
+		ASSERT_EQ(stats[2], 0u);
+	}
+
+	/* A file that isn't logged, one that's the wrong size, and one that's missing */
+	close(open("/tmp/famfs/d3/stray", O_RDWR | O_CREAT, 0644));
+	ASSERT_EQ(truncate("/tmp/famfs/d4/e14/file", 8192), 0);
+	ASSERT_EQ(unlink("/tmp/famfs/d5/e25/f35/file"), 0);
+	rc = __famfs_check("/tmp/famfs", NULL, 4, stats, 0);
+	ASSERT_EQ(rc, 0);
+	rc = __famfs_check("/tmp/famfs", logp, 4, stats, 2);
+	ASSERT_EQ(rc, 1);
+	ASSERT_EQ(stats[0], nfiles);
+	ASSERT_EQ(stats[2], 3u);
+
+	rc = __famfs_check("/tmp/nonexistent-dir", NULL, 4, stats, 0);
+	ASSERT_LT(rc, 0);
+	mock_kmod = 0;
+}
+
+#ifdef FAMFS_STATS
+TEST(famfs, famfs_stats)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_locked_log ll;
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	extern int mock_flush;
+	extern int mock_kmod;
+	int mock_flush_save = mock_flush;
+	char buf[4096] = { 0 };
+	char line[8192];
+	FILE *fp;
+	int rc;
+	int i;
+
+	mock_kmod = 1;
+	mock_flush = 0;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+
+	famfs_stats_reset();
+	ASSERT_EQ(famfs_stats.log_commit.count, 0u);
+
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 10; i++) {
+		char filename[64];
+		int fd;
+
+		sprintf(filename, "/tmp/famfs/stats%d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	famfs_release_locked_log(&ll);
+	ASSERT_GE(famfs_stats.log_lock.count, 1u);
+	ASSERT_EQ(famfs_stats.log_commit_entries, 10u);
+	ASSERT_EQ(famfs_stats.log_commit.count, 10u);
+	ASSERT_GE(famfs_stats.log_commit.ns, famfs_stats.log_commit.max_ns);
+	ASSERT_GE(famfs_stats.bitmap_build.count, 1u);
+	ASSERT_EQ(famfs_stats.alloc.count, 10u);
+	ASSERT_GE(famfs_stats.alloc_search_runs, 10u);
+	ASSERT_EQ(famfs_stats.alloc_failures, 0u);
+
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(famfs_stats.logplay.count, 1u);
+	ASSERT_EQ(famfs_stats.logplay_entries, 10u);
+
+	famfs_stats.flush_bytes = 0;
+	flush_processor_cache(buf, sizeof(buf));
+	ASSERT_EQ(famfs_stats.flush_bytes, sizeof(buf));
+	mock_flush = 1;
+	flush_processor_cache(buf, sizeof(buf));
+	ASSERT_EQ(famfs_stats.flush_bytes, sizeof(buf));
+
+	/* One line of JSON, with every counter */
+	fp = tmpfile();
+	ASSERT_NE(fp, nullptr);
+	famfs_stats_print(fp, FAMFS_STATS_JSON);
+	rewind(fp);
+	ASSERT_NE(fgets(line, sizeof(line), fp), nullptr);
+	ASSERT_EQ(line[0], '{');
+	ASSERT_NE(strstr(line, "\"log_commit_entries\":10,"), nullptr);
+	ASSERT_NE(strstr(line, "\"logplay\":{\"count\":1,"), nullptr);
+	ASSERT_NE(strstr(line, "\"pcq_crc_errors\":0}\n"), nullptr);
+	ASSERT_EQ(fgets(line, sizeof(line), fp), nullptr);
+	fclose(fp);
+
+	/* Prometheus text: each sample is preceded by its HELP and TYPE */
+	fp = tmpfile();
+	ASSERT_NE(fp, nullptr);
+	famfs_stats_print(fp, FAMFS_STATS_PROM);
+	rewind(fp);
+	i = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#') {
+			ASSERT_TRUE(!strncmp(line, "# HELP famfs_", 13) ||
+				    !strncmp(line, "# TYPE famfs_", 13));
+			continue;
+		}
+		ASSERT_EQ(strncmp(line, "famfs_", 6), 0);
+		i++;
+	}
+	ASSERT_EQ(i, 5 * 3 + 11); /* 5 timers, 11 counters */
+	fclose(fp);
+
+	ASSERT_EQ(famfs_stats_format_from_name("json"), FAMFS_STATS_JSON);
+	ASSERT_EQ(famfs_stats_format_from_name("prometheus"), FAMFS_STATS_PROM);
+	ASSERT_EQ(famfs_stats_format_from_name("xml"), -1);
+
+	famfs_stats_reset();
+	ASSERT_EQ(famfs_stats.logplay_entries, 0u);
+	mock_flush = mock_flush_save;
+	mock_kmod = 0;
+}
+#endif
+
+TEST(famfs, famfs_fsck_parallel)
+{
+	u64 device_size = 8ULL * 1024 * 1024 * 1024;
+	const struct famfs_log_entry *le;
+	struct famfs_log_entry e, first;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log_iter it;
+	struct famfs_log_rec *lr;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	u8 rec[FAMFS_LOG_REC_MAX];
+	u64 last = 0, parent;
+	int rc, len;
+	int i;
+
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+
+	/* Enough entries for 4 ranges, with files in each */
+	for (i = 0; i < 1200; i++) {
+		char path[64];
+		int fd;
+
+		if (i % 6) {
+			sprintf(path, "/tmp/famfs/dir%04d", i);
+			rc = __famfs_mkdir(&ll, path, 0755, 0, 0, 0);
+			ASSERT_EQ(rc, 0);
+			continue;
+		}
+		sprintf(path, "/tmp/famfs/file%04d", i);
+		fd = __famfs_mkfile(&ll, path, 0644, 0, 0, 4096, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	famfs_release_locked_log(&ll);
+
+	rc = famfs_fsck_scan(sb, logp, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_fsck_scan(sb, logp, 0, 4, 2);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_fsck_scan(sb, logp, 0, 64, 0);
+	ASSERT_EQ(rc, 0);
+
+	/* Point the last file at the first file's space, and fix up its crc: a collision
+	 * between the first range and the last, which only the merge sees
+	 */
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_NOPATHS);
+	for (i = 0; (le = famfs_log_iter_next(&it)) != NULL; ) {
+		if (le->famfs_log_entry_type != FAMFS_LOG_FILE)
+			continue;
+		if (i++ == 0)
+			memcpy(&first, le, sizeof(first));
+		last = it.cur;
+	}
+	ASSERT_EQ(it.err, 0);
+	ASSERT_EQ(i, 200);
+
+	lr = (struct famfs_log_rec *)&logp->famfs_log_data[last];
+	rc = famfs_log_rec_decode((u8 *)lr, lr->lr_len, &e, &parent, 1,
+				  famfs_log_crc_alg(logp));
+	ASSERT_EQ(rc, 0);
+	e.famfs_fc.famfs_ext_list[0] = first.famfs_fc.famfs_ext_list[0];
+	len = famfs_log_rec_encode(rec, &e, lr->lr_prev, parent,
+				   (const char *)e.famfs_fc.famfs_relpath, famfs_log_crc_alg(logp));
+	ASSERT_EQ(len, lr->lr_len);
+	memcpy(lr, rec, len);
+
+	rc = famfs_fsck_scan(sb, logp, 0, 1, 0);
+	ASSERT_EQ(rc, 1); /* one 2MiB allocation unit */
+	rc = famfs_fsck_scan(sb, logp, 0, 4, 0);
+	ASSERT_EQ(rc, 1);
+
+	/* A bad crc in the middle of the log is caught (by whichever range has it) */
+	memcpy(lr, rec, len);
+	logp->famfs_log_data[logp->famfs_log_next_offset / 2]++;
+	rc = famfs_fsck_scan(sb, logp, 0, 4, 0);
+	ASSERT_GT(rc, 0);
+	rc = famfs_fsck_scan(sb, logp, 0, 1, 0);
+	ASSERT_GT(rc, 0);
+	mock_kmod = 0;
+}
+
+struct ctx_writer_args {
+	struct famfs_ctx *ctx;
+	int               id;
+	int               nerrors;
+};
+
+static void *
+ctx_writer_thread(void *arg)
+{
+	struct ctx_writer_args *a = (struct ctx_writer_args *)arg;
+	char filename[64];
+	int fd;
+	int i;
+
+	for (i = 0; i < 25; i++) {
+		sprintf(filename, "/tmp/famfs/ctx%d_%02d", a->id, i);
+		fd = famfs_ctx_mkfile(a->ctx, filename, 0644, 0, 0, 2 * 1048576);
+		if (fd <= 0)
+			a->nerrors++;
+		else
+			close(fd);
+	}
+	return NULL;
+}
+
+TEST(famfs, famfs_ctx)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	size_t size = 1048576;
+	struct ctx_writer_args args[4];
+	const struct famfs_log_entry *le;
+	struct famfs_superblock *sb;
+	struct famfs_locked_log ll;
+	struct famfs_log_iter it;
+	struct famfs_log *logp;
+	struct famfs_ctx *ctx;
+	extern int mock_role;
+	extern int mock_kmod;
+	pthread_t tid[4];
+	char filename[64];
+	u64 nfiles, ndirs;
+	char *srcbuf;
+	char *destp;
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+
+	ctx = famfs_ctx_open("/tmp/famfs", FAMFS_ALLOC_FIRST_FIT, 0);
+	ASSERT_NE(ctx, nullptr);
+	ASSERT_EQ(famfs_ctx_open("/tmp/nonexistent_famfs", FAMFS_ALLOC_FIRST_FIT, 0), nullptr);
+
+	/* Threads sharing the context, while another writer logs between their calls */
+	for (i = 0; i < 4; i++) {
+		args[i].ctx = ctx;
+		args[i].id = i;
+		args[i].nerrors = 0;
+		rc = pthread_create(&tid[i], NULL, ctx_writer_thread, &args[i]);
+		ASSERT_EQ(rc, 0);
+	}
+	for (i = 0; i < 10; i++) {
+		rc = famfs_init_locked_log(&ll, "/tmp/famfs", 0);
+		ASSERT_EQ(rc, 0);
+		sprintf(filename, "/tmp/famfs/other%02d", i);
+		fd = __famfs_mkfile(&ll, filename, 0644, 0, 0, 2 * 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+		famfs_release_locked_log(&ll);
+	}
+	for (i = 0; i < 4; i++) {
+		pthread_join(tid[i], NULL);
+		ASSERT_EQ(args[i].nerrors, 0);
+	}
+
+	/* And deterministically: an allocation between two of the context's calls */
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 0);
+	ASSERT_EQ(rc, 0);
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/other10", 0644, 0, 0, 2 * 1048576, 0);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	famfs_release_locked_log(&ll);
+	fd = famfs_ctx_mkfile(ctx, "/tmp/famfs/ctx_after", 0644, 0, 0, 2 * 1048576);
+	ASSERT_GT(fd, 0);
+	close(fd);
+
+	/* The context's cached bitmap saw the other writer's allocations */
+	rc = famfs_fsck_scan(sb, logp, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_ctx_mkfile(ctx, "/tmp/famfs/empty", 0644, 0, 0, 0);
+	ASSERT_EQ(rc, -EINVAL);
+
+	rc = famfs_ctx_mkdir(ctx, "/tmp/famfs/ctxdir", 0755, 0, 0);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_ctx_mkdir(ctx, "/tmp/famfs/ctxdir", 0755, 0, 0);
+	ASSERT_NE(rc, 0);
+
+	srcbuf = (char *)malloc(size);
+	ASSERT_NE(srcbuf, nullptr);
+	randomize_buffer(srcbuf, size, 7);
+	fd = open("/tmp/famfs_ctx_src", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	ASSERT_GT(fd, 0);
+	ASSERT_EQ(write(fd, srcbuf, size), (ssize_t)size);
+	close(fd);
+	rc = famfs_ctx_cp(ctx, "/tmp/famfs_ctx_src", "/tmp/famfs/ctxdir/copy", 0, 0, 0);
+	ASSERT_EQ(rc, 0);
+	destp = (char *)famfs_mmap_whole_file("/tmp/famfs/ctxdir/copy", 1, NULL);
+	ASSERT_NE(destp, nullptr);
+	ASSERT_EQ(memcmp(destp, srcbuf, size), 0);
+	munmap(destp, size);
+	unlink("/tmp/famfs_ctx_src");
+	free(srcbuf);
+
+	/* A compaction by another writer drops the caches, which are rebuilt */
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 0);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_log_compact(&ll, 0);
+	ASSERT_GE(rc, 0);
+	famfs_release_locked_log(&ll);
+	fd = famfs_ctx_mkfile(ctx, "/tmp/famfs/after_compact", 0644, 0, 0, 2 * 1048576);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	rc = famfs_fsck_scan(sb, logp, 0, 1, 0);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_ctx_logplay(ctx, 1);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_ctx_close(ctx);
+	ASSERT_EQ(rc, 0);
+
+	nfiles = ndirs = 0;
+	famfs_log_iter_init(&it, logp, NULL, FAMFS_LOG_ITER_NOPATHS);
+	while ((le = famfs_log_iter_next(&it)) != NULL) {
+		if (le->famfs_log_entry_type == FAMFS_LOG_FILE)
+			nfiles++;
+		else if (le->famfs_log_entry_type == FAMFS_LOG_MKDIR)
+			ndirs++;
+	}
+	ASSERT_EQ(it.err, 0);
+	ASSERT_EQ(nfiles, 4u * 25 + 11 + 3);
+	ASSERT_EQ(ndirs, 1u);
+
+	/* On a client, a context can only play the log */
+	mock_role = FAMFS_CLIENT;
+	ctx = famfs_ctx_open("/tmp/famfs", FAMFS_ALLOC_FIRST_FIT, 0);
+	ASSERT_NE(ctx, nullptr);
+	rc = famfs_ctx_mkfile(ctx, "/tmp/famfs/client", 0644, 0, 0, 4096);
+	ASSERT_EQ(rc, -EROFS);
+	rc = famfs_ctx_mkdir(ctx, "/tmp/famfs/clientdir", 0755, 0, 0);
+	ASSERT_EQ(rc, -EROFS);
+	rc = famfs_ctx_logplay(ctx, 1);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_ctx_close(ctx);
+	ASSERT_EQ(rc, 0);
+	mock_role = 0;
+	mock_kmod = 0;
+}
+
+/*
+ * pcq tests: the queues are created in a mock famfs at /tmp/famfs
+ */
+static void
+pcq_test_create(const char *name, u64 nbuckets, u64 bucket_size, u64 nlanes)
+{
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char fname[PATH_MAX];
+	int rc;
+
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", 1024 * 1024 * 1024, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	snprintf(fname, sizeof(fname), "%s", name);
+	rc = pcq_create(fname, nbuckets, bucket_size, nlanes, MU_CRC_CRC32C, 0);
+	ASSERT_EQ(rc, 0);
+}
+
+static u8 *
+pcq_test_bucket(struct pcq_handle *pcqh, u64 index)
+{
+	return (u8 *)pcqh->pcq + pcqh->pcq->bucket_array_offset +
+		index * pcqh->pcq->bucket_size;
+}
+
+TEST(famfs, pcq_bad_msg)
+{
+	struct pcq_handle *prod, *cons;
+	struct pcq_thread_arg ta;
+	const void *buf;
+	u64 *seqp;
+	unsigned long *crcp;
+	u8 *entries, *out;
+	u64 nput, nget, n;
+	u8 *bucket;
+
+	pcq_test_create("/tmp/famfs/pcqbad", 16, 64, 1);
+	prod = pcq_producer_open("/tmp/famfs/pcqbad", 0);
+	ASSERT_NE(prod, nullptr);
+	cons = pcq_consumer_open("/tmp/famfs/pcqbad", 0);
+	ASSERT_NE(cons, nullptr);
+	entries = (u8 *)pcq_alloc_entries(prod, 16);
+	out = (u8 *)pcq_alloc_entries(cons, 16);
+	ASSERT_NE(entries, nullptr);
+	ASSERT_NE(out, nullptr);
+
+	/* A bucket that stays bad ends the batch before it... */
+	ASSERT_EQ(pcq_put_batch(prod, entries, 4, &nput, NULL), PCQ_PUT_GOOD);
+	ASSERT_EQ(nput, 4u);
+	bucket = pcq_test_bucket(prod, 2); /* The consumer maps it read-only */
+	bucket[0] ^= 0xff;
+	ASSERT_EQ(pcq_get_batch(cons, out, 4, &nget, NULL), PCQ_GET_GOOD);
+	ASSERT_EQ(nget, 2u);
+
+	/* ...and is then reported, not consumed */
+	ASSERT_EQ(pcq_get_batch(cons, out, 4, &nget, NULL), PCQ_GET_BAD_MSG);
+	ASSERT_EQ(nget, 0u);
+	memset(&ta, 0, sizeof(ta));
+	ASSERT_EQ(pcq_peek(cons, 4, &buf, &n, &ta), PCQ_GET_BAD_MSG);
+	ASSERT_EQ(n, 0u);
+	ASSERT_EQ(ta.nerrors, 1u);
+	ASSERT_EQ(cons->pcqc->consumer_index, 2u);
+	ASSERT_EQ(cons->pcqc->next_seq, 2u);
+
+	/* Once it's good again, the rest come through in sequence */
+	bucket[0] ^= 0xff;
+	ASSERT_EQ(pcq_get_batch(cons, out, 4, &nget, NULL), PCQ_GET_GOOD);
+	ASSERT_EQ(nget, 2u);
+	ASSERT_EQ(pcq_entry_seq(cons, out), 2u);
+
+	/* A good crc on the wrong sequence number is bad too */
+	ASSERT_EQ(pcq_put_batch(prod, entries, 1, &nput, NULL), PCQ_PUT_GOOD);
+	bucket = pcq_test_bucket(prod, 4);
+	seqp = (u64 *)(bucket + pcq_payload_size(cons->pcq));
+	crcp = (unsigned long *)(bucket + pcq_crc_offset(cons->pcq));
+	*seqp = 99;
+	*crcp = mu_crc(pcq_crc_alg(cons->pcq), 0, bucket, pcq_payload_size(cons->pcq) + 8);
+	ASSERT_EQ(pcq_get_batch(cons, out, 4, &nget, NULL), PCQ_GET_BAD_MSG);
+	ASSERT_EQ(nget, 0u);
+	ASSERT_EQ(cons->pcqc->next_seq, 4u);
+
+	/* Without a thread arg, a full queue is just a status */
+	*seqp = 4;
+	*crcp = mu_crc(pcq_crc_alg(cons->pcq), 0, bucket, pcq_payload_size(cons->pcq) + 8);
+	ASSERT_EQ(pcq_put_batch(prod, entries, 16, &nput, NULL), PCQ_PUT_FULL_NOWAIT);
+	ASSERT_EQ(nput, 14u);
+	ASSERT_EQ(pcq_put_batch(prod, entries, 1, &nput, NULL), PCQ_PUT_FULL_NOWAIT);
+	ASSERT_EQ(nput, 0u);
+	ASSERT_EQ(pcq_get_batch(cons, out, 16, &nget, NULL), PCQ_GET_GOOD);
+	ASSERT_EQ(nget, 15u); /* Across the end of the ring */
+	ASSERT_EQ(pcq_entry_seq(cons, out), 4u);
+
+	free(entries);
+	free(out);
+	pcq_close(prod);
+	pcq_close(cons);
+}
+
+/* Stamp (and check) entry i of a batch with @val, in the payload */
+static void
+pcq_test_stamp(struct pcq_handle *pcqh, u8 *entries, u64 i, u64 val)
+{
+	memcpy(entries + i * pcqh->pcq->bucket_size, &val, sizeof(val));
+}
+
+static u64
+pcq_test_stamped(struct pcq_handle *pcqh, const u8 *entries, u64 i)
+{
+	u64 val;
+
+	memcpy(&val, entries + i * pcqh->pcq->bucket_size, sizeof(val));
+	return val;
+}
+
+TEST(famfs, pcq_batch)
+{
+	struct pcq_handle *prod, *cons;
+	struct pcq_thread_arg pa, ca;
+	u64 nput, nget, i;
+	u8 *entries, *out;
+
+	pcq_test_create("/tmp/famfs/pcqbatch", 16, 64, 1);
+	prod = pcq_producer_open("/tmp/famfs/pcqbatch", 0);
+	ASSERT_NE(prod, nullptr);
+	cons = pcq_consumer_open("/tmp/famfs/pcqbatch", 0);
+	ASSERT_NE(cons, nullptr);
+	entries = (u8 *)pcq_alloc_entries(prod, 16);
+	out = (u8 *)pcq_alloc_entries(cons, 16);
+	memset(&pa, 0, sizeof(pa));
+	memset(&ca, 0, sizeof(ca));
+
+	/* One index update per batch */
+	for (i = 0; i < 10; i++)
+		pcq_test_stamp(prod, entries, i, i);
+	ASSERT_EQ(pcq_put_batch(prod, entries, 10, &nput, &pa), PCQ_PUT_GOOD);
+	ASSERT_EQ(nput, 10u);
+	ASSERT_EQ(pa.nsent, 10u);
+	ASSERT_EQ(pa.nbatches, 1u);
+	ASSERT_EQ(pcq_get_batch(cons, out, 16, &nget, &ca), PCQ_GET_GOOD);
+	ASSERT_EQ(nget, 10u);
+	ASSERT_EQ(ca.nreceived, 10u);
+	ASSERT_EQ(ca.nbatches, 1u);
+	for (i = 0; i < nget; i++) {
+		ASSERT_EQ(pcq_entry_seq(cons, out + i * cons->pcq->bucket_size), i);
+		ASSERT_EQ(pcq_test_stamped(cons, out, i), i);
+	}
+
+	/* A batch that wraps around the end of the ring is two index updates */
+	for (i = 0; i < 12; i++)
+		pcq_test_stamp(prod, entries, i, 10 + i);
+	ASSERT_EQ(pcq_put_batch(prod, entries, 12, &nput, &pa), PCQ_PUT_GOOD);
+	ASSERT_EQ(nput, 12u);
+	ASSERT_EQ(pa.nsent, 22u);
+	ASSERT_EQ(pa.nbatches, 3u);
+	ASSERT_EQ(prod->pcq->producer_index, 6u);
+	ASSERT_EQ(pcq_get_batch(cons, out, 16, &nget, &ca), PCQ_GET_GOOD);
+	ASSERT_EQ(nget, 12u);
+	ASSERT_EQ(ca.nreceived, 22u);
+	ASSERT_EQ(ca.nbatches, 3u);
+	ASSERT_EQ(cons->pcqc->consumer_index, 6u);
+	for (i = 0; i < nget; i++) {
+		/* The sequence carries on across batches, and across the wrap */
+		ASSERT_EQ(pcq_entry_seq(cons, out + i * cons->pcq->bucket_size), 10 + i);
+		ASSERT_EQ(pcq_test_stamped(cons, out, i), 10 + i);
+	}
+
+	/* A nearly full queue takes what fits (one bucket is always left empty) */
+	ASSERT_EQ(pcq_put_batch(prod, entries, 13, &nput, &pa), PCQ_PUT_GOOD);
+	ASSERT_EQ(nput, 13u);
+	for (i = 0; i < 5; i++)
+		pcq_test_stamp(prod, entries, i, 35 + i);
+	ASSERT_EQ(pcq_put_batch(prod, entries, 5, &nput, &pa), PCQ_PUT_FULL_NOWAIT);
+	ASSERT_EQ(nput, 2u);
+	ASSERT_EQ(pa.nsent, 37u);
+	ASSERT_EQ(pa.nfull, 1u);
+
+	/* A get of fewer than are queued leaves the rest */
+	ASSERT_EQ(pcq_get_batch(cons, out, 4, &nget, &ca), PCQ_GET_GOOD);
+	ASSERT_EQ(nget, 4u);
+	ASSERT_EQ(pcq_entry_seq(cons, out), 22u);
+	ASSERT_EQ(pcq_get_batch(cons, out, 16, &nget, &ca), PCQ_GET_GOOD);
+	ASSERT_EQ(nget, 11u);
+	ASSERT_EQ(pcq_entry_seq(cons, out), 26u);
+	ASSERT_EQ(pcq_entry_seq(cons, out + 10 * cons->pcq->bucket_size), 36u);
+	ASSERT_EQ(pcq_test_stamped(cons, out, 10), 36u);
+	ASSERT_EQ(ca.nreceived, 37u);
+
+	/* Empty */
+	ASSERT_EQ(pcq_get_batch(cons, out, 16, &nget, &ca), PCQ_GET_EMPTY);
+	ASSERT_EQ(nget, 0u);
+	ASSERT_EQ(ca.nempty, 1u);
+
+	free(entries);
+	free(out);
+	pcq_close(prod);
+	pcq_close(cons);
+}
+
+TEST(famfs, pcq_zerocopy)
+{
+	struct pcq_handle *prod, *cons;
+	u64 nreserved, navail, i;
+	struct pcq_thread_arg ta;
+	const void *cbuf;
+	void *buf;
+
+	pcq_test_create("/tmp/famfs/pcqzc", 16, 64, 1);
+	prod = pcq_producer_open("/tmp/famfs/pcqzc", 0);
+	ASSERT_NE(prod, nullptr);
+	cons = pcq_consumer_open("/tmp/famfs/pcqzc", 0);
+	ASSERT_NE(cons, nullptr);
+	memset(&ta, 0, sizeof(ta));
+
+	/* Fill and read the buckets in place */
+	ASSERT_EQ(pcq_reserve(prod, 10, &buf, &nreserved, &ta), PCQ_PUT_GOOD);
+	ASSERT_EQ(nreserved, 10u);
+	ASSERT_EQ(buf, pcq_test_bucket(prod, 0));
+	for (i = 0; i < nreserved; i++)
+		pcq_test_stamp(prod, (u8 *)buf, i, 100 + i);
+	pcq_commit(prod, nreserved, &ta);
+	ASSERT_EQ(prod->nreserved, 0u);
+	ASSERT_EQ(prod->pcq->producer_index, 10u);
+
+	ASSERT_EQ(pcq_peek(cons, 16, &cbuf, &navail, &ta), PCQ_GET_GOOD);
+	ASSERT_EQ(navail, 10u);
+	ASSERT_EQ(cons->npeeked, 10u);
+	for (i = 0; i < navail; i++)
+		ASSERT_EQ(pcq_test_stamped(cons, (const u8 *)cbuf, i), 100 + i);
+	pcq_release(cons, navail, &ta);
+	ASSERT_EQ(cons->npeeked, 0u);
+	ASSERT_EQ(cons->pcqc->consumer_index, 10u);
+
+	/* A reservation across the end of the ring is clamped to the contiguous run */
+	ASSERT_EQ(pcq_reserve(prod, 12, &buf, &nreserved, &ta), PCQ_PUT_GOOD);
+	ASSERT_EQ(nreserved, 6u);
+	ASSERT_EQ(buf, pcq_test_bucket(prod, 10));
+
+	/* Committing fewer than were reserved publishes just those */
+	pcq_commit(prod, 4, &ta);
+	ASSERT_EQ(prod->pcq->producer_index, 14u);
+	ASSERT_EQ(prod->pcq->next_seq, 14u);
+	ASSERT_EQ(pcq_reserve(prod, 12, &buf, &nreserved, &ta), PCQ_PUT_GOOD);
+	ASSERT_EQ(nreserved, 2u);
+	pcq_commit(prod, nreserved, &ta);
+	ASSERT_EQ(prod->pcq->producer_index, 0u);
+
+	/* ...and committing none abandons the reservation */
+	ASSERT_EQ(pcq_reserve(prod, 12, &buf, &nreserved, &ta), PCQ_PUT_GOOD);
+	ASSERT_EQ(nreserved, 9u); /* Up to the consumer, less the empty bucket */
+	ASSERT_EQ(buf, pcq_test_bucket(prod, 0));
+	pcq_commit(prod, 0, &ta);
+	ASSERT_EQ(prod->nreserved, 0u);
+	ASSERT_EQ(prod->pcq->producer_index, 0u);
+
+	/* A partial release hands the rest out again, and checks them again */
+	ASSERT_EQ(pcq_peek(cons, 16, &cbuf, &navail, &ta), PCQ_GET_GOOD);
+	ASSERT_EQ(navail, 6u);
+	ASSERT_EQ(pcq_entry_seq(cons, cbuf), 10u);
+	ASSERT_EQ(cons->pcqc->next_seq, 16u);
+	pcq_release(cons, 2, &ta);
+	ASSERT_EQ(cons->pcqc->consumer_index, 12u);
+	ASSERT_EQ(cons->pcqc->next_seq, 12u);
+	ASSERT_EQ(pcq_peek(cons, 16, &cbuf, &navail, &ta), PCQ_GET_GOOD);
+	ASSERT_EQ(navail, 4u);
+	ASSERT_EQ(cbuf, pcq_test_bucket(cons, 12));
+	ASSERT_EQ(pcq_entry_seq(cons, cbuf), 12u);
+	ASSERT_EQ(cons->pcqc->next_seq, 16u);
+
+	/* Releasing none keeps every peeked bucket */
+	pcq_release(cons, 0, &ta);
+	ASSERT_EQ(cons->pcqc->consumer_index, 12u);
+	ASSERT_EQ(cons->pcqc->next_seq, 12u);
+	ASSERT_EQ(pcq_peek(cons, 16, &cbuf, &navail, &ta), PCQ_GET_GOOD);
+	ASSERT_EQ(navail, 4u);
+
+#ifndef NDEBUG
+	/* Committing (or releasing) more than was handed out is a bug in the caller */
+	ASSERT_DEATH(pcq_release(cons, navail + 1, &ta), "npeeked");
+	pcq_release(cons, navail, &ta);
+	ASSERT_DEATH(pcq_release(cons, 1, &ta), "npeeked");
+
+	ASSERT_EQ(pcq_reserve(prod, 2, &buf, &nreserved, &ta), PCQ_PUT_GOOD);
+	ASSERT_EQ(nreserved, 2u);
+	ASSERT_DEATH(pcq_commit(prod, 3, &ta), "nreserved");
+	pcq_commit(prod, 2, &ta);
+	ASSERT_DEATH(pcq_commit(prod, 1, &ta), "nreserved");
+#endif
+
+	pcq_close(prod);
+	pcq_close(cons);
+}
+
+TEST(famfs, pcq_lanes)
+{
+	struct pcq_mpmc *pmq, *cmq;
+	struct pcq_thread_arg ta;
+	struct pcq_handle *h;
+	u64 nput, nget, i;
+	u8 *entries, *out;
+	u64 lane_size;
+
+	pcq_test_create("/tmp/famfs/pcqlanes", 64, 64, 4);
+	pmq = pcq_mpmc_open("/tmp/famfs/pcqlanes", PRODUCER, 0);
+	ASSERT_NE(pmq, nullptr);
+	cmq = pcq_mpmc_open("/tmp/famfs/pcqlanes", CONSUMER, 0);
+	ASSERT_NE(cmq, nullptr);
+	ASSERT_EQ(pmq->nlanes, 4u);
+	ASSERT_EQ(cmq->nlanes, 4u);
+	memset(&ta, 0, sizeof(ta));
+
+	/* Lane i's struct pcq is at i * lane_size, and its consumer at
+	 * i * PCQ_CONSUMER_LANE_SIZE; each one looks like a single-lane queue
+	 */
+	lane_size = pmq->lanes[0].pcqh.pcq->lane_size;
+	ASSERT_GE(lane_size, (u64)PCQ_HDR_SIZE + 64 * 64);
+	for (i = 0; i < 4; i++) {
+		struct pcq_handle *ph = &pmq->lanes[i].pcqh;
+
+		ASSERT_EQ((u8 *)ph->pcq, (u8 *)pmq->lanes[0].pcqh.pcq + i * lane_size);
+		ASSERT_EQ((u8 *)ph->pcqc,
+			  (u8 *)pmq->lanes[0].pcqh.pcqc + i * PCQ_CONSUMER_LANE_SIZE);
+		ASSERT_EQ(ph->pcq->pcq_magic, (u64)PCQ_MAGIC_V3);
+		ASSERT_EQ(ph->pcq->nlanes, 4u);
+		ASSERT_EQ(ph->pcq->nbuckets, 64u);
+		ASSERT_EQ(ph->pcqc->pcq_consumer_magic, (u32)PCQ_CONSUMER_MAGIC);
+	}
+
+	/* A message put through one lane's handle turns up in just that lane */
+	h = pcq_lane_open("/tmp/famfs/pcqlanes", PRODUCER, 2, 0);
+	ASSERT_NE(h, nullptr);
+	ASSERT_EQ(h->lane, 2u);
+	entries = (u8 *)pcq_alloc_entries(h, 1);
+	out = (u8 *)pcq_alloc_entries(h, 64);
+	ASSERT_EQ(pcq_put_batch(h, entries, 1, &nput, &ta), PCQ_PUT_GOOD);
+	pcq_close(h);
+	for (i = 0; i < 4; i++) {
+		ASSERT_EQ(pcq_get_batch(&cmq->lanes[i].pcqh, out, 64, &nget, &ta),
+			  (i == 2) ? PCQ_GET_GOOD : PCQ_GET_EMPTY);
+		ASSERT_EQ(nget, (i == 2) ? 1u : 0u);
+	}
+
+	/* There's no lane 4 */
+	ASSERT_EQ(pcq_lane_open("/tmp/famfs/pcqlanes", PRODUCER, 4, 0), nullptr);
+	ASSERT_EQ(pcq_lane_open("/tmp/famfs/pcqlanes", CONSUMER, 4, 0), nullptr);
+	pcq_mpmc_close(pmq);
+	pcq_mpmc_close(cmq);
+
+	/* Queues from before lanes have one, whatever @nlanes says */
+	pcq_test_create("/tmp/famfs/pcqv2", 64, 64, 1);
+	h = pcq_producer_open("/tmp/famfs/pcqv2", 0);
+	ASSERT_NE(h, nullptr);
+	h->pcq->pcq_magic = PCQ_MAGIC_V2;
+	h->pcq->nlanes = 4;
+	pcq_close(h);
+	pmq = pcq_mpmc_open("/tmp/famfs/pcqv2", PRODUCER, 0);
+	ASSERT_NE(pmq, nullptr);
+	ASSERT_EQ(pmq->nlanes, 1u);
+	pcq_mpmc_close(pmq);
+	ASSERT_EQ(pcq_lane_open("/tmp/famfs/pcqv2", PRODUCER, 1, 0), nullptr);
+
+	h = pcq_producer_open("/tmp/famfs/pcqv2", 0);
+	ASSERT_NE(h, nullptr);
+	h->pcq->pcq_magic = PCQ_MAGIC;
+	pcq_close(h);
+	pmq = pcq_mpmc_open("/tmp/famfs/pcqv2", PRODUCER, 0);
+	ASSERT_NE(pmq, nullptr);
+	ASSERT_EQ(pmq->nlanes, 1u);
+	pcq_mpmc_close(pmq);
+	ASSERT_EQ(pcq_lane_open("/tmp/famfs/pcqv2", PRODUCER, 1, 0), nullptr);
+	h = pcq_lane_open("/tmp/famfs/pcqv2", PRODUCER, 0, 0);
+	ASSERT_NE(h, nullptr);
+	pcq_close(h);
+
+	free(entries);
+	free(out);
+}
+
+#define PCQ_TEST_NPROD 4
+#define PCQ_TEST_NMSGS 100 /* Per producer */
+
+struct pcq_test_producer_arg {
+	struct pcq_mpmc *mq;
+	u64 id;
+	int keyed;
+	u64 nerrors;
+};
+
+/* Put PCQ_TEST_NMSGS messages stamped (id << 32 | i), five at a time */
+static void *
+pcq_test_producer(void *arg)
+{
+	struct pcq_test_producer_arg *pa = (struct pcq_test_producer_arg *)arg;
+	struct pcq_handle *pcqh = &pa->mq->lanes[0].pcqh;
+	struct pcq_thread_arg ta;
+	u64 i, j, n, nput;
+	u8 *entries;
+
+	memset(&ta, 0, sizeof(ta));
+	ta.wait = true;
+	entries = (u8 *)pcq_alloc_entries(pcqh, 5);
+	for (i = 0; i < PCQ_TEST_NMSGS; i += 5) {
+		for (j = 0; j < 5; j++)
+			pcq_test_stamp(pcqh, entries, j, (pa->id << 32) | (i + j));
+		for (n = 0; n < 5; n += nput) {
+			if (pcq_mpmc_put_batch(pa->mq, entries + n * pcqh->pcq->bucket_size,
+					       5 - n, (pa->keyed) ? pa->id : PCQ_LANE_ANY,
+					       &nput, &ta) != PCQ_PUT_GOOD) {
+				pa->nerrors++;
+				break;
+			}
+		}
+	}
+	free(entries);
+	return NULL;
+}
+
+TEST(famfs, pcq_mpmc)
+{
+	struct pcq_test_producer_arg args[PCQ_TEST_NPROD];
+	u64 next[PCQ_TEST_NPROD];
+	int lane_of[PCQ_TEST_NPROD];
+	pthread_t tid[PCQ_TEST_NPROD];
+	struct pcq_mpmc *pmq, *cmq;
+	u64 nget, i, total, val;
+	struct pcq_thread_arg ta;
+	int keyed, nused, l, t;
+	u8 *out;
+
+	/* Room for every message in any one lane, so keyed puts never wait */
+	pcq_test_create("/tmp/famfs/pcqmpmc", 512, 64, 4);
+	pmq = pcq_mpmc_open("/tmp/famfs/pcqmpmc", PRODUCER, 0);
+	ASSERT_NE(pmq, nullptr);
+	cmq = pcq_mpmc_open("/tmp/famfs/pcqmpmc", CONSUMER, 0);
+	ASSERT_NE(cmq, nullptr);
+	out = (u8 *)pcq_alloc_entries(&cmq->lanes[0].pcqh, 512);
+	memset(&ta, 0, sizeof(ta));
+
+	for (keyed = 0; keyed < 2; keyed++) {
+		for (t = 0; t < PCQ_TEST_NPROD; t++) {
+			args[t].mq = pmq;
+			args[t].id = t;
+			args[t].keyed = keyed;
+			args[t].nerrors = 0;
+			ASSERT_EQ(pthread_create(&tid[t], NULL, pcq_test_producer, &args[t]), 0);
+		}
+		for (t = 0; t < PCQ_TEST_NPROD; t++) {
+			pthread_join(tid[t], NULL);
+			ASSERT_EQ(args[t].nerrors, 0u);
+			next[t] = 0;
+			lane_of[t] = -1;
+		}
+
+		/* Drain lane by lane: each producer's messages are in order within a lane,
+		 * and with a key they're all in one lane
+		 */
+		total = 0;
+		nused = 0;
+		for (l = 0; l < 4; l++) {
+			u64 nlane = 0;
+
+			while (pcq_get_batch(&cmq->lanes[l].pcqh, out, 512, &nget, &ta) ==
+			       PCQ_GET_GOOD) {
+				for (i = 0; i < nget; i++) {
+					val = pcq_test_stamped(&cmq->lanes[l].pcqh, out, i);
+					t = val >> 32;
+					ASSERT_LT(t, PCQ_TEST_NPROD);
+					if (keyed) {
+						if (lane_of[t] < 0)
+							lane_of[t] = l;
+						ASSERT_EQ(lane_of[t], l);
+						ASSERT_EQ(val & 0xffffffff, next[t]);
+					} else {
+						ASSERT_GE(val & 0xffffffff, next[t]);
+					}
+					next[t] = (val & 0xffffffff) + 1;
+				}
+				nlane += nget;
+			}
+			if (nlane)
+				nused++;
+			total += nlane;
+			if (!keyed)
+				memset(next, 0, sizeof(next)); /* Ordered only within a lane */
+		}
+		ASSERT_EQ(total, (u64)PCQ_TEST_NPROD * PCQ_TEST_NMSGS);
+
+		/* Round-robin puts spread over the lanes */
+		if (!keyed) {
+			ASSERT_GT(nused, 1);
+		}
+		for (t = 0; keyed && t < PCQ_TEST_NPROD; t++)
+			ASSERT_EQ(next[t], (u64)PCQ_TEST_NMSGS);
+	}
+
+	free(out);
+	pcq_mpmc_close(pmq);
+	pcq_mpmc_close(cmq);
+}
+
+static u64
+pcq_test_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+struct pcq_test_consumer_arg {
+	struct pcq_handle *pcqh;
+	struct pcq_thread_arg ta;
+	u64 got_ns; /* When the get returned */
+	u64 nget;
+	int cstat;
+};
+
+static void *
+pcq_test_consumer(void *arg)
+{
+	struct pcq_test_consumer_arg *ca = (struct pcq_test_consumer_arg *)arg;
+	void *out = pcq_alloc_entries(ca->pcqh, 1);
+
+	ca->cstat = pcq_get_batch(ca->pcqh, out, 1, &ca->nget, &ca->ta);
+	ca->got_ns = pcq_test_now_ns();
+	free(out);
+	return NULL;
+}
+
+TEST(famfs, pcq_wait_adaptive)
+{
+	struct pcq_test_consumer_arg ca;
+	struct pcq_handle *prod, *cons;
+	struct pcq_thread_arg pa;
+	struct pcq_doorbell db;
+	u64 nput, put_ns;
+	pthread_t tid;
+	u8 *entries;
+	int i;
+
+	pcq_test_create("/tmp/famfs/pcqwait", 16, 64, 1);
+	prod = pcq_producer_open("/tmp/famfs/pcqwait", 0);
+	ASSERT_NE(prod, nullptr);
+	cons = pcq_consumer_open("/tmp/famfs/pcqwait", 0);
+	ASSERT_NE(cons, nullptr);
+	entries = (u8 *)pcq_alloc_entries(prod, 1);
+	memset(&db, 0, sizeof(db));
+
+	/* A consumer that has backed off into long sleeps is woken early by the doorbell:
+	 * by the time of the put, it's in a sleep of a quarter second or so
+	 */
+	memset(&ca, 0, sizeof(ca));
+	ca.pcqh = cons;
+	ca.ta.wait = true;
+	ca.ta.wait_policy = PCQ_WAIT_ADAPTIVE;
+	ca.ta.wait_spins = 10;
+	ca.ta.wait_max_us = 10 * 1000 * 1000;
+	ca.ta.doorbell = &db;
+	ASSERT_EQ(pthread_create(&tid, NULL, pcq_test_consumer, &ca), 0);
+	for (i = 0; i < 5000 && !__atomic_load_n(&db.nsleepers, __ATOMIC_ACQUIRE); i++)
+		usleep(1000);
+	ASSERT_EQ(db.nsleepers, 1u);
+	usleep(300 * 1000);
+
+	memset(&pa, 0, sizeof(pa));
+	pa.doorbell = &db;
+	put_ns = pcq_test_now_ns();
+	ASSERT_EQ(pcq_put_batch(prod, entries, 1, &nput, &pa), PCQ_PUT_GOOD);
+	pthread_join(tid, NULL);
+	ASSERT_EQ(ca.cstat, PCQ_GET_GOOD);
+	ASSERT_EQ(ca.nget, 1u);
+	ASSERT_LT(ca.got_ns - put_ns, 100 * 1000 * 1000ULL);
+	ASSERT_GT(db.seq, 0u);
+	ASSERT_EQ(db.nsleepers, 0u);
+	ASSERT_EQ(ca.ta.nempty, 1u);
+
+	/* Without a doorbell, the consumer still checks every wait_max_us */
+	memset(&ca, 0, sizeof(ca));
+	ca.pcqh = cons;
+	ca.ta.wait = true;
+	ca.ta.wait_policy = PCQ_WAIT_ADAPTIVE;
+	ca.ta.wait_spins = 10;
+	ca.ta.wait_max_us = 1000;
+	ASSERT_EQ(pthread_create(&tid, NULL, pcq_test_consumer, &ca), 0);
+	usleep(300 * 1000);
+
+	memset(&pa, 0, sizeof(pa));
+	put_ns = pcq_test_now_ns();
+	ASSERT_EQ(pcq_put_batch(prod, entries, 1, &nput, &pa), PCQ_PUT_GOOD);
+	pthread_join(tid, NULL);
+	ASSERT_EQ(ca.cstat, PCQ_GET_GOOD);
+	ASSERT_EQ(ca.nget, 1u);
+	ASSERT_LT(ca.got_ns - put_ns, 50 * 1000 * 1000ULL);
+	ASSERT_GE(ca.ta.empty_ns, 250 * 1000 * 1000ULL);
+
+	free(entries);
+	pcq_close(prod);
+	pcq_close(cons);
 }
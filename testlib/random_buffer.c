@@ -5,62 +5,257 @@
 
 #include <string.h>
 #include <assert.h>
+#include <immintrin.h>
 
 #include "xrand.h"
+#include "random_buffer.h"
 
-void
-randomize_buffer(void *buf, size_t len, unsigned int seed)
+/*
+ * The stream for a seed is the low 32 bits of each xrand64() output, one per 4 bytes
+ * of the buffer; a partial last word takes the leading bytes of its value.
+ *
+ * Big buffers are split into four quarters, each generated from its own (jumped) PRNG
+ * state in one lane of an AVX2 register. Below this many words per quarter the jumps
+ * aren't worth it.
+ */
+#define RB_SIMD_MIN_WORDS 4096
+
+static int
+rb_has_avx2(void)
 {
-    unsigned int *  tmp = (unsigned int *)buf;
-    u_int           last;
-    uint64_t        remain = len;
-    uint64_t        i;
-    struct xrand xr;
+    static int has = -1;
 
-    if (len == 0)
-        return;
+    if (has < 0)
+        has = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return has;
+}
+
+/* Words per quarter for the 4-lane kernels (a multiple of 4), or 0 to go scalar */
+static u_int64_t
+rb_quarter_words(size_t len)
+{
+    u_int64_t q = ((len / sizeof(unsigned int)) / 4) & ~3ULL;
+
+    if (q < RB_SIMD_MIN_WORDS || !rb_has_avx2())
+        return 0;
+    return q;
+}
+
+static void
+rb_fill(unsigned int *tmp, u_int64_t remain, struct xrand *xr)
+{
+    u_int    last;
+    u_int64_t i;
 
-    xrand_init(&xr, seed);
     for (i = 0; remain > 0; i++, remain -= sizeof(*tmp)) {
         if (remain > sizeof(*tmp)) { /* likely */
-            tmp[i] = xrand64(&xr);
+            tmp[i] = xrand64(xr);
         } else { /* unlikely */
-            last = xrand64(&xr);
+            last = xrand64(xr);
             memcpy(&tmp[i], &last, remain);
+            break;
         }
     }
 }
 
+/* Return value: the byte offset of the first miscompare, or -1 */
+static int64_t
+rb_check(const unsigned int *tmp, u_int64_t len, struct xrand *xr)
+{
+    unsigned int    val;
+    u_int64_t       remain = len;
+    u_int64_t       i;
+
+    for (i = 0; remain > 0; i++, remain -= sizeof(*tmp)) {
+        val = xrand64(xr);
+        if (remain >= sizeof(*tmp)) { /* Likely */
+            if (val != tmp[i])
+                return ((int64_t)(len - remain));
+        } else { /* Unlikely */
+            /*
+             * [HSE_REVISIT]
+             * Miscompare offset might be off here
+             */
+            if (memcmp(&val, &tmp[i], remain))
+                return ((int64_t)(len - remain));
+            break;
+        }
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+rb_rotl4(__m256i x, int k)
+{
+    return _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - k));
+}
+
+/* One xoroshiro128plus() step in each of 4 lanes */
+__attribute__((target("avx2")))
+static inline __m256i
+rb_step4(__m256i *s0, __m256i *s1)
+{
+    __m256i a = *s0;
+    __m256i b = *s1;
+    __m256i result = _mm256_add_epi64(a, b);
+
+    b = _mm256_xor_si256(b, a);
+    *s0 = _mm256_xor_si256(_mm256_xor_si256(rb_rotl4(a, 55), b), _mm256_slli_epi64(b, 14));
+    *s1 = rb_rotl4(b, 36);
+    return result;
+}
+
+/*
+ * Four steps in each lane, transposed so that each 128-bit half holds 4 consecutive
+ * words of one lane: *v02 is lanes 0 and 2, *v13 is lanes 1 and 3
+ */
+__attribute__((target("avx2")))
+static inline void
+rb_next4x4(__m256i *s0, __m256i *s1, __m256i *v02, __m256i *v13)
+{
+    __m256i a = rb_step4(s0, s1);
+    __m256i b = rb_step4(s0, s1);
+    __m256i c = rb_step4(s0, s1);
+    __m256i d = rb_step4(s0, s1);
+    __m256i ab = _mm256_blend_epi32(a, _mm256_slli_epi64(b, 32), 0xaa);
+    __m256i cd = _mm256_blend_epi32(c, _mm256_slli_epi64(d, 32), 0xaa);
+
+    *v02 = _mm256_unpacklo_epi64(ab, cd);
+    *v13 = _mm256_unpackhi_epi64(ab, cd);
+}
+
+__attribute__((target("avx2")))
+static void
+rb_load4(const struct xrand *lanes, __m256i *s0, __m256i *s1)
+{
+    *s0 = _mm256_set_epi64x(lanes[3].xr_state[0], lanes[2].xr_state[0],
+                            lanes[1].xr_state[0], lanes[0].xr_state[0]);
+    *s1 = _mm256_set_epi64x(lanes[3].xr_state[1], lanes[2].xr_state[1],
+                            lanes[1].xr_state[1], lanes[0].xr_state[1]);
+}
+
+/* Fill 4 quarters of q words; lanes[3] is left at the word after the last quarter */
+__attribute__((target("avx2")))
+static void
+rb_fill_avx2(unsigned int *w, u_int64_t q, struct xrand *lanes)
+{
+    __m256i s0, s1, v02, v13;
+    u_int64_t i;
+
+    rb_load4(lanes, &s0, &s1);
+    for (i = 0; i < q; i += 4) {
+        rb_next4x4(&s0, &s1, &v02, &v13);
+        _mm_storeu_si128((__m128i *)&w[i], _mm256_castsi256_si128(v02));
+        _mm_storeu_si128((__m128i *)&w[q + i], _mm256_castsi256_si128(v13));
+        _mm_storeu_si128((__m128i *)&w[2 * q + i], _mm256_extracti128_si256(v02, 1));
+        _mm_storeu_si128((__m128i *)&w[3 * q + i], _mm256_extracti128_si256(v13, 1));
+    }
+    lanes[3].xr_state[0] = _mm256_extract_epi64(s0, 3);
+    lanes[3].xr_state[1] = _mm256_extract_epi64(s1, 3);
+}
+
+/* Return value: 0 if all 4 quarters match, or -1 (with lanes[3] not advanced) */
+__attribute__((target("avx2")))
+static int
+rb_check_avx2(const unsigned int *w, u_int64_t q, struct xrand *lanes)
+{
+    __m256i s0, s1, v02, v13, e02, e13, x;
+    u_int64_t i;
+
+    rb_load4(lanes, &s0, &s1);
+    for (i = 0; i < q; i += 4) {
+        rb_next4x4(&s0, &s1, &v02, &v13);
+        e02 = _mm256_set_m128i(_mm_loadu_si128((const __m128i *)&w[2 * q + i]),
+                               _mm_loadu_si128((const __m128i *)&w[i]));
+        e13 = _mm256_set_m128i(_mm_loadu_si128((const __m128i *)&w[3 * q + i]),
+                               _mm_loadu_si128((const __m128i *)&w[q + i]));
+        x = _mm256_or_si256(_mm256_xor_si256(e02, v02), _mm256_xor_si256(e13, v13));
+        if (!_mm256_testz_si256(x, x))
+            return -1;
+    }
+    lanes[3].xr_state[0] = _mm256_extract_epi64(s0, 3);
+    lanes[3].xr_state[1] = _mm256_extract_epi64(s1, 3);
+    return 0;
+}
+
+/* Start each lane at its quarter (lanes[0] is the state at the first word) */
+static void
+rb_jump_lanes(struct xrand *lanes, u_int64_t q)
+{
+    int j;
+
+    for (j = 1; j < 4; j++) {
+        lanes[j] = lanes[j - 1];
+        xrand_jump(&lanes[j], q);
+    }
+}
+
+void
+randomize_buffer_at(void *buf, size_t len, unsigned int seed, u_int64_t offset)
+{
+    unsigned int *  tmp = (unsigned int *)buf;
+    struct xrand    lanes[4];
+    u_int64_t       q;
+
+    assert((offset % sizeof(*tmp)) == 0);
+    if (len == 0)
+        return;
+
+    xrand_init(&lanes[0], seed);
+    xrand_jump(&lanes[0], offset / sizeof(*tmp));
+
+    q = rb_quarter_words(len);
+    if (q) {
+        rb_jump_lanes(lanes, q);
+        rb_fill_avx2(tmp, q, lanes);
+        lanes[0] = lanes[3];
+    }
+    rb_fill(&tmp[4 * q], len - (4 * q * sizeof(*tmp)), &lanes[0]);
+}
+
 int64_t
-validate_random_buffer(void *buf, size_t len, unsigned int seed)
+validate_random_buffer_at(void *buf, size_t len, unsigned int seed, u_int64_t offset)
 {
     unsigned int *  tmp = (unsigned int *)buf;
-    unsigned int    val;
-    char *          expect = (char *)&val;
-    char *          found;
-    uint64_t        remain = len;
-    uint64_t        i;
-    struct xrand xr;
+    struct xrand    lanes[4];
+    u_int64_t       q;
+    int64_t         rc;
 
+    assert((offset % sizeof(*tmp)) == 0);
     if (len == 0)
         return -1; /* success... */
 
-    xrand_init(&xr, seed);
-    for (i = 0; remain > 0; i++, remain -= sizeof(*tmp)) {
-        val = xrand64(&xr);
-        if ((remain >= sizeof(*tmp)) && (val != tmp[i])) { /* Likely */
-            return ((int64_t)(len - remain));
-        } else if (remain < sizeof(*tmp)) { /* Unlikely */
-            found = (char *)&tmp[i];
-            if (memcmp(expect, found, remain)) {
-                /*
-                 * [HSE_REVISIT]
-                 * Miscompare offset might be off here
-                 */
-                return ((int64_t)(len - remain));
-            }
+    xrand_init(&lanes[0], seed);
+    xrand_jump(&lanes[0], offset / sizeof(*tmp));
+
+    q = rb_quarter_words(len);
+    if (q) {
+        struct xrand start = lanes[0];
+
+        rb_jump_lanes(lanes, q);
+        if (rb_check_avx2(tmp, q, lanes)) {
+            /* Find the first miscompare the slow way */
+            rc = rb_check(tmp, len, &start);
+            return (rc < 0) ? rc : (int64_t)offset + rc;
         }
+        lanes[0] = lanes[3];
     }
+    rc = rb_check(&tmp[4 * q], len - (4 * q * sizeof(*tmp)), &lanes[0]);
+    if (rc >= 0)
+        rc += (int64_t)(offset + (4 * q * sizeof(*tmp)));
+    return rc;
+}
+
+void
+randomize_buffer(void *buf, size_t len, unsigned int seed)
+{
+    randomize_buffer_at(buf, len, seed, 0);
+}
+
+int64_t
+validate_random_buffer(void *buf, size_t len, unsigned int seed)
+{
     /* -1 is success, because 0..n are valid offsets for an error */
-    return -1;
+    return validate_random_buffer_at(buf, len, seed, 0);
 }
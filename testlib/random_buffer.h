@@ -6,6 +6,9 @@
 #ifndef HSE_CORE_HSE_TEST_RANDOM_BUFFER_H
 #define HSE_CORE_HSE_TEST_RANDOM_BUFFER_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
 /* randomize_buffer
  *
  * Write pseudo-random data to a buffer, based on a specified seed
@@ -19,9 +22,29 @@ randomize_buffer(void *buf, size_t len, unsigned int seed);
  * Take advantage of the fact that starting with the same seed will generate
  * the same pseudo-random data, for an easy way to validate a buffer
  */
-int
+int64_t
 validate_random_buffer(void *buf, size_t len, unsigned int seed);
 
+/* randomize_buffer_at
+ *
+ * Write the part of the stream for seed that starts @offset bytes in, so a big
+ * buffer can be randomized in pieces (in any order, e.g. by several threads) and
+ * match randomize_buffer() on the whole thing. @offset must be a multiple of 4;
+ * seed 0 (a random seed) only makes sense for a whole buffer.
+ */
+void
+randomize_buffer_at(void *buf, size_t len, unsigned int seed, u_int64_t offset);
+
+/* validate_random_buffer_at
+ *
+ * Validate a piece of a buffer written by randomize_buffer() (or _at()), where
+ * buf is @offset bytes into the stream.
+ *
+ * Return value: the stream offset (not buf offset) of the first miscompare, or -1
+ */
+int64_t
+validate_random_buffer_at(void *buf, size_t len, unsigned int seed, u_int64_t offset);
+
 /* generate_random_u_int32_t
  *
  * Create and return a random u_int32_t between min and max inclusive with
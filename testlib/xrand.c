@@ -45,3 +45,57 @@ xrand_range64(struct xrand *xr, u_int64_t lo, u_int64_t hi)
     /* scale rv to the desired range */
     return (u_int64_t)((double)lo + (double)(hi - lo) * rv);
 }
+
+/* The characteristic polynomial of the xoroshiro128+ state transition T,
+ * without its x^128 term. After n steps the state is T^n(s) = r(T)(s), where
+ * r(x) = x^n mod P(x) (Cayley-Hamilton), and r has fewer than 128 terms.
+ * (x^(2^64) mod P is the well-known xoroshiro128+ jump polynomial.)
+ */
+#define XOROSHIRO128_POLY \
+    (((unsigned __int128)0x00653ced7f29f88aULL << 64) | 0x5fd66762f0e1c001ULL)
+
+static unsigned __int128
+xrand_polymulmod(unsigned __int128 a, unsigned __int128 b)
+{
+    unsigned __int128 r = 0;
+    int i;
+
+    for (i = 127; i >= 0; i--) {
+        r = (r >> 127) ? (r << 1) ^ XOROSHIRO128_POLY : r << 1;
+        if ((b >> i) & 1)
+            r ^= a;
+    }
+    return r;
+}
+
+void
+xrand_jump(struct xrand *xr, u_int64_t n)
+{
+    unsigned __int128 r = 1;
+    u_int64_t s0 = 0, s1 = 0;
+    int i;
+
+    if (n < 128) {
+        while (n--)
+            xrand64(xr);
+        return;
+    }
+
+    /* r = x^n mod P, by square-and-multiply over the bits of n */
+    for (i = 63 - __builtin_clzll(n); i >= 0; i--) {
+        r = xrand_polymulmod(r, r);
+        if ((n >> i) & 1)
+            r = (r >> 127) ? (r << 1) ^ XOROSHIRO128_POLY : r << 1;
+    }
+
+    /* Evaluate r(T)(s): sum T^i(s) over the terms of r */
+    for (i = 0; i < 128; i++) {
+        if ((r >> i) & 1) {
+            s0 ^= xr->xr_state[0];
+            s1 ^= xr->xr_state[1];
+        }
+        xrand64(xr);
+    }
+    xr->xr_state[0] = s0;
+    xr->xr_state[1] = s1;
+}
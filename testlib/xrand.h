@@ -53,4 +53,10 @@ xrand64_tls(void)
 u_int64_t
 xrand_range64(struct xrand *xr, u_int64_t lo, u_int64_t hi);
 
+/* Function xrand_jump() advances the PRNG state by n outputs, as if xrand64()
+ * had been called n times, in O(log n) time.
+ */
+void
+xrand_jump(struct xrand *xr, u_int64_t n);
+
 #endif